@@ -16,18 +16,40 @@
 
 #include "backend-set.h"
 #include <kj/debug.h>
+#include <sodium/crypto_generichash.h>
 
 namespace blackrock {
 
+namespace {
+
+uint64_t rendezvousScore(kj::StringPtr key, uint64_t id) {
+  // The weight of backend `id` for `key` under rendezvous (highest random weight) hashing: the
+  // backend with the highest score owns the key, so adding or removing a backend moves only the
+  // keys it wins or held.
+
+  crypto_generichash_state state;
+  uint64_t result;
+  KJ_ASSERT(crypto_generichash_init(&state, nullptr, 0, sizeof(result)) == 0);
+  KJ_ASSERT(crypto_generichash_update(&state,
+      reinterpret_cast<const byte*>(&id), sizeof(id)) == 0);
+  KJ_ASSERT(crypto_generichash_update(&state,
+      reinterpret_cast<const byte*>(key.begin()), key.size()) == 0);
+  KJ_ASSERT(crypto_generichash_final(&state,
+      reinterpret_cast<byte*>(&result), sizeof(result)) == 0);
+  return result;
+}
+
+}  // namespace
+
 BackendSetBase::BackendSetBase(kj::PromiseFulfillerPair<void> paf)
     : next(backends.end()),
-      readyPromise(paf.promise.fork()),
-      readyFulfiller(kj::mv(paf.fulfiller)) {}
+      addedPromise(paf.promise.fork()),
+      addedFulfiller(kj::mv(paf.fulfiller)) {}
 BackendSetBase::~BackendSetBase() noexcept(false) {}
 
 capnp::Capability::Client BackendSetBase::chooseOne() {
   if (backends.empty()) {
-    return readyPromise.addBranch().then([this]() {
+    return addedPromise.addBranch().then([this]() {
       return chooseOne();
     });
   } else {
@@ -39,16 +61,71 @@ capnp::Capability::Client BackendSetBase::chooseOne() {
   }
 }
 
+capnp::Capability::Client BackendSetBase::chooseById(uint64_t id) {
+  auto iter = backends.find(id);
+  if (iter == backends.end()) {
+    return addedPromise.addBranch().then([this,id]() {
+      return chooseById(id);
+    });
+  } else {
+    return iter->second.client;
+  }
+}
+
+kj::Promise<uint64_t> BackendSetBase::chooseIdByKey(kj::StringPtr key) {
+  if (backends.empty()) {
+    auto ownKey = kj::heapString(key);
+    return addedPromise.addBranch().then([this,KJ_MVCAP(ownKey)]() {
+      return chooseIdByKey(ownKey);
+    });
+  } else {
+    uint64_t best = 0;
+    uint64_t bestScore = 0;
+    for (auto& backend: backends) {
+      uint64_t score = rendezvousScore(key, backend.first);
+      if (score >= bestScore) {
+        best = backend.first;
+        bestScore = score;
+      }
+    }
+    return best;
+  }
+}
+
+uint64_t homeAmong(kj::StringPtr key, uint64_t count) {
+  KJ_REQUIRE(count > 0, "no backends to choose a home from");
+
+  // Same choice as chooseIdByKey(), including ties going to the higher ID.
+  uint64_t best = 0;
+  uint64_t bestScore = 0;
+  for (uint64_t id = 0; id < count; id++) {
+    uint64_t score = rendezvousScore(key, id);
+    if (score >= bestScore) {
+      best = id;
+      bestScore = score;
+    }
+  }
+  return best;
+}
+
 void BackendSetBase::clear() {
   backends.clear();
+  next = backends.end();
 }
 
 void BackendSetBase::add(uint64_t id, capnp::Capability::Client client) {
-  if (backends.empty()) {
-    readyFulfiller->fulfill();
+  auto iter = backends.find(id);
+  if (iter == backends.end()) {
+    backends.insert(std::make_pair(id, Backend { kj::mv(client) }));
+  } else {
+    // A keyed backend is being replaced, e.g. because its machine restarted.
+    iter->second.client = kj::mv(client);
   }
 
-  backends.insert(std::make_pair(id, Backend { kj::mv(client) }));
+  addedFulfiller->fulfill();
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  addedPromise = paf.promise.fork();
+  addedFulfiller = kj::mv(paf.fulfiller);
 }
 
 void BackendSetBase::remove(uint64_t id) {
@@ -56,12 +133,63 @@ void BackendSetBase::remove(uint64_t id) {
     ++next;
   }
   backends.erase(id);
+}
 
-  if (backends.empty()) {
-    auto paf = kj::newPromiseAndFulfiller<void>();
-    readyPromise = paf.promise.fork();
-    readyFulfiller = kj::mv(paf.fulfiller);
+// =======================================================================================
+
+kj::Maybe<uint64_t> KeyRouter::find(kj::StringPtr key) {
+  auto iter = current.find(key);
+  if (iter != current.end()) return iter->second;
+
+  iter = previous.find(key);
+  if (iter == previous.end()) return nullptr;
+
+  // Still in use, so keep it.
+  uint64_t id = iter->second;
+  previous.erase(iter);
+  set(key, id);
+  return id;
+}
+
+void KeyRouter::set(kj::StringPtr key, uint64_t id) {
+  auto iter = current.find(key);
+  if (iter != current.end()) {
+    iter->second = id;
+    return;
+  }
+
+  forget(key);
+  if (current.size() >= capacity) {
+    previous = kj::mv(current);
+    current.clear();
   }
+  current.insert(std::make_pair(kj::heapString(key), id));
+}
+
+void KeyRouter::forget(kj::StringPtr key) {
+  for (auto* generation: { &current, &previous }) {
+    auto iter = generation->find(key);
+    if (iter != generation->end()) generation->erase(iter);
+  }
+}
+
+void KeyRouter::forgetOwner(uint64_t id) {
+  ++epoch;
+  for (auto* generation: { &current, &previous }) {
+    for (auto iter = generation->begin(); iter != generation->end();) {
+      if (iter->second == id) {
+        iter = generation->erase(iter);
+      } else {
+        ++iter;
+      }
+    }
+  }
+}
+
+void KeyRouter::clear() {
+  ++epoch;
+  current.clear();
+  previous.clear();
 }
 
 // =======================================================================================
@@ -86,33 +214,39 @@ private:
 class BackendSetFeederBase::BackendRegistration final: public Registration {
 public:
   BackendRegistration(BackendSetFeederBase& feeder, capnp::Capability::Client cap);
+  BackendRegistration(BackendSetFeederBase& feeder, uint64_t id, capnp::Capability::Client cap);
 
   ~BackendRegistration() noexcept(false);
 
+  void setSuspected(bool suspected) override;
+
 private:
   friend class BackendSetFeederBase;
 
   BackendSetFeederBase& feeder;
   uint64_t id;
   capnp::Capability::Client cap;
+  bool keyed;
+  bool suspected = false;
+  bool routed;
   BackendRegistration* next;
   BackendRegistration** prev;
 };
 
 auto BackendSetFeederBase::addBackend(capnp::Capability::Client cap) -> kj::Own<Registration> {
-  auto result = kj::heap<BackendRegistration>(*this, kj::mv(cap));
+  return addRegistration(kj::heap<BackendRegistration>(*this, kj::mv(cap)));
+}
+
+auto BackendSetFeederBase::addBackend(uint64_t id, capnp::Capability::Client cap)
+    -> kj::Own<Registration> {
+  return addRegistration(kj::heap<BackendRegistration>(*this, id, kj::mv(cap)));
+}
 
+auto BackendSetFeederBase::addRegistration(kj::Own<BackendRegistration> result)
+    -> kj::Own<Registration> {
   if (ready) {
     // Consumers are already initialized. Add the new backend to each one.
-    for (ConsumerRegistration* consumer = consumersHead; consumer != nullptr;
-         consumer = consumer->next) {
-      tasks.add(kj::evalNow([&]() {
-        auto req = consumer->set.addRequest(capnp::MessageSize {4, 0});
-        req.setId(result->id);
-        req.getBackend().setAs<capnp::Capability>(result->cap);
-        return req.send().then([](auto&&) {});
-      }));
-    }
+    addToConsumers(*result);
   } else if (backendCount >= minCount) {
     // We have enough backends to initialize all consumers.
     ready = true;
@@ -136,11 +270,35 @@ auto BackendSetFeederBase::addConsumer(BackendSet<>::Client set) -> kj::Own<Regi
   return kj::mv(result);
 }
 
+void BackendSetFeederBase::addToConsumers(BackendRegistration& backend) {
+  for (ConsumerRegistration* consumer = consumersHead; consumer != nullptr;
+       consumer = consumer->next) {
+    tasks.add(kj::evalNow([&]() {
+      auto req = consumer->set.addRequest(capnp::MessageSize {4, 0});
+      req.setId(backend.id);
+      req.getBackend().setAs<capnp::Capability>(backend.cap);
+      return req.send().then([](auto&&) {});
+    }));
+  }
+}
+
+void BackendSetFeederBase::removeFromConsumers(BackendRegistration& backend) {
+  for (ConsumerRegistration* consumer = consumersHead; consumer != nullptr;
+       consumer = consumer->next) {
+    tasks.add(kj::evalNow([&]() {
+      auto req = consumer->set.removeRequest(capnp::MessageSize {4, 0});
+      req.setId(backend.id);
+      return req.send().then([](auto&&) {});
+    }));
+  }
+}
+
 void BackendSetFeederBase::taskFailed(kj::Exception&& exception) {
   KJ_LOG(ERROR, exception);
 }
 
 BackendSetFeederBase::Registration::~Registration() noexcept(false) {}
+void BackendSetFeederBase::Registration::setSuspected(bool suspected) {}
 
 BackendSetFeederBase::ConsumerRegistration::ConsumerRegistration(
     BackendSetFeederBase& feeder, BackendSet<>::Client set)
@@ -161,24 +319,47 @@ BackendSetFeederBase::ConsumerRegistration::~ConsumerRegistration() noexcept(fal
 
 void BackendSetFeederBase::ConsumerRegistration::init() {
   auto req = set.resetRequest();
-  auto list = req.initBackends(feeder.backendCount);
+  auto list = req.initBackends(feeder.routedCount + feeder.keyedBackends.size());
   uint i = 0;
   for (BackendRegistration* backend = feeder.backendsHead; backend != nullptr;
        backend = backend->next) {
+    if (!backend->routed) continue;
     auto element = list[i++];
     element.setId(backend->id);
     element.getBackend().setAs<capnp::Capability>(backend->cap);
   }
+  for (auto& backend: feeder.keyedBackends) {
+    auto element = list[i++];
+    element.setId(backend.first);
+    element.getBackend().setAs<capnp::Capability>(backend.second);
+  }
   feeder.tasks.add(req.send().then([](auto&&) {}));
 }
 
 BackendSetFeederBase::BackendRegistration::BackendRegistration(
     BackendSetFeederBase& feeder, capnp::Capability::Client cap)
-    : feeder(feeder), id(feeder.nextId++), cap(kj::mv(cap)),
+    : feeder(feeder), id(feeder.nextId++), cap(kj::mv(cap)), keyed(false), routed(true),
       next(nullptr), prev(feeder.backendsTail) {
   *feeder.backendsTail = this;
   feeder.backendsTail = &next;
   ++feeder.backendCount;
+  ++feeder.routedCount;
+}
+
+BackendSetFeederBase::BackendRegistration::BackendRegistration(
+    BackendSetFeederBase& feeder, uint64_t id, capnp::Capability::Client cap)
+    : feeder(feeder), id(id), cap(kj::mv(cap)), keyed(true), routed(false),
+      next(nullptr), prev(feeder.backendsTail) {
+  // Keyed backends are listed in `keyedBackends` instead of being `routed`, so that they stay
+  // in the sets after this registration is gone.
+  *feeder.backendsTail = this;
+  feeder.backendsTail = &next;
+  ++feeder.backendCount;
+
+  auto insertResult = feeder.keyedBackends.insert(std::make_pair(id, this->cap));
+  if (!insertResult.second) {
+    insertResult.first->second = this->cap;
+  }
 }
 
 BackendSetFeederBase::BackendRegistration::~BackendRegistration() noexcept(false) {
@@ -190,14 +371,33 @@ BackendSetFeederBase::BackendRegistration::~BackendRegistration() noexcept(false
   }
   *prev = next;
 
-  // Remove from all consumers.
-  for (ConsumerRegistration* consumer = feeder.consumersHead; consumer != nullptr;
-       consumer = consumer->next) {
-    feeder.tasks.add(kj::evalNow([&]() {
-      auto req = consumer->set.removeRequest(capnp::MessageSize {4, 0});
-      req.setId(id);
-      return req.send().then([](auto&&) {});
-    }));
+  // Remove from all consumers (unless suspicion already did).
+  if (routed) {
+    --feeder.routedCount;
+    feeder.removeFromConsumers(*this);
+  }
+}
+
+void BackendSetFeederBase::BackendRegistration::setSuspected(bool suspected) {
+  if (keyed || suspected == this->suspected) return;
+  this->suspected = suspected;
+
+  if (suspected) {
+    if (feeder.routedCount <= 1) {
+      // Don't leave the consumers with nothing. We'll stay in the sets, marked suspected.
+      return;
+    }
+    routed = false;
+    --feeder.routedCount;
+    if (feeder.ready) {
+      feeder.removeFromConsumers(*this);
+    }
+  } else if (!routed) {
+    routed = true;
+    ++feeder.routedCount;
+    if (feeder.ready) {
+      feeder.addToConsumers(*this);
+    }
   }
 }
 
@@ -29,6 +29,8 @@ public:
   ~BackendSetBase() noexcept(false);
 
   capnp::Capability::Client chooseOne();
+  capnp::Capability::Client chooseById(uint64_t id);
+  kj::Promise<uint64_t> chooseIdByKey(kj::StringPtr key);
 
   void clear();
   void add(uint64_t id, capnp::Capability::Client client);
@@ -45,8 +47,9 @@ private:
 
   std::map<uint64_t, Backend> backends;
   std::map<uint64_t, Backend>::iterator next;
-  kj::ForkedPromise<void> readyPromise;
-  kj::Own<kj::PromiseFulfiller<void>> readyFulfiller;
+  kj::ForkedPromise<void> addedPromise;
+  kj::Own<kj::PromiseFulfiller<void>> addedFulfiller;
+  // Resolves the next time a backend is added, for callers waiting for one.
 
   explicit BackendSetBase(kj::PromiseFulfillerPair<void> paf);
 };
@@ -62,6 +65,11 @@ public:
   // TODO(someady): Would be nice to build in disconnect handling here, e.g. pass in a callback
   //   function that initiates the work, catches exceptions and retries with a different back-end.
 
+  typename T::Client chooseById(uint64_t id) {
+    return base.chooseById(id).template castAs<T>();
+  }
+  // Return the backend with the given ID, or a promise for it if it isn't in the set right now.
+
 protected:
   typedef typename BackendSet<T>::Server Interface;
   kj::Promise<void> reset(typename Interface::ResetContext context) {
@@ -81,10 +89,117 @@ protected:
     return kj::READY_NOW;
   }
 
-private:
   BackendSetBase base;
 };
 
+uint64_t homeAmong(kj::StringPtr key, uint64_t count);
+// The home chooseIdByKey() would pick for `key` if the set's backends had exactly the IDs 0 through
+// `count - 1`. Storage nodes are numbered that way, and join in order, so a node can tell which
+// node was a name's home before it joined.
+
+// =======================================================================================
+
+class KeyRouter {
+  // The non-template part of KeyRoutedBackendSetImpl: remembers which backend owns each recently
+  // used key. Holds up to `capacity` keys in each of two generations; when the current generation
+  // fills up it replaces the previous one, so keys not used for a while are forgotten.
+
+public:
+  explicit KeyRouter(size_t capacity): capacity(capacity) {}
+
+  kj::Maybe<uint64_t> find(kj::StringPtr key);
+  void set(kj::StringPtr key, uint64_t id);
+  void forget(kj::StringPtr key);
+  void forgetOwner(uint64_t id);
+  void clear();
+
+  uint getEpoch() { return epoch; }
+  // Changes whenever the set's membership does, so that lookups begun before the change don't
+  // record owners afterwards.
+
+private:
+  struct KeyLess {
+    typedef void is_transparent;
+    inline bool operator()(kj::StringPtr a, kj::StringPtr b) const { return a < b; }
+  };
+  typedef std::map<kj::String, uint64_t, KeyLess> Generation;
+
+  size_t capacity;
+  uint epoch = 0;
+  Generation current;
+  Generation previous;
+};
+
+template <typename T>
+class KeyRoutedBackendSetImpl final: public BackendSetImpl<T> {
+  // A BackendSet whose backends each own a share of a keyspace rather than being interchangeable,
+  // e.g. storage nodes, which each hold the roots whose names hash to them. Fed with keyed
+  // backends (BackendSetFeeder::addBackend(id, cap)).
+  //
+  // Each key has a home: the backend chosen by rendezvous hashing over the backend IDs, which
+  // only changes for the keys a joining backend wins or a leaving one held. The home is the
+  // authority on its keys, but the object behind a key may live on another backend, to which the
+  // home forwards. `locate` asks a home where a key actually lives; answers which point elsewhere
+  // are redirects, which are cached so later calls go straight to the owner.
+
+public:
+  typedef kj::Function<kj::Promise<uint64_t>(typename T::Client home, kj::StringPtr key)> Locate;
+
+  explicit KeyRoutedBackendSetImpl(Locate locate, size_t cacheCapacity = 4096)
+      : locate(kj::mv(locate)), router(cacheCapacity) {}
+
+  typename T::Client chooseHome(kj::StringPtr key) {
+    return this->base.chooseIdByKey(key).then([this](uint64_t id) {
+      return this->chooseById(id);
+    });
+  }
+  // Return the home of `key`. Use for calls which create, replace or remove what the key names,
+  // since only the home can do that consistently. Waits for a backend if the set is empty.
+
+  typename T::Client chooseOwner(kj::StringPtr key) {
+    KJ_IF_MAYBE(id, router.find(key)) {
+      return this->chooseById(*id);
+    }
+
+    auto ownKey = kj::heapString(key);
+    return this->base.chooseIdByKey(key).then([this,KJ_MVCAP(ownKey)](uint64_t home) mutable {
+      uint epoch = router.getEpoch();
+      auto promise = locate(this->chooseById(home), ownKey);
+      return promise.then([this,KJ_MVCAP(ownKey),epoch](uint64_t owner) {
+        if (router.getEpoch() == epoch) router.set(ownKey, owner);
+        return this->chooseById(owner);
+      });
+    });
+  }
+  // Return the backend which holds what `key` names, as of the last time we asked its home. Use
+  // for calls on an existing object. The first call for a key costs a round trip to the home.
+
+  void forget(kj::StringPtr key) { router.forget(key); }
+  // Drop what we know about where `key` lives, e.g. because we just removed it, or because its
+  // cached owner no longer has it (ownership having moved), so the next chooseOwner() asks again.
+
+protected:
+  typedef typename BackendSet<T>::Server Interface;
+  kj::Promise<void> reset(typename Interface::ResetContext context) override {
+    router.clear();
+    return BackendSetImpl<T>::reset(context);
+  }
+  kj::Promise<void> add(typename Interface::AddContext context) override {
+    // A new backend may be the new home of keys owned elsewhere until now. Their old homes still
+    // know, but our answers from them could be stale.
+    router.clear();
+    return BackendSetImpl<T>::add(context);
+  }
+  kj::Promise<void> remove(typename Interface::RemoveContext context) override {
+    router.forgetOwner(context.getParams().getId());
+    return BackendSetImpl<T>::remove(context);
+  }
+
+private:
+  Locate locate;
+  KeyRouter router;
+};
+
 // =======================================================================================
 
 class BackendSetFeederBase: private kj::TaskSet::ErrorHandler {
@@ -95,9 +210,17 @@ public:
   class Registration {
   public:
     virtual ~Registration() noexcept(false);
+
+    virtual void setSuspected(bool suspected);
+    // Indicates that the machine behind this registration is suspected to have failed (or has
+    // recovered). A suspected backend is removed from all consumer sets, so that new work is
+    // routed elsewhere, and is re-added when the suspicion is cleared. As a special case, the
+    // last unsuspected backend in a feeder stays in the sets, since a slow backend is better than
+    // none at all. Has no effect on consumer registrations.
   };
 
   kj::Own<Registration> addBackend(capnp::Capability::Client cap);
+  kj::Own<Registration> addBackend(uint64_t id, capnp::Capability::Client cap);
   kj::Own<Registration> addConsumer(BackendSet<>::Client set);
 
 private:
@@ -107,13 +230,20 @@ private:
   uint minCount;
   bool ready = minCount == 0;  // Becomes true when minCount backends are first available.
   uint64_t backendCount = 0;
+  uint64_t routedCount = 0;  // Backends not currently removed from consumers due to suspicion.
   uint64_t nextId = 0;
+  std::map<uint64_t, capnp::Capability::Client> keyedBackends;
+  // Every keyed backend ever added, by ID, including ones whose registrations have been dropped.
   BackendRegistration* backendsHead = nullptr;
   BackendRegistration** backendsTail = &backendsHead;
   ConsumerRegistration* consumersHead = nullptr;
   ConsumerRegistration** consumersTail = &consumersHead;
   kj::TaskSet tasks;
 
+  kj::Own<Registration> addRegistration(kj::Own<BackendRegistration> registration);
+  void addToConsumers(BackendRegistration& backend);
+  void removeFromConsumers(BackendRegistration& backend);
+
   void taskFailed(kj::Exception&& exception) override;
 };
 
@@ -142,6 +272,17 @@ public:
     return BackendSetFeederBase::addBackend(kj::mv(cap));
   }
 
+  kj::Own<Registration> addBackend(uint64_t id, typename T::Client cap) KJ_WARN_UNUSED_RESULT {
+    // Like addBackend(cap), but for sets which route each request to a particular backend (see
+    // KeyRoutedBackendSetImpl) rather than load-balancing, e.g. storage nodes which each hold a
+    // partition of the data. The caller chooses the ID, which must stay the same when the
+    // machine behind it is restarted. Such a backend is never removed from consumers -- requests
+    // for its keys can't go anywhere else -- so dropping the registration or suspecting the
+    // machine has no effect, and consumers keep the old capability until a new backend with the
+    // same ID replaces it. Don't mix with unkeyed backends in one feeder.
+    return BackendSetFeederBase::addBackend(id, kj::mv(cap));
+  }
+
   kj::Own<Registration> addConsumer(typename BackendSet<T>::Client set) KJ_WARN_UNUSED_RESULT {
     // Inserts all backends into this consumer. When the returned Consumer is dropped (indicating
     // that it has disconnected), stops updating it.
@@ -117,20 +117,42 @@ public:
       mkdir("/var", 0755);
       mkdir("/var/blackrock", 0755);
       mkdir("/var/blackrock/storage", 0755);
-      auto ptr = kj::heap<StorageInfo>(ioContext, rpcSystem);
+      auto params = context.getParams();
+      auto ptr = kj::heap<StorageInfo>(ioContext, rpcSystem, params.getNodeIndex(),
+                                       "/var/blackrock/storage");
+      ptr->replicaSet = ptr->storage->replicateTo(params.getSynchronousReplication());
       info = ptr;
       storageInfo = kj::mv(ptr);
     }
 
     auto results = context.getResults();
-    results.setSibling(info->selfAsSibling);
-    results.setRootSet(info->rootSet);
-    results.setStorageRestorer(info->restorer);
-    results.setStorageFactory(info->factory);
+    info->setResults(results);
+    results.setReplicaSet(KJ_ASSERT_NONNULL(info->replicaSet));
+
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> becomeStorageStandby(BecomeStorageStandbyContext context) override {
+    StorageInfo* info;
+    KJ_IF_MAYBE(i, standbyInfo) {
+      KJ_LOG(INFO, "rebecome storage standby...");
+      info = *i;
+    } else {
+      KJ_LOG(INFO, "become storage standby...");
+      mkdir("/var", 0755);
+      mkdir("/var/blackrock", 0755);
+      mkdir("/var/blackrock/standby", 0755);
+      auto ptr = kj::heap<StorageInfo>(ioContext, rpcSystem, context.getParams().getNodeIndex(),
+                                       "/var/blackrock/standby");
+      ptr->replica = ptr->storage->asStandby();
+      info = ptr;
+      standbyInfo = kj::mv(ptr);
+    }
 
-    results.setSiblingSet(kj::addRef(*info->siblingSet));
-    results.setHostedRestorerSet(kj::addRef(*info->hostedRestorerSet));
-    results.setGatewayRestorerSet(kj::addRef(*info->gatewayRestorerSet));
+    auto results = context.getResults();
+    info->setResults(results);
+    results.setReplica(KJ_ASSERT_NONNULL(info->replica));
+    results.setPromoted(info->storage->wasPromoted());
 
     return kj::READY_NOW;
   }
@@ -191,19 +213,23 @@ public:
   }
 
   kj::Promise<void> becomeMongo(BecomeMongoContext context) override {
-    Mongo::Client client = nullptr;
-    KJ_IF_MAYBE(w, mongo) {
+    MongoInfo* info = nullptr;
+    KJ_IF_MAYBE(i, mongoInfo) {
       KJ_LOG(INFO, "rebecome mongo...");
-      client = *w;
+      info = *i;
     } else {
       KJ_LOG(INFO, "become mongo...");
       SimpleAddress mongoAddr = selfAddress;
       mongoAddr.setPort(27017);
-      client = kj::heap<MongoImpl>(ioContext.provider->getTimer(), subprocessSet, mongoAddr);
-      mongo = client;
+      auto ptr = kj::heap<MongoInfo>(kj::heap<MongoImpl>(ioContext.provider->getTimer(),
+          subprocessSet, mongoAddr, context.getParams().getMemberIndex()));
+      info = ptr;
+      mongoInfo = kj::mv(ptr);
     }
 
-    context.getResults().setMongo(kj::mv(client));
+    auto results = context.getResults();
+    results.setMongo(info->client);
+    results.setMemberSet(info->impl->getMemberBackendSet());
     return kj::READY_NOW;
   }
 
@@ -231,6 +257,15 @@ public:
     return kj::READY_NOW;
   }
 
+  kj::Promise<void> shutdown(ShutdownContext context) override {
+    // Stop grains cleanly rather than letting them die with the machine.
+    KJ_IF_MAYBE(w, worker) {
+      KJ_LOG(INFO, "shutting down; draining worker...");
+      return w->drainRequest().send().then([](auto&&) {});
+    }
+    return kj::READY_NOW;
+  }
+
   kj::Promise<void> ping(PingContext context) override {
     if (context.getParams().getHang()) {
       return kj::NEVER_DONE;
@@ -247,6 +282,7 @@ private:
   SimpleAddress selfAddress;
 
   struct StorageInfo {
+    FilesystemStorage* storage;
     StorageSibling::Client selfAsSibling;
     StorageRootSet::Client rootSet;
     MasterRestorer<SturdyRef::Stored>::Client restorer;
@@ -256,19 +292,47 @@ private:
     kj::Own<BackendSetImpl<Restorer<SturdyRef::Hosted>>> hostedRestorerSet;
     kj::Own<BackendSetImpl<Restorer<SturdyRef::External>>> gatewayRestorerSet;
 
-    StorageInfo(kj::AsyncIoContext& ioContext, capnp::RpcSystem<VatPath>& rpcSystem)
-        : selfAsSibling(nullptr),  // TODO(someday)
-          rootSet(kj::heap<FilesystemStorage>(
-              sandstorm::raiiOpen("/var/blackrock/storage", O_RDONLY | O_DIRECTORY | O_CLOEXEC),
-              ioContext.unixEventPort, ioContext.lowLevelProvider->getTimer(),
-              kj::heap<RemoteRestorer>(rpcSystem))),
+    kj::Maybe<BackendSet<StorageReplica>::Client> replicaSet;
+    // Set on a storage node.
+
+    kj::Maybe<StorageReplica::Client> replica;
+    // Set on a standby.
+
+    StorageInfo(kj::AsyncIoContext& ioContext, capnp::RpcSystem<VatPath>& rpcSystem,
+                uint32_t nodeIndex, kj::StringPtr directory)
+        : selfAsSibling(nullptr),
+          rootSet(nullptr),
           restorer(nullptr),       // TODO(someday)
-          factory(rootSet.getFactoryRequest().send().getFactory()),
+          factory(nullptr),
           siblingSet(kj::refcounted<BackendSetImpl<StorageSibling>>()),
           hostedRestorerSet(kj::refcounted<BackendSetImpl<Restorer<SturdyRef::Hosted>>>()),
-          gatewayRestorerSet(kj::refcounted<BackendSetImpl<Restorer<SturdyRef::External>>>()) {}
+          gatewayRestorerSet(kj::refcounted<BackendSetImpl<Restorer<SturdyRef::External>>>()) {
+      auto ownStorage = kj::heap<FilesystemStorage>(
+          sandstorm::raiiOpen(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+          ioContext.unixEventPort, ioContext.lowLevelProvider->getTimer(),
+          kj::heap<RemoteRestorer>(rpcSystem));
+      storage = ownStorage;
+      rootSet = kj::mv(ownStorage);
+      factory = rootSet.getFactoryRequest().send().getFactory();
+      selfAsSibling = storage->joinCluster(nodeIndex, kj::addRef(*siblingSet));
+    }
+
+    template <typename Results>
+    void setResults(Results results) {
+      // Fills in the results becomeStorage() and becomeStorageStandby() have in common.
+
+      results.setSibling(selfAsSibling);
+      results.setRootSet(rootSet);
+      results.setStorageRestorer(restorer);
+      results.setStorageFactory(factory);
+
+      results.setSiblingSet(kj::addRef(*siblingSet));
+      results.setHostedRestorerSet(kj::addRef(*hostedRestorerSet));
+      results.setGatewayRestorerSet(kj::addRef(*gatewayRestorerSet));
+    }
   };
   kj::Maybe<kj::Own<StorageInfo>> storageInfo;
+  kj::Maybe<kj::Own<StorageInfo>> standbyInfo;
 
   kj::Maybe<Worker::Client> worker;
 
@@ -290,7 +354,14 @@ private:
   };
   kj::Maybe<kj::Own<GatewayInfo>> gatewayInfo;
 
-  kj::Maybe<Mongo::Client> mongo;
+  struct MongoInfo {
+    MongoImpl* impl;
+    Mongo::Client client;
+
+    MongoInfo(kj::Own<MongoImpl> impl)
+        : impl(impl), client(kj::mv(impl)) {}
+  };
+  kj::Maybe<kj::Own<MongoInfo>> mongoInfo;
 };
 
 class BootstrapFactoryImpl: public capnp::BootstrapFactory<VatPath> {
@@ -348,6 +419,7 @@ public:
         .addSubCommand("backup", KJ_BIND_METHOD(*this, getBackupMain),
             "(internal) backup/restore grain data from/to directory")
         .addSubCommand("log", KJ_BIND_METHOD(*this, getLogMain), "run log client")
+        .addSubCommand("logs", KJ_BIND_METHOD(*this, getLogsMain), "print stored logs")
         .build();
   }
 
@@ -365,6 +437,9 @@ public:
   kj::MainFunc getStartMain() {
     return kj::MainBuilder(context, "Sandstorm Blackrock version " SANDSTORM_VERSION,
                            "Starts Blackrock master as daemon, logging to log directory.")
+        .addOption({'z', "compress-logs"}, [this]() { compressLogs = true; return true; },
+            "Store logs as compressed, indexed blocks, to be read with `blackrock logs`, rather "
+            "than as plain text.")
         .expectArg("<master-config>", KJ_BIND_METHOD(*this, runMasterDaemon))
         .build();
   }
@@ -390,6 +465,23 @@ public:
         .build();
   }
 
+  kj::MainFunc getLogsMain() {
+    return kj::MainBuilder(context, "Sandstorm Blackrock version " SANDSTORM_VERSION,
+                           "Prints logs stored by a master started with --compress-logs. By "
+                           "default, prints the last hour of logs from all machines. Times are "
+                           "UTC, formatted YYYY-MM-DD_HH-MM-SS like the logs themselves.")
+        .addOptionWithArg({'d', "dir"}, KJ_BIND_METHOD(*this, setLogsDir), "<path>",
+            "Read logs from <path> rather than /var/blackrock/log.")
+        .addOptionWithArg({'s', "since"}, KJ_BIND_METHOD(*this, setLogsSince), "<time>",
+            "Print logs starting at <time>.")
+        .addOptionWithArg({'u', "until"}, KJ_BIND_METHOD(*this, setLogsUntil), "<time>",
+            "Print logs up to and including <time>.")
+        .addOptionWithArg({'n', "name"}, KJ_BIND_METHOD(*this, addLogsSource), "<name>",
+            "Only print logs from the machine named <name>. May be repeated.")
+        .callAfterParsing(KJ_BIND_METHOD(*this, runLogs))
+        .build();
+  }
+
   kj::MainFunc getSupervisorMain() {
     alternateMain = kj::heap<SupervisorMain>(context);
     return alternateMain->getMain();
@@ -422,6 +514,12 @@ private:
   bool killedExisting = false;
   bool shouldRestart = false;
   kj::Vector<kj::StringPtr> machinesToRestart;
+  bool compressLogs = false;
+
+  kj::StringPtr logsDir = "/var/blackrock/log";
+  kj::Maybe<time_t> logsSince;
+  kj::Maybe<time_t> logsUntil;
+  kj::Vector<kj::StringPtr> logsSources;
 
   kj::Maybe<kj::StringPtr> loggingName;
 
@@ -573,6 +671,42 @@ private:
     return true;
   }
 
+  static kj::Maybe<time_t> parseTime(kj::StringPtr arg) {
+    struct tm utc;
+    memset(&utc, 0, sizeof(utc));
+    const char* end = strptime(arg.cStr(), "%Y-%m-%d_%H-%M-%S", &utc);
+    if (end == nullptr || *end != '\0') return nullptr;
+    return timegm(&utc);
+  }
+
+  kj::MainBuilder::Validity setLogsDir(kj::StringPtr arg) {
+    logsDir = arg;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setLogsSince(kj::StringPtr arg) {
+    KJ_IF_MAYBE(t, parseTime(arg)) {
+      logsSince = *t;
+      return true;
+    } else {
+      return "invalid time; expected YYYY-MM-DD_HH-MM-SS";
+    }
+  }
+
+  kj::MainBuilder::Validity setLogsUntil(kj::StringPtr arg) {
+    KJ_IF_MAYBE(t, parseTime(arg)) {
+      logsUntil = *t;
+      return true;
+    } else {
+      return "invalid time; expected YYYY-MM-DD_HH-MM-SS";
+    }
+  }
+
+  kj::MainBuilder::Validity addLogsSource(kj::StringPtr arg) {
+    logsSources.add(arg);
+    return true;
+  }
+
   bool runMaster(kj::StringPtr configFile) {
     KJ_LOG(INFO, "*** Starting Blackrock Master ***");
 
@@ -649,7 +783,11 @@ private:
           sandstorm::recursivelyCreateParent("/var/blackrock/log/dummy");
           auto logDirFd = sandstorm::raiiOpen(
               "/var/blackrock/log", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
-          rotateLogs(logPipe.readEnd, logDirFd);
+          if (compressLogs) {
+            storeLogs(logPipe.readEnd, logDirFd);
+          } else {
+            rotateLogs(logPipe.readEnd, logDirFd);
+          }
           subprocess2.waitForSuccess();
         });
       }
@@ -802,6 +940,19 @@ private:
     KJ_UNREACHABLE;
   }
 
+  bool runLogs() {
+    time_t now = time(nullptr);
+    time_t until = logsUntil.orDefault(now);
+    time_t since = logsSince.orDefault(until - 3600);
+    if (since > until) {
+      context.exitError("--since is after --until");
+    }
+
+    auto logDirFd = sandstorm::raiiOpen(logsDir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    queryLogs(logDirFd, since, until, logsSources.asPtr(), STDOUT_FILENO);
+    return true;
+  }
+
   void dumpFile(int inFd, int outFd) {
     ssize_t n;
     off_t offset = 0;
@@ -16,8 +16,12 @@
 
 #include "common.h"
 #include <sandstorm/util.h>
+#include <kj/thread.h>
+#include <kj/mutex.h>
 #include <unistd.h>
 #include <sys/eventfd.h>
+#include <algorithm>
+#include <deque>
 
 namespace blackrock {
 
@@ -41,4 +45,123 @@ void writeEvent(int fd, uint64_t value) {
   KJ_ASSERT(n == 8, "wrong-sized write on eventfd", n);
 }
 
+namespace {
+
+class ThreadPool {
+  // The threads behind parallelFor(), one per CPU, started on first use and kept for the life of
+  // the process, so that a call doesn't pay for starting and joining threads.
+  //
+  // A call offers its work to the pool, then works through it on the calling thread too. Threads
+  // which pick up the offer claim calls of func() one at a time, so the caller only ever waits
+  // for calls already in progress -- never for threads busy elsewhere. Hence parallelFor() can be
+  // used from within func().
+
+public:
+  ThreadPool()
+      : readyEventFd(newEventFd(0, EFD_CLOEXEC | EFD_SEMAPHORE)),
+        threads(startThreads()) {}
+
+  void run(uint count, kj::Function<void(uint)>& func) {
+    Batch batch(count, func);
+
+    uint offers = kj::min(count - 1, uint(threads.size()));
+    {
+      auto lock = queue.lockExclusive();
+      for (uint i = 0; i < offers; i++) {
+        lock->push_back(&batch);
+      }
+    }
+    writeEvent(readyEventFd, offers);
+
+    batch.work();
+
+    // Withdraw the offers no thread has taken up, then wait for the threads which did.
+    uint taken;
+    {
+      auto lock = queue.lockExclusive();
+      auto end = std::remove(lock->begin(), lock->end(), &batch);
+      taken = offers - (lock->end() - end);
+      lock->erase(end, lock->end());
+    }
+    for (uint64_t done = 0; done < taken; done += readEvent(batch.doneEventFd)) {}
+
+    for (auto& exception: batch.exceptions) {
+      KJ_IF_MAYBE(e, exception) {
+        kj::throwFatalException(kj::mv(*e));
+      }
+    }
+  }
+
+private:
+  struct Batch {
+    kj::Function<void(uint)>& func;
+    uint count;
+    uint next = 0;
+    kj::Array<kj::Maybe<kj::Exception>> exceptions;
+    kj::AutoCloseFd doneEventFd;
+    // Counts threads which have finished with the batch.
+
+    Batch(uint count, kj::Function<void(uint)>& func)
+        : func(func), count(count), exceptions(kj::heapArray<kj::Maybe<kj::Exception>>(count)),
+          doneEventFd(newEventFd(0, EFD_CLOEXEC)) {}
+
+    void work() {
+      for (;;) {
+        uint i = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+        if (i >= count) break;
+        exceptions[i] = kj::runCatchingExceptions([&]() { func(i); });
+      }
+    }
+  };
+
+  kj::MutexGuarded<std::deque<Batch*>> queue;
+  // One entry per thread wanted, so a batch can be in here several times.
+
+  kj::AutoCloseFd readyEventFd;
+  // Counts entries added to `queue`, as a semaphore. Entries withdrawn leave their events behind,
+  // so a thread may wake to find nothing to do.
+
+  kj::Array<kj::Own<kj::Thread>> threads;
+
+  kj::Array<kj::Own<kj::Thread>> startThreads() {
+    uint cpuCount = kj::max(sysconf(_SC_NPROCESSORS_ONLN), 1l);
+    auto builder = kj::heapArrayBuilder<kj::Own<kj::Thread>>(cpuCount);
+    for (uint i = 0; i < cpuCount; i++) {
+      builder.add(kj::heap<kj::Thread>([this]() { doThread(); }));
+    }
+    return builder.finish();
+  }
+
+  void doThread() {
+    for (;;) {
+      readEvent(readyEventFd);
+
+      Batch* batch;
+      {
+        auto lock = queue.lockExclusive();
+        if (lock->empty()) continue;
+        batch = lock->front();
+        lock->pop_front();
+      }
+
+      // Once we've said we're done, the batch may go away at any moment.
+      batch->work();
+      writeEvent(batch->doneEventFd, 1);
+    }
+  }
+};
+
+}  // namespace
+
+void parallelFor(uint threadCount, kj::Function<void(uint)> func) {
+  if (threadCount <= 1) {
+    if (threadCount == 1) func(0u);
+    return;
+  }
+
+  // Never destroyed: its threads run until the process exits.
+  static ThreadPool* pool = new ThreadPool;
+  pool->run(threadCount, func);
+}
+
 }  // namespace blackrock
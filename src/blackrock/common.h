@@ -19,6 +19,7 @@
 
 #include <kj/common.h>
 #include <kj/io.h>
+#include <kj/function.h>
 #include <inttypes.h>
 
 namespace blackrock {
@@ -36,6 +37,12 @@ uint64_t readEvent(int fd);
 void writeEvent(int fd, uint64_t value);
 // TODO(cleanup): Find a better home for these.
 
+void parallelFor(uint threadCount, kj::Function<void(uint)> func);
+// Calls func(0) through func(threadCount - 1) in parallel, waits for all of them, then rethrows
+// the first exception thrown, if any. The calls run on the calling thread and on a pool of
+// threads, one per CPU, shared by the whole process; so with more calls than CPUs, some run one
+// after another. May be called from within func().
+
 }  // namespace blackrock
 
 #endif // BLACKROCK_COMMON_H_
@@ -0,0 +1,342 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distributed-blocks.h"
+#include <kj/main.h>
+#include <kj/debug.h>
+#include <sandstorm/util.h>
+#include <sodium/core.h>
+#include <sodium/crypto_generichash_blake2b.h>
+#include <sodium/crypto_stream_chacha20.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace blackrock {
+
+class BlockStoreBench {
+  // Load test comparing the two ways FilesystemStorage can store a Volume: as a sparse file, or
+  // in a LocalBlockShard. Runs the same workloads against one volume of each kind, performing
+  // the same operations VolumeImpl would for each block, and reports IOPS and disk usage.
+
+public:
+  BlockStoreBench(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "Blackrock",
+          "Benchmarks Volume storage backends using files under <dir>. Use a directory on the "
+          "filesystem you'd use for storage. Reads may be served from the page cache.")
+        .addOptionWithArg({'b', "blocks"}, KJ_BIND_METHOD(*this, setBlocks), "<count>",
+            "Size of the volume, in 4k blocks (default: 262144, i.e. 1GB).")
+        .addOptionWithArg({'n', "ops"}, KJ_BIND_METHOD(*this, setOps), "<count>",
+            "Number of operations in each random workload (default: 100000).")
+        .addOption({"crypto"}, [this]() { crypto = true; return true; },
+            "Instead of comparing backends, measure block hashing and encryption throughput, "
+            "one block at a time and in batches.")
+        .addOptionWithArg({"sync-every"}, KJ_BIND_METHOD(*this, setSyncEvery), "<count>",
+            "Sync after this many writes, like a guest filesystem flushing (default: only at "
+            "the end of each workload).")
+        .expectArg("<dir>", KJ_BIND_METHOD(*this, setDir))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  uint64_t blocks = 262144;
+  uint64_t ops = 100000;
+  uint64_t syncEvery = 0;
+  bool crypto = false;
+  kj::AutoCloseFd dirFd;
+
+  static constexpr uint BLOCK_SIZE = LocalBlockShard::BLOCK_SIZE;
+
+  class Backend {
+  public:
+    virtual ~Backend() noexcept(false) {}
+    virtual void write(uint32_t blockNum, kj::ArrayPtr<const byte> data) = 0;
+    virtual void read(uint32_t blockNum, kj::ArrayPtr<byte> data) = 0;
+    virtual void sync() = 0;
+    virtual int getFd() = 0;
+  };
+
+  class SparseFileBackend final: public Backend {
+    // What VolumeImpl does without a block store.
+
+  public:
+    explicit SparseFileBackend(kj::AutoCloseFd fd): fd(kj::mv(fd)) {}
+
+    void write(uint32_t blockNum, kj::ArrayPtr<const byte> data) override {
+      KJ_SYSCALL(pwrite(fd, data.begin(), data.size(), uint64_t(blockNum) * BLOCK_SIZE));
+    }
+
+    void read(uint32_t blockNum, kj::ArrayPtr<byte> data) override {
+      ssize_t n;
+      KJ_SYSCALL(n = pread(fd, data.begin(), data.size(), uint64_t(blockNum) * BLOCK_SIZE));
+      memset(data.begin() + n, 0, data.size() - n);
+    }
+
+    void sync() override {
+      KJ_SYSCALL(fdatasync(fd));
+    }
+
+    int getFd() override { return fd; }
+
+  private:
+    kj::AutoCloseFd fd;
+  };
+
+  class BlockShardBackend final: public Backend {
+    // What VolumeImpl does with a block store, including deriving a key for every block.
+
+  public:
+    explicit BlockShardBackend(kj::AutoCloseFd fd)
+        : fd(kj::mv(fd)), shard(kj::AutoCloseFd(dup(this->fd))) {}
+
+    void write(uint32_t blockNum, kj::ArrayPtr<const byte> data) override {
+      shard.putMutable({ { 1, 1, blockNum, 0 } }, getKey(blockNum), data);
+    }
+
+    void read(uint32_t blockNum, kj::ArrayPtr<byte> data) override {
+      if (shard.getMutable({ { 1, 1, blockNum, 0 } }, getKey(blockNum), data) == nullptr) {
+        memset(data.begin(), 0, data.size());
+      }
+    }
+
+    void sync() override {
+      shard.sync();
+    }
+
+    int getFd() override { return fd; }
+
+  private:
+    kj::AutoCloseFd fd;
+    LocalBlockShard shard;
+
+    UInt256 getKey(uint32_t blockNum) {
+      static const byte VOLUME_KEY[32] = { 1 };
+      UInt256 result;
+      uint64_t input = blockNum;
+      KJ_ASSERT(crypto_generichash_blake2b(
+          reinterpret_cast<byte*>(result.value), sizeof(result.value),
+          reinterpret_cast<const byte*>(&input), sizeof(input),
+          VOLUME_KEY, sizeof(VOLUME_KEY)) == 0);
+      return result;
+    }
+  };
+
+  kj::MainBuilder::Validity parseCount(kj::StringPtr arg, uint64_t& result, bool allowZero) {
+    char* end;
+    result = strtoull(arg.cStr(), &end, 0);
+    if (*end != '\0' || (result == 0 && !allowZero)) return "invalid count";
+    return true;
+  }
+
+  kj::MainBuilder::Validity setBlocks(kj::StringPtr arg) {
+    auto result = parseCount(arg, blocks, false);
+    if (blocks > (1u << 27)) return "volume too big for one block store";
+    return result;
+  }
+
+  kj::MainBuilder::Validity setOps(kj::StringPtr arg) {
+    return parseCount(arg, ops, false);
+  }
+
+  kj::MainBuilder::Validity setSyncEvery(kj::StringPtr arg) {
+    return parseCount(arg, syncEvery, true);
+  }
+
+  kj::MainBuilder::Validity setDir(kj::StringPtr arg) {
+    mkdir(arg.cStr(), 0777);
+    dirFd = sandstorm::raiiOpen(arg, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return true;
+  }
+
+  static uint64_t mix(uint64_t x) {
+    // splitmix64, for picking blocks and generating their content.
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+  }
+
+  static uint64_t nowNs() {
+    struct timespec ts;
+    KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  }
+
+  LocalBlockShard::Geometry getGeometry() {
+    // Room for twice the volume, since overwritten blocks aren't freed until the next sync.
+    uint8_t lgBlockCount = 6;
+    while ((1ull << lgBlockCount) < blocks * 2) ++lgBlockCount;
+    return { uint8_t(lgBlockCount + 1), 16, lgBlockCount };
+  }
+
+  void runWorkloads(kj::StringPtr name, Backend& backend) {
+    context.warning(kj::str(name, ":"));
+
+    alignas(uint64_t) byte data[BLOCK_SIZE];
+    uint64_t counter = 0;
+    uint64_t writesSinceSync = 0;
+
+    auto write = [&](uint64_t blockNum) {
+      // Distinct, incompressible content for every write.
+      uint64_t* words = reinterpret_cast<uint64_t*>(data);
+      for (uint i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++) {
+        words[i] = mix(counter++);
+      }
+      backend.write(blockNum, kj::arrayPtr(data, sizeof(data)));
+
+      if (syncEvery > 0 && ++writesSinceSync == syncEvery) {
+        backend.sync();
+        writesSinceSync = 0;
+      }
+    };
+    auto read = [&](uint64_t blockNum) {
+      backend.read(blockNum, kj::arrayPtr(data, sizeof(data)));
+    };
+
+    auto measure = [&](kj::StringPtr workload, uint64_t count, auto&& func) {
+      uint64_t start = nowNs();
+      for (uint64_t i = 0; i < count; i++) {
+        func(i);
+      }
+      backend.sync();
+      uint64_t elapsed = nowNs() - start;
+      context.warning(kj::str("  ", workload, ": ", count * 1000000000ull / elapsed, " IOPS"));
+    };
+
+    auto reportSpace = [&]() {
+      struct stat stats;
+      KJ_SYSCALL(fstat(backend.getFd(), &stats));
+      context.warning(kj::str("  disk used: ", stats.st_blocks * 512 / 1048576, "MB for ",
+                              blocks * BLOCK_SIZE / 1048576, "MB of data"));
+    };
+
+    // Fill only every other block, so that reads also see holes.
+    measure("sequential write", blocks / 2, [&](uint64_t i) { write(i * 2); });
+    reportSpace();
+    measure("random overwrite", ops, [&](uint64_t i) { write(mix(i) % (blocks / 2) * 2); });
+    reportSpace();
+    measure("random read", ops, [&](uint64_t i) { read(mix(i + ops) % blocks); });
+    measure("mixed, 70% reads", ops, [&](uint64_t i) {
+      uint64_t r = mix(i + ops * 2);
+      if (r % 10 < 7) {
+        read((r >> 8) % blocks);
+      } else {
+        write((r >> 8) % (blocks / 2) * 2);
+      }
+    });
+    reportSpace();
+  }
+
+  void measureThroughput(kj::StringPtr name, uint64_t count, kj::Function<void(uint64_t)> func) {
+    uint64_t start = nowNs();
+    for (uint64_t i = 0; i < count; i++) {
+      func(i);
+    }
+    uint64_t elapsed = nowNs() - start;
+    context.warning(kj::str("  ", name, ": ", count * BLOCK_SIZE * 1000 / elapsed, "MB/s"));
+  }
+
+  void runCrypto() {
+    // sodium_init() picks the implementations for this CPU, as LocalBlockShard does.
+    KJ_ASSERT(sodium_init() != -1);
+
+    alignas(uint64_t) byte data[BLOCK_SIZE];
+    uint64_t* words = reinterpret_cast<uint64_t*>(data);
+    for (uint i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++) {
+      words[i] = mix(i);
+    }
+
+    context.warning("one core:");
+    byte hash[32];
+    measureThroughput("BLAKE2b", ops, [&](uint64_t i) {
+      words[0] = i;
+      crypto_generichash_blake2b(hash, sizeof(hash), data, sizeof(data), nullptr, 0);
+    });
+    const byte KEY[crypto_stream_chacha20_KEYBYTES] = { 1 };
+    measureThroughput("ChaCha20", ops, [&](uint64_t i) {
+      crypto_stream_chacha20_xor(data, data, sizeof(data),
+                                 reinterpret_cast<const byte*>(&i), KEY);
+    });
+
+    // Batches the size of the largest Volume read, through a block store under <dir>.
+    auto fd = sandstorm::raiiOpenAt(dirFd, "blocks", O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC);
+    LocalBlockShard::format(fd, { { 1, 1 } }, { 14, 10, 13 });
+    LocalBlockShard shard(kj::mv(fd));
+    KJ_SYSCALL(unlinkat(dirFd, "blocks", 0));
+
+    constexpr uint BATCH = 2047;
+    auto ids = kj::heapArray<UInt256>(BATCH);
+    auto keys = kj::heapArray<UInt256>(BATCH);
+    auto batch = kj::heapArray<byte>(BATCH * BLOCK_SIZE);
+    for (uint i = 0; i < BATCH; i++) {
+      ids[i] = { { 1, 1, i, 0 } };
+      keys[i] = { { mix(i), mix(i + 1), mix(i + 2), mix(i + 3) } };
+      memcpy(batch.begin() + i * BLOCK_SIZE, data, BLOCK_SIZE);
+    }
+
+    context.warning(kj::str("batches of ", BATCH, " blocks:"));
+    uint64_t batchCount = kj::max(ops / BATCH, uint64_t(1));
+    measureThroughput("putMutableBlocks + sync", batchCount * BATCH, [&](uint64_t i) {
+      // Overwritten blocks are only freed by sync(), and the store only has room for two copies.
+      if (i % BATCH == 0) {
+        shard.putMutableBlocks(ids, keys, batch);
+        shard.sync();
+      }
+    });
+    measureThroughput("getMutableBlocks", batchCount * BATCH, [&](uint64_t i) {
+      if (i % BATCH == 0) shard.getMutableBlocks(ids, keys, batch);
+    });
+  }
+
+  bool run() {
+    if (crypto) {
+      runCrypto();
+      return true;
+    }
+
+    {
+      SparseFileBackend backend(sandstorm::raiiOpenAt(dirFd, "volume",
+          O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC));
+      runWorkloads("sparse file", backend);
+    }
+    KJ_SYSCALL(unlinkat(dirFd, "volume", 0));
+
+    {
+      auto fd = sandstorm::raiiOpenAt(dirFd, "blocks", O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC);
+      auto geometry = getGeometry();
+      LocalBlockShard::format(fd, { { 1, 1 } }, geometry);
+      context.warning(kj::str("block store geometry: 2^", geometry.lgBucketCount,
+          " buckets, 2^", geometry.lgJournalSize, " journal entries, 2^", geometry.lgBlockCount,
+          " blocks"));
+
+      BlockShardBackend backend(kj::mv(fd));
+      runWorkloads("block store", backend);
+    }
+    KJ_SYSCALL(unlinkat(dirFd, "blocks", 0));
+
+    return true;
+  }
+};
+
+}  // namespace blackrock
+
+KJ_MAIN(blackrock::BlockStoreBench)
@@ -0,0 +1,623 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distributed-blocks.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <kj/function.h>
+#include <sandstorm/util.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string.h>
+
+namespace blackrock {
+namespace {
+
+constexpr LocalBlockShard::Geometry SMALL = {
+  8,  // 256 buckets
+  5,  // 32 journal entries, so that tests wrap around the journal
+  6   // 64 blocks
+};
+
+kj::AutoCloseFd newDisk() {
+  return sandstorm::raiiOpen("/var/tmp", O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+}
+
+kj::AutoCloseFd dupFd(int fd) {
+  int result;
+  KJ_SYSCALL(result = dup(fd));
+  return kj::AutoCloseFd(result);
+}
+
+kj::AutoCloseFd copyDisk(int fd) {
+  // Copies what's on the disk -- not including anything LocalBlockShard has only in memory -- as
+  // if we'd crashed.
+
+  auto result = newDisk();
+  struct stat stats;
+  KJ_SYSCALL(fstat(fd, &stats));
+  KJ_SYSCALL(ftruncate(result, stats.st_size));
+
+  byte buffer[65536];
+  for (off_t offset = 0; offset < stats.st_size; offset += sizeof(buffer)) {
+    ssize_t n;
+    KJ_SYSCALL(n = pread(fd, buffer, sizeof(buffer), offset));
+    KJ_SYSCALL(pwrite(result, buffer, n, offset));
+  }
+  return result;
+}
+
+struct TestBlock {
+  byte data[LocalBlockShard::BLOCK_SIZE];
+
+  explicit TestBlock(byte fill) { memset(data, fill, sizeof(data)); }
+
+  kj::ArrayPtr<byte> asPtr() { return kj::arrayPtr(data, sizeof(data)); }
+  bool operator==(const TestBlock& other) const {
+    return memcmp(data, other.data, sizeof(data)) == 0;
+  }
+};
+
+UInt256 id(uint64_t group, uint64_t n) {
+  return { { group, group, n, 0 } };
+}
+
+uint32_t revision(kj::Maybe<uint32_t> result) {
+  return KJ_ASSERT_NONNULL(result, "block not found");
+}
+
+const UInt256 KEY = { { 1, 2, 3, 4 } };
+const UInt256 OTHER_KEY = { { 4, 3, 2, 1 } };
+
+KJ_TEST("block shard stores mutable blocks with revisions") {
+  auto disk = newDisk();
+  LocalBlockShard::format(disk, { { 123, 456 } }, SMALL);
+  LocalBlockShard shard(dupFd(disk));
+
+  TestBlock out(0);
+  KJ_EXPECT(shard.getMutable(id(1, 0), KEY, out.asPtr()) == nullptr);
+
+  KJ_EXPECT(shard.putMutable(id(1, 0), KEY, TestBlock('a').asPtr()));
+  KJ_EXPECT(revision(shard.getMutable(id(1, 0), KEY, out.asPtr())) == 1);
+  KJ_EXPECT(out == TestBlock('a'));
+
+  KJ_EXPECT(!shard.putMutable(id(1, 0), KEY, TestBlock('b').asPtr()));
+  KJ_EXPECT(revision(shard.getMutable(id(1, 0), KEY, out.asPtr())) == 2);
+  KJ_EXPECT(out == TestBlock('b'));
+
+  // Stored encrypted.
+  shard.getMutable(id(1, 0), OTHER_KEY, out.asPtr());
+  KJ_EXPECT(!(out == TestBlock('b')));
+
+  KJ_EXPECT(shard.putMutable(id(1, 1), KEY, TestBlock('c').asPtr()));
+  KJ_EXPECT(shard.putMutable(id(2, 0), KEY, TestBlock('d').asPtr()));
+  KJ_EXPECT(shard.getGroupBlockCount(id(1, 0).group()) == 2);
+  KJ_EXPECT(shard.getGroupBlockCount(id(2, 0).group()) == 1);
+  KJ_EXPECT(shard.getGroups().size() == 2);
+
+  KJ_EXPECT(shard.deleteMutable(id(1, 0)));
+  KJ_EXPECT(!shard.deleteMutable(id(1, 0)));
+  KJ_EXPECT(shard.getMutable(id(1, 0), KEY, out.asPtr()) == nullptr);
+  KJ_EXPECT(revision(shard.getMutable(id(1, 1), KEY, out.asPtr())) == 1);
+  KJ_EXPECT(out == TestBlock('c'));
+
+  KJ_EXPECT(shard.deleteGroup(id(2, 0).group()) == 1);
+  KJ_EXPECT(shard.getMutable(id(2, 0), KEY, out.asPtr()) == nullptr);
+  KJ_EXPECT(shard.getGroups().size() == 1);
+}
+
+KJ_TEST("block shard deduplicates immutable blocks") {
+  auto disk = newDisk();
+  LocalBlockShard::format(disk, { { 123, 456 } }, SMALL);
+  LocalBlockShard shard(dupFd(disk));
+
+  KJ_EXPECT(shard.addImmutable(TestBlock(0).asPtr()).isZero());
+  KJ_EXPECT(shard.getStats().blocksUsed == 0);
+
+  auto ref = shard.addImmutable(TestBlock('x').asPtr());
+  KJ_EXPECT(shard.addImmutable(TestBlock('x').asPtr()) == ref);
+  KJ_EXPECT(shard.getStats().blocksUsed == 1);
+  KJ_EXPECT(shard.getImmutableId(ref) != ref);
+
+  TestBlock out(0);
+  KJ_EXPECT(shard.getImmutable(ref, out.asPtr()));
+  KJ_EXPECT(out == TestBlock('x'));
+
+  shard.releaseImmutable(ref);
+  KJ_EXPECT(shard.getImmutable(ref, out.asPtr()));
+  shard.releaseImmutable(ref);
+  KJ_EXPECT(!shard.getImmutable(ref, out.asPtr()));
+
+  // The block is freed once the release is durable.
+  shard.sync();
+  KJ_EXPECT(shard.getStats().blocksUsed == 0);
+}
+
+KJ_TEST("block shard reads and writes mutable blocks in batches") {
+  // Enough blocks that the crypto is split across threads.
+  constexpr uint COUNT = 200;
+
+  auto disk = newDisk();
+  LocalBlockShard::format(disk, { { 123, 456 } }, { 10, 5, 8 });
+  LocalBlockShard shard(dupFd(disk));
+
+  constexpr size_t BLOCK_SIZE = LocalBlockShard::BLOCK_SIZE;
+  auto ids = kj::heapArray<UInt256>(COUNT);
+  auto keys = kj::heapArray<UInt256>(COUNT);
+  auto data = kj::heapArray<byte>(COUNT * BLOCK_SIZE);
+  for (uint i = 0; i < COUNT; i++) {
+    ids[i] = id(1, i);
+    keys[i] = { { i, 2, 3, 4 } };
+    memset(data.begin() + i * BLOCK_SIZE, i + 1, BLOCK_SIZE);
+  }
+  shard.putMutableBlocks(ids, keys, data);
+
+  // Each block can be read on its own, with its own key.
+  TestBlock out(0);
+  KJ_EXPECT(revision(shard.getMutable(id(1, 7), keys[7], out.asPtr())) == 1);
+  KJ_EXPECT(out == TestBlock(8));
+
+  KJ_EXPECT(shard.deleteMutable(id(1, 7)));
+  memset(data.begin(), 0xff, data.size());
+  KJ_EXPECT(shard.getMutableBlocks(ids, keys, data) == COUNT - 1);
+  for (uint i = 0; i < COUNT; i++) {
+    byte expected = i == 7 ? 0 : i + 1;
+    for (size_t j = 0; j < BLOCK_SIZE; j++) {
+      if (data[i * BLOCK_SIZE + j] != expected) {
+        KJ_FAIL_EXPECT("wrong content", i, j);
+        break;
+      }
+    }
+  }
+}
+
+KJ_TEST("block shard reuses space freed by overwrites") {
+  auto disk = newDisk();
+  LocalBlockShard::format(disk, { { 123, 456 } }, SMALL);
+  LocalBlockShard shard(dupFd(disk));
+
+  // Far more writes than there are blocks, or journal entries. Full stores sync to free space.
+  for (uint i = 0; i < 1000; i++) {
+    shard.putMutable(id(1, i % 16), KEY, TestBlock(i % 251 + 1).asPtr());
+  }
+
+  TestBlock out(0);
+  for (uint i = 1000 - 16; i < 1000; i++) {
+    shard.getMutable(id(1, i % 16), KEY, out.asPtr());
+    KJ_EXPECT(out == TestBlock(i % 251 + 1), i);
+  }
+
+  shard.sync();
+  KJ_EXPECT(shard.getStats().blocksUsed == 16);
+}
+
+KJ_TEST("block shard recovers from its journal") {
+  auto disk = newDisk();
+  LocalBlockShard::format(disk, { { 123, 456 } }, SMALL);
+
+  kj::AutoCloseFd crashed = nullptr;
+  UInt256 ref;
+  {
+    LocalBlockShard shard(dupFd(disk));
+    for (uint i = 0; i < 40; i++) {
+      shard.putMutable(id(1, i % 20), KEY, TestBlock(i + 1).asPtr());
+    }
+    shard.deleteMutable(id(1, 3));
+    ref = shard.addImmutable(TestBlock('x').asPtr());
+    shard.sync();
+
+    // The journal filled up once, forcing a checkpoint. Later transactions are only in the
+    // journal.
+    crashed = copyDisk(disk);
+  }
+
+  for (int fd: { disk.get(), crashed.get() }) {
+    LocalBlockShard shard(dupFd(fd));
+    TestBlock out(0);
+    for (uint i = 20; i < 40; i++) {
+      if (i % 20 == 3) {
+        KJ_EXPECT(shard.getMutable(id(1, 3), KEY, out.asPtr()) == nullptr);
+      } else {
+        KJ_EXPECT(revision(shard.getMutable(id(1, i % 20), KEY, out.asPtr())) == 2);
+        KJ_EXPECT(out == TestBlock(i + 1), i);
+      }
+    }
+    KJ_EXPECT(shard.getImmutable(ref, out.asPtr()));
+    KJ_EXPECT(out == TestBlock('x'));
+    KJ_EXPECT(shard.getGroupBlockCount(id(1, 0).group()) == 19);
+    KJ_EXPECT(shard.getStats().blocksUsed == 20);
+  }
+}
+
+class FlakyShard final: public BlockShard {
+  // Passes everything through to a real shard, but throws while `broken` is set.
+
+public:
+  explicit FlakyShard(BlockShard& inner): inner(inner) {}
+
+  bool broken = false;
+
+  kj::Maybe<kj::Function<void()>> beforeExport;
+  // Called once, on the next exportBlock().
+
+  UInt128 getClusterId() override { return inner.getClusterId(); }
+  Placement getPlacement() override { return inner.getPlacement(); }
+
+  UInt256 addImmutable(kj::ArrayPtr<const byte> data) override {
+    check();
+    return inner.addImmutable(data);
+  }
+  bool getImmutable(const UInt256& blockRef, kj::ArrayPtr<byte> data) override {
+    check();
+    return inner.getImmutable(blockRef, data);
+  }
+  void releaseImmutable(const UInt256& blockRef) override {
+    check();
+    inner.releaseImmutable(blockRef);
+  }
+  kj::Maybe<uint32_t> getMutable(
+      const UInt256& id, const UInt256& key, kj::ArrayPtr<byte> data) override {
+    check();
+    return inner.getMutable(id, key, data);
+  }
+  bool putMutable(const UInt256& id, const UInt256& key,
+                  kj::ArrayPtr<const byte> data) override {
+    check();
+    return inner.putMutable(id, key, data);
+  }
+  bool deleteMutable(const UInt256& id) override {
+    check();
+    return inner.deleteMutable(id);
+  }
+  uint64_t getGroupBlockCount(const UInt128& group) override {
+    check();
+    return inner.getGroupBlockCount(group);
+  }
+  uint64_t deleteGroup(const UInt128& group) override {
+    check();
+    return inner.deleteGroup(group);
+  }
+  void sync() override {
+    check();
+    inner.sync();
+  }
+  kj::Array<UInt256> listBlocks(uint8_t replicaId, uint32_t begin, uint32_t end) override {
+    check();
+    return inner.listBlocks(replicaId, begin, end);
+  }
+  bool exportBlock(const UInt256& id, RawBlock& block) override {
+    check();
+    KJ_IF_MAYBE(func, beforeExport) {
+      auto run = kj::mv(*func);
+      beforeExport = nullptr;
+      run();
+    }
+    return inner.exportBlock(id, block);
+  }
+  void importBlock(const RawBlock& block) override {
+    check();
+    inner.importBlock(block);
+  }
+  bool dropBlock(const UInt256& id) override {
+    check();
+    return inner.dropBlock(id);
+  }
+
+private:
+  BlockShard& inner;
+
+  void check() {
+    KJ_REQUIRE(!broken, "shard is broken");
+  }
+};
+
+const UInt128 CLUSTER_ID = { { 123, 456 } };
+
+uint64_t testGroup(uint i) {
+  // Groups spread over both halves of the first word, i.e. over the key spaces of replicas 0
+  // and 1.
+  return (i + 1) * 0x9e3779b97f4a7c15ull;
+}
+
+KJ_TEST("block router writes every replica and rebalances when shards are added") {
+  auto disk0 = newDisk();
+  auto disk1 = newDisk();
+  auto disk2 = newDisk();
+  LocalBlockShard::format(disk0, CLUSTER_ID, SMALL, { 0, 0 });
+  LocalBlockShard::format(disk1, CLUSTER_ID, SMALL, { 1, 0x12345678 });
+  LocalBlockShard::format(disk2, CLUSTER_ID, SMALL, { 0, 0x80000000 });
+  LocalBlockShard shard0(dupFd(disk0));
+  LocalBlockShard shard1(dupFd(disk1));
+  LocalBlockShard shard2(dupFd(disk2));
+
+  BlockRouter router(CLUSTER_ID);
+  router.addShard(shard0);
+  router.addShard(shard1);
+  KJ_EXPECT(router.getReplicaCount() == 2);
+
+  for (uint i = 0; i < 8; i++) {
+    for (uint n = 0; n < 2; n++) {
+      KJ_EXPECT(router.putMutable(id(testGroup(i), n), KEY, TestBlock(i * 2 + n + 1).asPtr()));
+    }
+  }
+  auto ref = router.addImmutable(TestBlock('x').asPtr());
+  router.sync();
+  KJ_EXPECT(shard0.getStats().blocksUsed == 17);
+  KJ_EXPECT(shard1.getStats().blocksUsed == 17);
+
+  // The new shard takes the upper half of replica 0's key space, and nothing else.
+  router.addShard(shard2);
+  KJ_EXPECT(shard0.getStats().blocksUsed + shard2.getStats().blocksUsed == 17);
+  KJ_EXPECT(shard1.getStats().blocksUsed == 17);
+  for (uint i = 0; i < 8; i++) {
+    UInt128 group = id(testGroup(i), 0).group();
+    bool upper = uint32_t(testGroup(i)) >= 0x80000000u;
+    KJ_EXPECT(shard0.getGroupBlockCount(group) == (upper ? 0 : 2), i);
+    KJ_EXPECT(shard2.getGroupBlockCount(group) == (upper ? 2 : 0), i);
+    KJ_EXPECT(router.getGroupBlockCount(group) == 2, i);
+  }
+
+  TestBlock out(0);
+  for (uint i = 0; i < 8; i++) {
+    for (uint n = 0; n < 2; n++) {
+      KJ_EXPECT(revision(router.getMutable(id(testGroup(i), n), KEY, out.asPtr())) == 1);
+      KJ_EXPECT(out == TestBlock(i * 2 + n + 1), i, n);
+    }
+  }
+  KJ_EXPECT(router.getImmutable(ref, out.asPtr()));
+  KJ_EXPECT(out == TestBlock('x'));
+
+  KJ_EXPECT(router.deleteGroup(id(testGroup(0), 0).group()) == 2);
+  KJ_EXPECT(router.getGroupBlockCount(id(testGroup(0), 0).group()) == 0);
+  KJ_EXPECT(shard1.getGroupBlockCount(id(testGroup(0), 0).group()) == 0);
+}
+
+KJ_TEST("block router reads from another replica when one fails") {
+  auto disk0 = newDisk();
+  auto disk1 = newDisk();
+  LocalBlockShard::format(disk0, CLUSTER_ID, SMALL, { 0, 0 });
+  LocalBlockShard::format(disk1, CLUSTER_ID, SMALL, { 1, 0 });
+  LocalBlockShard shard0(dupFd(disk0));
+  LocalBlockShard shard1(dupFd(disk1));
+  FlakyShard flaky(shard0);
+  FlakyShard flaky1(shard1);
+
+  BlockRouter router(CLUSTER_ID);
+  router.addShard(flaky);
+  router.addShard(flaky1);
+
+  router.putMutable(id(1, 0), KEY, TestBlock('a').asPtr());
+
+  flaky.broken = true;
+  TestBlock out(0);
+  KJ_EXPECT(revision(router.getMutable(id(1, 0), KEY, out.asPtr())) == 1);
+  KJ_EXPECT(out == TestBlock('a'));
+
+  // A write still reaches the healthy replica, but reports the failure.
+  KJ_EXPECT_THROW_MESSAGE("shard is broken",
+      router.putMutable(id(1, 0), KEY, TestBlock('b').asPtr()));
+  KJ_EXPECT(revision(shard1.getMutable(id(1, 0), KEY, out.asPtr())) == 2);
+  KJ_EXPECT(out == TestBlock('b'));
+
+  // The failed shard missed that write, so reads avoid it even once it's back, and so do later
+  // writes, which it would apply on top of the old content.
+  flaky.broken = false;
+  KJ_EXPECT(revision(router.getMutable(id(1, 0), KEY, out.asPtr())) == 2);
+  KJ_EXPECT(out == TestBlock('b'));
+  router.putMutable(id(1, 0), KEY, TestBlock('c').asPtr());
+  KJ_EXPECT(revision(shard0.getMutable(id(1, 0), KEY, out.asPtr())) == 1);
+  KJ_EXPECT(out == TestBlock('a'));
+
+  // The same goes for deleting a group: the other replica alone answers for it.
+  router.putMutable(id(2, 0), KEY, TestBlock('d').asPtr());
+  flaky.broken = true;
+  KJ_EXPECT_THROW_MESSAGE("shard is broken", router.deleteGroup(id(2, 0).group()));
+  flaky.broken = false;
+  KJ_EXPECT(shard0.getGroupBlockCount(id(2, 0).group()) == 1);
+  flaky1.broken = true;
+  KJ_EXPECT_THROW_MESSAGE("shard is broken", router.getGroupBlockCount(id(2, 0).group()));
+  KJ_EXPECT_THROW_MESSAGE("shard is broken", router.getMutable(id(1, 0), KEY, out.asPtr()));
+  flaky1.broken = false;
+
+  // sync() repairs the shard from the other replica, after which it can serve reads alone.
+  router.sync();
+  KJ_EXPECT(revision(shard0.getMutable(id(1, 0), KEY, out.asPtr())) == 3);
+  KJ_EXPECT(out == TestBlock('c'));
+  KJ_EXPECT(shard0.getGroupBlockCount(id(2, 0).group()) == 0);
+  flaky1.broken = true;
+  KJ_EXPECT(revision(router.getMutable(id(1, 0), KEY, out.asPtr())) == 3);
+  KJ_EXPECT(out == TestBlock('c'));
+  KJ_EXPECT(router.getGroupBlockCount(id(2, 0).group()) == 0);
+}
+
+KJ_TEST("block router copies blocks written while a shard is being added") {
+  auto disk0 = newDisk();
+  auto disk2 = newDisk();
+  LocalBlockShard::format(disk0, CLUSTER_ID, SMALL, { 0, 0 });
+  LocalBlockShard::format(disk2, CLUSTER_ID, SMALL, { 0, 0x80000000 });
+  LocalBlockShard shard0(dupFd(disk0));
+  LocalBlockShard shard2(dupFd(disk2));
+  FlakyShard hooked(shard0);
+
+  BlockRouter router(CLUSTER_ID);
+  router.addShard(hooked);
+  for (uint i = 0; i < 4; i++) {
+    for (uint n = 0; n < 2; n++) {
+      router.putMutable(id(testGroup(i), n), KEY, TestBlock(i * 2 + n + 1).asPtr());
+    }
+  }
+
+  // Groups 1, 3 and 5 go to the new shard. Change them once the copying has begun.
+  hooked.beforeExport = [&]() {
+    router.putMutable(id(testGroup(1), 0), KEY, TestBlock('z').asPtr());
+    router.deleteMutable(id(testGroup(1), 1));
+    router.deleteGroup(id(testGroup(3), 0).group());
+    router.putMutable(id(testGroup(3), 1), KEY, TestBlock('r').asPtr());
+    router.putMutable(id(testGroup(5), 0), KEY, TestBlock('n').asPtr());
+  };
+  router.addShard(shard2);
+  KJ_EXPECT(hooked.beforeExport == nullptr);
+
+  KJ_EXPECT(shard0.getStats().blocksUsed == 4);
+  KJ_EXPECT(shard2.getStats().blocksUsed == 3);
+
+  TestBlock out(0);
+  KJ_EXPECT(revision(shard2.getMutable(id(testGroup(1), 0), KEY, out.asPtr())) == 2);
+  KJ_EXPECT(out == TestBlock('z'));
+  KJ_EXPECT(shard2.getMutable(id(testGroup(1), 1), KEY, out.asPtr()) == nullptr);
+  KJ_EXPECT(shard2.getMutable(id(testGroup(3), 0), KEY, out.asPtr()) == nullptr);
+  KJ_EXPECT(revision(shard2.getMutable(id(testGroup(3), 1), KEY, out.asPtr())) == 1);
+  KJ_EXPECT(out == TestBlock('r'));
+  KJ_EXPECT(revision(router.getMutable(id(testGroup(5), 0), KEY, out.asPtr())) == 1);
+  KJ_EXPECT(out == TestBlock('n'));
+  KJ_EXPECT(revision(router.getMutable(id(testGroup(2), 1), KEY, out.asPtr())) == 1);
+  KJ_EXPECT(out == TestBlock(6));
+}
+
+KJ_TEST("block shard evicts idle blocks to a cold store") {
+  char path[] = "/var/tmp/blackrock-cold-test.XXXXXX";
+  KJ_ASSERT(mkdtemp(path) != nullptr);
+  KJ_DEFER(sandstorm::recursivelyDelete(path));
+  auto coldFd = sandstorm::raiiOpen(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DirectoryColdStore cold(dupFd(coldFd));
+
+  auto disk = newDisk();
+  LocalBlockShard::format(disk, CLUSTER_ID, SMALL);
+
+  UInt256 ref;
+  {
+    LocalBlockShard shard(dupFd(disk), cold);
+    for (uint n = 0; n < 4; n++) {
+      shard.putMutable(id(1, n), KEY, TestBlock(n + 1).asPtr());
+    }
+    shard.putMutable(id(2, 0), KEY, TestBlock('z').asPtr());
+    ref = shard.addImmutable(TestBlock('x').asPtr());
+
+    KJ_EXPECT(shard.getIdleGroups(0 * kj::SECONDS).size() == 2);
+    KJ_EXPECT(shard.getIdleGroups(3600 * kj::SECONDS).size() == 0);
+
+    KJ_EXPECT(shard.evictGroup(id(1, 0).group()) == 4);
+    KJ_EXPECT(shard.evictBlock(shard.getImmutableId(ref)));
+    KJ_EXPECT(!shard.evictBlock(shard.getImmutableId(ref)));
+    shard.sync();
+
+    auto stats = shard.getStats();
+    KJ_EXPECT(stats.blocksUsed == 1);
+    KJ_EXPECT(stats.coldBlocks == 5);
+    KJ_EXPECT(shard.getGroupBlockCount(id(1, 0).group()) == 4);
+
+    // The evicted group isn't idle anymore; it's gone.
+    auto idle = shard.getIdleGroups(0 * kj::SECONDS);
+    KJ_EXPECT(idle.size() == 1 && idle[0] == id(2, 0).group());
+  }
+
+  // Evicted blocks stay evicted across restarts, and come back when read.
+  LocalBlockShard shard(dupFd(disk), cold);
+  KJ_EXPECT(shard.getStats().coldBlocks == 5);
+
+  TestBlock out(0);
+  KJ_EXPECT(revision(shard.getMutable(id(1, 2), KEY, out.asPtr())) == 3);
+  KJ_EXPECT(out == TestBlock(3));
+  KJ_EXPECT(shard.getImmutable(ref, out.asPtr()));
+  KJ_EXPECT(out == TestBlock('x'));
+
+  // Overwriting or deleting a cold block drops its cold copy once synced.
+  shard.putMutable(id(1, 3), KEY, TestBlock('w').asPtr());
+  shard.deleteMutable(id(1, 1));
+  KJ_EXPECT(sandstorm::listDirectoryFd(coldFd).size() == 5);
+  shard.sync();
+
+  auto stats = shard.getStats();
+  KJ_EXPECT(stats.coldBlocks == 1);
+  KJ_EXPECT(stats.blocksUsed == 4);
+  KJ_EXPECT(sandstorm::listDirectoryFd(coldFd).size() == 1);
+
+  // Cold blocks can also be faulted in ahead of reading them.
+  auto ids = kj::heapArray<UInt256>({ id(1, 0), id(2, 0) });
+  KJ_EXPECT(shard.hasColdBlocks(ids));
+  shard.faultIn(ids);
+  KJ_EXPECT(!shard.hasColdBlocks(ids));
+  KJ_EXPECT(shard.getStats().coldBlocks == 0);
+
+  KJ_EXPECT(revision(shard.getMutable(id(1, 0), KEY, out.asPtr())) == 3);
+  KJ_EXPECT(out == TestBlock(1));
+}
+
+class HookedColdStore final: public ColdStore {
+  // Runs `onPut` in the middle of the next put(), as if it happened concurrently.
+
+public:
+  explicit HookedColdStore(ColdStore& inner): inner(inner) {}
+
+  kj::Maybe<kj::Function<void()>> onPut;
+
+  void put(kj::StringPtr name, kj::ArrayPtr<const byte> data) override {
+    inner.put(name, data);
+    KJ_IF_MAYBE(hook, onPut) {
+      auto func = kj::mv(*hook);
+      onPut = nullptr;
+      func();
+    }
+  }
+  void get(kj::StringPtr name, kj::ArrayPtr<byte> data) override { inner.get(name, data); }
+  void remove(kj::StringPtr name) override { inner.remove(name); }
+
+private:
+  ColdStore& inner;
+};
+
+KJ_TEST("block shard eviction survives blocks being deleted and rewritten") {
+  char path[] = "/var/tmp/blackrock-cold-test.XXXXXX";
+  KJ_ASSERT(mkdtemp(path) != nullptr);
+  KJ_DEFER(sandstorm::recursivelyDelete(path));
+  auto coldFd = sandstorm::raiiOpen(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DirectoryColdStore directory(dupFd(coldFd));
+  HookedColdStore cold(directory);
+
+  auto disk = newDisk();
+  LocalBlockShard::format(disk, CLUSTER_ID, SMALL);
+  LocalBlockShard shard(dupFd(disk), cold);
+  TestBlock out(0);
+
+  // A block deleted and rewritten while its eviction is uploading may get the revision it had
+  // before, but the eviction must still notice that the upload is stale.
+  shard.putMutable(id(1, 0), KEY, TestBlock('a').asPtr());
+  cold.onPut = [&]() {
+    shard.deleteMutable(id(1, 0));
+    shard.putMutable(id(1, 0), KEY, TestBlock('b').asPtr());
+  };
+  KJ_EXPECT(!shard.evictBlock(id(1, 0)));
+  KJ_EXPECT(shard.getStats().coldBlocks == 0);
+  KJ_EXPECT(shard.getMutable(id(1, 0), KEY, out.asPtr()) != nullptr);
+  KJ_EXPECT(out == TestBlock('b'));
+
+  // Likewise, a block evicted, deleted, rewritten and evicted again must not be stored under the
+  // name of its previous cold copy, which is about to be removed.
+  shard.putMutable(id(1, 1), KEY, TestBlock('c').asPtr());
+  KJ_EXPECT(shard.evictBlock(id(1, 1)));
+  shard.deleteMutable(id(1, 1));
+  shard.putMutable(id(1, 1), KEY, TestBlock('d').asPtr());
+  KJ_EXPECT(shard.evictBlock(id(1, 1)));
+  shard.sync();
+  KJ_EXPECT(sandstorm::listDirectoryFd(coldFd).size() == 1);
+  KJ_EXPECT(shard.getMutable(id(1, 1), KEY, out.asPtr()) != nullptr);
+  KJ_EXPECT(out == TestBlock('d'));
+}
+
+}  // namespace
+}  // namespace blackrock
@@ -14,27 +14,35 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-// ************************************
-// **** INCOMPLETE **** INCOMPLETE ****
-// ************************************
+// This file defines the on-disk format of Blackrock's block storage and implements
+// LocalBlockShard (see distributed-blocks.h), which stores blocks on one disk in that format.
 //
-// This file contains some initial ideas for data structures relating to a distributed block
-// storage system. At present we are not implementing this, but we might in the future.
+// The format was designed for a distributed system where each disk holds shards of the
+// cluster's block ID space, blocks reference one another, and several replicas exist. Only the
+// single-shard, single-replica subset is implemented so far.
 
-#include "common.h"
-#include <inttypes.h>
+#include "distributed-blocks.h"
+#include <kj/debug.h>
+#include <sandstorm/util.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sodium/core.h>
+#include <sodium/randombytes.h>
+#include <sodium/crypto_generichash_blake2b.h>
+#include <sodium/crypto_stream_chacha20.h>
+#include <time.h>
+#include <algorithm>
+#include <unordered_map>
+#undef BLOCK_SIZE  // defined by sys/mount.h, conflicts with LocalBlockShard::BLOCK_SIZE
 
 namespace blackrock {
 namespace {
 
-struct UInt128 {
-  uint64_t value[2];
-};
-
-struct UInt256 {
-  uint64_t value[4];
-};
-
 struct Superblock {
   // First block of a physical disk which is part of the distributed block storage system.
 
@@ -98,7 +106,12 @@ struct Bucket {
   //
   // TODO(someday): Unclear if this flag is strictly necessary.
 
-  unsigned reserved0 :3;
+  unsigned isCold :1;
+  // If true, the content isn't stored locally but in the ColdStore, under a name derived from
+  // `blockId` and `coldRevision`, and `offset` is zero. The block is fetched back ("faulted in")
+  // the next time it is read.
+
+  unsigned reserved0 :2;
   // Must be zero.
 
   unsigned offset :28;
@@ -113,14 +126,18 @@ struct Bucket {
   // when the block is overwritten since this is always accomplished by writing the new data to
   // a new location and then updating `offset`.
 
-  uint32_t reserved1[5];
+  uint32_t nonce[2];
+  // For mutable blocks, the (random) 64-bit ChaCha20 nonce with which the current content was
+  // encrypted. A fresh nonce is chosen on every write, since the key stays the same. Zero for
+  // immutable blocks, whose key is unique to their content.
+
+  uint32_t reserved1;
   // Must be zero.
-  //
-  // TODO(someday):
-  // - Record crypto nonce? (Could union with refcount.)
-  // - Record location of the block in long-term storage.
-  // - Implement policy for pushing blocks to long-term storage.
-  // - Implement policy for purging blocks from local storage once they are in long-term storage.
+
+  uint64_t coldRevision;
+  // If `isCold`, the eviction sequence number under which the block was evicted. The shard never
+  // reuses one, so this distinguishes the copy in the ColdStore from every other copy of the same
+  // block, including ones which may not have been deleted yet.
 };
 
 static_assert(sizeof(Bucket) == 64, "Bucket size changed!");
@@ -130,7 +147,9 @@ struct Transaction {
   // Transaction ID. Assigned sequentially per-shard.
 
   uint64_t firstIncompleteTx;
-  // The transaction ID of the first incomplete transaction at the time
+  // The transaction ID of the first incomplete transaction at the time this one was written,
+  // i.e. the first one whose bucket update might not yet be reflected in the on-disk hash table.
+  // Recovery replays from here.
 
   uint32_t bucketIndex;
   // Which bucket to overwrite.
@@ -159,12 +178,12 @@ struct Transaction {
 
   uint8_t reserved1[2];
 
-  uint32_t reserved2[6];
+  uint64_t checksum;
+  // First 8 bytes of the BLAKE2b hash of this Transaction (including `refs`), computed with this
+  // field set to zero. Lets us reliably find the end of the journal after power failure.
+
+  uint32_t reserved2[4];
   // Must be zero.
-  //
-  // TODO(someday):
-  // - Verify valid transaction, e.g. with a checksum/hash, so that we can reliably find the end of
-  //   the journal after power failure.
 
   Bucket newBucket;
   // New bucket contents.
@@ -188,7 +207,8 @@ struct Block {
     // A regular data block containing bytes.
     //
     // The block is encrypted using its own 256-bit BLAKE2b hash (salted with the cluster ID) as
-    // the key, and a nonce of zero.
+    // the key, and a nonce of zero. Mutable blocks are instead encrypted with a key chosen by
+    // their owner and the nonce recorded in their Bucket.
 
     UInt256 blockTableSegment[128];
     // A block which contains a list of references to other blocks.
@@ -206,5 +226,1842 @@ struct Block {
 
 static_assert(sizeof(Block) == 4096, "Block size changed!");
 
+constexpr UInt128 Superblock::MAGIC;
+
+// =======================================================================================
+
+void preadAll(int fd, void* data, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t n;
+    KJ_SYSCALL(n = pread(fd, data, size, offset));
+    KJ_REQUIRE(n > 0, "block store truncated");
+    data = reinterpret_cast<byte*>(data) + n;
+    size -= n;
+    offset += n;
+  }
+}
+
+void pwriteAll(int fd, const void* data, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t n;
+    KJ_SYSCALL(n = pwrite(fd, data, size, offset));
+    KJ_ASSERT(n != 0, "zero-sized write?");
+    data = reinterpret_cast<const byte*>(data) + n;
+    size -= n;
+    offset += n;
+  }
+}
+
+uint64_t getDiskSize(int fd) {
+  struct stat stats;
+  KJ_SYSCALL(fstat(fd, &stats));
+  if (S_ISBLK(stats.st_mode)) {
+    uint64_t size;
+    KJ_SYSCALL(ioctl(fd, BLKGETSIZE64, &size));
+    return size;
+  } else {
+    return stats.st_size;
+  }
+}
+
+inline uint64_t mix(uint64_t x) {
+  // splitmix64 finalizer.
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+inline UInt256 operator^(const UInt256& a, const UInt256& b) {
+  return { { a.value[0] ^ b.value[0], a.value[1] ^ b.value[1],
+             a.value[2] ^ b.value[2], a.value[3] ^ b.value[3] } };
+}
+
+inline bool isLive(const Bucket& bucket) {
+  // A bucket with a zero blockId is empty. A bucket with a blockId but no references is a
+  // "tombstone" left behind by a deletion: lookups must probe past it (since other blocks may
+  // have been placed beyond it), but inserts may reuse it.
+
+  return bucket.refcount > 0;
+}
+
+inline uint64_t getNonce(const Bucket& bucket) {
+  uint64_t result;
+  memcpy(&result, bucket.nonce, sizeof(result));
+  return result;
+}
+
+inline void setNonce(Bucket& bucket, uint64_t nonce) {
+  memcpy(bucket.nonce, &nonce, sizeof(nonce));
+}
+
+inline kj::Maybe<uint32_t> getLocalContent(const Bucket& bucket) {
+  // The content block to free once `bucket` has been replaced, if it has one.
+
+  if (isLive(bucket) && !bucket.isCold) {
+    return uint32_t(bucket.offset);
+  } else {
+    return nullptr;
+  }
+}
+
+kj::String getColdName(const UInt256& id, uint64_t coldRevision) {
+  return kj::str(kj::hex(id.value[0]), '-', kj::hex(id.value[1]), '-', kj::hex(id.value[2]), '-',
+                 kj::hex(id.value[3]), '-', coldRevision);
+}
+
+uint64_t nowNs() {
+  struct timespec ts;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// ---------------------------------------------------------------------------------------
+// Bulk crypto
+//
+// Hashing and encrypting 4k blocks is most of the CPU cost of the block store. libsodium already
+// has SIMD (SSSE3/AVX2) implementations of BLAKE2b and ChaCha20, picked for the CPU by
+// sodium_init(). On top of that, we keep the crypto outside the shard lock, so that threads
+// don't serialize on it, and spread big batches (e.g. an 8MB Volume read) across cores.
+
+void cryptBlock(byte* out, const byte* in, const UInt256& key, uint64_t nonce) {
+  // Encrypts or decrypts (it's the same) one block.
+
+  static_assert(crypto_stream_chacha20_NONCEBYTES == sizeof(nonce), "Bad nonce size.");
+  static_assert(crypto_stream_chacha20_KEYBYTES == sizeof(key.value), "Bad key size.");
+  crypto_stream_chacha20_xor(out, in, BlockShard::BLOCK_SIZE,
+      reinterpret_cast<const byte*>(&nonce), reinterpret_cast<const byte*>(key.value));
+}
+
+constexpr size_t MIN_BLOCKS_PER_THREAD = 64;
+// Below 256k of work per thread, handing it to the thread costs about as much as it saves.
+
+template <typename Func>
+void forEachBlock(size_t count, Func&& func) {
+  // Calls func(i) for each i in [0, count), in parallel if there are enough.
+
+  static const size_t cpuCount = kj::max(sysconf(_SC_NPROCESSORS_ONLN), 1l);
+  uint threadCount = kj::max(kj::min(count / MIN_BLOCKS_PER_THREAD, cpuCount), size_t(1));
+  parallelFor(threadCount, [&](uint t) {
+    for (size_t i = count * t / threadCount; i < count * (t + 1) / threadCount; i++) {
+      func(i);
+    }
+  });
+}
+
+inline bool inRange(uint32_t key, uint32_t begin, uint32_t end) {
+  // Whether `key` is in [begin, end), wrapping around if `end` <= `begin`. In particular,
+  // begin == end is the whole key space, which is what the only shard in a replica owns.
+
+  return begin == end || uint32_t(key - begin) < uint32_t(end - begin);
+}
+
+struct Layout {
+  // Byte offsets of the regions of a disk, each of which starts on a block boundary: the
+  // superblock, then the journal, then the hash table, then the content blocks.
+
+  uint64_t journalOffset;
+  uint64_t journalSize;
+  uint64_t tableOffset;
+  uint64_t tableSize;
+  uint64_t contentOffset;
+  uint64_t end;
+
+  Layout() = default;
+  explicit Layout(LocalBlockShard::Geometry geometry) {
+    KJ_REQUIRE(geometry.lgBlockCount >= 6 && geometry.lgBlockCount <= 28,
+               "invalid block count", geometry.lgBlockCount);
+    KJ_REQUIRE(geometry.lgBucketCount > geometry.lgBlockCount && geometry.lgBucketCount <= 32,
+               "there must be more buckets than blocks",
+               geometry.lgBucketCount, geometry.lgBlockCount);
+    KJ_REQUIRE(geometry.lgJournalSize >= 5 && geometry.lgJournalSize <= 24,
+               "invalid journal size", geometry.lgJournalSize);
+
+    journalOffset = LocalBlockShard::BLOCK_SIZE;
+    journalSize = sizeof(Transaction) << geometry.lgJournalSize;
+    tableOffset = journalOffset + journalSize;
+    tableSize = sizeof(Bucket) << geometry.lgBucketCount;
+    contentOffset = tableOffset + tableSize;
+    end = contentOffset + (uint64_t(LocalBlockShard::BLOCK_SIZE) << geometry.lgBlockCount);
+  }
+};
+
+class MmapDisposer: public kj::ArrayDisposer {
+protected:
+  void disposeImpl(void* firstElement, size_t elementSize, size_t elementCount,
+                   size_t capacity, void (*destroyElement)(void*)) const override {
+    KJ_SYSCALL(munmap(firstElement, elementSize * capacity));
+  }
+};
+
+const MmapDisposer mmapDisposer = MmapDisposer();
+
 }  // namespace
+
+// =======================================================================================
+
+class LocalBlockShard::Impl {
+public:
+  Impl(kj::AutoCloseFd fdParam, kj::Maybe<ColdStore&> coldStore)
+      : fd(kj::mv(fdParam)), superblock(readSuperblock(fd)), hasher(superblock.clusterId),
+        coldStore(coldStore), openedAtNs(nowNs()) {
+    layout = Layout(Geometry {
+        superblock.lgBucketCount, superblock.lgJournalSize, superblock.lgBlockCount });
+    KJ_REQUIRE(getDiskSize(fd) >= layout.end, "block store truncated");
+
+    bucketMask = (1ull << superblock.lgBucketCount) - 1;
+    journalMask = (1ull << superblock.lgJournalSize) - 1;
+    blockCount = 1ull << superblock.lgBlockCount;
+
+    // We map the hash table privately, so that the kernel can't write back a bucket before the
+    // journal entry for it is durable; checkpoint() writes back changed pages explicitly.
+    KJ_REQUIRE(sysconf(_SC_PAGESIZE) == BLOCK_SIZE, "LocalBlockShard requires 4k pages");
+    void* mapping = mmap(nullptr, layout.tableSize, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                         fd, layout.tableOffset);
+    if (mapping == MAP_FAILED) {
+      KJ_FAIL_SYSCALL("mmap(hash table)", errno);
+    }
+    table = kj::Array<Bucket>(reinterpret_cast<Bucket*>(mapping), bucketMask + 1, mmapDisposer);
+
+    bool replayed = replayJournal();
+    countUsage();
+    if (replayed) checkpoint();
+  }
+
+  ~Impl() noexcept(false) {
+    unwindDetector.catchExceptionsIfUnwinding([&]() {
+      checkpoint();
+    });
+  }
+
+  void addImmutable(const UInt256& ref, kj::ArrayPtr<const byte> data) {
+    // `ref` is the (nonzero) blockRef of `data`, computed by the caller outside the lock.
+
+    UInt256 id = hasher.getImmutableId(ref);
+    KJ_IF_MAYBE(index, find(id)) {
+      Bucket bucket = table[*index];
+      KJ_REQUIRE(!bucket.isMutable, "block ID collides with a mutable block");
+      KJ_REQUIRE(bucket.refcount < uint32_t(kj::maxValue), "too many references to block");
+      ++bucket.refcount;
+      ++bucket.revision;
+      commitBucket(*index, bucket);
+    } else {
+      byte buffer[BLOCK_SIZE];
+      cryptBlock(buffer, data.begin(), hasher.getContentHash(ref), 0);
+      uint32_t offset = allocateBlock();
+      writeContent(offset, buffer);
+      uint64_t index = findFree(id);
+      commitBucket(index, newBucket(table[index], id, false, offset));
+    }
+  }
+
+  bool readImmutable(const UInt256& ref, byte* data) {
+    // Reads the (nonzero) blockRef's content, still encrypted.
+
+    KJ_IF_MAYBE(index, find(hasher.getImmutableId(ref))) {
+      KJ_REQUIRE(!table[*index].isMutable, "not an immutable block");
+      readContent(faultIn(*index).offset, data);
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  void releaseImmutable(const UInt256& ref) {
+    if (ref.isZero()) return;
+
+    kj::Maybe<uint64_t> found = find(hasher.getImmutableId(ref));
+    uint64_t index = KJ_REQUIRE_NONNULL(found, "no such block");
+    Bucket bucket = table[index];
+    KJ_REQUIRE(!bucket.isMutable, "not an immutable block");
+    if (bucket.refcount == 1) {
+      removeBucket(index);
+    } else {
+      --bucket.refcount;
+      ++bucket.revision;
+      commitBucket(index, bucket);
+    }
+  }
+
+  UInt256 getImmutableId(const UInt256& ref) {
+    return hasher.getImmutableId(ref);
+  }
+
+  UInt128 getClusterId() {
+    return superblock.clusterId;
+  }
+
+  Placement getPlacement() {
+    return { superblock.replicaId, superblock.shardIds[0] };
+  }
+
+  kj::Maybe<uint32_t> readMutable(const UInt256& id, byte* data, uint64_t& nonce) {
+    // Reads a mutable block's content, still encrypted, and the nonce needed to decrypt it.
+
+    KJ_IF_MAYBE(index, find(id)) {
+      KJ_REQUIRE(table[*index].isMutable, "not a mutable block");
+      touch(id.group());
+      const Bucket& bucket = faultIn(*index);
+      readContent(bucket.offset, data);
+      nonce = getNonce(bucket);
+      return uint32_t(bucket.revision);
+    } else {
+      return nullptr;
+    }
+  }
+
+  bool putMutable(const UInt256& id, const byte* data, uint64_t nonce) {
+    // Writes a mutable block's content, already encrypted with `nonce`.
+
+    KJ_REQUIRE(!id.isZero(), "mutable block ID can't be zero");
+
+    kj::Maybe<uint64_t> existing = find(id);
+    KJ_IF_MAYBE(index, existing) {
+      KJ_REQUIRE(table[*index].isMutable, "not a mutable block");
+    }
+    touch(id.group());
+
+    // We never overwrite content in place: the old content must stay intact until the journal
+    // entry pointing at the new content is durable.
+    uint32_t offset = allocateBlock();
+    writeContent(offset, data);
+
+    KJ_IF_MAYBE(index, existing) {
+      Bucket bucket = table[*index];
+      kj::Maybe<uint32_t> oldOffset = getLocalContent(bucket);
+      bucket.offset = offset;
+      bucket.isCold = false;
+      bucket.coldRevision = 0;
+      setNonce(bucket, nonce);
+      ++bucket.revision;
+      commitBucket(*index, bucket, oldOffset);
+      return false;
+    } else {
+      uint64_t index = findFree(id);
+      Bucket bucket = newBucket(table[index], id, true, offset);
+      setNonce(bucket, nonce);
+      commitBucket(index, bucket);
+      return true;
+    }
+  }
+
+  bool deleteMutable(const UInt256& id) {
+    KJ_IF_MAYBE(index, find(id)) {
+      KJ_REQUIRE(table[*index].isMutable, "not a mutable block");
+      removeBucket(*index);
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  uint64_t getGroupBlockCount(const UInt128& group) {
+    auto iter = groupCounts.find(group);
+    return iter == groupCounts.end() ? 0 : iter->second;
+  }
+
+  kj::Array<UInt128> getGroups() {
+    auto result = kj::heapArrayBuilder<UInt128>(groupCounts.size());
+    for (auto& entry: groupCounts) {
+      result.add(entry.first);
+    }
+    return result.finish();
+  }
+
+  uint64_t deleteGroup(const UInt128& group) {
+    uint64_t remaining = getGroupBlockCount(group);
+    uint64_t deleted = 0;
+    for (uint64_t i = 0; i <= bucketMask && remaining > 0; i++) {
+      const Bucket& bucket = table[i];
+      if (isLive(bucket) && bucket.isMutable && bucket.blockId.group() == group) {
+        removeBucket(i);
+        ++deleted;
+        --remaining;
+      }
+    }
+    lastAccessNs.erase(group);
+    return deleted;
+  }
+
+  kj::Array<UInt256> listGroup(const UInt128& group) {
+    uint64_t remaining = getGroupBlockCount(group);
+    kj::Vector<UInt256> result(remaining);
+    for (uint64_t i = 0; i <= bucketMask && remaining > 0; i++) {
+      const Bucket& bucket = table[i];
+      if (isLive(bucket) && bucket.isMutable && bucket.blockId.group() == group) {
+        result.add(bucket.blockId);
+        --remaining;
+      }
+    }
+    return result.releaseAsArray();
+  }
+
+  kj::Array<UInt128> getIdleGroups(uint64_t idleNs) {
+    uint64_t now = nowNs();
+    kj::Vector<UInt128> result;
+    for (auto& entry: groupCounts) {
+      auto iter = lastAccessNs.find(entry.first);
+      uint64_t lastAccess = iter == lastAccessNs.end() ? openedAtNs : iter->second;
+      if (lastAccess != EVICTED && now - lastAccess >= idleNs) {
+        result.add(entry.first);
+      }
+    }
+    return result.releaseAsArray();
+  }
+
+  kj::Array<UInt256> listLocalBlocks(const UInt128& group) {
+    kj::Vector<UInt256> result;
+    for (auto& bucket: table) {
+      if (isLive(bucket) && !bucket.isCold && bucket.isMutable &&
+          bucket.blockId.group() == group) {
+        result.add(bucket.blockId);
+      }
+    }
+    return result.releaseAsArray();
+  }
+
+  void markEvicted(const UInt128& group) {
+    lastAccessNs[group] = EVICTED;
+  }
+
+  kj::Maybe<uint64_t> prepareEviction(const UInt256& id, RawBlock& block) {
+    // First step of moving a block to the ColdStore: copy it out, and return a new eviction
+    // sequence number, under which to store the copy, and which finishEviction() will expect.
+    // Returns null if the block doesn't exist or is already cold.
+
+    KJ_IF_MAYBE(index, find(id)) {
+      if (table[*index].isCold) return nullptr;
+      exportBlock(id, block);
+      uint64_t token = nextColdRevision++;
+      pendingEvictions[*index] = token;
+      return token;
+    } else {
+      return nullptr;
+    }
+  }
+
+  bool finishEviction(const UInt256& id, uint64_t token) {
+    // Last step of moving a block to the ColdStore, once the copy there is durable. Returns false
+    // if the block changed since prepareEviction(), in which case the copy is useless.
+
+    KJ_IF_MAYBE(index, find(id)) {
+      auto iter = pendingEvictions.find(*index);
+      if (iter == pendingEvictions.end() || iter->second != token) return false;
+      pendingEvictions.erase(iter);
+
+      Bucket bucket = table[*index];
+      KJ_ASSERT(!bucket.isCold, "cold bucket changed without invalidating its eviction");
+
+      uint32_t oldOffset = bucket.offset;
+      bucket.isCold = true;
+      bucket.coldRevision = token;
+      bucket.offset = 0;
+      ++bucket.revision;
+      commitBucket(*index, bucket, oldOffset);
+      ++coldBlocks;
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  kj::Maybe<uint64_t> getColdRevision(const UInt256& id) {
+    // If the block is cold, the revision naming its copy in the ColdStore, which the caller may
+    // fetch without holding the lock and then pass to finishFaultIn().
+
+    KJ_IF_MAYBE(index, find(id)) {
+      const Bucket& bucket = table[*index];
+      if (bucket.isCold) return uint64_t(bucket.coldRevision);
+    }
+    return nullptr;
+  }
+
+  void finishFaultIn(const UInt256& id, uint64_t coldRevision, const byte* data) {
+    // Stores a cold block's content fetched by the caller. Does nothing if the block changed in
+    // the meantime -- including if someone else faulted it in first.
+
+    KJ_IF_MAYBE(index, find(id)) {
+      const Bucket& bucket = table[*index];
+      if (bucket.isCold && bucket.coldRevision == coldRevision) {
+        storeFaultedIn(*index, data);
+      }
+    }
+  }
+
+  ColdStore& getColdStore() {
+    return KJ_REQUIRE_NONNULL(coldStore, "block store has no cold store configured");
+  }
+
+  kj::Array<UInt256> listBlocks(uint8_t replicaId, uint32_t begin, uint32_t end) {
+    KJ_REQUIRE(replicaId < 8, "invalid replica ID", replicaId);
+
+    kj::Vector<UInt256> result;
+    for (auto& bucket: table) {
+      if (isLive(bucket) && inRange(bucket.blockId.getRoutingKey(replicaId), begin, end)) {
+        result.add(bucket.blockId);
+      }
+    }
+    return result.releaseAsArray();
+  }
+
+  bool exportBlock(const UInt256& id, RawBlock& block) {
+    KJ_IF_MAYBE(index, find(id)) {
+      const Bucket& bucket = faultIn(*index);
+      block.id = id;
+      block.isMutable = bucket.isMutable;
+      block.refcount = bucket.refcount;
+      block.revision = bucket.revision;
+      block.nonce = getNonce(bucket);
+      readContent(bucket.offset, block.data);
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  void importBlock(const RawBlock& block) {
+    KJ_REQUIRE(!block.id.isZero() && block.refcount > 0, "invalid block");
+
+    uint32_t offset = allocateBlock();
+    writeContent(offset, block.data);
+
+    kj::Maybe<uint64_t> existing = find(block.id);
+    uint64_t index;
+    kj::Maybe<uint32_t> trim;
+    KJ_IF_MAYBE(i, existing) {
+      index = *i;
+      trim = getLocalContent(table[index]);
+    } else {
+      index = findFree(block.id);
+    }
+
+    Bucket bucket = newBucket(table[index], block.id, block.isMutable, offset);
+    bucket.refcount = block.refcount;
+    bucket.revision = block.revision;
+    setNonce(bucket, block.nonce);
+    commitBucket(index, bucket, trim);
+  }
+
+  bool dropBlock(const UInt256& id) {
+    KJ_IF_MAYBE(index, find(id)) {
+      removeBucket(*index);
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  void sync() {
+    KJ_SYSCALL(fdatasync(fd));
+    finishSync(startSync());
+  }
+
+  struct SyncPoint {
+    // What becomes reusable once everything written so far is durable.
+
+    kj::Vector<uint32_t> free;
+    kj::Vector<kj::String> coldRemovals;
+  };
+
+  SyncPoint startSync() {
+    // Together with finishSync(), sync() in two halves, so that LocalBlockShard can fdatasync()
+    // in between without holding the lock. Blocks freed meanwhile wait for the next sync.
+
+    SyncPoint result { kj::mv(pendingFree), kj::mv(pendingColdRemoval) };
+    pendingFree = kj::Vector<uint32_t>();
+    pendingColdRemoval = kj::Vector<kj::String>();
+    return result;
+  }
+
+  void finishSync(SyncPoint point) {
+    // Blocks trimmed by the transactions just made durable can be reused.
+    for (uint32_t offset: point.free) {
+      usedBlocks[offset / 64] &= ~(1ull << (offset % 64));
+      --blocksUsed;
+      if (offset < freeHint) freeHint = offset;
+    }
+
+    // Likewise, cold copies which no bucket refers to anymore can go, once we've let go of the
+    // lock; see takeColdRemovals().
+    for (auto& name: point.coldRemovals) {
+      coldRemovals.add(kj::mv(name));
+    }
+  }
+
+  int getFd() { return fd; }
+
+  kj::Vector<kj::String> takeColdRemovals() {
+    // Names of cold copies which are safe to remove from the cold store, since the buckets which
+    // stopped referring to them are durable.
+
+    return kj::mv(coldRemovals);
+  }
+
+  void checkpoint() {
+    sync();
+
+    if (dirtyBuckets.size() > 0) {
+      constexpr uint BUCKETS_PER_PAGE = BLOCK_SIZE / sizeof(Bucket);
+      std::sort(dirtyBuckets.begin(), dirtyBuckets.end());
+      uint64_t lastPage = kj::maxValue;
+      for (uint32_t index: dirtyBuckets) {
+        uint64_t page = index / BUCKETS_PER_PAGE;
+        if (page == lastPage) continue;
+        lastPage = page;
+
+        byte* ptr = reinterpret_cast<byte*>(table.begin()) + page * BLOCK_SIZE;
+        pwriteAll(fd, ptr, BLOCK_SIZE, layout.tableOffset + page * BLOCK_SIZE);
+
+        // The file now has our changes, so drop our private copy of the page rather than let the
+        // table gradually become entirely anonymous memory.
+        KJ_SYSCALL(madvise(ptr, BLOCK_SIZE, MADV_DONTNEED));
+      }
+      dirtyBuckets.clear();
+      KJ_SYSCALL(fdatasync(fd));
+    }
+
+    checkpointTxnId = nextTxnId;
+  }
+
+  Stats getStats() {
+    return { bucketMask + 1, bucketsUsed, blockCount, blocksUsed, coldBlocks };
+  }
+
+private:
+  kj::AutoCloseFd fd;
+  Superblock superblock;
+  BlockHasher hasher;
+  Layout layout;
+  uint64_t bucketMask;
+  uint64_t journalMask;
+  uint64_t blockCount;
+
+  kj::Array<Bucket> table;
+  // The hash table, mapped privately from disk.
+
+  uint64_t nextTxnId = 1;
+
+  uint64_t checkpointTxnId = 1;
+  // Transactions before this one are reflected in the on-disk hash table, so their journal
+  // entries may be overwritten.
+
+  kj::Vector<uint32_t> dirtyBuckets;
+  // Buckets modified since the last checkpoint. May contain duplicates.
+
+  kj::Array<uint64_t> usedBlocks;
+  // Bitmap of content blocks which are in use, or which were trimmed but not yet synced.
+
+  uint64_t freeHint = 0;
+  // No block below this one is free. We always allocate the lowest free block, which keeps a
+  // sparse file no bigger than it needs to be.
+
+  kj::Vector<uint32_t> pendingFree;
+  // Content blocks trimmed since the last sync(). We can't reuse them until then, because until
+  // the trimming transaction is durable, a crash could bring back the bucket pointing at them.
+
+  uint64_t blocksUsed = 0;
+  uint64_t bucketsUsed = 0;
+
+  std::unordered_map<UInt128, uint64_t, UInt128::Hash> groupCounts;
+  // Number of live mutable blocks in each group.
+
+  kj::Maybe<ColdStore&> coldStore;
+
+  kj::Vector<kj::String> pendingColdRemoval;
+  // Names of objects in the cold store which buckets stopped referring to since the last sync().
+  // Like `pendingFree`, we can't remove them until then.
+
+  kj::Vector<kj::String> coldRemovals;
+  // Names from `pendingColdRemoval` which a sync() made removable. A name is never reused, so
+  // they can be removed at leisure, without holding the lock.
+
+  uint64_t nextColdRevision = 1;
+  // Next eviction sequence number. Starts past every `coldRevision` in the table, so that a new
+  // cold copy never takes the name of one still in use or in `pendingColdRemoval`.
+
+  std::unordered_map<uint64_t, uint64_t> pendingEvictions;
+  // Bucket index -> sequence number of the eviction in progress for it, dropped whenever the
+  // bucket changes, since that makes the copy being uploaded stale. Bucket revisions can't tell
+  // us, since a bucket deleted and then reused starts them over.
+
+  uint64_t coldBlocks = 0;
+
+  uint64_t openedAtNs;
+  std::unordered_map<UInt128, uint64_t, UInt128::Hash> lastAccessNs;
+  // When each group's blocks were last read or written (CLOCK_MONOTONIC), for getIdleGroups().
+  // Groups not listed haven't been used since `openedAtNs`. Not persisted.
+
+  static constexpr uint64_t EVICTED = kj::maxValue;
+  // Value of `lastAccessNs` for a group which was evicted and not used since.
+
+  kj::UnwindDetector unwindDetector;
+
+  static Superblock readSuperblock(int fd) {
+    Superblock result;
+    preadAll(fd, &result, sizeof(result), 0);
+    KJ_REQUIRE(result.magic == Superblock::MAGIC, "not a Blackrock block store");
+    KJ_REQUIRE(result.version == Superblock::VERSION,
+               "unsupported block store version", result.version);
+    KJ_REQUIRE(result.shardCount == 0,
+               "block stores with more than one shard per disk are not supported yet");
+    KJ_REQUIRE(result.replicaId < 8, "block store is corrupt", result.replicaId);
+    return result;
+  }
+
+  static uint64_t checksum(Transaction txn) {
+    txn.checksum = 0;
+    byte result[crypto_generichash_blake2b_BYTES_MIN];
+    KJ_ASSERT(crypto_generichash_blake2b(result, sizeof(result),
+        reinterpret_cast<const byte*>(&txn), sizeof(txn), nullptr, 0) == 0);
+
+    uint64_t truncated;
+    memcpy(&truncated, result, sizeof(truncated));
+    return truncated;
+  }
+
+  bool isValid(const Transaction& txn, uint64_t slot) {
+    return txn.id != 0 && (txn.id & journalMask) == slot &&
+           txn.bucketIndex <= bucketMask &&
+           txn.refsAddedCount == 0 && txn.refsRemovedCount == 0 &&
+           txn.checksum == checksum(txn);
+  }
+
+  bool replayJournal() {
+    // Applies journal entries from the last checkpoint onward to the hash table. Returns true if
+    // the journal had any entries at all.
+
+    auto journal = kj::heapArray<byte>(layout.journalSize);
+    preadAll(fd, journal.begin(), journal.size(), layout.journalOffset);
+    auto entry = [&](uint64_t slot) {
+      Transaction txn;
+      memcpy(&txn, journal.begin() + slot * sizeof(Transaction), sizeof(txn));
+      return txn;
+    };
+
+    uint64_t last = 0;
+    for (uint64_t slot = 0; slot <= journalMask; slot++) {
+      Transaction txn = entry(slot);
+      if (isValid(txn, slot) && txn.id > last) {
+        last = txn.id;
+      }
+    }
+    if (last == 0) return false;
+
+    uint64_t first = entry(last & journalMask).firstIncompleteTx;
+    KJ_REQUIRE(first <= last && last - first <= journalMask,
+               "block store journal is corrupt", first, last);
+
+    uint64_t count = 0;
+    for (uint64_t id = first; id <= last; id++) {
+      Transaction txn = entry(id & journalMask);
+      if (txn.id != id || !isValid(txn, id & journalMask)) {
+        // This transaction was never written (or only partially), since we crashed before the
+        // sync() that would have made it durable. Later transactions might have made it to disk
+        // anyway, but they weren't synced either, so we drop them too.
+        KJ_LOG(WARNING, "discarding unsynced block store transactions", id, last);
+        break;
+      }
+
+      table[txn.bucketIndex] = txn.newBucket;
+      dirtyBuckets.add(txn.bucketIndex);
+      ++count;
+    }
+
+    KJ_LOG(INFO, "replayed block store journal", count);
+
+    // Never reuse an ID we've seen, even if we discarded the transaction, so that a stale entry
+    // can't later be mistaken for a new one.
+    nextTxnId = last + 1;
+    checkpointTxnId = first;
+    return true;
+  }
+
+  void countUsage() {
+    // Scan the hash table to find which content blocks are in use.
+    //
+    // TODO(perf): This reads the whole table on startup. We could persist the bitmap and group
+    //   counts at checkpoints.
+
+    usedBlocks = kj::heapArray<uint64_t>(blockCount / 64);
+    memset(usedBlocks.begin(), 0, usedBlocks.size() * sizeof(usedBlocks[0]));
+
+    for (auto& bucket: table) {
+      if (bucket.blockId.isZero()) continue;
+      ++bucketsUsed;
+      if (!isLive(bucket)) continue;
+
+      if (bucket.isMutable) {
+        ++groupCounts[bucket.blockId.group()];
+      }
+
+      if (bucket.isCold) {
+        ++coldBlocks;
+        nextColdRevision = kj::max(nextColdRevision, bucket.coldRevision + 1);
+        continue;
+      }
+
+      uint32_t offset = bucket.offset;
+      KJ_REQUIRE(offset < blockCount, "block store hash table is corrupt", offset);
+      uint64_t& word = usedBlocks[offset / 64];
+      uint64_t bit = 1ull << (offset % 64);
+      if (word & bit) {
+        KJ_LOG(ERROR, "two buckets point at the same content block", offset);
+      } else {
+        word |= bit;
+        ++blocksUsed;
+      }
+    }
+  }
+
+  uint64_t firstBucket(const UInt256& id) {
+    // Immutable block IDs are uniformly random, but mutable ones share their first 128 bits with
+    // the rest of their group, so we have to mix everything.
+
+    return mix(id.value[0] ^ mix(id.value[1] ^ mix(id.value[2] ^ mix(id.value[3])))) &
+           bucketMask;
+  }
+
+  kj::Maybe<uint64_t> find(const UInt256& id) {
+    // Find the live bucket for the given block ID. We never let the table fill up, so the probe
+    // always ends at an empty bucket.
+
+    for (uint64_t i = firstBucket(id);; i = (i + 1) & bucketMask) {
+      const Bucket& bucket = table[i];
+      if (bucket.blockId.isZero()) return nullptr;
+      if (isLive(bucket) && bucket.blockId == id) return i;
+    }
+  }
+
+  uint64_t findFree(const UInt256& id) {
+    // Find the bucket in which to insert `id`, which must not be present.
+    //
+    // TODO(perf): Tombstones only go away when a deletion finds an empty bucket after them, so
+    //   a long-lived store with lots of churn may accumulate them. We should rehash at some
+    //   point.
+
+    KJ_REQUIRE(bucketsUsed < bucketMask, "block store hash table is full");
+    for (uint64_t i = firstBucket(id);; i = (i + 1) & bucketMask) {
+      if (!isLive(table[i])) return i;
+    }
+  }
+
+  static Bucket newBucket(const Bucket& old, const UInt256& id, bool isMutable, uint32_t offset) {
+    Bucket bucket;
+    memset(&bucket, 0, sizeof(bucket));
+    bucket.blockId = id;
+    bucket.isMutable = isMutable;
+    bucket.offset = offset;
+    bucket.refcount = 1;
+    bucket.revision = old.revision + 1;
+    return bucket;
+  }
+
+  void commitBucket(uint64_t index, const Bucket& newBucket,
+                    kj::Maybe<uint32_t> trim = nullptr) {
+    // Journal and apply a change to one bucket. `trim` is a content block to free once the
+    // change is durable.
+
+    if (nextTxnId - checkpointTxnId > journalMask) {
+      // The journal is full of transactions which recovery might still need.
+      checkpoint();
+    }
+
+    Transaction txn;
+    memset(&txn, 0, sizeof(txn));
+    txn.id = nextTxnId;
+    txn.firstIncompleteTx = checkpointTxnId;
+    txn.bucketIndex = index;
+    KJ_IF_MAYBE(t, trim) {
+      txn.trim = true;
+      txn.trimIndex = *t;
+    }
+    txn.parentTxnId = kj::maxValue;
+    txn.newBucket = newBucket;
+    txn.checksum = checksum(txn);
+    pwriteAll(fd, &txn, sizeof(txn),
+              layout.journalOffset + (txn.id & journalMask) * sizeof(Transaction));
+    ++nextTxnId;
+
+    Bucket& bucket = table[index];
+    if (isLive(bucket) && bucket.isCold &&
+        !(newBucket.isCold && newBucket.coldRevision == bucket.coldRevision)) {
+      // The cold copy is no longer needed once this is durable.
+      pendingColdRemoval.add(getColdName(bucket.blockId, bucket.coldRevision));
+      --coldBlocks;
+    }
+    if (isLive(bucket) && bucket.isMutable) {
+      auto iter = groupCounts.find(bucket.blockId.group());
+      KJ_ASSERT(iter != groupCounts.end());
+      if (--iter->second == 0) groupCounts.erase(iter);
+    }
+    if (isLive(newBucket) && newBucket.isMutable) {
+      ++groupCounts[newBucket.blockId.group()];
+    }
+    if (bucket.blockId.isZero() && !newBucket.blockId.isZero()) {
+      ++bucketsUsed;
+    } else if (!bucket.blockId.isZero() && newBucket.blockId.isZero()) {
+      --bucketsUsed;
+    }
+
+    bucket = newBucket;
+    dirtyBuckets.add(index);
+    pendingEvictions.erase(index);
+    KJ_IF_MAYBE(t, trim) {
+      pendingFree.add(*t);
+    }
+  }
+
+  void removeBucket(uint64_t index) {
+    // Delete the block in the given bucket, freeing its content.
+
+    Bucket bucket = table[index];
+    kj::Maybe<uint32_t> offset = getLocalContent(bucket);
+
+    if (table[(index + 1) & bucketMask].blockId.isZero()) {
+      // No probe continues past this bucket, so it can become empty rather than a tombstone, and
+      // then so can any tombstones immediately before it.
+      memset(&bucket, 0, sizeof(bucket));
+      commitBucket(index, bucket, offset);
+      for (uint64_t i = (index - 1) & bucketMask;
+           !table[i].blockId.isZero() && !isLive(table[i]);
+           i = (i - 1) & bucketMask) {
+        commitBucket(i, bucket);
+      }
+    } else {
+      bucket.refcount = 0;
+      bucket.offset = 0;
+      bucket.isCold = false;
+      bucket.coldRevision = 0;
+      setNonce(bucket, 0);
+      ++bucket.revision;
+      commitBucket(index, bucket, offset);
+    }
+  }
+
+  const Bucket& faultIn(uint64_t index) {
+    // Make sure the block in the given bucket is stored locally, fetching it from the cold store
+    // if need be, and return the bucket.
+    //
+    // LocalBlockShard fetches cold blocks before taking the lock to read them, so this only
+    // talks to the cold store -- blocking everything else on the shard -- if the block was
+    // evicted again in between, or for exportBlock().
+
+    const Bucket& bucket = table[index];
+    if (bucket.isCold) {
+      byte buffer[BLOCK_SIZE];
+      getColdStore().get(getColdName(bucket.blockId, bucket.coldRevision),
+                         kj::arrayPtr(buffer, sizeof(buffer)));
+      storeFaultedIn(index, buffer);
+    }
+    return table[index];
+  }
+
+  void storeFaultedIn(uint64_t index, const byte* data) {
+    // Stores the content of the cold block in the given bucket locally.
+
+    uint32_t offset = allocateBlock();
+    writeContent(offset, data);
+    Bucket bucket = table[index];
+    bucket.isCold = false;
+    bucket.coldRevision = 0;
+    bucket.offset = offset;
+    ++bucket.revision;
+    commitBucket(index, bucket);
+  }
+
+  void touch(const UInt128& group) {
+    lastAccessNs[group] = nowNs();
+  }
+
+  uint32_t allocateBlock() {
+    if (blocksUsed == blockCount && pendingFree.size() > 0) {
+      // Everything free is waiting on a sync.
+      sync();
+    }
+    KJ_REQUIRE(blocksUsed < blockCount, "block store is full");
+
+    for (uint64_t i = freeHint / 64;; i++) {
+      KJ_ASSERT(i < usedBlocks.size(), "block bitmap out of sync with count");
+      uint64_t& word = usedBlocks[i];
+      if (~word != 0) {
+        uint32_t offset = i * 64 + __builtin_ctzll(~word);
+        word |= 1ull << (offset % 64);
+        ++blocksUsed;
+        freeHint = offset;
+        return offset;
+      }
+    }
+  }
+
+  void writeContent(uint32_t offset, const byte* data) {
+    pwriteAll(fd, data, BLOCK_SIZE, layout.contentOffset + uint64_t(offset) * BLOCK_SIZE);
+  }
+
+  void readContent(uint32_t offset, byte* data) {
+    preadAll(fd, data, BLOCK_SIZE, layout.contentOffset + uint64_t(offset) * BLOCK_SIZE);
+  }
+};
+
+// =======================================================================================
+
+BlockHasher::BlockHasher(const UInt128& clusterId): clusterId(clusterId) {
+  // Among other things, sodium_init() picks the fastest BLAKE2b and ChaCha20 implementations for
+  // this CPU. Until it's called, libsodium uses portable ones.
+  KJ_ASSERT(sodium_init() != -1);
+
+  byte zeros[BlockShard::BLOCK_SIZE];
+  memset(zeros, 0, sizeof(zeros));
+  zeroHash = hash(zeros, sizeof(zeros));
+  zeroRefHash = hash(zeros, sizeof(UInt256));
+}
+
+UInt256 BlockHasher::hash(const void* data, size_t size) const {
+  UInt256 result;
+  KJ_ASSERT(crypto_generichash_blake2b(
+      reinterpret_cast<byte*>(result.value), sizeof(result.value),
+      reinterpret_cast<const byte*>(data), size,
+      reinterpret_cast<const byte*>(clusterId.value), sizeof(clusterId.value)) == 0);
+  return result;
+}
+
+UInt256 BlockHasher::getImmutableRef(kj::ArrayPtr<const byte> data) const {
+  return hash(data.begin(), data.size()) ^ zeroHash;
+}
+
+UInt256 BlockHasher::getContentHash(const UInt256& blockRef) const {
+  return blockRef ^ zeroHash;
+}
+
+UInt256 BlockHasher::getImmutableId(const UInt256& blockRef) const {
+  return hash(blockRef.value, sizeof(blockRef.value)) ^ zeroRefHash;
+}
+
+// =======================================================================================
+
+constexpr uint BlockShard::BLOCK_SIZE;
+
+BlockShard::~BlockShard() noexcept(false) {}
+ColdStore::~ColdStore() noexcept(false) {}
+
+// =======================================================================================
+
+DirectoryColdStore::DirectoryColdStore(kj::AutoCloseFd directoryFd)
+    : directoryFd(kj::mv(directoryFd)) {}
+
+void DirectoryColdStore::put(kj::StringPtr name, kj::ArrayPtr<const byte> data) {
+  // Write under a temporary name and rename into place, so that a reader never sees a partial
+  // object.
+
+  auto tempName = kj::str(name, ".tmp");
+  {
+    auto fd = sandstorm::raiiOpenAt(directoryFd, tempName,
+                                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    pwriteAll(fd, data.begin(), data.size(), 0);
+    KJ_SYSCALL(fdatasync(fd));
+  }
+  KJ_SYSCALL(renameat(directoryFd, tempName.cStr(), directoryFd, name.cStr()));
+  KJ_SYSCALL(fsync(directoryFd));
+}
+
+void DirectoryColdStore::get(kj::StringPtr name, kj::ArrayPtr<byte> data) {
+  auto fd = sandstorm::raiiOpenAt(directoryFd, name, O_RDONLY | O_CLOEXEC);
+  preadAll(fd, data.begin(), data.size(), 0);
+}
+
+void DirectoryColdStore::remove(kj::StringPtr name) {
+  if (unlinkat(directoryFd, name.cStr(), 0) < 0) {
+    int error = errno;
+    if (error != ENOENT) {
+      KJ_FAIL_SYSCALL("unlinkat", error, name);
+    }
+  }
+}
+
+uint64_t LocalBlockShard::getFormattedSize(Geometry geometry) {
+  return Layout(geometry).end;
+}
+
+void LocalBlockShard::format(int fd, const UInt128& clusterId, Geometry geometry,
+                             Placement placement) {
+  Layout layout(geometry);
+  KJ_REQUIRE(placement.replicaId < 8, "invalid replica ID", placement.replicaId);
+
+  struct stat stats;
+  KJ_SYSCALL(fstat(fd, &stats));
+  if (S_ISREG(stats.st_mode)) {
+    // Truncating to zero first zeroes everything without writing anything.
+    KJ_SYSCALL(ftruncate(fd, 0));
+    KJ_SYSCALL(ftruncate(fd, layout.end));
+  } else {
+    uint64_t size = getDiskSize(fd);
+    KJ_REQUIRE(size >= layout.end, "disk too small for requested geometry", size, layout.end);
+
+    // The journal and hash table must start out zeroed. Content blocks don't matter.
+    auto zeros = kj::heapArray<byte>(1 << 20);
+    memset(zeros.begin(), 0, zeros.size());
+    for (uint64_t offset = layout.journalOffset; offset < layout.contentOffset;
+         offset += zeros.size()) {
+      pwriteAll(fd, zeros.begin(), std::min<uint64_t>(zeros.size(), layout.contentOffset - offset),
+                offset);
+    }
+  }
+
+  auto block = kj::heapArray<byte>(BLOCK_SIZE);
+  memset(block.begin(), 0, block.size());
+  auto& superblock = *reinterpret_cast<Superblock*>(block.begin());
+  superblock.magic = Superblock::MAGIC;
+  superblock.clusterId = clusterId;
+  superblock.version = Superblock::VERSION;
+  superblock.replicaId = placement.replicaId;
+  superblock.lgBucketCount = geometry.lgBucketCount;
+  superblock.lgJournalSize = geometry.lgJournalSize;
+  superblock.lgBlockCount = geometry.lgBlockCount;
+  superblock.shardCount = 0;
+  superblock.shardIds[0] = placement.shardId;
+  pwriteAll(fd, block.begin(), block.size(), 0);
+  KJ_SYSCALL(fdatasync(fd));
+}
+
+LocalBlockShard::LocalBlockShard(kj::AutoCloseFd fd, kj::Maybe<ColdStore&> coldStore)
+    : impl(kj::heap<Impl>(kj::mv(fd), coldStore)),
+      hasher((*impl.lockExclusive())->getClusterId()) {}
+
+LocalBlockShard::~LocalBlockShard() noexcept(false) {}
+
+UInt128 LocalBlockShard::getClusterId() {
+  return (*impl.lockExclusive())->getClusterId();
+}
+
+auto LocalBlockShard::getPlacement() -> Placement {
+  return (*impl.lockExclusive())->getPlacement();
+}
+
+UInt256 LocalBlockShard::addImmutable(kj::ArrayPtr<const byte> data) {
+  KJ_REQUIRE(data.size() == BLOCK_SIZE, "wrong block size", data.size());
+
+  UInt256 ref = hasher.getImmutableRef(data);
+  if (!ref.isZero()) {
+    (*impl.lockExclusive())->addImmutable(ref, data);
+  }
+  return ref;
+}
+
+bool LocalBlockShard::getImmutable(const UInt256& blockRef, kj::ArrayPtr<byte> data) {
+  KJ_REQUIRE(data.size() == BLOCK_SIZE, "wrong block size", data.size());
+
+  if (blockRef.isZero()) {
+    memset(data.begin(), 0, data.size());
+    return true;
+  }
+
+  UInt256 id = hasher.getImmutableId(blockRef);
+  faultIn(kj::arrayPtr(&id, 1));
+  if (!(*impl.lockExclusive())->readImmutable(blockRef, data.begin())) {
+    return false;
+  }
+
+  UInt256 key = hasher.getContentHash(blockRef);
+  cryptBlock(data.begin(), data.begin(), key, 0);
+  KJ_ASSERT(hasher.hash(data.begin(), data.size()) == key,
+            "block content doesn't match its hash; disk corruption?");
+  return true;
+}
+
+void LocalBlockShard::releaseImmutable(const UInt256& blockRef) {
+  (*impl.lockExclusive())->releaseImmutable(blockRef);
+}
+
+UInt256 LocalBlockShard::getImmutableId(const UInt256& blockRef) {
+  return (*impl.lockExclusive())->getImmutableId(blockRef);
+}
+
+kj::Maybe<uint32_t> LocalBlockShard::getMutable(
+    const UInt256& id, const UInt256& key, kj::ArrayPtr<byte> data) {
+  KJ_REQUIRE(data.size() == BLOCK_SIZE, "wrong block size", data.size());
+
+  faultIn(kj::arrayPtr(&id, 1));
+  uint64_t nonce;
+  kj::Maybe<uint32_t> revision = (*impl.lockExclusive())->readMutable(id, data.begin(), nonce);
+  if (revision != nullptr) {
+    cryptBlock(data.begin(), data.begin(), key, nonce);
+  }
+  return revision;
+}
+
+bool LocalBlockShard::putMutable(
+    const UInt256& id, const UInt256& key, kj::ArrayPtr<const byte> data) {
+  KJ_REQUIRE(data.size() == BLOCK_SIZE, "wrong block size", data.size());
+
+  // The key stays the same across writes, so every write needs a fresh nonce.
+  uint64_t nonce;
+  randombytes_buf(&nonce, sizeof(nonce));
+  byte buffer[BLOCK_SIZE];
+  cryptBlock(buffer, data.begin(), key, nonce);
+
+  return (*impl.lockExclusive())->putMutable(id, buffer, nonce);
+}
+
+uint LocalBlockShard::getMutableBlocks(kj::ArrayPtr<const UInt256> ids,
+                                       kj::ArrayPtr<const UInt256> keys,
+                                       kj::ArrayPtr<byte> data, kj::ArrayPtr<bool> found) {
+  KJ_REQUIRE(keys.size() == ids.size() && data.size() == ids.size() * BLOCK_SIZE,
+             "wrong batch size");
+
+  faultIn(ids);
+
+  auto nonces = kj::heapArray<uint64_t>(ids.size());
+  kj::Array<bool> ownFound;
+  if (found.size() == 0) {
+    ownFound = kj::heapArray<bool>(ids.size());
+    found = ownFound;
+  }
+  KJ_REQUIRE(found.size() == ids.size(), "wrong batch size");
+  uint count = 0;
+  {
+    auto lock = impl.lockExclusive();
+    for (size_t i = 0; i < ids.size(); i++) {
+      found[i] = (*lock)->readMutable(ids[i], data.begin() + i * BLOCK_SIZE, nonces[i]) != nullptr;
+      if (found[i]) ++count;
+    }
+  }
+
+  forEachBlock(ids.size(), [&](size_t i) {
+    byte* block = data.begin() + i * BLOCK_SIZE;
+    if (found[i]) {
+      cryptBlock(block, block, keys[i], nonces[i]);
+    } else {
+      memset(block, 0, BLOCK_SIZE);
+    }
+  });
+
+  return count;
+}
+
+void LocalBlockShard::putMutableBlocks(kj::ArrayPtr<const UInt256> ids,
+                                       kj::ArrayPtr<const UInt256> keys,
+                                       kj::ArrayPtr<const byte> data) {
+  KJ_REQUIRE(keys.size() == ids.size() && data.size() == ids.size() * BLOCK_SIZE,
+             "wrong batch size");
+
+  auto nonces = kj::heapArray<uint64_t>(ids.size());
+  randombytes_buf(nonces.begin(), nonces.size() * sizeof(nonces[0]));
+  auto buffer = kj::heapArray<byte>(data.size());
+  forEachBlock(ids.size(), [&](size_t i) {
+    cryptBlock(buffer.begin() + i * BLOCK_SIZE, data.begin() + i * BLOCK_SIZE, keys[i], nonces[i]);
+  });
+
+  auto lock = impl.lockExclusive();
+  for (size_t i = 0; i < ids.size(); i++) {
+    (*lock)->putMutable(ids[i], buffer.begin() + i * BLOCK_SIZE, nonces[i]);
+  }
+}
+
+bool LocalBlockShard::deleteMutable(const UInt256& id) {
+  return (*impl.lockExclusive())->deleteMutable(id);
+}
+
+uint LocalBlockShard::deleteMutableBlocks(kj::ArrayPtr<const UInt256> ids) {
+  auto lock = impl.lockExclusive();
+  uint count = 0;
+  for (auto& id: ids) {
+    count += (*lock)->deleteMutable(id);
+  }
+  return count;
+}
+
+uint64_t LocalBlockShard::getGroupBlockCount(const UInt128& group) {
+  return (*impl.lockExclusive())->getGroupBlockCount(group);
+}
+
+kj::Array<UInt128> LocalBlockShard::getGroups() {
+  return (*impl.lockExclusive())->getGroups();
+}
+
+uint64_t LocalBlockShard::deleteGroup(const UInt128& group) {
+  return (*impl.lockExclusive())->deleteGroup(group);
+}
+
+kj::Array<UInt256> LocalBlockShard::listGroup(const UInt128& group) {
+  return (*impl.lockExclusive())->listGroup(group);
+}
+
+kj::Array<UInt256> LocalBlockShard::listBlocks(uint8_t replicaId, uint32_t begin, uint32_t end) {
+  return (*impl.lockExclusive())->listBlocks(replicaId, begin, end);
+}
+
+bool LocalBlockShard::exportBlock(const UInt256& id, RawBlock& block) {
+  faultIn(kj::arrayPtr(&id, 1));
+  return (*impl.lockExclusive())->exportBlock(id, block);
+}
+
+void LocalBlockShard::importBlock(const RawBlock& block) {
+  (*impl.lockExclusive())->importBlock(block);
+}
+
+bool LocalBlockShard::dropBlock(const UInt256& id) {
+  return (*impl.lockExclusive())->dropBlock(id);
+}
+
+kj::Array<UInt128> LocalBlockShard::getIdleGroups(kj::Duration idleTime) {
+  return (*impl.lockExclusive())->getIdleGroups(idleTime / kj::NANOSECONDS);
+}
+
+bool LocalBlockShard::evictBlock(const UInt256& id) {
+  auto block = kj::heap<RawBlock>();
+  uint64_t token;
+  ColdStore* coldStore;
+  {
+    auto lock = impl.lockExclusive();
+    coldStore = &(*lock)->getColdStore();
+    KJ_IF_MAYBE(t, (*lock)->prepareEviction(id, *block)) {
+      token = *t;
+    } else {
+      return false;
+    }
+  }
+
+  auto name = getColdName(id, token);
+  coldStore->put(name, kj::arrayPtr(block->data, sizeof(block->data)));
+
+  if ((*impl.lockExclusive())->finishEviction(id, token)) {
+    return true;
+  } else {
+    coldStore->remove(name);
+    return false;
+  }
+}
+
+uint64_t LocalBlockShard::evictGroup(const UInt128& group) {
+  uint64_t count = 0;
+  for (auto& id: (*impl.lockExclusive())->listLocalBlocks(group)) {
+    if (evictBlock(id)) ++count;
+  }
+  (*impl.lockExclusive())->markEvicted(group);
+  return count;
+}
+
+bool LocalBlockShard::hasColdBlocks(kj::ArrayPtr<const UInt256> ids) {
+  auto lock = impl.lockExclusive();
+  for (auto& id: ids) {
+    if ((*lock)->getColdRevision(id) != nullptr) return true;
+  }
+  return false;
+}
+
+void LocalBlockShard::faultIn(kj::ArrayPtr<const UInt256> ids) {
+  struct ColdBlock {
+    size_t index;
+    uint64_t coldRevision;
+  };
+  kj::Vector<ColdBlock> cold;
+  ColdStore* coldStore;
+  {
+    auto lock = impl.lockExclusive();
+    for (auto i: kj::indices(ids)) {
+      KJ_IF_MAYBE(r, (*lock)->getColdRevision(ids[i])) {
+        cold.add(ColdBlock { i, *r });
+      }
+    }
+    if (cold.size() == 0) return;
+    coldStore = &(*lock)->getColdStore();
+  }
+
+  auto buffer = kj::heapArray<byte>(cold.size() * BLOCK_SIZE);
+  auto fetched = kj::heapArray<bool>(cold.size());
+  for (auto i: kj::indices(cold)) {
+    // The block may be overwritten or deleted meanwhile, and its cold copy removed. Then we don't
+    // need the copy anyway; otherwise, faulting it in under the lock will report the error.
+    fetched[i] = kj::runCatchingExceptions([&]() {
+      coldStore->get(getColdName(ids[cold[i].index], cold[i].coldRevision),
+                     buffer.slice(i * BLOCK_SIZE, (i + 1) * BLOCK_SIZE));
+    }) == nullptr;
+  }
+
+  auto lock = impl.lockExclusive();
+  for (auto i: kj::indices(cold)) {
+    if (fetched[i]) {
+      (*lock)->finishFaultIn(ids[cold[i].index], cold[i].coldRevision,
+                             buffer.begin() + i * BLOCK_SIZE);
+    }
+  }
+}
+
+void LocalBlockShard::sync() {
+  // Syncing can take a while, so don't hold the lock meanwhile. Whatever was written before we
+  // let go of it is covered.
+  int fd;
+  Impl::SyncPoint point;
+  {
+    auto lock = impl.lockExclusive();
+    fd = (*lock)->getFd();
+    point = (*lock)->startSync();
+  }
+
+  KJ_SYSCALL(fdatasync(fd));
+
+  auto lock = impl.lockExclusive();
+  (*lock)->finishSync(kj::mv(point));
+  removeColdCopies(kj::mv(lock));
+}
+
+void LocalBlockShard::checkpoint() {
+  auto lock = impl.lockExclusive();
+  (*lock)->checkpoint();
+  removeColdCopies(kj::mv(lock));
+}
+
+void LocalBlockShard::removeColdCopies(kj::Locked<kj::Own<Impl>> lock) {
+  auto names = (*lock)->takeColdRemovals();
+  if (names.size() == 0) return;
+  ColdStore& coldStore = (*lock)->getColdStore();
+  lock = kj::Locked<kj::Own<Impl>>();
+
+  for (auto& name: names) {
+    // A copy we fail to remove only wastes space in the cold store.
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() { coldStore.remove(name); })) {
+      KJ_LOG(ERROR, "failed to remove unused cold block copy", name, *exception);
+    }
+  }
+}
+
+auto LocalBlockShard::getStats() -> Stats {
+  return (*impl.lockExclusive())->getStats();
+}
+
+// =======================================================================================
+
+namespace {
+
+constexpr uint64_t FAILURE_PENALTY_NS = 10ull * 1000000000ull;
+// After a shard throws, we read from other replicas for this long.
+
+bool inRange(uint32_t key, uint32_t begin, uint32_t end) {
+  // Whether `key` is in [begin, end), wrapping around if `end` <= `begin`, like listBlocks().
+
+  return begin < end ? key >= begin && key < end : key >= begin || key < end;
+}
+
+UInt256 groupId(const UInt128& group) {
+  // An ID which routes like every mutable block of `group`, in replicas 0-3.
+
+  return { { group.value[0], group.value[1], 0, 0 } };
+}
+
+void copyBlock(BlockShard& from, BlockShard& to, const UInt256& id, BlockShard::RawBlock& block) {
+  // Makes block `id` on `to` as it is on `from`, deleting it from `to` if `from` doesn't have it.
+
+  if (from.exportBlock(id, block)) {
+    to.importBlock(block);
+  } else {
+    to.dropBlock(id);
+  }
+}
+
+}  // namespace
+
+constexpr uint BlockRouter::BLOCK_SIZE;
+
+BlockRouter::BlockRouter(const UInt128& clusterId): clusterId(clusterId), hasher(clusterId) {}
+
+void BlockRouter::addShard(BlockShard& shard) {
+  KJ_REQUIRE(shard.getClusterId() == clusterId, "block shard belongs to a different cluster");
+  auto placement = shard.getPlacement();
+  KJ_REQUIRE(placement.replicaId < MAX_REPLICAS, "invalid replica ID", placement.replicaId);
+
+  const ShardState* previous = nullptr;
+  uint32_t end = 0;
+  {
+    auto lock = rings.lockExclusive();
+    KJ_REQUIRE(lock->moving == nullptr, "calls to addShard() overlapped");
+    Ring& ring = lock->replicas[placement.replicaId];
+    KJ_REQUIRE(ring.count(placement.shardId) == 0, "two block shards have the same shard ID",
+               placement.replicaId, placement.shardId);
+
+    if (ring.empty()) {
+      ring.insert(std::make_pair(placement.shardId, kj::heap<ShardState>(shard)));
+      return;
+    }
+
+    // The new shard takes over the range from its shardId up to the next one from whichever
+    // shard owns that range now.
+    previous = &findOwner(ring, placement.shardId);
+    auto next = ring.upper_bound(placement.shardId);
+    end = next == ring.end() ? ring.begin()->first : next->first;
+
+    auto move = kj::heap<Move>();
+    move->replicaId = placement.replicaId;
+    move->begin = placement.shardId;
+    move->end = end;
+    lock->moving = kj::mv(move);
+  }
+  KJ_DEFER(rings.lockExclusive()->moving = nullptr);
+
+  // Copy everything in the range while reads and writes carry on. Writes to the range are noted
+  // in `moving`, to copy again below.
+  auto ids = previous->shard.listBlocks(placement.replicaId, placement.shardId, end);
+  if (ids.size() > 0) {
+    KJ_LOG(INFO, "moving blocks to new shard", placement.replicaId, placement.shardId,
+           ids.size());
+  }
+  auto block = kj::heap<BlockShard::RawBlock>();
+  for (auto& id: ids) {
+    copyBlock(previous->shard, shard, id, *block);
+  }
+  shard.sync();
+
+  auto lock = rings.lockExclusive();
+  Move& move = *KJ_ASSERT_NONNULL(lock->moving);
+  auto written = move.written.lockExclusive();
+
+  // Groups first, since blocks written after their group was deleted must survive.
+  for (auto& group: written->groups) {
+    shard.deleteGroup(group);
+  }
+  for (auto& id: written->ids) {
+    copyBlock(previous->shard, shard, id, *block);
+  }
+  shard.sync();
+
+  // Don't delete the originals until the copies are durable. If we crash in between, the next
+  // addShard() will find the originals and copy them again. That's also why the originals must
+  // be gone before anything is written to the new shard, which would otherwise be overwritten
+  // with the originals.
+  for (auto& id: ids) {
+    previous->shard.dropBlock(id);
+  }
+  for (auto& id: written->ids) {
+    previous->shard.dropBlock(id);
+  }
+  previous->shard.sync();
+
+  // If the previous owner is behind on any of the blocks it handed over, now the new one is.
+  auto state = kj::heap<ShardState>(shard);
+  {
+    auto from = previous->missed.lockExclusive();
+    auto to = state->missed.lockExclusive();
+    for (auto iter = from->groups.begin(); iter != from->groups.end();) {
+      if (inRange(groupId(*iter).getRoutingKey(move.replicaId), move.begin, move.end)) {
+        to->groups.insert(*iter);
+        iter = from->groups.erase(iter);
+      } else {
+        ++iter;
+      }
+    }
+    for (auto iter = from->ids.begin(); iter != from->ids.end();) {
+      if (inRange(iter->getRoutingKey(move.replicaId), move.begin, move.end)) {
+        to->ids.insert(*iter);
+        iter = from->ids.erase(iter);
+      } else {
+        ++iter;
+      }
+    }
+  }
+
+  lock->replicas[placement.replicaId].insert(std::make_pair(placement.shardId, kj::mv(state)));
+}
+
+uint BlockRouter::getReplicaCount() {
+  auto lock = rings.lockShared();
+  uint result = 0;
+  for (auto& ring: lock->replicas) {
+    if (!ring.empty()) ++result;
+  }
+  return result;
+}
+
+auto BlockRouter::findOwner(const Ring& ring, uint32_t key) -> const ShardState& {
+  // The owner is the shard with the greatest shardId not above `key`, wrapping around to the
+  // greatest shardId overall if there is none.
+
+  KJ_ASSERT(!ring.empty());
+  auto iter = ring.upper_bound(key);
+  if (iter == ring.begin()) iter = ring.end();
+  --iter;
+  return *iter->second;
+}
+
+auto BlockRouter::getOwners(const Rings& rings, const UInt256& id, bool groupsOnly)
+    -> kj::Vector<const ShardState*> {
+  kj::Vector<const ShardState*> result;
+  for (uint8_t replicaId = 0; replicaId < MAX_REPLICAS; replicaId++) {
+    const Ring& ring = rings.replicas[replicaId];
+    if (ring.empty()) continue;
+    KJ_REQUIRE(!groupsOnly || replicaId < 4,
+               "group operations require replica IDs below 4", replicaId);
+    result.add(&findOwner(ring, id.getRoutingKey(replicaId)));
+  }
+  KJ_REQUIRE(result.size() > 0, "no block shards have been added");
+
+  uint64_t now = nowNs();
+  auto rank = [now](const ShardState* state) {
+    uint64_t failedAt = __atomic_load_n(&state->failedAtNs, __ATOMIC_RELAXED);
+    bool recentlyFailed = failedAt != 0 && now - failedAt < FAILURE_PENALTY_NS;
+    return std::make_pair(recentlyFailed, __atomic_load_n(&state->latencyNs, __ATOMIC_RELAXED));
+  };
+  std::sort(result.begin(), result.end(),
+      [&](const ShardState* a, const ShardState* b) { return rank(a) < rank(b); });
+  return result;
+}
+
+bool BlockRouter::isCurrent(const ShardState& state, const UInt256& id, bool wholeGroup) {
+  auto missed = state.missed.lockExclusive();
+  UInt128 group = id.group();
+  if (missed->groups.count(group) > 0) return false;
+  if (!wholeGroup) return missed->ids.count(id) == 0;
+
+  // The group's blocks are adjacent, starting from groupId().
+  auto iter = missed->ids.lower_bound(groupId(group));
+  return iter == missed->ids.end() || iter->group() != group;
+}
+
+void BlockRouter::noteWrite(const Rings& rings, const UInt256& id, bool wholeGroup) {
+  KJ_IF_MAYBE(move, rings.moving) {
+    if (inRange(id.getRoutingKey((*move)->replicaId), (*move)->begin, (*move)->end)) {
+      auto written = (*move)->written.lockExclusive();
+      if (wholeGroup) {
+        written->groups.insert(id.group());
+      } else {
+        written->ids.insert(id);
+      }
+    }
+  }
+}
+
+void BlockRouter::repair() {
+  // Catches up shards which missed writes: first by deleting the groups they missed, then by
+  // copying each block they missed from an owner in another replica which has it. A write
+  // landing between reading a block and copying it would be lost, so this holds the exclusive
+  // lock, but only takes it if some shard is behind.
+
+  {
+    auto lock = rings.lockShared();
+    bool anyBehind = false;
+    for (auto& ring: lock->replicas) {
+      for (auto& entry: ring) {
+        auto missed = entry.second->missed.lockExclusive();
+        if (!missed->ids.empty() || !missed->groups.empty()) anyBehind = true;
+      }
+    }
+    if (!anyBehind) return;
+  }
+
+  auto lock = rings.lockExclusive();
+  auto block = kj::heap<BlockShard::RawBlock>();
+  for (auto& ring: lock->replicas) {
+    for (auto& entry: ring) {
+      ShardState& state = *entry.second;
+      auto missed = state.missed.lockExclusive();
+
+      // If the shard is still failing, leave the rest of its repairs for the next sync().
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        while (!missed->groups.empty()) {
+          UInt128 group = *missed->groups.begin();
+          noteWrite(*lock, groupId(group), true);
+          state.shard.deleteGroup(group);
+          missed->groups.erase(missed->groups.begin());
+        }
+
+        for (auto iter = missed->ids.begin(); iter != missed->ids.end();) {
+          const ShardState* source = nullptr;
+          for (auto owner: getOwners(*lock, *iter)) {
+            if (owner != &state && isCurrent(*owner, *iter, false)) {
+              source = owner;
+              break;
+            }
+          }
+
+          if (source == nullptr) {
+            ++iter;
+          } else {
+            noteWrite(*lock, *iter, false);
+            copyBlock(source->shard, state.shard, *iter, *block);
+            iter = missed->ids.erase(iter);
+          }
+        }
+      })) {
+        KJ_LOG(WARNING, "couldn't repair block shard", *exception);
+      }
+    }
+  }
+}
+
+template <typename Func>
+kj::Maybe<kj::Exception> BlockRouter::call(const ShardState& state, Func&& func) {
+  // Calls func(state.shard), recording how long it took, or that it failed.
+
+  uint64_t start = nowNs();
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() { func(state.shard); })) {
+    __atomic_store_n(&state.failedAtNs, nowNs(), __ATOMIC_RELAXED);
+    KJ_LOG(WARNING, "block shard failed", *exception);
+    return kj::mv(*exception);
+  }
+
+  uint64_t elapsed = nowNs() - start;
+  uint64_t average = __atomic_load_n(&state.latencyNs, __ATOMIC_RELAXED);
+  average = average == 0 ? elapsed : average - average / 8 + elapsed / 8;
+  __atomic_store_n(&state.latencyNs, average, __ATOMIC_RELAXED);
+  return nullptr;
+}
+
+template <typename Func>
+auto BlockRouter::read(const Rings& rings, const UInt256& id, bool wholeGroup, Func&& func) {
+  // Returns func() of the first owner which is current and doesn't throw.
+
+  auto owners = getOwners(rings, id, wholeGroup);
+  kj::Maybe<decltype(func(owners[0]->shard))> result;
+  kj::Maybe<kj::Exception> firstError;
+  for (auto state: owners) {
+    if (!isCurrent(*state, id, wholeGroup)) continue;
+    KJ_IF_MAYBE(exception, call(*state, [&](BlockShard& shard) { result = func(shard); })) {
+      if (firstError == nullptr) firstError = kj::mv(*exception);
+    } else {
+      return kj::mv(KJ_ASSERT_NONNULL(result));
+    }
+  }
+  KJ_IF_MAYBE(exception, firstError) {
+    kj::throwFatalException(kj::mv(*exception));
+  }
+  KJ_FAIL_ASSERT("every replica of this block missed a write");
+}
+
+template <typename Func>
+auto BlockRouter::write(const Rings& rings, const UInt256& id, bool wholeGroup, Func&& func) {
+  // Calls func() on every owner, even if some throw, then rethrows the first exception, if any.
+  // Otherwise returns func() of the first owner. Owners which are behind are skipped, since
+  // they'd only look current afterwards; they stay behind until repair().
+  //
+  // The calls are sequential: they only queue up writes on each shard, and it's sync() which
+  // waits for the disks, in parallel.
+
+  noteWrite(rings, id, wholeGroup);
+
+  auto owners = getOwners(rings, id, wholeGroup);
+  kj::Maybe<decltype(func(owners[0]->shard))> result;
+  kj::Maybe<kj::Exception> firstError;
+  kj::Vector<const ShardState*> missedBy;
+  for (auto state: owners) {
+    if (!isCurrent(*state, id, wholeGroup)) {
+      missedBy.add(state);
+      continue;
+    }
+    KJ_IF_MAYBE(exception, call(*state, [&](BlockShard& shard) {
+      auto value = func(shard);
+      if (result == nullptr) result = kj::mv(value);
+    })) {
+      if (firstError == nullptr) firstError = kj::mv(*exception);
+      missedBy.add(state);
+    }
+  }
+
+  // If no owner took the write, none is behind the others.
+  if (result != nullptr) {
+    for (auto state: missedBy) {
+      auto missed = state->missed.lockExclusive();
+      if (wholeGroup) {
+        missed->groups.insert(id.group());
+      } else {
+        missed->ids.insert(id);
+      }
+    }
+  }
+
+  KJ_IF_MAYBE(exception, firstError) {
+    kj::throwFatalException(kj::mv(*exception));
+  }
+  return kj::mv(KJ_ASSERT_NONNULL(result, "every replica of this block missed a write"));
+}
+
+UInt256 BlockRouter::addImmutable(kj::ArrayPtr<const byte> data) {
+  KJ_REQUIRE(data.size() == BLOCK_SIZE, "wrong block size", data.size());
+
+  UInt256 ref = hasher.getImmutableRef(data);
+  if (ref.isZero()) return ref;
+
+  auto lock = rings.lockShared();
+  write(*lock, hasher.getImmutableId(ref), false, [&](BlockShard& shard) {
+    KJ_ASSERT(shard.addImmutable(data) == ref, "block shard computed a different blockRef");
+    return true;
+  });
+  return ref;
+}
+
+bool BlockRouter::getImmutable(const UInt256& blockRef, kj::ArrayPtr<byte> data) {
+  if (blockRef.isZero()) {
+    KJ_REQUIRE(data.size() == BLOCK_SIZE, "wrong block size", data.size());
+    memset(data.begin(), 0, data.size());
+    return true;
+  }
+
+  auto lock = rings.lockShared();
+  return read(*lock, hasher.getImmutableId(blockRef), false, [&](BlockShard& shard) {
+    return shard.getImmutable(blockRef, data);
+  });
+}
+
+void BlockRouter::releaseImmutable(const UInt256& blockRef) {
+  if (blockRef.isZero()) return;
+
+  auto lock = rings.lockShared();
+  write(*lock, hasher.getImmutableId(blockRef), false, [&](BlockShard& shard) {
+    shard.releaseImmutable(blockRef);
+    return true;
+  });
+}
+
+kj::Maybe<uint32_t> BlockRouter::getMutable(
+    const UInt256& id, const UInt256& key, kj::ArrayPtr<byte> data) {
+  auto lock = rings.lockShared();
+  return read(*lock, id, false, [&](BlockShard& shard) {
+    return shard.getMutable(id, key, data);
+  });
+}
+
+bool BlockRouter::putMutable(const UInt256& id, const UInt256& key,
+                             kj::ArrayPtr<const byte> data) {
+  auto lock = rings.lockShared();
+  return write(*lock, id, false, [&](BlockShard& shard) {
+    return shard.putMutable(id, key, data);
+  });
+}
+
+bool BlockRouter::deleteMutable(const UInt256& id) {
+  auto lock = rings.lockShared();
+  return write(*lock, id, false, [&](BlockShard& shard) {
+    return shard.deleteMutable(id);
+  });
+}
+
+uint64_t BlockRouter::getGroupBlockCount(const UInt128& group) {
+  auto lock = rings.lockShared();
+  return read(*lock, groupId(group), true, [&](BlockShard& shard) {
+    return shard.getGroupBlockCount(group);
+  });
+}
+
+uint64_t BlockRouter::deleteGroup(const UInt128& group) {
+  auto lock = rings.lockShared();
+  return write(*lock, groupId(group), true, [&](BlockShard& shard) {
+    return shard.deleteGroup(group);
+  });
+}
+
+void BlockRouter::sync() {
+  repair();
+
+  // Each replica is on different disks, so there's no reason to wait for them one at a time.
+
+  auto lock = rings.lockShared();
+  kj::Vector<BlockShard*> shards;
+  for (auto& ring: lock->replicas) {
+    for (auto& entry: ring) {
+      shards.add(&entry.second->shard);
+    }
+  }
+
+  if (shards.size() > 0) {
+    parallelFor(shards.size(), [&](uint i) {
+      shards[i]->sync();
+    });
+  }
+}
+
 }  // namespace blackrock
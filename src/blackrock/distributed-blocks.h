@@ -0,0 +1,516 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLACKROCK_DISTRIBUTED_BLOCKS_H_
+#define BLACKROCK_DISTRIBUTED_BLOCKS_H_
+
+#include "common.h"
+#include <kj/io.h>
+#include <kj/mutex.h>
+#include <kj/vector.h>
+#include <kj/time.h>
+#include <inttypes.h>
+#include <map>
+#include <set>
+
+namespace blackrock {
+
+struct UInt128 {
+  uint64_t value[2];
+
+  inline bool operator==(const UInt128& other) const {
+    return ((value[0] ^ other.value[0]) | (value[1] ^ other.value[1])) == 0;
+  }
+  inline bool operator!=(const UInt128& other) const { return !operator==(other); }
+  inline bool operator<(const UInt128& other) const {
+    return value[0] != other.value[0] ? value[0] < other.value[0] : value[1] < other.value[1];
+  }
+
+  struct Hash {
+    inline size_t operator()(const UInt128& v) const { return v.value[0]; }
+  };
+};
+
+struct UInt256 {
+  uint64_t value[4];
+
+  inline bool operator==(const UInt256& other) const {
+    return ((value[0] ^ other.value[0]) | (value[1] ^ other.value[1]) |
+            (value[2] ^ other.value[2]) | (value[3] ^ other.value[3])) == 0;
+  }
+  inline bool operator!=(const UInt256& other) const { return !operator==(other); }
+  inline bool operator<(const UInt256& other) const {
+    for (uint i = 0; i < 4; i++) {
+      if (value[i] != other.value[i]) return value[i] < other.value[i];
+    }
+    return false;
+  }
+  // Orders by value[0] first, so that the blocks of a group are adjacent.
+
+  inline bool isZero() const {
+    return (value[0] | value[1] | value[2] | value[3]) == 0;
+  }
+
+  inline UInt128 group() const { return { { value[0], value[1] } }; }
+  // The first 128 bits of a mutable block ID name the group (e.g. the Volume) to which it
+  // belongs; see LocalBlockShard::deleteGroup().
+
+  inline uint32_t getRoutingKey(uint8_t replicaId) const {
+    return value[replicaId / 2] >> (replicaId % 2 * 32);
+  }
+  // Where this block falls in the key space of the given replica: word `replicaId` of the ID,
+  // viewed as uint32_t[8]. See BlockRouter.
+};
+
+class BlockHasher {
+  // Computes the BLAKE2b hashes, salted with the cluster ID, from which immutable blocks get
+  // their blockRefs and IDs. Every shard in a cluster, and anyone routing blocks to them, must
+  // agree on these.
+
+public:
+  explicit BlockHasher(const UInt128& clusterId);
+
+  UInt256 hash(const void* data, size_t size) const;
+
+  UInt256 getImmutableRef(kj::ArrayPtr<const byte> data) const;
+  // The blockRef of a block with the given content: its hash XOR the hash of an all-zero block,
+  // so that all-zero content has a zero blockRef.
+
+  UInt256 getContentHash(const UInt256& blockRef) const;
+  // Inverse of getImmutableRef(): the content hash, which is also the block's encryption key.
+
+  UInt256 getImmutableId(const UInt256& blockRef) const;
+  // The hash of the blockRef XOR the hash of an all-zero blockRef.
+
+private:
+  UInt128 clusterId;
+  UInt256 zeroHash;
+  UInt256 zeroRefHash;
+};
+
+class BlockShard {
+  // One shard of the cluster's block storage. BlockRouter spreads blocks across many of these.
+  // See LocalBlockShard, the only implementation so far, for what each method does.
+  //
+  // TODO(someday): Implement over RPC, so that shards can live on other machines.
+
+public:
+  static constexpr uint BLOCK_SIZE = 4096;
+
+  struct Placement {
+    uint8_t replicaId;
+    // Which replica of the cluster's storage this shard belongs to, 0 through 7.
+
+    uint32_t shardId;
+    // Where this shard begins in its replica's key space. See BlockRouter.
+  };
+
+  struct RawBlock {
+    // A block as stored, i.e. still encrypted, for moving between shards without knowing its key.
+
+    UInt256 id;
+    bool isMutable;
+    uint32_t refcount;
+    uint32_t revision;
+    uint64_t nonce;
+    byte data[BLOCK_SIZE];
+  };
+
+  virtual ~BlockShard() noexcept(false);
+
+  virtual UInt128 getClusterId() = 0;
+  virtual Placement getPlacement() = 0;
+
+  virtual UInt256 addImmutable(kj::ArrayPtr<const byte> data) = 0;
+  virtual bool getImmutable(const UInt256& blockRef, kj::ArrayPtr<byte> data) = 0;
+  virtual void releaseImmutable(const UInt256& blockRef) = 0;
+
+  virtual kj::Maybe<uint32_t> getMutable(
+      const UInt256& id, const UInt256& key, kj::ArrayPtr<byte> data) = 0;
+  virtual bool putMutable(const UInt256& id, const UInt256& key,
+                          kj::ArrayPtr<const byte> data) = 0;
+  virtual bool deleteMutable(const UInt256& id) = 0;
+  virtual uint64_t getGroupBlockCount(const UInt128& group) = 0;
+  virtual uint64_t deleteGroup(const UInt128& group) = 0;
+
+  virtual void sync() = 0;
+
+  virtual kj::Array<UInt256> listBlocks(uint8_t replicaId, uint32_t begin, uint32_t end) = 0;
+  virtual bool exportBlock(const UInt256& id, RawBlock& block) = 0;
+  virtual void importBlock(const RawBlock& block) = 0;
+  virtual bool dropBlock(const UInt256& id) = 0;
+};
+
+class ColdStore {
+  // Long-term storage for blocks which haven't been used in a while, such as an S3-compatible
+  // object store. Cheaper but slower than the disks holding LocalBlockShards. Blocks are sent
+  // still encrypted, so the store never sees their content.
+
+public:
+  virtual ~ColdStore() noexcept(false);
+
+  virtual void put(kj::StringPtr name, kj::ArrayPtr<const byte> data) = 0;
+  // Stores an object, replacing any object of the same name. It must be durable on return.
+
+  virtual void get(kj::StringPtr name, kj::ArrayPtr<byte> data) = 0;
+  // Reads an object previously put(), which must be exactly `data.size()` bytes. Throws if it
+  // doesn't exist.
+
+  virtual void remove(kj::StringPtr name) = 0;
+  // Deletes an object. Does nothing if it doesn't exist.
+};
+
+class DirectoryColdStore final: public ColdStore {
+  // A ColdStore keeping each object as a file in a directory. The directory can be a mounted
+  // object store bucket (e.g. via s3fs), or local, for testing.
+  //
+  // TODO(someday): Speak the S3 API directly.
+
+public:
+  explicit DirectoryColdStore(kj::AutoCloseFd directoryFd);
+
+  void put(kj::StringPtr name, kj::ArrayPtr<const byte> data) override;
+  void get(kj::StringPtr name, kj::ArrayPtr<byte> data) override;
+  void remove(kj::StringPtr name) override;
+
+private:
+  kj::AutoCloseFd directoryFd;
+};
+
+class LocalBlockShard final: public BlockShard {
+  // A block store occupying one raw disk (or one big file), in the format defined in
+  // distributed-blocks.c++: a superblock, a journal of Transactions, a hash table of Buckets
+  // indexed by block ID, and a table of 4k content blocks.
+  //
+  // Two kinds of blocks are stored:
+  // - Immutable blocks are content-addressed: the ID is derived from the BLAKE2b hash of the
+  //   content, so storing the same content twice just bumps a refcount. The caller gets back a
+  //   "blockRef", which is also the key needed to decrypt the content.
+  // - Mutable blocks have caller-chosen IDs and are encrypted with a caller-provided key. An
+  //   overwrite writes the new content to a free location and then repoints the bucket, bumping
+  //   its revision.
+  //
+  // Every bucket change is appended to the journal before it is applied, but -- like a Volume --
+  // nothing is durable until sync(). Buckets are written back to the table at checkpoint(),
+  // which also happens automatically before the journal would wrap. On open, the journal is
+  // replayed from the last checkpoint.
+  //
+  // If given a ColdStore, blocks can be evicted to it to free local space, leaving only their
+  // bucket behind. An evicted block is fetched back the next time it is read. Mutable blocks are
+  // evicted a group at a time, once the group has been idle for a while -- e.g. a Volume whose
+  // grain hasn't run lately.
+  //
+  // Methods may be called from any thread. A single lock serializes them, except for hashing
+  // and encryption, which happen outside it.
+  //
+  // TODO(someday): Only one shard per disk is supported so far (Superblock::shardCount == 0),
+  //   and blocks cannot yet reference other blocks (Transaction::refs).
+
+public:
+  struct Geometry {
+    uint8_t lgBucketCount;
+    // Log base 2 of the number of hash table buckets. Should be at least lgBlockCount + 1, so
+    // that the table is never more than half full.
+
+    uint8_t lgJournalSize;
+    // Log base 2 of the number of journal entries. Each is 128 bytes, and we checkpoint every
+    // time the journal fills.
+
+    uint8_t lgBlockCount;
+    // Log base 2 of the number of 4k content blocks. At most 28.
+  };
+
+  static uint64_t getFormattedSize(Geometry geometry);
+  // Number of bytes of disk needed for the given geometry.
+
+  static void format(int fd, const UInt128& clusterId, Geometry geometry,
+                     Placement placement = { 0, 0 });
+  // Initializes a new, empty store on `fd`, which may be a block device or a regular file. A
+  // regular file is extended (sparsely) to the needed size.
+
+  explicit LocalBlockShard(kj::AutoCloseFd fd, kj::Maybe<ColdStore&> coldStore = nullptr);
+  // Opens a store previously initialized with format(), replaying its journal. `coldStore` is
+  // needed if any blocks were evicted.
+
+  ~LocalBlockShard() noexcept(false);
+  // Checkpoints, so the next open has nothing to replay.
+
+  KJ_DISALLOW_COPY(LocalBlockShard);
+
+  UInt128 getClusterId() override;
+  Placement getPlacement() override;
+  // As given to format().
+
+  // ---------------------------------------------------------------------------
+  // immutable blocks
+
+  UInt256 addImmutable(kj::ArrayPtr<const byte> data) override;
+  // Stores a block of content (exactly BLOCK_SIZE bytes), or adds a reference to it if it is
+  // already present. Returns its blockRef. All-zero content is never stored and has a blockRef of
+  // zero.
+
+  bool getImmutable(const UInt256& blockRef, kj::ArrayPtr<byte> data) override;
+  // Reads the block with the given blockRef into `data`. Returns false if no such block is
+  // stored. Throws if the content doesn't match its hash.
+
+  void releaseImmutable(const UInt256& blockRef) override;
+  // Drops one reference added by addImmutable(), deleting the block if it was the last.
+
+  UInt256 getImmutableId(const UInt256& blockRef);
+  // The block ID under which a blockRef is stored. Unlike the blockRef, the ID does not allow
+  // decrypting the content.
+
+  // ---------------------------------------------------------------------------
+  // mutable blocks
+
+  kj::Maybe<uint32_t> getMutable(
+      const UInt256& id, const UInt256& key, kj::ArrayPtr<byte> data) override;
+  // Reads mutable block `id`, decrypting it with `key`, and returns its revision, or null if
+  // the block doesn't exist (in which case `data` is untouched).
+
+  bool putMutable(const UInt256& id, const UInt256& key,
+                  kj::ArrayPtr<const byte> data) override;
+  // Writes mutable block `id`, creating it if needed. Returns true if the block was created.
+  // The ID must not be zero.
+
+  bool deleteMutable(const UInt256& id) override;
+  // Deletes mutable block `id`. Returns false if it didn't exist.
+
+  uint deleteMutableBlocks(kj::ArrayPtr<const UInt256> ids);
+  // Like deleteMutable() on many blocks, taking the lock once. Returns the number deleted.
+
+  uint getMutableBlocks(kj::ArrayPtr<const UInt256> ids, kj::ArrayPtr<const UInt256> keys,
+                        kj::ArrayPtr<byte> data, kj::ArrayPtr<bool> found = nullptr);
+  void putMutableBlocks(kj::ArrayPtr<const UInt256> ids, kj::ArrayPtr<const UInt256> keys,
+                        kj::ArrayPtr<const byte> data);
+  // Like getMutable() and putMutable() on many blocks, where block i is ids[i], with keys[i], at
+  // data[i * BLOCK_SIZE]. Much faster for big batches, as the crypto is spread across cores.
+  // getMutableBlocks() zeroes missing blocks and returns the number found. If given `found`, it
+  // also sets found[i] to whether block i exists.
+
+  uint64_t getGroupBlockCount(const UInt128& group) override;
+  // Number of mutable blocks whose ID begins with `group`.
+
+  kj::Array<UInt128> getGroups();
+  // All groups having at least one mutable block.
+
+  uint64_t deleteGroup(const UInt128& group) override;
+  // Deletes every mutable block whose ID begins with `group`, returning the number deleted. This
+  // scans the whole hash table, so it's meant for occasional cleanup, e.g. of a deleted Volume.
+
+  kj::Array<UInt256> listGroup(const UInt128& group);
+  // IDs of every mutable block whose ID begins with `group`, cold or not, in no particular order.
+  // Scans the hash table like deleteGroup(), e.g. to copy a Volume elsewhere.
+
+  // ---------------------------------------------------------------------------
+  // moving blocks between shards
+
+  kj::Array<UInt256> listBlocks(uint8_t replicaId, uint32_t begin, uint32_t end) override;
+  // IDs of all blocks whose routing key for `replicaId` is in [begin, end), wrapping around if
+  // `end` <= `begin`. Scans the whole hash table.
+
+  bool exportBlock(const UInt256& id, RawBlock& block) override;
+  // Copies out block `id` as stored. Returns false if it doesn't exist.
+
+  void importBlock(const RawBlock& block) override;
+  // Stores a block exported from another shard of the same cluster, replacing any block with
+  // the same ID.
+
+  bool dropBlock(const UInt256& id) override;
+  // Deletes block `id` regardless of its type or refcount, e.g. once it has been moved to
+  // another shard. Returns false if it didn't exist.
+
+  // ---------------------------------------------------------------------------
+  // cold storage
+
+  kj::Array<UInt128> getIdleGroups(kj::Duration idleTime);
+  // Groups of mutable blocks which haven't been read or written for at least `idleTime`, not
+  // counting groups which were evicted and haven't been used since. Usage isn't persisted, so
+  // on startup every group counts as just used.
+
+  bool evictBlock(const UInt256& id);
+  // Moves a block to the cold store, freeing its local content once synced. Returns false if the
+  // block doesn't exist, is already evicted, or changed while we were copying it. Doesn't hold
+  // the lock while talking to the cold store.
+
+  uint64_t evictGroup(const UInt128& group);
+  // Evicts every local mutable block in `group`, returning the number evicted.
+
+  bool hasColdBlocks(kj::ArrayPtr<const UInt256> ids);
+  // Whether any of the given blocks (by bucket ID) is in the cold store, so that reading it
+  // would have to wait for the cold store.
+
+  void faultIn(kj::ArrayPtr<const UInt256> ids);
+  // Fetches those of the given blocks which are cold back from the cold store, without holding
+  // the lock while talking to it. Reads do this themselves, but a caller on an event loop can do
+  // it on another thread first.
+
+  // ---------------------------------------------------------------------------
+
+  void sync() override;
+  // Waits until all previous changes are durable. Other calls can proceed meanwhile.
+
+  void checkpoint();
+  // Like sync(), and also writes back the hash table so that the journal can be reused.
+
+  struct Stats {
+    uint64_t bucketCount;
+    uint64_t bucketsUsed;     // including deleted buckets not yet reclaimed
+    uint64_t blockCount;
+    uint64_t blocksUsed;
+    uint64_t coldBlocks;      // evicted to the cold store; not counted in blocksUsed
+  };
+
+  Stats getStats();
+
+private:
+  class Impl;
+  kj::MutexGuarded<kj::Own<Impl>> impl;
+
+  BlockHasher hasher;
+  // A copy of the one in `impl`, so that we can hash without the lock.
+
+  void removeColdCopies(kj::Locked<kj::Own<Impl>> lock);
+  // Removes the cold copies which the sync() just made under `lock` leaves unused, after
+  // releasing the lock.
+};
+
+class BlockRouter {
+  // Spreads blocks across shards, storing each one in every replica of the cluster's storage.
+  //
+  // Within replica R, a block's routing key is UInt256::getRoutingKey(R). Each shard owns the
+  // keys from its shardId up to the next shardId in its replica, wrapping around, so adding a
+  // shard only takes keys from the one shard preceding it. Keys are drawn from different parts
+  // of the ID in each replica, so a hot spot in one replica isn't a hot spot in the others.
+  // Mutable block IDs begin with their group, so in replicas 0-3 a group lives entirely on one
+  // shard, which makes the group operations cheap.
+  //
+  // Writes go to the owning shard in every replica. Reads go to whichever owner has lately been
+  // answering fastest, skipping shards which failed recently unless there's no alternative.
+  // Shards are synced in parallel.
+  //
+  // A shard which throws on a write that another replica took is behind on that block (or
+  // group) until sync() repairs it, by copying the block from a replica which has it. Until then
+  // reads never go to it, and later writes of the block skip it, so that it can't look current.
+  // Which shards are behind is kept in memory only.
+  //
+  // The set of shards isn't persisted: the owner of the router adds them all on startup, in any
+  // order. Methods may be called from any thread, but calls to addShard() must not overlap.
+
+public:
+  static constexpr uint BLOCK_SIZE = BlockShard::BLOCK_SIZE;
+
+  explicit BlockRouter(const UInt128& clusterId);
+
+  void addShard(BlockShard& shard);
+  // Starts routing blocks to `shard`, first moving to it the blocks it now owns from the shard
+  // which owned them until now. The first shard of each replica owns the whole key space. The
+  // bulk of the copying happens while other calls carry on; only blocks written meanwhile are
+  // copied again with everything else excluded.
+
+  uint getReplicaCount();
+
+  UInt256 addImmutable(kj::ArrayPtr<const byte> data);
+  bool getImmutable(const UInt256& blockRef, kj::ArrayPtr<byte> data);
+  void releaseImmutable(const UInt256& blockRef);
+
+  kj::Maybe<uint32_t> getMutable(const UInt256& id, const UInt256& key, kj::ArrayPtr<byte> data);
+  bool putMutable(const UInt256& id, const UInt256& key, kj::ArrayPtr<const byte> data);
+  bool deleteMutable(const UInt256& id);
+  uint64_t getGroupBlockCount(const UInt128& group);
+  uint64_t deleteGroup(const UInt128& group);
+  // Like the LocalBlockShard methods of the same names. Writes which fail on some replica still
+  // go to the others, then throw. The group methods require all replica IDs to be below 4.
+
+  void sync();
+  // Repairs shards which are behind, then syncs every shard.
+
+private:
+  static constexpr uint MAX_REPLICAS = 8;
+
+  struct BlockIds {
+    std::set<UInt256> ids;
+    std::set<UInt128> groups;
+    // Whole groups of mutable blocks, as deleted by deleteGroup().
+  };
+
+  struct ShardState {
+    BlockShard& shard;
+
+    mutable uint64_t latencyNs = 0;
+    // Moving average of how long calls to this shard take, or zero if we haven't called it yet.
+    // Updated atomically without taking the exclusive lock.
+
+    mutable uint64_t failedAtNs = 0;
+    // When a call to this shard last threw, or zero. Updated like `latencyNs`.
+
+    kj::MutexGuarded<BlockIds> missed;
+    // Writes which this shard missed while another replica took them. Entries are only removed
+    // with the exclusive lock held, by repair() or by addShard() handing them to a new shard.
+
+    explicit ShardState(BlockShard& shard): shard(shard) {}
+  };
+
+  typedef std::map<uint32_t, kj::Own<ShardState>> Ring;
+  // Shards of one replica, by shardId.
+
+  struct Move {
+    uint8_t replicaId;
+    uint32_t begin;
+    uint32_t end;
+    // The part of the replica's key space which addShard() is moving to a new shard.
+
+    kj::MutexGuarded<BlockIds> written;
+    // What was written in that part since the copying began, so must be copied again.
+  };
+
+  struct Rings {
+    Ring replicas[MAX_REPLICAS];
+    // Empty for replicas that don't exist.
+
+    kj::Maybe<kj::Own<Move>> moving;
+    // Set while addShard() copies blocks without the exclusive lock.
+  };
+
+  UInt128 clusterId;
+  BlockHasher hasher;
+  kj::MutexGuarded<Rings> rings;
+
+  static const ShardState& findOwner(const Ring& ring, uint32_t key);
+  static kj::Vector<const ShardState*> getOwners(
+      const Rings& rings, const UInt256& id, bool groupsOnly = false);
+  // Owners of `id` in every replica, fastest first.
+
+  static bool isCurrent(const ShardState& state, const UInt256& id, bool wholeGroup);
+  // Whether `state` missed no write to block `id`, or if `wholeGroup`, to any block in its group.
+
+  static void noteWrite(const Rings& rings, const UInt256& id, bool wholeGroup);
+  // Records a write in `rings.moving`, if it falls in the part being moved.
+
+  void repair();
+
+  template <typename Func>
+  static kj::Maybe<kj::Exception> call(const ShardState& state, Func&& func);
+  template <typename Func>
+  static auto read(const Rings& rings, const UInt256& id, bool wholeGroup, Func&& func);
+  template <typename Func>
+  static auto write(const Rings& rings, const UInt256& id, bool wholeGroup, Func&& func);
+  // Call func() on the owners of block `id`, or of its group if `wholeGroup`.
+};
+
+}  // namespace blackrock
+
+#endif  // BLACKROCK_DISTRIBUTED_BLOCKS_H_
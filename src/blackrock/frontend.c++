@@ -31,6 +31,10 @@
 
 namespace blackrock {
 
+static constexpr kj::Duration GRAIN_SHUTDOWN_GRACE = 30 * kj::SECONDS;
+// When a grain's supervisor is unresponsive but its worker is alive, how long we wait for the
+// worker to mark the grain inactive before forcibly taking it over.
+
 class FrontendImpl::BackendImpl: public sandstorm::Backend::Server {
 public:
   BackendImpl(FrontendImpl& frontend, kj::Timer& timer,
@@ -54,21 +58,21 @@ protected:
       req.send().getCore();
     });
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
+    auto userObjectName = kj::str("user-", params.getOwnerId());
+    StorageRootSet::Client storage = storageFor(userObjectName);
     StorageFactory::Client storageFactory = storage.getFactoryRequest().send().getFactory();
 
     // Load the package volume.
     auto packageVolume = ({
-      auto req = storage.getRequest<Assignable<PackageStorage>>();
-      req.setName(kj::str("package-", packageId));
+      auto packageObjectName = kj::str("package-", packageId);
+      auto req = storageHolding(packageObjectName).getRequest<Assignable<PackageStorage>>();
+      req.setName(packageObjectName);
       req.send().getObject().castAs<OwnedAssignable<PackageStorage>>()
           .getRequest().send().getValue().getVolume();
     });
 
     // Get the owner user data.
     auto owner = ({
-      auto userObjectName = kj::str("user-", params.getOwnerId());
-
       auto req = storage.getOrCreateAssignableRequest<AccountStorage>();
       req.setName(userObjectName);
       req.initDefaultValue();
@@ -128,12 +132,10 @@ protected:
     auto grainId = params.getGrainId();
     KJ_LOG(INFO, "Backend: getGrain", grainId);
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
-
     auto owner = ({
       auto userObjectName = kj::str("user-", params.getOwnerId());
 
-      auto req = storage.getOrCreateAssignableRequest<AccountStorage>();
+      auto req = storageFor(userObjectName).getOrCreateAssignableRequest<AccountStorage>();
       req.setName(userObjectName);
       req.initDefaultValue();
       req.send().getObject();
@@ -185,12 +187,10 @@ protected:
     auto grainId = params.getGrainId();
     KJ_LOG(INFO, "Backend: deleteGrain", grainId);
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
-
     auto owner = ({
       auto userObjectName = kj::str("user-", params.getOwnerId());
 
-      auto req = storage.getOrCreateAssignableRequest<AccountStorage>();
+      auto req = storageFor(userObjectName).getOrCreateAssignableRequest<AccountStorage>();
       req.setName(userObjectName);
       req.initDefaultValue();
       req.send().getObject();
@@ -296,7 +296,7 @@ protected:
     auto userObjectName = kj::str("user-", userId);
     context.releaseParams();
 
-    auto req = frontend.storageRoots->chooseOne().removeRequest();
+    auto req = storageFor(userObjectName).removeRequest();
     req.setName(userObjectName);
     return req.send().then([](auto&&){});
   }
@@ -306,6 +306,9 @@ protected:
   kj::Promise<void> installPackage(InstallPackageContext context) override {
     KJ_LOG(INFO, "Backend: installPackage");
 
+    // We don't know the package ID -- and hence which storage node will hold the package -- until
+    // the upload is done, so create the package on any node. If it's not the one responsible for
+    // the ID, that one will forward to it.
     Worker::Client worker = frontend.workers->chooseOne();
     StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
     StorageFactory::Client storageFactory = storage.getFactoryRequest().send().getFactory();
@@ -316,8 +319,8 @@ protected:
       req.send().getStream();
     });
 
-    context.getResults().setStream(
-        kj::heap<PackageUploadStreamImpl>(kj::mv(storage), kj::mv(stream)));
+    context.getResults().setStream(kj::heap<PackageUploadStreamImpl>(
+        kj::addRef(*frontend.storageRoots), kj::mv(storage), kj::mv(stream)));
     return kj::READY_NOW;
   }
 
@@ -325,9 +328,9 @@ protected:
     auto packageId = context.getParams().getPackageId();
     KJ_LOG(INFO, "Backend: tryGetPackage", packageId);
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
-    auto req = storage.tryGetRequest<Assignable<PackageStorage>>();
-    req.setName(kj::str("package-", packageId));
+    auto packageObjectName = kj::str("package-", packageId);
+    auto req = storageFor(packageObjectName).tryGetRequest<Assignable<PackageStorage>>();
+    req.setName(packageObjectName);
     context.releaseParams();
 
     return req.send().then([this,context](auto&& outerResult) mutable -> kj::Promise<void> {
@@ -368,9 +371,10 @@ protected:
     auto packageId = context.getParams().getPackageId();
     KJ_LOG(INFO, "Backend: deletePackage", packageId);
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
-    auto req = storage.removeRequest();
-    req.setName(kj::str("package-", packageId));
+    auto packageObjectName = kj::str("package-", packageId);
+    auto req = storageFor(packageObjectName).removeRequest();
+    req.setName(packageObjectName);
+    frontend.storageRoots->forget(packageObjectName);
     context.releaseParams();
     return req.send().ignoreResult();
   }
@@ -383,15 +387,18 @@ protected:
     auto backupId = params.getBackupId();
     KJ_LOG(INFO, "Backend: backupGrain", grainId, backupId);
 
+    // The backup is created on the node which will hold it, not necessarily the grain's.
+    auto backupObjectName = kj::str("backup-", backupId);
     Worker::Client worker = frontend.workers->chooseOne();
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
+    StorageRootSet::Client storage = storageFor(backupObjectName);
     StorageFactory::Client storageFactory = storage.getFactoryRequest().send().getFactory();
 
-    auto req = storage.getOrCreateAssignableRequest<AccountStorage>();
-    req.setName(kj::str("user-", params.getOwnerId()));
+    auto userObjectName = kj::str("user-", params.getOwnerId());
+    auto req = storageFor(userObjectName).getOrCreateAssignableRequest<AccountStorage>();
+    req.setName(userObjectName);
     req.initDefaultValue();
     return req.send().getObject().getRequest().send().then(
-        [this,context,params,grainId,backupId,
+        [this,context,params,grainId,KJ_MVCAP(backupObjectName),
          KJ_MVCAP(worker),KJ_MVCAP(storage),KJ_MVCAP(storageFactory)]
         (auto&& getResults) mutable {
       for (auto grainInfo: getResults.getValue().getGrains()) {
@@ -433,9 +440,10 @@ protected:
           req.setVolume(kj::mv(volume));
           req.setMetadata(metadata);
           req.setStorage(kj::mv(storageFactory));
-          return req.send().then([this,backupId,KJ_MVCAP(storage)](auto&& response) mutable {
+          return req.send().then([this,KJ_MVCAP(backupObjectName),KJ_MVCAP(storage)]
+                                 (auto&& response) mutable {
             auto req2 = storage.setRequest<sandstorm::Blob>(capnp::MessageSize {4, 1});
-            req2.setName(kj::str("backup-", backupId));
+            req2.setName(backupObjectName);
             req2.setObject(response.getData());
             return req2.send().then([](auto&&) {});
           });
@@ -451,13 +459,16 @@ protected:
     auto backupId = params.getBackupId();
     KJ_LOG(INFO, "Backend: restoreGrain", grainId, backupId);
 
+    // The grain is restored into storage on the new owner's node.
     Worker::Client worker = frontend.workers->chooseOne();
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
+    auto userObjectName = kj::str("user-", params.getOwnerId());
+    StorageRootSet::Client storage = storageFor(userObjectName);
     StorageFactory::Client storageFactory = storage.getFactoryRequest().send().getFactory();
 
     auto blob = ({
-      auto req = storage.getRequest<sandstorm::Blob>();
-      req.setName(kj::str("backup-", backupId));
+      auto backupObjectName = kj::str("backup-", backupId);
+      auto req = storageHolding(backupObjectName).getRequest<sandstorm::Blob>();
+      req.setName(backupObjectName);
       req.send().getObject().castAs<sandstorm::Blob>();
     });
 
@@ -465,7 +476,8 @@ protected:
     req.setData(kj::mv(blob));
     req.setStorage(storageFactory);
 
-    return req.send().then([this,context,params,grainId,KJ_MVCAP(storage),KJ_MVCAP(storageFactory)]
+    return req.send().then([this,context,grainId,KJ_MVCAP(userObjectName),
+                            KJ_MVCAP(storage),KJ_MVCAP(storageFactory)]
                            (auto&& response) mutable {
       auto grainState = ({
         auto req = storageFactory.newAssignableRequest<GrainState>();
@@ -477,7 +489,7 @@ protected:
 
       auto ownerGet = ({
         auto req = storage.getOrCreateAssignableRequest<AccountStorage>();
-        req.setName(kj::str("user-", params.getOwnerId()));
+        req.setName(userObjectName);
         req.initDefaultValue();
         req.send().getObject().getRequest().send();
       });
@@ -495,13 +507,14 @@ protected:
     auto backupId = context.getParams().getBackupId();
     KJ_LOG(INFO, "Backend: uploadBackup", backupId);
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
+    auto backupObjectName = kj::str("backup-", backupId);
+    StorageRootSet::Client storage = storageFor(backupObjectName);
     StorageFactory::Client storageFactory = storage.getFactoryRequest().send().getFactory();
 
     auto upload = storageFactory.uploadBlobRequest().send();
 
     auto req = storage.setRequest<sandstorm::Blob>();
-    req.setName(kj::str("backup-", backupId));
+    req.setName(backupObjectName);
     req.setObject(upload.getBlob());
     context.releaseParams();
 
@@ -518,10 +531,9 @@ protected:
     auto backupId = params.getBackupId();
     KJ_LOG(INFO, "Backend: downloadBackup", backupId);
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
-
-    auto req = storage.getRequest<sandstorm::Blob>();
-    req.setName(kj::str("backup-", backupId));
+    auto backupObjectName = kj::str("backup-", backupId);
+    auto req = storageHolding(backupObjectName).getRequest<sandstorm::Blob>();
+    req.setName(backupObjectName);
     context.releaseParams();
 
     auto req2 = req.send().getObject().castAs<sandstorm::Blob>().writeToRequest();
@@ -533,8 +545,10 @@ protected:
     auto backupId = context.getParams().getBackupId();
     KJ_LOG(INFO, "Backend: deleteBackup", backupId);
 
-    auto req = frontend.storageRoots->chooseOne().removeRequest();
-    req.setName(kj::str("backup-", backupId));
+    auto backupObjectName = kj::str("backup-", backupId);
+    auto req = storageFor(backupObjectName).removeRequest();
+    req.setName(backupObjectName);
+    frontend.storageRoots->forget(backupObjectName);
     context.releaseParams();
     return req.send().then([](auto&&) {});
   }
@@ -542,13 +556,11 @@ protected:
   // ---------------------------------------------------------------------------
 
   kj::Promise<void> getUserStorageUsage(GetUserStorageUsageContext context) override {
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
-
     auto owner = ({
       auto userObjectName = kj::str("user-", context.getParams().getUserId());
       context.releaseParams();
 
-      auto req = storage.getOrCreateAssignableRequest<AccountStorage>();
+      auto req = storageFor(userObjectName).getOrCreateAssignableRequest<AccountStorage>();
       req.setName(userObjectName);
       req.initDefaultValue();
       req.send().getObject();
@@ -563,12 +575,10 @@ protected:
     auto params = context.getParams();
     auto grainId = params.getGrainId();
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
-
     auto owner = ({
       auto userObjectName = kj::str("user-", params.getOwnerId());
 
-      auto req = storage.getOrCreateAssignableRequest<AccountStorage>();
+      auto req = storageFor(userObjectName).getOrCreateAssignableRequest<AccountStorage>();
       req.setName(userObjectName);
       req.initDefaultValue();
       req.send().getObject();
@@ -595,11 +605,25 @@ private:
   kj::Timer& timer;
   sandstorm::SandstormCoreFactory::Client coreFactory;
 
+  StorageRootSet::Client storageFor(kj::StringPtr rootName) {
+    // Root objects are partitioned across storage nodes by name. This is the name's home node,
+    // which must handle anything but a plain get(). Objects which a root is to own -- e.g. a grain
+    // in a user's account -- must be created with the same node's factory.
+    return frontend.storageRoots->chooseHome(rootName);
+  }
+
+  StorageRootSet::Client storageHolding(kj::StringPtr rootName) {
+    // The node actually holding the named root, for get()s. Usually the home node, but not for
+    // packages, which are created wherever they were uploaded.
+    return frontend.storageRoots->chooseOwner(rootName);
+  }
+
   class PackageUploadStreamImpl: public sandstorm::Backend::PackageUploadStream::Server {
   public:
-    PackageUploadStreamImpl(StorageRootSet::Client storage,
+    PackageUploadStreamImpl(kj::Own<KeyRoutedBackendSetImpl<StorageRootSet>> storageRoots,
+                            StorageRootSet::Client storage,
                             Worker::PackageUploadStream::Client inner)
-        : storage(kj::mv(storage)), inner(kj::mv(inner)) {}
+        : storageRoots(kj::mv(storageRoots)), storage(kj::mv(storage)), inner(kj::mv(inner)) {}
 
   protected:
     kj::Promise<void> write(WriteContext context) override {
@@ -643,8 +667,10 @@ private:
         });
 
         auto promise = ({
-          auto req = storage.setRequest<Assignable<PackageStorage>>();
-          req.setName(kj::str("package-", packageId));
+          auto packageObjectName = kj::str("package-", packageId);
+          auto req = storageRoots->chooseHome(packageObjectName)
+              .setRequest<Assignable<PackageStorage>>();
+          req.setName(packageObjectName);
           req.setObject(kj::mv(packageStorage));
           req.send();
         });
@@ -662,7 +688,8 @@ private:
     }
 
   private:
-    StorageRootSet::Client storage;
+    kj::Own<KeyRoutedBackendSetImpl<StorageRootSet>> storageRoots;
+    StorageRootSet::Client storage;  // the node on which the package is being created
     Worker::PackageUploadStream::Client inner;
   };
 
@@ -698,7 +725,7 @@ private:
   }
 
   struct ContinueParams {
-    sandstorm::Assignable<GrainState>::Client grainAssignable;
+    Assignable<GrainState>::Client grainAssignable;
     StorageFactory::Client storageFactory;
     Volume::Client packageVolume;
     capnp::Text::Reader packageId;
@@ -716,7 +743,7 @@ private:
       return KJ_EXCEPTION(DISCONNECTED, "couldn't start grain");
     }
 
-    auto promise = params.grainAssignable.getRequest().send();
+    auto promise = params.grainAssignable.getWithVersionRequest().send();
     return promise.then([this,KJ_MVCAP(params),retryCount](auto grainGetResult) mutable
                         -> kj::Promise<sandstorm::Supervisor::Client> {
       auto grainState = grainGetResult.getValue();
@@ -760,6 +787,7 @@ private:
         case GrainState::ACTIVE: {
           // Attempt to keep-alive the old supervisor.
           auto supervisor = grainState.getActive();
+          auto workerProbe = supervisor.castAs<Persistent>();
           auto keepAliveReq = supervisor.keepAliveRequest();
           keepAliveReq.setCore(params.core);
           auto promise = timer.timeoutAfter(4 * kj::SECONDS, keepAliveReq.send());
@@ -767,16 +795,17 @@ private:
               -> kj::Promise<sandstorm::Supervisor::Client> {
             // Keep-alive succeeded. Use existing supervisor.
             return kj::mv(supervisor);
-          }, [this,KJ_MVCAP(params),KJ_MVCAP(grainGetResult),grainState,retryCount]
+          }, [this,KJ_MVCAP(params),KJ_MVCAP(grainGetResult),KJ_MVCAP(workerProbe),
+              grainState,retryCount]
              (kj::Exception&& e) mutable
               -> kj::Promise<sandstorm::Supervisor::Client> {
             // Keep-alive failed. Possibilities:
             // 1. The grain is in the midst of shutting down. The supervisor has already exited
-            //    but we're still waiting for clean unmount. We should pause for a short time to
-            //    give it a chance to clean up.
+            //    but we're still waiting for clean unmount. We should wait for the worker to
+            //    finish and set the GrainState to `inactive`.
             // 2. The worker died while the grain was running and as a result never managed to
             //    update the grain state to reflect that it is no longer live. We can simply take
-            //    ownership.
+            //    ownership, right away.
             // 3. The worker is unhealthy but still executing. This state is dangerous, since we
             //    cannot support concurrent access to the same underlying volume. Luckily each
             //    grain takes out an "exclusive" Volume capability which will disconnect itself
@@ -784,19 +813,47 @@ private:
             //    written, but given that the worker appears unhealthy that data was probably
             //    in bad shape already.
             //
-            // To cover all cases, waiting a few seconds should be sufficient.
-            //
-            // TODO(integrity): We could handle case (1) more precisely by observing the GrainState,
-            //   waiting for the previous worker to set it to `inactive`. Then we could pause much
-            //   longer, so that we don't interrupt an unmount that has a lot of data to flush.
-            //   This should be exceedingly rare, though. In fact, this whole branch is rare.
+            // To tell (2) apart from the others, we probe the worker itself: the supervisor
+            // capability is a LocalPersistentRegistry wrapper hosted by the worker, which answers
+            // ping() without involving the grain. If the worker is alive, we watch the GrainState
+            // and retry the moment it changes, giving up and taking over after a grace period in
+            // case (3).
             KJ_LOG(INFO, "RARE: (startGrain) GrainState is active, but supervisor appears dead.",
                    params.grainId, e);
 
-            return timer.afterDelay(4 * kj::SECONDS)
-                .then([KJ_MVCAP(grainGetResult),grainState]() {
-              // OK, a few seconds have gone by. Let's attempt to switch this grain's state to
-              // "inactive".
+            auto grainAssignable = params.grainAssignable;
+            auto grainId = params.grainId;
+            uint64_t version = grainGetResult.getVersion();
+            auto probe = timer.timeoutAfter(2 * kj::SECONDS, workerProbe.pingRequest().send())
+                .then([](auto&&) { return true; }, [](kj::Exception&&) { return false; });
+
+            return probe.then([this,grainAssignable,grainId,version](bool workerAlive) mutable
+                              -> kj::Promise<bool> {
+              if (!workerAlive) {
+                KJ_LOG(INFO, "worker hosting grain is unreachable; taking over", grainId);
+                return false;
+              }
+
+              auto req = grainAssignable.whenChangedRequest();
+              req.setVersion(version);
+              return req.send().then([](auto&&) -> kj::Promise<bool> {
+                return true;
+              }, [this](kj::Exception&& e) -> kj::Promise<bool> {
+                // Storage doesn't support watching? Fall back to waiting out the grace period,
+                // since the old worker may still be unmounting.
+                KJ_LOG(WARNING, "GrainState whenChanged() failed", e);
+                return timer.afterDelay(GRAIN_SHUTDOWN_GRACE).then([]() { return false; });
+              }).exclusiveJoin(timer.afterDelay(GRAIN_SHUTDOWN_GRACE)
+                  .then([]() { return false; }));
+            }).then([this,KJ_MVCAP(params),KJ_MVCAP(grainGetResult),grainState,retryCount]
+                    (bool changed) mutable -> kj::Promise<sandstorm::Supervisor::Client> {
+              if (changed) {
+                // The old worker finished shutting down (or someone else took over). Start over
+                // with the new state.
+                return continueGrain(kj::mv(params), retryCount + 1);
+              }
+
+              // Let's attempt to switch this grain's state to "inactive".
               auto setter = grainGetResult.getSetter();
               auto sizeHint = grainState.totalSize();
               sizeHint.wordCount += 16;
@@ -823,10 +880,10 @@ private:
                   // Other exception.
                   return kj::mv(e);
                 }
+              }).then([this,KJ_MVCAP(params),retryCount]() mutable {
+                // OK, try again now.
+                return continueGrain(kj::mv(params), retryCount + 1);
               });
-            }).then([this,KJ_MVCAP(params),retryCount]() mutable {
-              // OK, try again now.
-              return continueGrain(kj::mv(params), retryCount + 1);
             });
           });
         }
@@ -839,17 +896,26 @@ private:
 // =======================================================================================
 
 struct FrontendImpl::MongoInfo {
-  SimpleAddress address;
+  kj::Array<SimpleAddress> members;
   kj::String username;
   kj::String password;
+  kj::String replicaSet;
 
   explicit MongoInfo(Mongo::GetConnectionInfoResults::Reader reader)
-      : address(reader.getAddress()),
+      : members(reader.getMembers().size() > 0
+            ? KJ_MAP(member, reader.getMembers()) { return SimpleAddress(member); }
+            : kj::heapArray<SimpleAddress>({ SimpleAddress(reader.getAddress()) })),
         username(kj::str(reader.getUsername())),
-        password(kj::str(reader.getPassword())) {}
+        password(kj::str(reader.getPassword())),
+        replicaSet(kj::str(reader.getReplicaSet())) {}
+
+  kj::String getUrl(kj::StringPtr dbName, kj::StringPtr extraOptions = nullptr) {
+    // Naming the replica set makes the driver find its primary among (and beyond) `members`, and
+    // follow it through failovers.
 
-  kj::String toString() {
-    return kj::str(username, ':', password, '@', address);
+    return kj::str("mongodb://", username, ':', password, '@', kj::strArray(members, ","),
+        '/', dbName, "?authSource=admin",
+        replicaSet.size() > 0 ? "&replicaSet=" : "", replicaSet, extraOptions);
   }
 };
 
@@ -873,7 +939,14 @@ FrontendImpl::FrontendImpl(kj::LowLevelAsyncIoProvider& llaiop,
                            sandstorm::SubprocessSet& subprocessSet,
                            FrontendConfig::Reader config, uint replicaNumber,
                            SimpleAddress bindAddress)
-    : storageRoots(kj::refcounted<BackendSetImpl<StorageRootSet>>()),
+    : storageRoots(kj::refcounted<KeyRoutedBackendSetImpl<StorageRootSet>>(
+          [](StorageRootSet::Client home, kj::StringPtr name) {
+        auto req = home.locateRequest();
+        req.setName(name);
+        return req.send().then([](auto&& response) -> uint64_t {
+          return response.getNode();
+        });
+      })),
       storageFactories(kj::refcounted<BackendSetImpl<StorageFactory>>()),
       workers(kj::refcounted<BackendSetImpl<Worker>>()),
       mongos(kj::refcounted<BackendSetImpl<Mongo>>()) {
@@ -902,8 +975,7 @@ FrontendImpl::Instance::Instance(
   paf.fulfiller->fulfill(kj::heap<BackendImpl>(frontend, timer,
       capnpServer.getBootstrap().castAs<sandstorm::SandstormCoreFactory>()));
 
-  tasks.add(frontend.mongos->chooseOne().getConnectionInfoRequest().send()
-      .then([this,&llaiop](auto&& mongoInfo) mutable {
+  tasks.add(getMongoInfo(*frontend.mongos).then([this,&llaiop](MongoInfo&& mongoInfo) mutable {
     int backendSocketpair[2];
     KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
                           0, backendSocketpair));
@@ -919,12 +991,27 @@ FrontendImpl::Instance::Instance(
     auto listener = kj::heap<kj::CapabilityStreamConnectionReceiver>(*backendServerStream);
     listener = listener.attach(kj::mv(backendServerStream));
 
-    tasks.add(startExecLoop(MongoInfo(mongoInfo), kj::mv(backendClient)));
+    tasks.add(startExecLoop(kj::mv(mongoInfo), kj::mv(backendClient)));
 
     return capnpServer.listen(kj::mv(listener));
   }));
 }
 
+kj::Promise<FrontendImpl::MongoInfo> FrontendImpl::Instance::getMongoInfo(
+    BackendSetImpl<Mongo>& mongos) {
+  // Any member will do, but the one we pick may be down -- if it's the one that failed.
+
+  return mongos.chooseOne().getConnectionInfoRequest().send()
+      .then([](auto&& response) -> kj::Promise<MongoInfo> {
+    return MongoInfo(response);
+  }, [this,&mongos](kj::Exception&& exception) -> kj::Promise<MongoInfo> {
+    KJ_LOG(WARNING, "couldn't get Mongo connection info; trying again", replicaNumber, exception);
+    return timer.afterDelay(1 * kj::SECONDS).then([this,&mongos]() {
+      return getMongoInfo(mongos);
+    });
+  });
+}
+
 void FrontendImpl::Instance::taskFailed(kj::Exception&& exception) {
   KJ_LOG(FATAL, replicaNumber, exception);
   abort();
@@ -1026,10 +1113,11 @@ kj::Promise<void> FrontendImpl::Instance::execLoop(
       KJ_SYSCALL(setenv("ROOT_URL", config.getBaseUrl().cStr(), true));
       KJ_SYSCALL(setenv("PORT", "4321", true));  // a lie, doesn't matter
       KJ_SYSCALL(setenv("PORTS", "4321", true));  // a lie, doesn't matter
+      // The shell's queries go to secondaries where possible, to spread the load. The oplog is
+      // tailed from the primary.
       KJ_SYSCALL(setenv("MONGO_URL",
-          kj::str("mongodb://", mongoInfo, "/meteor?authSource=admin").cStr(), true));
-      KJ_SYSCALL(setenv("MONGO_OPLOG_URL",
-          kj::str("mongodb://", mongoInfo, "/local?authSource=admin").cStr(), true));
+          mongoInfo.getUrl("meteor", "&readPreference=secondaryPreferred").cStr(), true));
+      KJ_SYSCALL(setenv("MONGO_OPLOG_URL", mongoInfo.getUrl("local").cStr(), true));
       KJ_SYSCALL(setenv("BIND_IP", "0.0.0.0", true));
       if (config.hasMailUrl()) {
         KJ_SYSCALL(setenv("MAIL_URL", config.getMailUrl().cStr(), true));
@@ -1095,12 +1183,55 @@ kj::Promise<void> FrontendImpl::Instance::execLoop(
 // This is in frontend.c++ mostly because it shares a bunch of code related to using the
 // Sandstorm bundle, and because the Frontend is the only thing that uses Mongo.
 
+static constexpr char MONGO_REPLICA_SET[] = "ssrs";
+
+static kj::String randomChars(size_t count, const char* digits) {
+  // `count` random characters out of the 64 `digits`.
+
+  auto result = kj::heapString(count);
+  randombytes_buf(result.begin(), count);
+  for (auto& c: result) {
+    c = digits[byte(c) % 64];
+  }
+  return result;
+}
+
+static void writeMongoSecret(kj::StringPtr name, kj::StringPtr content) {
+  // Replaces /var/mongo/<name>, as seen from inside the bundle, with a file only Mongo can read.
+
+  auto path = kj::str("/var/blackrock/bundle/mongo/", name);
+  auto tmpPath = kj::str(path, ".tmp");
+  {
+    auto outFd = sandstorm::raiiOpen(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    KJ_SYSCALL(fchown(outFd, 1000, 1000));
+    kj::FdOutputStream((int)outFd).write(content.begin(), content.size());
+  }
+  KJ_SYSCALL(rename(tmpPath.cStr(), path.cStr()));
+}
+
+static void copyMembers(const std::map<uint, SimpleAddress>& members,
+                        capnp::List<Address>::Builder builder) {
+  uint i = 0;
+  for (auto& member: members) {
+    member.second.copyTo(builder[i++]);
+  }
+}
+
 MongoImpl::MongoImpl(
     kj::Timer& timer, sandstorm::SubprocessSet& subprocessSet, SimpleAddress bindAddress,
-    kj::PromiseFulfillerPair<void> passwordPaf)
+    uint memberIndex, kj::PromiseFulfillerPair<void> passwordPaf)
     : timer(timer), subprocessSet(subprocessSet), bindAddress(bindAddress),
+      memberIndex(memberIndex), memberSet(kj::refcounted<BackendSetImpl<Mongo>>()),
       passwordPromise(passwordPaf.promise.fork()),
-      execTask(startExecLoop(kj::mv(passwordPaf.fulfiller))) {}
+      lastReconfig(kj::Promise<void>(kj::READY_NOW).fork()),
+      joinTask(kj::READY_NOW),
+      execTask(startExecLoop(kj::mv(passwordPaf.fulfiller))) {
+  members.insert(std::make_pair(memberIndex, bindAddress));
+}
+
+BackendSet<Mongo>::Client MongoImpl::getMemberBackendSet() {
+  return kj::addRef(*memberSet);
+}
 
 kj::Promise<void> MongoImpl::getConnectionInfo(GetConnectionInfoContext context) {
   return passwordPromise.addBranch().then([this,context]() mutable {
@@ -1108,6 +1239,74 @@ kj::Promise<void> MongoImpl::getConnectionInfo(GetConnectionInfoContext context)
     bindAddress.copyTo(results.initAddress());
     results.setUsername("sandstorm");
     results.setPassword(KJ_ASSERT_NONNULL(password));
+    copyMembers(members, results.initMembers(members.size()));
+    results.setReplicaSet(MONGO_REPLICA_SET);
+  });
+}
+
+kj::Promise<void> MongoImpl::getClusterSecrets(GetClusterSecretsContext context) {
+  KJ_REQUIRE(memberIndex == 0, "only the seed member hands out the replica set's secrets");
+
+  return passwordPromise.addBranch().then([this,context]() mutable {
+    auto results = context.getResults();
+    results.setKeyFile(sandstorm::readAll("/var/blackrock/bundle/mongo/keyfile"));
+    results.setPassword(KJ_ASSERT_NONNULL(password));
+  });
+}
+
+kj::Promise<void> MongoImpl::addMember(AddMemberContext context) {
+  KJ_REQUIRE(memberIndex == 0, "only the seed member adds members");
+
+  auto params = context.getParams();
+  uint index = params.getMemberIndex();
+  SimpleAddress address = params.getAddress();
+  KJ_REQUIRE(index != 0, "the seed is a member from the start");
+
+  return passwordPromise.addBranch().then([this,index,address]() -> kj::Promise<void> {
+    auto iter = members.find(index);
+    if (iter != members.end() && iter->second == address) {
+      // Already added since we started.
+      return kj::READY_NOW;
+    }
+
+    // Mongo's own config is the authority on membership -- ours only covers members added since
+    // we started -- so check it. Only the primary can change it without forcing, and forcing
+    // could roll back writes, so if we aren't the primary, have the primary do it.
+    auto host = kj::str(address);
+    auto command = kj::str(
+        "var conn = db, status = db.isMaster();"
+        "if (!status.ismaster) {"
+        "  if (!status.primary) throw new Error('replica set has no primary');"
+        "  conn = new Mongo(status.primary).getDB('admin');"
+        "  conn.auth('sandstorm', '", KJ_ASSERT_NONNULL(password), "');"
+        "}"
+        "var cfg = conn.adminCommand({replSetGetConfig: 1}).config;"
+        "var known = false, changed = false;"
+        "cfg.members.forEach(function(m) {"
+        "  if (m._id == ", index, ") {"
+        "    known = true;"
+        "    if (m.host != '", host, "') { m.host = '", host, "'; changed = true; }"
+        "  }"
+        "});"
+        "if (!known) { cfg.members.push({_id: ", index, ", host: '", host, "'}); changed = true; }"
+        "if (changed) {"
+        "  cfg.version++;"
+        "  var result = conn.adminCommand({replSetReconfig: cfg});"
+        "  if (!result.ok) throw new Error(tojson(result));"
+        "}");
+
+    auto reconfig = lastReconfig.addBranch().then([this,KJ_MVCAP(command)]() mutable {
+      return tryMongoCommand(kj::mv(command), "admin");
+    }).fork();
+    auto result = reconfig.addBranch();
+    lastReconfig = reconfig.addBranch().catch_([](kj::Exception&&) {}).fork();
+
+    return result.then([this,index,address]() {
+      members.erase(index);
+      members.insert(std::make_pair(index, address));
+    });
+  }).then([this,context]() mutable {
+    copyMembers(members, context.getResults().initMembers(members.size()));
   });
 }
 
@@ -1121,6 +1320,8 @@ kj::Promise<void> MongoImpl::execLoop(kj::PromiseFulfiller<void>& passwordFulfil
   auto rateLimit = timer.afterDelay(10 * kj::SECONDS);
 
   return kj::evalNow([&]() {
+    return prepareSecrets();
+  }).then([this](bool joinedBefore) {
     sandstorm::Subprocess subprocess([&]() -> int {
       enterSandstormBundle();
 
@@ -1129,15 +1330,17 @@ kj::Promise<void> MongoImpl::execLoop(kj::PromiseFulfiller<void>& passwordFulfil
           "--port", kj::str(bindAddress.getPort()).cStr(),
           "--dbpath", "/var/mongo", "--logpath", "/var/log/mongo.log",
           "--pidfilepath", "/var/pid/mongo.pid",
-          "--auth", "--nohttpinterface", "--replSet", "ssrs", "--oplogSize", "128",
+          "--auth", "--keyFile", "/var/mongo/keyfile", "--nohttpinterface",
+          "--replSet", MONGO_REPLICA_SET, "--oplogSize", "128",
           (char*)nullptr));
       KJ_UNREACHABLE;
     });
 
     // Wait for mongod to return, meaning the database is up.  Then get its real pid via the
     // pidfile.
-    return subprocessSet.waitForSuccess(kj::mv(subprocess));
-  }).then([this,&passwordFulfiller]() {
+    return subprocessSet.waitForSuccess(kj::mv(subprocess))
+        .then([joinedBefore]() { return joinedBefore; });
+  }).then([this,&passwordFulfiller](bool joinedBefore) {
     pid_t pid = KJ_ASSERT_NONNULL(sandstorm::parseUInt(sandstorm::trim(
         sandstorm::readAll("/var/blackrock/bundle/pid/mongo.pid")), 10));
 
@@ -1151,9 +1354,25 @@ kj::Promise<void> MongoImpl::execLoop(kj::PromiseFulfiller<void>& passwordFulfil
     KJ_ASSERT(getpid() == 1);
     sandstorm::Subprocess mongoProc(pid);
 
-    return initializeMongo()
-        .then([this,KJ_MVCAP(mongoProc),&passwordFulfiller](kj::String&& pw) mutable {
-      password = kj::mv(pw);
+    kj::Promise<void> ready = nullptr;
+    if (memberIndex == 0) {
+      ready = initializeMongo().then([this](kj::String&& pw) {
+        password = kj::mv(pw);
+      });
+    } else {
+      password = sandstorm::trim(sandstorm::readAll(
+          sandstorm::raiiOpen("/var/blackrock/bundle/mongo/passwd", O_RDONLY)));
+      if (joinedBefore) {
+        // We're in the set's config already, so we can serve -- even with the seed down, which
+        // is when we're most needed -- while making sure we're still in it.
+        joinTask = joinReplicaSet().eagerlyEvaluate(nullptr);
+        ready = kj::READY_NOW;
+      } else {
+        ready = joinReplicaSet();
+      }
+    }
+
+    return ready.then([this,KJ_MVCAP(mongoProc),&passwordFulfiller]() mutable {
       passwordFulfiller.fulfill();
       return subprocessSet.waitForSuccess(kj::mv(mongoProc));
     });
@@ -1167,22 +1386,57 @@ kj::Promise<void> MongoImpl::execLoop(kj::PromiseFulfiller<void>& passwordFulfil
   });
 }
 
+kj::Promise<bool> MongoImpl::prepareSecrets() {
+  // Makes sure the key file members authenticate each other with, and the password, are on disk
+  // before mongod starts. Returns whether they were already, which -- for any member but the
+  // seed -- means we've joined the set before.
+
+  bool haveKeyFile = access("/var/blackrock/bundle/mongo/keyfile", F_OK) == 0;
+  bool haveSecrets = haveKeyFile && access("/var/blackrock/bundle/mongo/passwd", F_OK) == 0;
+
+  if (memberIndex == 0) {
+    // The password is created along with the database, in initializeMongo().
+    if (!haveKeyFile) {
+      writeMongoSecret("keyfile", randomChars(756,
+          "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/"));
+    }
+    return haveSecrets;
+  } else if (haveSecrets) {
+    return true;
+  } else {
+    return memberSet->chooseById(0).getClusterSecretsRequest().send()
+        .then([](auto&& response) {
+      writeMongoSecret("keyfile", response.getKeyFile());
+      writeMongoSecret("passwd", response.getPassword());
+      return false;
+    });
+  }
+}
+
 kj::Promise<kj::String> MongoImpl::initializeMongo() {
   bool isNew = access("/var/blackrock/bundle/mongo/passwd", F_OK) < 0;
 
   return kj::evalNow([&]() {
     if (isNew) {
-      // We need to initialize the repl set to get oplog tailing. Our set isn't actually much of a
-      // set since it only contains one instance, but you need that for oplog.
+      // We need to initialize the repl set to get oplog tailing, even if we're its only member.
+      // Other members are added as they come up; see addMember().
       return mongoCommand(kj::str(
-          "rs.initiate({_id: 'ssrs', members: [{_id: 0, host: '", bindAddress, "'}]})"));
+          "rs.initiate({_id: '", MONGO_REPLICA_SET, "', "
+                       "members: [{_id: 0, host: '", bindAddress, "'}]})"));
     } else {
       // It's possible that the bind address has changed, so reconfig the repl set. We have to set
       // {force: true} because if the address changed then Mongo will think it doesn't have a
       // majority (because it can't reach the old address) and will refuse to update the config.
+      // Only do it if the address did change, though, since forcing could roll back writes the
+      // other members accepted meanwhile.
       return mongoCommand(kj::str(
-          "rs.reconfig({_id: 'ssrs', members: [{_id: 0, host: '", bindAddress, "'}]}, "
-                      "{force: true})"));
+          "var cfg = rs.conf();"
+          "var self = cfg.members.filter(function(m) { return m._id == 0; })[0];"
+          "if (!self || self.host != '", bindAddress, "') {"
+          "  cfg.members = cfg.members.filter(function(m) { return m._id != 0; });"
+          "  cfg.members.unshift({_id: 0, host: '", bindAddress, "'});"
+          "  rs.reconfig(cfg, {force: true});"
+          "}"));
     }
   }).then([this]() {
     // We have to wait a few seconds for Mongo to elect itself master of the repl set. Mongo does
@@ -1193,17 +1447,8 @@ kj::Promise<kj::String> MongoImpl::initializeMongo() {
   }).then([this,isNew]() -> kj::Promise<kj::String> {
     if (isNew) {
       // Get 30 random chars for password.
-      char passwd[30];
-      randombytes_buf(passwd, sizeof(passwd));
-
-      const char* digits =
-          "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ-_";
-
-      for (auto& c: passwd) {
-        c = digits[byte(c) % 64];
-      }
-
-      auto passwdStr = kj::heapString(passwd, sizeof(passwd));
+      auto passwdStr = randomChars(30,
+          "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ-_");
 
       // Create the mongo user.
       auto command = kj::str(
@@ -1226,7 +1471,37 @@ kj::Promise<kj::String> MongoImpl::initializeMongo() {
   });
 }
 
+kj::Promise<void> MongoImpl::joinReplicaSet() {
+  // Asks the seed to add us to the set, until it does.
+
+  auto req = memberSet->chooseById(0).addMemberRequest();
+  req.setMemberIndex(memberIndex);
+  bindAddress.copyTo(req.initAddress());
+  return req.send().then([this](auto&& response) -> kj::Promise<void> {
+    members.clear();
+    uint i = 0;
+    for (auto member: response.getMembers()) {
+      members.insert(std::make_pair(i++, SimpleAddress(member)));
+    }
+    return kj::READY_NOW;
+  }, [this](kj::Exception&& exception) -> kj::Promise<void> {
+    KJ_LOG(WARNING, "couldn't join the Mongo replica set; will retry", exception);
+    return timer.afterDelay(10 * kj::SECONDS).then([this]() {
+      return joinReplicaSet();
+    });
+  });
+}
+
 kj::Promise<void> MongoImpl::mongoCommand(kj::String command, kj::StringPtr dbName) {
+  auto promise = tryMongoCommand(kj::heapString(command), dbName);
+  return promise.catch_([KJ_MVCAP(command)](kj::Exception&& exception) -> kj::Promise<void> {
+    KJ_LOG(FATAL, "Mongo client command failed! State is inconsistent! Hanging forever!",
+        command, exception.getDescription());
+    return kj::NEVER_DONE;
+  });
+}
+
+kj::Promise<void> MongoImpl::tryMongoCommand(kj::String command, kj::StringPtr dbName) {
   sandstorm::Subprocess subprocess([&]() -> int {
     enterSandstormBundle();
 
@@ -1263,12 +1538,7 @@ kj::Promise<void> MongoImpl::mongoCommand(kj::String command, kj::StringPtr dbNa
     KJ_UNREACHABLE;
   });
 
-  return subprocessSet.waitForSuccess(kj::mv(subprocess))
-      .catch_([KJ_MVCAP(command)](kj::Exception&& exception) -> kj::Promise<void> {
-    KJ_LOG(FATAL, "Mongo client command failed! State is inconsistent! Hanging forever!",
-        command, exception.getDescription());
-    return kj::NEVER_DONE;
-  });
+  return subprocessSet.waitForSuccess(kj::mv(subprocess));
 }
 
 } // namespace blackrock
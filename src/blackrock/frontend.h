@@ -58,7 +58,7 @@ private:
   kj::Own<capnp::MallocMessageBuilder> configMessage;
   FrontendConfig::Reader config;
 
-  kj::Own<BackendSetImpl<StorageRootSet>> storageRoots;
+  kj::Own<KeyRoutedBackendSetImpl<StorageRootSet>> storageRoots;
   kj::Own<BackendSetImpl<StorageFactory>> storageFactories;
   kj::Own<BackendSetImpl<Worker>> workers;
   kj::Own<BackendSetImpl<Mongo>> mongos;
@@ -90,6 +90,8 @@ private:
     pid_t pid = 0;
     kj::TaskSet tasks;
 
+    kj::Promise<MongoInfo> getMongoInfo(BackendSetImpl<Mongo>& mongos);
+
     kj::Promise<void> startExecLoop(MongoInfo&& mongoInfo, kj::AutoCloseFd&& backendClientFd);
 
     kj::Promise<void> execLoop(MongoInfo&& mongoInfo, kj::AutoCloseFd&& http,
@@ -103,23 +105,42 @@ class MongoImpl: public Mongo::Server {
 public:
   explicit MongoImpl(
       kj::Timer& timer, sandstorm::SubprocessSet& subprocessSet, SimpleAddress bindAddress,
+      uint memberIndex,
       kj::PromiseFulfillerPair<void> passwordPaf = kj::newPromiseAndFulfiller<void>());
 
+  BackendSet<Mongo>::Client getMemberBackendSet();
+
 protected:
   kj::Promise<void> getConnectionInfo(GetConnectionInfoContext context) override;
+  kj::Promise<void> getClusterSecrets(GetClusterSecretsContext context) override;
+  kj::Promise<void> addMember(AddMemberContext context) override;
 
 private:
   kj::Timer& timer;
   sandstorm::SubprocessSet& subprocessSet;
   SimpleAddress bindAddress;
+  uint memberIndex;
+  kj::Own<BackendSetImpl<Mongo>> memberSet;
   kj::Maybe<kj::String> password;
   kj::ForkedPromise<void> passwordPromise;
+
+  std::map<uint, SimpleAddress> members;
+  // On the seed, every member added since it started, by index. Elsewhere, the members as last
+  // returned by the seed's addMember(), in no particular order.
+
+  kj::ForkedPromise<void> lastReconfig;
+  // Reconfigurations of the set run one at a time, in order.
+
+  kj::Promise<void> joinTask;
   kj::Promise<void> execTask;
 
   kj::Promise<void> startExecLoop(kj::Own<kj::PromiseFulfiller<void>> passwordFulfiller);
   kj::Promise<void> execLoop(kj::PromiseFulfiller<void>& passwordFulfiller);
+  kj::Promise<bool> prepareSecrets();
   kj::Promise<kj::String> initializeMongo();
+  kj::Promise<void> joinReplicaSet();
   kj::Promise<void> mongoCommand(kj::String command, kj::StringPtr dbName = "meteor");
+  kj::Promise<void> tryMongoCommand(kj::String command, kj::StringPtr dbName = "meteor");
 };
 
 } // namespace blackrock
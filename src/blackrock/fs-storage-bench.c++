@@ -0,0 +1,237 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fs-storage.h"
+#include <kj/main.h>
+#include <kj/debug.h>
+#include <sandstorm/util.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace blackrock {
+
+class FsStorageBench {
+  // Measures the filesystem operations FilesystemStorage performs per object -- open, create,
+  // and rename from staging -- against a main/ directory populated with a given number of
+  // objects, in either the flat or the sharded layout.
+  //
+  // Population is incremental: running at 1M and then at 10M only creates the additional 9M
+  // files. Object IDs are derived from a counter, so the benchmark can pick existing ones.
+
+public:
+  FsStorageBench(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "Blackrock",
+          "Benchmarks FilesystemStorage directory operations with <count> objects under "
+          "<dir>/main. Drop the page cache (echo 3 > /proc/sys/vm/drop_caches) between runs for "
+          "cold-cache numbers.")
+        .addOption({"flat"}, KJ_BIND_METHOD(*this, setFlat),
+            "Use the old flat layout instead of shard directories.")
+        .addOptionWithArg({'n', "samples"}, KJ_BIND_METHOD(*this, setSamples), "<count>",
+            "Number of operations to time for each measurement (default: 10000).")
+        .expectArg("<dir>", KJ_BIND_METHOD(*this, setDir))
+        .expectArg("<count>", KJ_BIND_METHOD(*this, setCount))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  bool flat = false;
+  uint samples = 10000;
+  uint64_t count = 0;
+  kj::AutoCloseFd dirFd;
+  kj::AutoCloseFd mainFd;
+  kj::AutoCloseFd stagingFd;
+
+  typedef FilesystemStorage::ObjectId ObjectId;
+
+  bool setFlat() {
+    flat = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setSamples(kj::StringPtr arg) {
+    char* end;
+    samples = strtoul(arg.cStr(), &end, 0);
+    if (*end != '\0' || samples == 0) return "invalid sample count";
+    return true;
+  }
+
+  kj::MainBuilder::Validity setDir(kj::StringPtr arg) {
+    mkdir(arg.cStr(), 0777);
+    dirFd = sandstorm::raiiOpen(arg, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return true;
+  }
+
+  kj::MainBuilder::Validity setCount(kj::StringPtr arg) {
+    char* end;
+    count = strtoull(arg.cStr(), &end, 0);
+    if (*end != '\0' || count == 0) return "invalid object count";
+    return true;
+  }
+
+  static uint64_t mix(uint64_t x) {
+    // splitmix64 finalizer: spreads a counter uniformly, like the blake2b IDs in real storage.
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+  }
+
+  static ObjectId idFor(uint64_t index) {
+    ObjectId result;
+    result.id[0] = mix(index);
+    result.id[1] = mix(index ^ 0x5555555555555555ull);
+    return result;
+  }
+
+  kj::String pathFor(ObjectId id) {
+    return flat ? kj::str(id.filename('o').begin()) : kj::str(id.shardedFilename('o').begin());
+  }
+
+  void makeParents(kj::StringPtr path) {
+    // Like FilesystemStorage, only called after an operation fails with ENOENT, so that the
+    // common case doesn't pay for it.
+
+    KJ_ASSERT(!flat);
+    for (size_t length: { 2, 4 }) {
+      auto dir = kj::heapString(path.begin(), length);
+      if (mkdirat(mainFd, dir.cStr(), 0777) < 0) {
+        int error = errno;
+        if (error != EEXIST) KJ_FAIL_SYSCALL("mkdirat", error, dir);
+      }
+    }
+  }
+
+  void create(kj::StringPtr path) {
+    int fd = openat(mainFd, path.cStr(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0 && errno == ENOENT && !flat) {
+      makeParents(path);
+      fd = openat(mainFd, path.cStr(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    }
+    if (fd < 0) KJ_FAIL_SYSCALL("openat(O_CREAT)", errno, path);
+    close(fd);
+  }
+
+  void renameIn(kj::StringPtr stagingName, kj::StringPtr path) {
+    int result = renameat(stagingFd, stagingName.cStr(), mainFd, path.cStr());
+    if (result < 0 && errno == ENOENT && !flat) {
+      makeParents(path);
+      result = renameat(stagingFd, stagingName.cStr(), mainFd, path.cStr());
+    }
+    if (result < 0) KJ_FAIL_SYSCALL("renameat", errno, stagingName, path);
+  }
+
+  uint64_t readPopulation() {
+    KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(mainFd, ".bench-count", O_RDONLY | O_CLOEXEC)) {
+      return strtoull(sandstorm::readAll(*fd).cStr(), nullptr, 10);
+    } else {
+      return 0;
+    }
+  }
+
+  void writePopulation(uint64_t n) {
+    auto fd = sandstorm::raiiOpenAt(mainFd, ".bench-count",
+                                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+    auto text = kj::str(n);
+    kj::FdOutputStream(fd.get()).write(text.begin(), text.size());
+  }
+
+  void populate() {
+    uint64_t existing = readPopulation();
+    if (existing >= count) return;
+
+    context.warning(kj::str("populating ", existing, " -> ", count, " objects..."));
+    for (uint64_t i = existing; i < count; i++) {
+      create(pathFor(idFor(i)));
+      if ((i + 1) % 1000000 == 0) {
+        writePopulation(i + 1);
+        context.warning(kj::str("  ", i + 1));
+      }
+    }
+    writePopulation(count);
+    KJ_SYSCALL(syncfs(mainFd));
+  }
+
+  static uint64_t nowNs() {
+    struct timespec ts;
+    KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  }
+
+  template <typename Func>
+  void measure(kj::StringPtr name, Func&& func) {
+    auto times = kj::heapArray<uint64_t>(samples);
+    for (uint i = 0; i < samples; i++) {
+      uint64_t start = nowNs();
+      func(i);
+      times[i] = nowNs() - start;
+    }
+
+    std::sort(times.begin(), times.end());
+    uint64_t total = 0;
+    for (auto t: times) total += t;
+
+    context.warning(kj::str(name, ": mean ", total / samples / 1000, "us, p50 ",
+        times[samples / 2] / 1000, "us, p99 ", times[samples * 99 / 100] / 1000, "us"));
+  }
+
+  bool run() {
+    mkdirat(dirFd, "main", 0777);
+    mkdirat(dirFd, "staging", 0777);
+    mainFd = sandstorm::raiiOpenAt(dirFd, "main", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stagingFd = sandstorm::raiiOpenAt(dirFd, "staging", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    populate();
+    context.warning(kj::str(flat ? "flat" : "sharded", " layout, ", count, " objects"));
+
+    measure("openObject", [&](uint i) {
+      auto path = pathFor(idFor(mix(i + count) % count));
+      sandstorm::raiiOpenAt(mainFd, path, O_RDWR | O_CLOEXEC);
+    });
+
+    // New objects beyond the population, which we delete afterwards so reruns are repeatable.
+    measure("createObject", [&](uint i) {
+      create(pathFor(idFor(count + i)));
+    });
+
+    for (uint i = 0; i < samples; i++) {
+      int fd;
+      KJ_SYSCALL(fd = openat(stagingFd, kj::str(i).cStr(),
+                             O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666));
+      close(fd);
+    }
+    measure("rename from staging", [&](uint i) {
+      renameIn(kj::str(i), pathFor(idFor(count + samples + i)));
+    });
+
+    for (uint64_t i = count; i < count + 2 * samples; i++) {
+      KJ_SYSCALL(unlinkat(mainFd, pathFor(idFor(i)).cStr(), 0));
+    }
+
+    return true;
+  }
+};
+
+}  // namespace blackrock
+
+KJ_MAIN(blackrock::FsStorageBench)
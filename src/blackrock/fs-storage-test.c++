@@ -15,6 +15,7 @@
 // limitations under the License.
 
 #include "fs-storage.h"
+#include "distributed-blocks.h"
 #include <kj/test.h>
 #include <sandstorm/util.h>
 #include <stdlib.h>
@@ -108,6 +109,21 @@ struct StorageTestFixture {
   }
 };
 
+size_t countObjects(int mainFd) {
+  // Counts the object files in main/, which live two levels of shard directories deep.
+
+  size_t result = 0;
+  for (auto& dir1: sandstorm::listDirectoryFd(mainFd)) {
+    if (dir1.startsWith(".")) continue;
+    auto fd1 = sandstorm::raiiOpenAt(mainFd, dir1, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (auto& dir2: sandstorm::listDirectoryFd(fd1)) {
+      result += sandstorm::listDirectoryFd(
+          sandstorm::raiiOpenAt(fd1, dir2, O_RDONLY | O_DIRECTORY | O_CLOEXEC)).size();
+    }
+  }
+  return result;
+}
+
 KJ_TEST("basic assignables") {
   StorageTestFixture env;
 
@@ -203,7 +219,7 @@ KJ_TEST("delete some children") {
   auto deathRow = sandstorm::raiiOpenAt(testTempdir.fd, "death-row",
       O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-  KJ_EXPECT(sandstorm::listDirectoryFd(main).size() == 4);
+  KJ_EXPECT(countObjects(main) == 4);
   KJ_EXPECT(sandstorm::listDirectoryFd(deathRow).size() == 0);
 
   OwnedAssignable<TestStoredObject>::Client zombie = ({
@@ -225,7 +241,7 @@ KJ_TEST("delete some children") {
   env.io.provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(env.io.waitScope);
 
   // Verify that tree was deleted. We'll need to give the death-row deleter thread some time, too.
-  KJ_EXPECT(sandstorm::listDirectoryFd(main).size() == 2);
+  KJ_EXPECT(countObjects(main) == 2);
   KJ_EXPECT(sandstorm::listDirectoryFd(deathRow).size() == 0);
 
   // Try overwriting our zombie reference.
@@ -236,7 +252,7 @@ KJ_TEST("delete some children") {
   }
 
   // That shouldn't have added a file to main.
-  KJ_EXPECT(sandstorm::listDirectoryFd(main).size() == 2);
+  KJ_EXPECT(countObjects(main) == 2);
 
   // It adds a file directly to death row, which should get cleaned up.
   env.io.provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(env.io.waitScope);
@@ -260,7 +276,7 @@ KJ_TEST("delete volume child while still writing") {
   auto deathRow = sandstorm::raiiOpenAt(testTempdir.fd, "death-row",
       O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-  KJ_EXPECT(sandstorm::listDirectoryFd(main).size() == 2);
+  KJ_EXPECT(countObjects(main) == 2);
   KJ_EXPECT(sandstorm::listDirectoryFd(deathRow).size() == 0);
 
   // Set root.sub2 to (volume = (some new volume)).
@@ -296,7 +312,7 @@ KJ_TEST("delete volume child while still writing") {
   env.io.provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(env.io.waitScope);
 
   // Verify that tree was deleted. We'll need to give the death-row deleter thread some time, too.
-  KJ_EXPECT(sandstorm::listDirectoryFd(main).size() == 2);
+  KJ_EXPECT(countObjects(main) == 2);
   KJ_EXPECT(sandstorm::listDirectoryFd(deathRow).size() == 0);
 
   // Try writing to our volume. It takes several writes before a size update is triggered, which
@@ -313,6 +329,76 @@ KJ_TEST("delete volume child while still writing") {
   KJ_EXPECT(root.getStorageUsageRequest().send().wait(env.io.waitScope).getTotalBytes() == 4096*2);
 }
 
+KJ_TEST("transitive sizes are updated immediately and persisted on shutdown") {
+  uint64_t size;
+
+  {
+    StorageTestFixture env;
+
+    auto volume = env.factory.newVolumeRequest().send().getVolume();
+    env.setRoot("sized", env.newObject([&](auto value) {
+      value.setText("sized");
+      value.setVolume(volume);
+    }));
+    auto root = env.getRoot("sized");
+
+    uint64_t initial = root.getStorageUsageRequest().send().wait(env.io.waitScope).getTotalBytes();
+
+    // Enough writes to trigger several size updates; these are batched into one flush.
+    for (auto i: kj::range(0, 512)) {
+      auto req = volume.writeRequest();
+      req.setBlockNum(i * 8);
+      auto data = req.initData(Volume::BLOCK_SIZE * 8);
+      memset(data.begin(), 12, data.size());
+      req.send().wait(env.io.waitScope);
+    }
+
+    size = root.getStorageUsageRequest().send().wait(env.io.waitScope).getTotalBytes();
+    KJ_EXPECT(size >= initial + 4096 * 3000, initial, size);
+  }
+
+  // Destroying the storage flushed the sizes, so a fresh instance reads the same from disk.
+  StorageTestFixture env;
+  auto root = env.getRoot("sized");
+  KJ_EXPECT(root.getStorageUsageRequest().send().wait(env.io.waitScope).getTotalBytes() == size);
+}
+
+KJ_TEST("transitive sizes of objects dropped before the flush are not lost") {
+  uint64_t size;
+
+  {
+    StorageTestFixture env;
+
+    {
+      auto volume = env.factory.newVolumeRequest().send().getVolume();
+      env.setRoot("dropped", env.newObject([&](auto value) {
+        value.setText("dropped");
+        value.setVolume(volume);
+      }));
+      auto root = env.getRoot("dropped");
+
+      for (auto i: kj::range(0, 64)) {
+        auto req = volume.writeRequest();
+        req.setBlockNum(i * 8);
+        auto data = req.initData(Volume::BLOCK_SIZE * 8);
+        memset(data.begin(), 34, data.size());
+        req.send().wait(env.io.waitScope);
+      }
+
+      size = root.getStorageUsageRequest().send().wait(env.io.waitScope).getTotalBytes();
+      KJ_EXPECT(size >= 4096 * 512, size);
+    }
+
+    // Both objects are gone from memory now, but the flush that follows must still write their
+    // sizes.
+    env.io.provider->getTimer().afterDelay(2 * kj::SECONDS).wait(env.io.waitScope);
+  }
+
+  StorageTestFixture env;
+  auto root = env.getRoot("dropped");
+  KJ_EXPECT(root.getStorageUsageRequest().send().wait(env.io.waitScope).getTotalBytes() == size);
+}
+
 // =======================================================================================
 
 struct TestByteStream final: public sandstorm::ByteStream::Server, public kj::Refcounted {
@@ -640,7 +726,942 @@ KJ_TEST("blob interleaved initialization partial download with expected size") {
   KJ_EXPECT(KJ_ASSERT_NONNULL(stream->expectedSize) == 2);
 }
 
-// TODO(test): journal recovery
+KJ_TEST("assignable whenChanged") {
+  StorageTestFixture env;
+
+  env.setRoot("watched", env.newTextObject("foo"));
+  auto object = env.getRoot("watched");
+
+  auto response = object.getWithVersionRequest().send().wait(env.io.waitScope);
+  KJ_EXPECT(response.getValue().getText() == "foo");
+  uint64_t version = response.getVersion();
+
+  auto watch = object.whenChangedRequest();
+  watch.setVersion(version);
+  auto changed = watch.send().then([](auto&& response) {
+    return kj::Maybe<uint64_t>(response.getVersion());
+  }).fork();
+
+  // Nothing has changed yet, so the request should still be pending.
+  KJ_EXPECT(changed.addBranch().exclusiveJoin(
+      env.io.provider->getTimer().afterDelay(10 * kj::MILLISECONDS)
+          .then([]() -> kj::Maybe<uint64_t> { return nullptr; }))
+      .wait(env.io.waitScope) == nullptr);
+
+  {
+    auto req = response.getSetter().setRequest();
+    req.initValue().setText("bar");
+    req.send().wait(env.io.waitScope);
+  }
+
+  uint64_t newVersion = KJ_ASSERT_NONNULL(changed.addBranch().wait(env.io.waitScope));
+  KJ_EXPECT(newVersion > version);
+
+  // A stale version returns immediately.
+  {
+    auto req = object.whenChangedRequest();
+    req.setVersion(version);
+    KJ_EXPECT(req.send().wait(env.io.waitScope).getVersion() == newVersion);
+  }
+
+  // getWithVersion() reports the same versions as whenChanged().
+  KJ_EXPECT(object.getWithVersionRequest().send().wait(env.io.waitScope).getVersion() ==
+            newVersion);
+}
+
+class TestObserver: public Assignable<TestStoredObject>::Observer::Server {
+public:
+  kj::Vector<kj::String> seen;
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> blocker;
+
+protected:
+  kj::Promise<void> changed(ChangedContext context) override {
+    seen.add(kj::str(context.getParams().getValue().getText()));
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    blocker = kj::mv(paf.fulfiller);
+    return kj::mv(paf.promise);
+  }
+};
+
+KJ_TEST("assignable observers coalesce changes") {
+  StorageTestFixture env;
+
+  env.setRoot("observed", env.newTextObject("foo"));
+  auto object = env.getRoot("observed");
+
+  auto observerImpl = kj::heap<TestObserver>();
+  auto& observer = *observerImpl;
+  Assignable<TestStoredObject>::Observer::Client observerCap = kj::mv(observerImpl);
+  auto req = object.observeRequest();
+  req.setObserver(observerCap);
+  req.setVersion(0);
+  auto handle = req.send().wait(env.io.waitScope).getHandle();
+
+  auto waitForCallbacks = [&]() {
+    env.io.provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(env.io.waitScope);
+  };
+  auto set = [&](kj::StringPtr text) {
+    auto req = object.asSetterRequest().send().getSetter().setRequest();
+    req.initValue().setText(text);
+    req.send().wait(env.io.waitScope);
+  };
+
+  // Version zero means we get the current value right away.
+  waitForCallbacks();
+  KJ_ASSERT(observer.seen.size() == 1);
+  KJ_EXPECT(observer.seen[0] == "foo");
+
+  // While the observer is busy, several sets collapse into one notification with the latest value.
+  set("bar");
+  set("baz");
+  waitForCallbacks();
+  KJ_EXPECT(observer.seen.size() == 1);
+
+  KJ_ASSERT_NONNULL(observer.blocker)->fulfill();
+  waitForCallbacks();
+  KJ_ASSERT(observer.seen.size() == 2);
+  KJ_EXPECT(observer.seen[1] == "baz");
+
+  // Dropping the handle stops notifications.
+  handle = nullptr;
+  KJ_ASSERT_NONNULL(observer.blocker)->fulfill();
+  set("qux");
+  waitForCallbacks();
+  KJ_EXPECT(observer.seen.size() == 2);
+}
+
+KJ_TEST("objects migrate out of the flat layout") {
+  KJ_SYSCALL(mkdirat(testTempdir.fd, "layout", 0777));
+  auto dirFd = sandstorm::raiiOpenAt(testTempdir.fd, "layout", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  auto io = kj::setupAsyncIo();
+
+  auto newStorage = [&]() -> StorageRootSet::Client {
+    return kj::heap<FilesystemStorage>(dirFd, io.unixEventPort, io.provider->getTimer(), nullptr);
+  };
+
+  {
+    StorageRootSet::Client storage = newStorage();
+    auto factory = storage.getFactoryRequest().send().getFactory();
+    auto req = factory.newAssignableRequest<TestStoredObject>();
+    req.getInitialValue().setText("foo");
+    auto setReq = storage.setRequest<Assignable<TestStoredObject>>();
+    setReq.setName("root");
+    setReq.setObject(req.send().getAssignable());
+    setReq.send().wait(io.waitScope);
+    io.provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(io.waitScope);
+  }
+
+  // Rewrite into the old layout: every object directly under main/, and no marker.
+  auto mainFd = sandstorm::raiiOpenAt(dirFd, "main", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  uint count = 0;
+  for (auto& dir1: sandstorm::listDirectoryFd(mainFd)) {
+    if (dir1 == ".sharded") {
+      KJ_SYSCALL(unlinkat(mainFd, dir1.cStr(), 0));
+      continue;
+    }
+    for (auto& dir2: sandstorm::listDirectoryFd(
+        sandstorm::raiiOpenAt(mainFd, dir1, O_RDONLY | O_DIRECTORY | O_CLOEXEC))) {
+      auto path = kj::str(dir1, '/', dir2);
+      for (auto& file: sandstorm::listDirectoryFd(
+          sandstorm::raiiOpenAt(mainFd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC))) {
+        KJ_SYSCALL(renameat(mainFd, kj::str(path, '/', file).cStr(), mainFd, file.cStr()));
+        ++count;
+      }
+    }
+  }
+  KJ_ASSERT(count > 0);
+
+  {
+    StorageRootSet::Client storage = newStorage();
+    auto req = storage.getRequest<Assignable<TestStoredObject>>();
+    req.setName("root");
+    auto object = req.send().getObject().castAs<Assignable<TestStoredObject>>();
+    auto response = object.getRequest().send().wait(io.waitScope);
+    KJ_EXPECT(response.getValue().getText() == "foo");
+
+    bool done = false;
+    for (uint i = 0; i < 1000 && !done; i++) {
+      io.provider->getTimer().afterDelay(1 * kj::MILLISECONDS).wait(io.waitScope);
+      done = faccessat(mainFd, ".sharded", F_OK, 0) == 0;
+    }
+    KJ_ASSERT(done, "migration didn't finish");
+
+    for (auto& name: sandstorm::listDirectoryFd(mainFd)) {
+      KJ_EXPECT(name.size() <= 2 || name == ".sharded", name);
+    }
+
+    // Still readable, and writable, after migration.
+    {
+      auto req = response.getSetter().setRequest();
+      req.initValue().setText("bar");
+      req.send().wait(io.waitScope);
+    }
+    KJ_EXPECT(object.getRequest().send().wait(io.waitScope).getValue().getText() == "bar");
+  }
+}
+
+KJ_TEST("volumes can be stored in a block store") {
+  KJ_SYSCALL(mkdirat(testTempdir.fd, "block-store", 0777));
+  auto dirFd = sandstorm::raiiOpenAt(testTempdir.fd, "block-store",
+                                     O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  LocalBlockShard::format(
+      sandstorm::raiiOpenAt(dirFd, "blocks", O_RDWR | O_CREAT | O_CLOEXEC),
+      { { 123, 456 } }, { 12, 8, 10 });
+  auto io = kj::setupAsyncIo();
+
+  auto newStorage = [&]() -> StorageRootSet::Client {
+    return kj::heap<FilesystemStorage>(dirFd, io.unixEventPort, io.provider->getTimer(), nullptr);
+  };
+
+  {
+    StorageRootSet::Client storage = newStorage();
+    auto factory = storage.getFactoryRequest().send().getFactory();
+    auto volume = factory.newVolumeRequest().send().getVolume();
+
+    {
+      auto req = volume.writeRequest();
+      req.setBlockNum(10);
+      auto data = req.initData(Volume::BLOCK_SIZE * 2);
+      memset(data.begin(), 'a', Volume::BLOCK_SIZE);
+      memset(data.begin() + Volume::BLOCK_SIZE, 0, Volume::BLOCK_SIZE);
+      req.send().wait(io.waitScope);
+    }
+    volume.syncRequest().send().wait(io.waitScope);
+
+    auto req = factory.newAssignableRequest<TestStoredObject>();
+    req.getInitialValue().setText("volume");
+    req.getInitialValue().setVolume(volume);
+    auto setReq = storage.setRequest<Assignable<TestStoredObject>>();
+    setReq.setName("root");
+    setReq.setObject(req.send().getAssignable());
+    setReq.send().wait(io.waitScope);
+  }
+
+  {
+    StorageRootSet::Client storage = newStorage();
+    auto req = storage.getRequest<Assignable<TestStoredObject>>();
+    req.setName("root");
+    auto object = req.send().getObject().castAs<Assignable<TestStoredObject>>();
+    auto volume = object.getRequest().send().wait(io.waitScope).getValue().getVolume();
+
+    auto readReq = volume.readRequest();
+    readReq.setBlockNum(9);
+    readReq.setCount(3);
+    auto response = readReq.send().wait(io.waitScope);
+    auto data = response.getData();
+    KJ_ASSERT(data.size() == Volume::BLOCK_SIZE * 3);
+    for (uint i = 0; i < data.size(); i++) {
+      byte expected = i / Volume::BLOCK_SIZE == 1 ? 'a' : 0;
+      KJ_ASSERT(data[i] == expected, i);
+    }
+  }
+
+  // After a restart, only the adopted volume's block is left, since the all-zero one was never
+  // stored.
+  LocalBlockShard shard(sandstorm::raiiOpenAt(dirFd, "blocks", O_RDWR | O_CLOEXEC));
+  KJ_EXPECT(shard.getGroups().size() == 1);
+  KJ_EXPECT(shard.getStats().blocksUsed == 1);
+}
+
+KJ_TEST("volumes can be cloned from a template") {
+  StorageTestFixture env;
+
+  // Add a template of our own: two 'a' blocks at 3 and one 'b' block at 100.
+  {
+    auto templatesFd = sandstorm::raiiOpenAt(testTempdir.fd, "templates",
+                                             O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    auto fd = sandstorm::raiiOpenAt(templatesFd, "test",
+                                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+    byte block[Volume::BLOCK_SIZE];
+    memset(block, 'a', sizeof(block));
+    KJ_SYSCALL(pwrite(fd, block, sizeof(block), 3 * Volume::BLOCK_SIZE));
+    KJ_SYSCALL(pwrite(fd, block, sizeof(block), 4 * Volume::BLOCK_SIZE));
+    memset(block, 'b', sizeof(block));
+    KJ_SYSCALL(pwrite(fd, block, sizeof(block), 100 * Volume::BLOCK_SIZE));
+  }
+
+  auto newVolume = [&](kj::StringPtr templateId) {
+    auto req = env.factory.newVolumeFromTemplateRequest();
+    req.setTemplateId(templateId);
+    return req.send().getVolume();
+  };
+  auto read = [&](Volume::Client& volume, uint32_t blockNum) {
+    auto req = volume.readRequest();
+    req.setBlockNum(blockNum);
+    auto response = req.send().wait(env.io.waitScope);
+    return kj::heapArray<byte>(response.getData());
+  };
+
+  auto volume = newVolume("test");
+  KJ_EXPECT(read(volume, 2)[0] == 0);
+  KJ_EXPECT(read(volume, 3)[0] == 'a');
+  KJ_EXPECT(read(volume, 4)[Volume::BLOCK_SIZE - 1] == 'a');
+  KJ_EXPECT(read(volume, 100)[0] == 'b');
+  KJ_EXPECT(read(volume, 101)[0] == 0);
+
+  // Writing to the clone leaves the template alone.
+  {
+    auto req = volume.writeRequest();
+    req.setBlockNum(3);
+    memset(req.initData(Volume::BLOCK_SIZE).begin(), 'c', Volume::BLOCK_SIZE);
+    req.send().wait(env.io.waitScope);
+  }
+  KJ_EXPECT(read(volume, 3)[0] == 'c');
+  auto volume2 = newVolume("test");
+  KJ_EXPECT(read(volume2, 3)[0] == 'a');
+
+  // The built-in template starts with an ext4 superblock.
+  auto ext4 = newVolume("blank-ext4");
+  auto superblock = read(ext4, 0);
+  KJ_EXPECT(superblock[1024 + 0x38] == 0x53 && superblock[1024 + 0x39] == 0xef);
+
+  KJ_EXPECT_THROW_MESSAGE("no such volume template",
+      newVolume("nonexistent").whenResolved().wait(env.io.waitScope));
+  KJ_EXPECT_THROW_MESSAGE("invalid template ID",
+      newVolume("../main").whenResolved().wait(env.io.waitScope));
+}
+
+KJ_TEST("template volumes share blocks through the block store") {
+  // Reuses the block store from "volumes can be stored in a block store".
+  auto dirFd = sandstorm::raiiOpenAt(testTempdir.fd, "block-store",
+                                     O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  auto io = kj::setupAsyncIo();
+  StorageRootSet::Client storage = kj::heap<FilesystemStorage>(
+      dirFd, io.unixEventPort, io.provider->getTimer(), nullptr);
+  auto factory = storage.getFactoryRequest().send().getFactory();
+
+  // A template with an 'a' block at 3 and a 'b' block at 100.
+  auto templatesFd = sandstorm::raiiOpenAt(dirFd, "templates",
+                                           O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  {
+    auto fd = sandstorm::raiiOpenAt(templatesFd, "shared",
+                                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+    byte block[Volume::BLOCK_SIZE];
+    memset(block, 'a', sizeof(block));
+    KJ_SYSCALL(pwrite(fd, block, sizeof(block), 3 * Volume::BLOCK_SIZE));
+    memset(block, 'b', sizeof(block));
+    KJ_SYSCALL(pwrite(fd, block, sizeof(block), 100 * Volume::BLOCK_SIZE));
+  }
+
+  auto newVolume = [&]() {
+    auto req = factory.newVolumeFromTemplateRequest();
+    req.setTemplateId("shared");
+    return req.send().getVolume();
+  };
+  auto read = [&](Volume::Client& volume, uint32_t blockNum) {
+    auto req = volume.readRequest();
+    req.setBlockNum(blockNum);
+    auto response = req.send().wait(io.waitScope);
+    return response.getData()[0];
+  };
+
+  auto volume = newVolume();
+  KJ_EXPECT(read(volume, 2) == 0);
+  KJ_EXPECT(read(volume, 3) == 'a');
+  KJ_EXPECT(read(volume, 100) == 'b');
+  KJ_EXPECT(faccessat(templatesFd, ".shared.blocks", F_OK, 0) == 0);
+
+  // Overwriting or zeroing a shared block hides it from this volume only.
+  {
+    auto req = volume.writeRequest();
+    req.setBlockNum(3);
+    memset(req.initData(Volume::BLOCK_SIZE).begin(), 'c', Volume::BLOCK_SIZE);
+    req.send().wait(io.waitScope);
+  }
+  {
+    auto req = volume.zeroRequest();
+    req.setBlockNum(100);
+    req.send().wait(io.waitScope);
+  }
+  KJ_EXPECT(read(volume, 3) == 'c');
+  KJ_EXPECT(read(volume, 100) == 0);
+
+  auto volume2 = newVolume();
+  KJ_EXPECT(read(volume2, 3) == 'a');
+  KJ_EXPECT(read(volume2, 100) == 'b');
+}
+
+struct TestNode {
+  StorageRootSet::Client storage = nullptr;
+  StorageSibling::Client sibling = nullptr;
+  kj::Own<BackendSetImpl<StorageSibling>> siblingSet;
+};
+
+kj::Array<TestNode> startCluster(kj::AsyncIoContext& io, kj::ArrayPtr<const int> dirFds) {
+  // Starts a storage node in each directory, as if each were on its own machine.
+
+  auto nodes = kj::heapArray<TestNode>(dirFds.size());
+  for (uint i: kj::indices(nodes)) {
+    auto server = kj::heap<FilesystemStorage>(
+        dirFds[i], io.unixEventPort, io.provider->getTimer(), nullptr);
+    auto& serverRef = *server;
+    nodes[i].storage = kj::mv(server);
+    nodes[i].siblingSet = kj::refcounted<BackendSetImpl<StorageSibling>>();
+    nodes[i].sibling = serverRef.joinCluster(i, kj::addRef(*nodes[i].siblingSet));
+  }
+  for (auto& node: nodes) {
+    BackendSet<StorageSibling>::Client set = kj::addRef(*node.siblingSet);
+    auto req = set.resetRequest();
+    auto backends = req.initBackends(nodes.size());
+    for (uint i: kj::indices(nodes)) {
+      backends[i].setId(i);
+      backends[i].setBackend(nodes[i].sibling);
+    }
+    req.send().wait(io.waitScope);
+  }
+  return nodes;
+}
+
+void stopCluster(kj::AsyncIoContext& io, kj::Array<TestNode> nodes) {
+  // Each node's sibling set refers back to the node itself, so must be emptied to let it go.
+  for (auto& node: nodes) {
+    BackendSet<StorageSibling>::Client set = kj::addRef(*node.siblingSet);
+    set.resetRequest().send().wait(io.waitScope);
+  }
+}
+
+KJ_TEST("roots and refs span storage nodes") {
+  // Two storage nodes, each in its own directory as if on its own machine.
+  auto io = kj::setupAsyncIo();
+  KJ_SYSCALL(mkdirat(testTempdir.fd, "node0", 0777));
+  KJ_SYSCALL(mkdirat(testTempdir.fd, "node1", 0777));
+  auto dirFd0 = sandstorm::raiiOpenAt(testTempdir.fd, "node0", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  auto dirFd1 = sandstorm::raiiOpenAt(testTempdir.fd, "node1", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  int dirFds[2] = { dirFd0, dirFd1 };
+
+  auto getText = [&](Assignable<TestStoredObject>::Client object) {
+    return kj::heapString(object.getRequest().send().wait(io.waitScope).getValue().getText());
+  };
+  auto getRoot = [&](StorageRootSet::Client& storage, kj::StringPtr name) {
+    auto req = storage.getRequest<Assignable<TestStoredObject>>();
+    req.setName(name);
+    return req.send().getObject().castAs<OwnedAssignable<TestStoredObject>>();
+  };
+
+  {
+    auto nodes = startCluster(io, dirFds);
+
+    // Node 0 takes a root which node 1 created. Node 1 ends up holding it.
+    auto foreign = ({
+      auto req = nodes[1].storage.getFactoryRequest().send().getFactory()
+          .newAssignableRequest<TestStoredObject>();
+      req.getInitialValue().setText("from node 1");
+      req.send().getAssignable();
+    });
+    {
+      auto req = nodes[0].storage.setRequest<Assignable<TestStoredObject>>();
+      req.setName("foreign");
+      req.setObject(foreign);
+      req.send().wait(io.waitScope);
+    }
+    KJ_EXPECT(getText(getRoot(nodes[0].storage, "foreign")) == "from node 1");
+    KJ_EXPECT(getText(getRoot(nodes[1].storage, "foreign")) == "from node 1");
+
+    // Node 0 redirects lookups of that name to node 1.
+    auto locate = [&](StorageRootSet::Client& storage, kj::StringPtr name) {
+      auto req = storage.locateRequest();
+      req.setName(name);
+      return req.send().wait(io.waitScope).getNode();
+    };
+    KJ_EXPECT(locate(nodes[0].storage, "foreign") == 1);
+    KJ_EXPECT(locate(nodes[1].storage, "foreign") == 1);
+    KJ_EXPECT(locate(nodes[0].storage, "nonexistent") == 0);
+
+    // An object on node 0 can refer to it -- weakly -- but not own it.
+    auto weakRef = foreign.getPersistentWeakRefRequest().send().getRef();
+    {
+      auto req = nodes[0].storage.getFactoryRequest().send().getFactory()
+          .newAssignableRequest<TestStoredObject>();
+      req.getInitialValue().setText("on node 0");
+      req.getInitialValue().setRef(weakRef);
+      auto setReq = nodes[0].storage.setRequest<Assignable<TestStoredObject>>();
+      setReq.setName("local");
+      setReq.setObject(req.send().getAssignable());
+      setReq.send().wait(io.waitScope);
+    }
+    {
+      auto req = nodes[0].storage.getFactoryRequest().send().getFactory()
+          .newAssignableRequest<TestStoredObject>();
+      req.getInitialValue().setSub1(foreign);
+      KJ_EXPECT(kj::runCatchingExceptions([&]() { req.send().wait(io.waitScope); }) != nullptr,
+                "owned another node's object");
+    }
+
+    // Replacing a root held by node 1 with one of node 0's own objects lets node 1 drop it.
+    auto setText = [&](StorageRootSet::Client& factoryNode, kj::StringPtr name,
+                       kj::StringPtr text) {
+      auto req = factoryNode.getFactoryRequest().send().getFactory()
+          .newAssignableRequest<TestStoredObject>();
+      req.getInitialValue().setText(text);
+      auto setReq = nodes[0].storage.setRequest<Assignable<TestStoredObject>>();
+      setReq.setName(name);
+      setReq.setObject(req.send().getAssignable());
+      setReq.send().wait(io.waitScope);
+    };
+    setText(nodes[1].storage, "replaced", "old, on node 1");
+    KJ_EXPECT(locate(nodes[0].storage, "replaced") == 1);
+    setText(nodes[0].storage, "replaced", "new, on node 0");
+    KJ_EXPECT(locate(nodes[0].storage, "replaced") == 0);
+    KJ_EXPECT(getText(getRoot(nodes[0].storage, "replaced")) == "new, on node 0");
+    {
+      auto req = nodes[1].storage.tryGetRequest<Assignable<TestStoredObject>>();
+      req.setName("replaced");
+      KJ_EXPECT(!req.send().wait(io.waitScope).hasObject());
+    }
+
+    stopCluster(io, kj::mv(nodes));
+  }
+
+  {
+    // After a restart, both the forwarded root and the ref still lead to node 1's object.
+    auto nodes = startCluster(io, dirFds);
+    KJ_EXPECT(getText(getRoot(nodes[0].storage, "foreign")) == "from node 1");
+    auto local = getRoot(nodes[0].storage, "local").getRequest().send().wait(io.waitScope);
+    KJ_EXPECT(local.getValue().getText() == "on node 0");
+    KJ_EXPECT(getText(local.getValue().getRef()) == "from node 1");
+
+    // Removing the root through node 0 removes it from node 1.
+    {
+      auto req = nodes[0].storage.removeRequest();
+      req.setName("foreign");
+      req.send().wait(io.waitScope);
+    }
+    {
+      auto req = nodes[1].storage.tryGetRequest<Assignable<TestStoredObject>>();
+      req.setName("foreign");
+      KJ_EXPECT(!req.send().wait(io.waitScope).hasObject());
+    }
+
+    stopCluster(io, kj::mv(nodes));
+  }
+}
+
+KJ_TEST("roots migrate between storage nodes while in use") {
+  auto io = kj::setupAsyncIo();
+  KJ_SYSCALL(mkdirat(testTempdir.fd, "migrate0", 0777));
+  KJ_SYSCALL(mkdirat(testTempdir.fd, "migrate1", 0777));
+  auto dirFd0 = sandstorm::raiiOpenAt(testTempdir.fd, "migrate0",
+      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  auto dirFd1 = sandstorm::raiiOpenAt(testTempdir.fd, "migrate1",
+      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int dirFds[2] = { dirFd0, dirFd1 };
+
+  auto writeBlock = [&](Volume::Client volume, uint32_t blockNum, byte value) {
+    auto req = volume.writeRequest();
+    req.setBlockNum(blockNum);
+    memset(req.initData(Volume::BLOCK_SIZE).begin(), value, Volume::BLOCK_SIZE);
+    req.send().wait(io.waitScope);
+  };
+  auto readBlock = [&](Volume::Client volume, uint32_t blockNum) -> byte {
+    auto req = volume.readRequest();
+    req.setBlockNum(blockNum);
+    req.setCount(1);
+    return req.send().wait(io.waitScope).getData()[0];
+  };
+  auto getText = [&](Assignable<TestStoredObject>::Client object) {
+    return kj::heapString(object.getRequest().send().wait(io.waitScope).getValue().getText());
+  };
+  auto getRoot = [&](StorageRootSet::Client& storage, kj::StringPtr name) {
+    auto req = storage.getRequest<Assignable<TestStoredObject>>();
+    req.setName(name);
+    return req.send().getObject().castAs<OwnedAssignable<TestStoredObject>>();
+  };
+
+  {
+    auto nodes = startCluster(io, dirFds);
+
+    // A root on node 0 owning a child and a volume, which a grain is writing.
+    auto factory = nodes[0].storage.getFactoryRequest().send().getFactory();
+    OwnedVolume::Client volume = factory.newVolumeRequest().send().getVolume();
+    Volume::Client exclusive = volume.getExclusiveRequest().send().getExclusive();
+    writeBlock(exclusive, 3, 'a');
+    writeBlock(exclusive, 100000, 'b');
+    {
+      auto child = factory.newAssignableRequest<TestStoredObject>();
+      child.getInitialValue().setText("child");
+      auto req = factory.newAssignableRequest<TestStoredObject>();
+      req.getInitialValue().setText("root");
+      req.getInitialValue().setSub1(child.send().getAssignable());
+      req.getInitialValue().setVolume(volume);
+      auto setReq = nodes[0].storage.setRequest<Assignable<TestStoredObject>>();
+      setReq.setName("moving");
+      setReq.setObject(req.send().getAssignable());
+      setReq.send().wait(io.waitScope);
+    }
+
+    // The grain keeps writing during the migration. The write either lands before the final pass,
+    // and is carried over, or fails because the final pass took the volume away.
+    auto migration = ({
+      auto req = nodes[0].storage.migrateRequest();
+      req.setName("moving");
+      req.setToNode(1);
+      req.send();
+    });
+    bool lateWriteLanded = kj::runCatchingExceptions([&]() {
+      writeBlock(exclusive, 5, 'c');
+    }) == nullptr;
+    migration.wait(io.waitScope);
+
+    {
+      auto req = nodes[0].storage.locateRequest();
+      req.setName("moving");
+      KJ_EXPECT(req.send().wait(io.waitScope).getNode() == 1);
+    }
+
+    // Both nodes now lead to the copy on node 1.
+    for (auto& node: nodes) {
+      auto response = getRoot(node.storage, "moving").getRequest().send().wait(io.waitScope);
+      auto value = response.getValue();
+      KJ_EXPECT(value.getText() == "root");
+      KJ_EXPECT(getText(value.getSub1()) == "child");
+      KJ_EXPECT(readBlock(value.getVolume(), 3) == 'a');
+      KJ_EXPECT(readBlock(value.getVolume(), 100000) == 'b');
+      KJ_EXPECT(readBlock(value.getVolume(), 5) == (lateWriteLanded ? 'c' : 0));
+    }
+
+    // The grain has to get the volume again.
+    KJ_EXPECT(kj::runCatchingExceptions([&]() { writeBlock(exclusive, 6, 'd'); }) != nullptr,
+              "wrote through a capability to the migrated volume's original");
+
+    stopCluster(io, kj::mv(nodes));
+  }
+
+  {
+    // The forwarding record survives a restart.
+    auto nodes = startCluster(io, dirFds);
+    KJ_EXPECT(getText(getRoot(nodes[0].storage, "moving")) == "root");
+    stopCluster(io, kj::mv(nodes));
+  }
+}
+
+KJ_TEST("roots stay put as storage nodes join") {
+  auto io = kj::setupAsyncIo();
+  kj::AutoCloseFd dirs[3];
+  int dirFds[3];
+  for (uint i: kj::indices(dirs)) {
+    auto name = kj::str("grow", i);
+    KJ_SYSCALL(mkdirat(testTempdir.fd, name.cStr(), 0777));
+    dirs[i] = sandstorm::raiiOpenAt(testTempdir.fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dirFds[i] = dirs[i];
+  }
+
+  // Each name's home as the cluster grows. Roots are created at their home of the time.
+  //
+  //   name    1 node  2 nodes  3 nodes
+  //   root0   0       0        0
+  //   root6   0       1        1
+  //   root14  0       1        2        (node 1 never has it)
+  //   root24          1        2
+  //   root25          1        2        (with its object on node 0)
+  //   root2                    2        (never created before)
+  KJ_ASSERT(homeAmong("root0", 3) == 0);
+  KJ_ASSERT(homeAmong("root6", 2) == 1 && homeAmong("root6", 3) == 1);
+  KJ_ASSERT(homeAmong("root14", 2) == 1 && homeAmong("root14", 3) == 2);
+  KJ_ASSERT(homeAmong("root24", 2) == 1 && homeAmong("root24", 3) == 2);
+  KJ_ASSERT(homeAmong("root25", 2) == 1 && homeAmong("root25", 3) == 2);
+  KJ_ASSERT(homeAmong("root2", 3) == 2);
+
+  auto setText = [&](StorageRootSet::Client& home, StorageRootSet::Client& factoryNode,
+                     kj::StringPtr name, kj::StringPtr text) {
+    auto req = factoryNode.getFactoryRequest().send().getFactory()
+        .newAssignableRequest<TestStoredObject>();
+    req.getInitialValue().setText(text);
+    auto setReq = home.setRequest<Assignable<TestStoredObject>>();
+    setReq.setName(name);
+    setReq.setObject(req.send().getAssignable());
+    setReq.send().wait(io.waitScope);
+  };
+  auto getOrCreateText = [&](StorageRootSet::Client& home, kj::StringPtr name) {
+    auto req = home.getOrCreateAssignableRequest<TestStoredObject>();
+    req.setName(name);
+    req.initDefaultValue().setText("created");
+    auto object = req.send().getObject();
+    return kj::heapString(object.getRequest().send().wait(io.waitScope).getValue().getText());
+  };
+  auto locate = [&](StorageRootSet::Client& home, kj::StringPtr name) {
+    auto req = home.locateRequest();
+    req.setName(name);
+    return req.send().wait(io.waitScope).getNode();
+  };
+  auto remove = [&](StorageRootSet::Client& home, kj::StringPtr name) {
+    auto req = home.removeRequest();
+    req.setName(name);
+    req.send().wait(io.waitScope);
+  };
+  auto has = [&](StorageRootSet::Client& node, kj::StringPtr name) {
+    auto req = node.tryGetRequest<Assignable<TestStoredObject>>();
+    req.setName(name);
+    return req.send().wait(io.waitScope).hasObject();
+  };
+
+  {
+    auto nodes = startCluster(io, kj::arrayPtr(dirFds, 1));
+    setText(nodes[0].storage, nodes[0].storage, "root0", "zero");
+    setText(nodes[0].storage, nodes[0].storage, "root6", "six");
+    setText(nodes[0].storage, nodes[0].storage, "root14", "fourteen");
+    stopCluster(io, kj::mv(nodes));
+  }
+
+  {
+    auto nodes = startCluster(io, kj::arrayPtr(dirFds, 2));
+    setText(nodes[1].storage, nodes[1].storage, "root24", "twenty-four");
+    setText(nodes[1].storage, nodes[0].storage, "root25", "twenty-five");
+    KJ_EXPECT(locate(nodes[1].storage, "root25") == 0);
+    stopCluster(io, kj::mv(nodes));
+  }
+
+  {
+    auto nodes = startCluster(io, kj::arrayPtr(dirFds, 3));
+
+    // Each root is found through its new home, rather than created afresh there.
+    KJ_EXPECT(getOrCreateText(nodes[0].storage, "root0") == "zero");
+    KJ_EXPECT(getOrCreateText(nodes[1].storage, "root6") == "six");
+    KJ_EXPECT(getOrCreateText(nodes[2].storage, "root14") == "fourteen");
+    KJ_EXPECT(getOrCreateText(nodes[2].storage, "root24") == "twenty-four");
+    KJ_EXPECT(getOrCreateText(nodes[2].storage, "root2") == "created");
+
+    // The new homes lead straight to the nodes holding the objects. For root25, which node 1
+    // forwarded, node 2 takes over the forwarding.
+    KJ_EXPECT(locate(nodes[1].storage, "root6") == 0);
+    KJ_EXPECT(locate(nodes[2].storage, "root14") == 0);
+    KJ_EXPECT(locate(nodes[2].storage, "root24") == 1);
+    KJ_EXPECT(locate(nodes[2].storage, "root25") == 0);
+    KJ_EXPECT(locate(nodes[2].storage, "root2") == 2);
+
+    // Removing or replacing a root through its new home lets the node holding it let go.
+    remove(nodes[1].storage, "root6");
+    KJ_EXPECT(!has(nodes[0].storage, "root6"));
+    KJ_EXPECT(!has(nodes[1].storage, "root6"));
+    setText(nodes[2].storage, nodes[2].storage, "root24", "replaced");
+    KJ_EXPECT(getOrCreateText(nodes[2].storage, "root24") == "replaced");
+    KJ_EXPECT(locate(nodes[2].storage, "root24") == 2);
+    KJ_EXPECT(!has(nodes[1].storage, "root24"));
+
+    // Node 1 dropped its forwarding record for root25, so once the root is removed, it's gone
+    // for good, and can be created afresh.
+    remove(nodes[2].storage, "root25");
+    KJ_EXPECT(!has(nodes[0].storage, "root25"));
+    KJ_EXPECT(getOrCreateText(nodes[2].storage, "root25") == "created");
+
+    stopCluster(io, kj::mv(nodes));
+  }
+
+  {
+    // What the new homes learned survives a restart.
+    auto nodes = startCluster(io, kj::arrayPtr(dirFds, 3));
+    KJ_EXPECT(locate(nodes[2].storage, "root14") == 0);
+    KJ_EXPECT(getOrCreateText(nodes[2].storage, "root14") == "fourteen");
+    stopCluster(io, kj::mv(nodes));
+  }
+}
+
+KJ_TEST("storage nodes replicate to a hot standby") {
+  auto io = kj::setupAsyncIo();
+  KJ_SYSCALL(mkdirat(testTempdir.fd, "replica0", 0777));
+  KJ_SYSCALL(mkdirat(testTempdir.fd, "replica1", 0777));
+  auto dirFd0 = sandstorm::raiiOpenAt(testTempdir.fd, "replica0",
+      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  auto dirFd1 = sandstorm::raiiOpenAt(testTempdir.fd, "replica1",
+      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  auto writeBlock = [&](Volume::Client volume, uint32_t blockNum, byte value) {
+    auto req = volume.writeRequest();
+    req.setBlockNum(blockNum);
+    memset(req.initData(Volume::BLOCK_SIZE).begin(), value, Volume::BLOCK_SIZE);
+    req.send().wait(io.waitScope);
+  };
+  auto readBlock = [&](Volume::Client volume, uint32_t blockNum) -> byte {
+    auto req = volume.readRequest();
+    req.setBlockNum(blockNum);
+    req.setCount(1);
+    return req.send().wait(io.waitScope).getData()[0];
+  };
+  auto getText = [&](Assignable<TestStoredObject>::Client object) {
+    return kj::heapString(object.getRequest().send().wait(io.waitScope).getValue().getText());
+  };
+  auto getRoot = [&](StorageRootSet::Client& storage, kj::StringPtr name) {
+    auto req = storage.getRequest<Assignable<TestStoredObject>>();
+    req.setName(name);
+    return req.send().getObject().castAs<OwnedAssignable<TestStoredObject>>();
+  };
+  auto setTextRoot = [&](StorageRootSet::Client& storage, kj::StringPtr name,
+                         kj::StringPtr text) {
+    auto req = storage.getFactoryRequest().send().getFactory()
+        .newAssignableRequest<TestStoredObject>();
+    req.getInitialValue().setText(text);
+    auto setReq = storage.setRequest<Assignable<TestStoredObject>>();
+    setReq.setName(name);
+    setReq.setObject(req.send().getAssignable());
+    setReq.send().wait(io.waitScope);
+  };
+
+  {
+    auto primaryServer = kj::heap<FilesystemStorage>(
+        dirFd0, io.unixEventPort, io.provider->getTimer(), nullptr);
+    auto& primaryRef = *primaryServer;
+    StorageRootSet::Client primary = kj::mv(primaryServer);
+    auto standbyServer = kj::heap<FilesystemStorage>(
+        dirFd1, io.unixEventPort, io.provider->getTimer(), nullptr);
+    auto& standbyRef = *standbyServer;
+    StorageRootSet::Client standby = kj::mv(standbyServer);
+    KJ_EXPECT(!standbyRef.wasPromoted());
+
+    // Roots which exist before the standby is attached reach it through the resync.
+    setTextRoot(primary, "early", "early");
+    setTextRoot(primary, "doomed", "doomed");
+
+    auto replicaSet = primaryRef.replicateTo(true);
+    StorageReplica::Client replica = standbyRef.asStandby();
+    {
+      auto req = replicaSet.addRequest();
+      req.setId(0);
+      req.setBackend(replica);
+      req.send().wait(io.waitScope);
+    }
+
+    // Changes made afterwards are shipped as they happen.
+    auto factory = primary.getFactoryRequest().send().getFactory();
+    OwnedVolume::Client volume = factory.newVolumeRequest().send().getVolume();
+    Volume::Client exclusive = volume.getExclusiveRequest().send().getExclusive();
+    writeBlock(exclusive, 3, 'a');
+    writeBlock(exclusive, 100000, 'b');
+    {
+      auto child = factory.newAssignableRequest<TestStoredObject>();
+      child.getInitialValue().setText("child");
+      auto req = factory.newAssignableRequest<TestStoredObject>();
+      req.getInitialValue().setText("root");
+      req.getInitialValue().setSub1(child.send().getAssignable());
+      req.getInitialValue().setVolume(volume);
+      auto setReq = primary.setRequest<Assignable<TestStoredObject>>();
+      setReq.setName("late");
+      setReq.setObject(req.send().getAssignable());
+      setReq.send().wait(io.waitScope);
+    }
+    setTextRoot(primary, "early", "changed");
+    {
+      auto req = primary.removeRequest();
+      req.setName("doomed");
+      req.send().wait(io.waitScope);
+    }
+    writeBlock(exclusive, 3, 'c');
+
+    // In synchronous mode, a sync returns only once the standby has everything before it.
+    exclusive.syncRequest().send().wait(io.waitScope);
+    replicaSet.resetRequest().send().wait(io.waitScope);
+
+    replica.promoteRequest().send().wait(io.waitScope);
+    KJ_EXPECT(standbyRef.wasPromoted());
+    KJ_EXPECT(kj::runCatchingExceptions([&]() {
+      replica.beginResyncRequest().send().wait(io.waitScope);
+    }) != nullptr, "promoted standby still accepts replication");
+
+    KJ_EXPECT(getText(getRoot(standby, "early")) == "changed");
+    KJ_EXPECT(kj::runCatchingExceptions([&]() { getText(getRoot(standby, "doomed")); })
+              != nullptr, "removed root survived on the standby");
+    auto response = getRoot(standby, "late").getRequest().send().wait(io.waitScope);
+    auto value = response.getValue();
+    KJ_EXPECT(value.getText() == "root");
+    KJ_EXPECT(getText(value.getSub1()) == "child");
+    KJ_EXPECT(readBlock(value.getVolume(), 3) == 'c');
+    KJ_EXPECT(readBlock(value.getVolume(), 100000) == 'b');
+  }
+
+  {
+    // The promotion survives a restart, along with the data.
+    auto storageServer = kj::heap<FilesystemStorage>(
+        dirFd1, io.unixEventPort, io.provider->getTimer(), nullptr);
+    KJ_EXPECT(storageServer->wasPromoted());
+    StorageRootSet::Client storage = kj::mv(storageServer);
+    KJ_EXPECT(getText(getRoot(storage, "early")) == "changed");
+  }
+}
+
+KJ_TEST("a large journal is replayed after a crash") {
+  auto io = kj::setupAsyncIo();
+  KJ_SYSCALL(mkdirat(testTempdir.fd, "replay", 0777));
+  auto dirFd = sandstorm::raiiOpenAt(testTempdir.fd, "replay",
+      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  auto getRoot = [&](StorageRootSet::Client& storage, kj::StringPtr name) {
+    auto req = storage.getRequest<Assignable<TestStoredObject>>();
+    req.setName(name);
+    return req.send().getObject().castAs<OwnedAssignable<TestStoredObject>>();
+  };
+
+  // Each chain is a root which owns a child, which owns a grandchild, so that most entries
+  // depend on the one creating their owner.
+  static constexpr uint CHAIN_COUNT = 400;
+
+  {
+    auto storageServer = kj::heap<FilesystemStorage>(
+        dirFd, io.unixEventPort, io.provider->getTimer(), nullptr);
+    storageServer->simulateCrash();
+    StorageRootSet::Client storage = kj::mv(storageServer);
+    auto factory = storage.getFactoryRequest().send().getFactory();
+
+    for (uint i = 0; i < CHAIN_COUNT; i++) {
+      auto grandchild = factory.newAssignableRequest<TestStoredObject>();
+      grandchild.getInitialValue().setText("grandchild");
+      auto child = factory.newAssignableRequest<TestStoredObject>();
+      child.getInitialValue().setText("child");
+      child.getInitialValue().setSub1(grandchild.send().getAssignable());
+      auto req = factory.newAssignableRequest<TestStoredObject>();
+      req.getInitialValue().setText(kj::str("chain", i));
+      req.getInitialValue().setSub1(child.send().getAssignable());
+      auto setReq = storage.setRequest<Assignable<TestStoredObject>>();
+      setReq.setName(kj::str("chain", i));
+      setReq.setObject(req.send().getAssignable());
+      setReq.send().wait(io.waitScope);
+    }
+
+    // Dropping the child of every other chain deletes its grandchild along with it.
+    for (uint i = 0; i < CHAIN_COUNT; i += 2) {
+      auto response = getRoot(storage, kj::str("chain", i)).getRequest().send()
+          .wait(io.waitScope);
+      auto req = response.getSetter().setRequest();
+      req.initValue().setText("pruned");
+      req.send().wait(io.waitScope);
+    }
+  }
+
+  // Enough for the replay to be split across threads (at least 1024 64-byte entries).
+  struct stat stats;
+  KJ_SYSCALL(fstatat(dirFd, "journal", &stats, 0));
+  KJ_EXPECT(stats.st_size >= 1024 * 64, stats.st_size);
+
+  {
+    StorageRootSet::Client storage = kj::heap<FilesystemStorage>(
+        dirFd, io.unixEventPort, io.provider->getTimer(), nullptr);
+
+    auto main = sandstorm::raiiOpenAt(dirFd, "main", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    auto staging = sandstorm::raiiOpenAt(dirFd, "staging", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    KJ_EXPECT(sandstorm::listDirectoryFd(staging).size() == 0);
+
+    // Death row deletes the pruned children and grandchildren asynchronously.
+    for (uint i = 0; i < 1000 && countObjects(main) != CHAIN_COUNT * 2; i++) {
+      io.provider->getTimer().afterDelay(1 * kj::MILLISECONDS).wait(io.waitScope);
+    }
+    KJ_EXPECT(countObjects(main) == CHAIN_COUNT * 2, countObjects(main));
+
+    for (uint i = 0; i < CHAIN_COUNT; i++) {
+      auto response = getRoot(storage, kj::str("chain", i)).getRequest().send()
+          .wait(io.waitScope);
+      auto value = response.getValue();
+      if (i % 2 == 0) {
+        KJ_EXPECT(value.getText() == "pruned", i);
+        KJ_EXPECT(!value.hasSub1(), i);
+      } else {
+        KJ_EXPECT(value.getText() == kj::str("chain", i));
+        auto child = value.getSub1().getRequest().send().wait(io.waitScope);
+        KJ_EXPECT(child.getValue().getText() == "child", i);
+        auto grandchild = child.getValue().getSub1().getRequest().send().wait(io.waitScope);
+        KJ_EXPECT(grandchild.getValue().getText() == "grandchild", i);
+      }
+    }
+  }
+}
+
 // TODO(test): recursive delete
 // TODO(test): volumes
 // TODO(test): outgoing SturdyRefs
@@ -15,20 +15,30 @@
 // limitations under the License.
 
 #include "fs-storage.h"
+#include "distributed-blocks.h"
+#include "sparse-stream.h"
+#include <blackrock/blank-ext4.capnp.h>
 #include <kj/debug.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <sodium/randombytes.h>
 #include <sodium/crypto_generichash_blake2b.h>
 #include <sandstorm/util.h>
 #include <capnp/serialize.h>
 #include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/syscall.h>
 #include <kj/thread.h>
 #include <kj/async-unix.h>
+#include <algorithm>
 #include <queue>
+#include <map>
+#include <set>
 #include <unordered_map>
 #include <unordered_set>
 #include <capnp/persistent.capnp.h>
@@ -67,6 +77,15 @@ void pwriteAll(int fd, const void* data, size_t size, off_t offset) {
   }
 }
 
+bool isAllZero(kj::ArrayPtr<const byte> block) {
+  const uint64_t* words = reinterpret_cast<const uint64_t*>(block.begin());
+  uint64_t bits = 0;
+  for (size_t i = 0; i < block.size() / sizeof(uint64_t); i++) {
+    bits |= words[i];
+  }
+  return bits == 0;
+}
+
 uint64_t getFileSize(int fd) {
   struct stat stats;
   KJ_SYSCALL(fstat(fd, &stats));
@@ -79,6 +98,51 @@ uint64_t getFileBlockCount(int fd) {
   return (stats.st_blocks * 512 + Volume::BLOCK_SIZE - 1) / Volume::BLOCK_SIZE;
 }
 
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)  // linux/fs.h only has this since 4.5
+#endif
+
+bool tryCloneFile(int fd, int sourceFd) {
+  // Makes `fd`'s content a copy of `sourceFd`'s by sharing the extents copy-on-write, which is
+  // quick. Returns false if the filesystem doesn't support reflinks (only btrfs and XFS do).
+
+  if (ioctl(fd, FICLONE, sourceFd) >= 0) return true;
+
+  int error = errno;
+  if (error != EOPNOTSUPP && error != ENOTTY && error != EINVAL && error != EXDEV) {
+    KJ_FAIL_SYSCALL("ioctl(FICLONE)", error);
+  }
+  return false;
+}
+
+void copySparseFile(int fd, int sourceFd) {
+  // Makes `fd`'s content a copy of `sourceFd`'s the slow way, skipping holes.
+
+  scanSparseFile(sourceFd, [&](uint64_t offset, kj::ArrayPtr<const byte> data) {
+    pwriteAll(fd, data.begin(), data.size(), offset);
+  });
+}
+
+struct TemplateBlock {
+  // A non-zero block of a volume template, kept in the block shard as an immutable block. Lists
+  // of these, in order of blockNum, are stored in templates/ and in template-based volumes. See
+  // StorageFactoryImpl::getTemplateBlocks().
+
+  uint64_t blockNum;
+  UInt256 ref;
+};
+
+kj::Array<TemplateBlock> readTemplateBlocks(int fd, uint64_t offset) {
+  // Reads a list of TemplateBlocks which makes up the rest of the file from `offset`.
+
+  uint64_t size = getFileSize(fd);
+  size = size > offset ? size - offset : 0;
+  KJ_REQUIRE(size % sizeof(TemplateBlock) == 0, "template block list is corrupt", size);
+  auto result = kj::heapArray<TemplateBlock>(size / sizeof(TemplateBlock));
+  preadAllOrZero(fd, result.begin(), size, offset);
+  return result;
+}
+
 uint64_t getFilePosition(int fd) {
   off_t offset;
   KJ_SYSCALL(offset = lseek(fd, 0, SEEK_CUR));
@@ -102,10 +166,71 @@ kj::Array<T> removeNulls(kj::Array<kj::Maybe<T>> array) {
 
 static constexpr uint64_t EVENTFD_MAX = (uint64_t)-2;
 
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+bool noRenameat2 = false;
+// Set the first time we find that the kernel or filesystem doesn't support renameat2().
+
+kj::Maybe<int> renameat2IfSupported(int oldDirFd, const char* oldPath,
+                                    int newDirFd, const char* newPath, uint flags) {
+  // Calls renameat2() (added in Linux 3.15; glibc only gained a wrapper much later), retrying on
+  // EINTR. Returns zero on success or the errno value on failure. Returns null if renameat2() or
+  // the given flags aren't supported here, in which case the caller needs to fall back to
+  // renameat() preceded by whatever checks the flags would have done atomically.
+
+#ifdef SYS_renameat2
+  while (!__atomic_load_n(&noRenameat2, __ATOMIC_RELAXED)) {
+    if (syscall(SYS_renameat2, oldDirFd, oldPath, newDirFd, newPath, flags) == 0) {
+      return 0;
+    }
+
+    int error = errno;
+    switch (error) {
+      case EINTR:
+        break;
+      case ENOSYS:
+      case EINVAL:
+        // Old kernel, or a filesystem which doesn't implement the flags.
+        KJ_LOG(WARNING, "renameat2() not supported; falling back to renameat()", error);
+        __atomic_store_n(&noRenameat2, true, __ATOMIC_RELAXED);
+        break;
+      default:
+        return error;
+    }
+  }
+#endif
+
+  return nullptr;
+}
+
+uint recoveryThreadCount() {
+  // Recovery is dominated by metadata syscalls which block on the disk, so it pays to split it
+  // more ways than there are cores. parallelFor() runs about one split per core at a time, but
+  // smaller splits balance better when some of them block.
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return kj::min(kj::max(cpus * 2, 4l), 32l);
+}
+
 typedef capnp::Persistent<SturdyRef, SturdyRef::Owner> StandardPersistent;
 typedef capnp::CallContext<StandardPersistent::SaveParams, StandardPersistent::SaveResults>
      StandardSaveContext;
 
+template <typename Context>
+struct ResultsOf {
+  // The results struct which `Context` fills in. For a capnp::CallContext, that's its results;
+  // anything else standing in for one must say, by declaring `Results`.
+
+  typedef typename Context::Results Type;
+};
+
+template <typename Params, typename Results>
+struct ResultsOf<capnp::CallContext<Params, Results>> {
+  typedef Results Type;
+};
+
 class RefcountedMallocMessageBuilder: public kj::Refcounted {
 public:
   template <typename T>
@@ -126,6 +251,52 @@ private:
   capnp::BuilderCapabilityTable capTable;
 };
 
+class BlockBitmap {
+  // A sparse set of block numbers, e.g. the blocks of a Volume written since some point. Bits are
+  // allocated a page -- covering 32768 blocks -- at a time.
+
+public:
+  void add(uint32_t first, uint32_t count) {
+    for (uint64_t block = first; block < uint64_t(first) + count; block++) {
+      uint64_t& word = pages[block / PAGE_BLOCKS].words[block % PAGE_BLOCKS / 64];
+      uint64_t bit = 1ull << (block % 64);
+      if ((word & bit) == 0) {
+        word |= bit;
+        ++size;
+      }
+    }
+  }
+
+  inline size_t getSize() const { return size; }
+
+  kj::Array<uint32_t> take() {
+    // Returns all the blocks in order, and clears the set.
+
+    auto result = kj::heapArrayBuilder<uint32_t>(size);
+    for (auto& page: pages) {
+      for (uint i = 0; i < kj::size(page.second.words); i++) {
+        uint64_t word = page.second.words[i];
+        for (uint bit = 0; word != 0; bit++, word >>= 1) {
+          if (word & 1) result.add(page.first * PAGE_BLOCKS + i * 64 + bit);
+        }
+      }
+    }
+    pages.clear();
+    size = 0;
+    return result.finish();
+  }
+
+private:
+  static constexpr uint PAGE_BLOCKS = 1 << 15;
+
+  struct Page {
+    uint64_t words[PAGE_BLOCKS / 64] = {};
+  };
+
+  std::map<uint32_t, Page> pages;
+  size_t size = 0;
+};
+
 template <size_t size>
 kj::StringPtr fixedStr(kj::FixedArray<char, size>& data) {
   return kj::StringPtr(data.begin(), size - 1);
@@ -195,6 +366,31 @@ kj::FixedArray<char, 24> FilesystemStorage::ObjectId::filename(char prefix) cons
   return result;
 }
 
+static constexpr size_t FLAT_NAME_SIZE = 23;
+// strlen(ObjectId::filename()).
+
+static kj::FixedArray<char, 29> shardName(const char* flatName) {
+  // Computes the sharded path for the given flat filename: the first directory level is named by
+  // the two characters after the prefix, the second by the third character. Note that, because
+  // filename() masks each digit with 0x37, only 32 distinct characters appear, so this makes 1024
+  // first-level and 32768 second-level directories. At 50M objects that's about 1500 entries per
+  // directory, while at 1M objects the directory blocks cost no more than the inodes themselves.
+
+  kj::FixedArray<char, 29> result;
+  char* output = result.begin();
+  *output++ = flatName[1];
+  *output++ = flatName[2];
+  *output++ = '/';
+  *output++ = flatName[3];
+  *output++ = '/';
+  memcpy(output, flatName, FLAT_NAME_SIZE + 1);
+  return result;
+}
+
+kj::FixedArray<char, 29> FilesystemStorage::ObjectId::shardedFilename(char prefix) const {
+  return shardName(filename(prefix).begin());
+}
+
 enum class FilesystemStorage::Type: uint8_t {
   // (zero skipped to help detect errors)
   BLOB = 1,
@@ -223,8 +419,15 @@ struct FilesystemStorage::Xattr {
   // either the stream is still uploading, or it failed to fully upload). Once set this
   // can never be unset.
 
-  byte reserved[2];
-  // Must be zero.
+  bool inBlockShard;
+  // For volumes, indicates that the blocks live in the LocalBlockShard, under mutable block IDs
+  // prefixed by the volume's ObjectId, rather than in the file itself. The file then contains
+  // just the ObjectId, so that death row can find the blocks to delete.
+
+  bool fromTemplate;
+  // For volumes in the block shard, indicates that the volume was made from a template, whose
+  // blocks the volume shares rather than copies. The file continues after the ObjectId with the
+  // template's TemplateBlocks, which fill in whatever blocks the volume hasn't written itself.
 
   uint32_t accountedBlockCount;
   // The number of 4k blocks consumed by this object the last time we considered it for
@@ -259,9 +462,19 @@ public:
     writeEvent(eventFd, 1);
   }
 
+  void sweepBlockGroups(kj::Array<UInt128> groups) {
+    // Has the deleter thread delete those of the given groups of blocks in the block shard whose
+    // volumes don't exist. Each deleteGroup() scans the whole hash table, so we don't want to do
+    // that on the event loop, let alone before storage can serve anything.
+
+    *groupsToSweep.lockExclusive() = kj::mv(groups);
+    writeEvent(eventFd, 1);
+  }
+
 private:
   FilesystemStorage& storage;
   kj::AutoCloseFd eventFd;
+  kj::MutexGuarded<kj::Array<UInt128>> groupsToSweep;
   kj::Thread thread;
 
   // TODO(perf): Replace use of eventFd in DeathRow and in Journal with a thread signaling
@@ -270,6 +483,8 @@ private:
   void doThread() {
     KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
       for (;;) {
+        sweep();
+
         // Scan directory, delete all files.
         auto files = sandstorm::listDirectoryFd(storage.deathRowFd);
         if (files.size() == 0) {
@@ -293,6 +508,12 @@ private:
               for (auto child: reader.getRoot<StoredChildIds>().getChildren()) {
                 storage.moveToDeathRowIfExists(child, false);
               };
+            } else if (xattr.type == Type::VOLUME && xattr.inBlockShard) {
+              ObjectId id = nullptr;
+              preadAllOrZero(fd, &id, sizeof(id), 0);
+              KJ_IF_MAYBE(shard, storage.blockShard) {
+                (*shard)->deleteGroup({ { id.id[0], id.id[1] } });
+              }
             }
             KJ_SYSCALL(unlinkat(storage.deathRowFd, file.cStr(), 0));
           }
@@ -306,8 +527,321 @@ private:
       abort();
     }
   }
+
+  void sweep() {
+    auto groups = kj::mv(*groupsToSweep.lockExclusive());
+    KJ_IF_MAYBE(shard, storage.blockShard) {
+      for (auto& group: groups) {
+        ObjectId id;
+        id.id[0] = group.value[0];
+        id.id[1] = group.value[1];
+        if (!storage.objectExists(id)) {
+          (*shard)->deleteGroup(group);
+        }
+      }
+    }
+  }
+};
+
+class FilesystemStorage::LayoutMigrator {
+  // Moves objects from the old flat layout of main/ into shard directories, in the background,
+  // while the storage is in use. Each object is moved with link() + unlink(), so readers always
+  // find it under one name or the other, and both names always refer to the same inode. Anything
+  // that modifies an object first finishes migrating it (see migrateFromLegacyLayout()), after
+  // which the flat name is gone and can't come back.
+
+public:
+  explicit LayoutMigrator(FilesystemStorage& storage)
+      : storage(storage),
+        thread([this]() { doThread(); }) {}
+
+  static constexpr const char* SHARDED_MARKER = ".sharded";
+  // Created in main/ once no flat-layout objects remain.
+
+  ~LayoutMigrator() noexcept(false) {
+    __atomic_store_n(&canceled, true, __ATOMIC_RELAXED);
+
+    // Now the destructor of the thread will wait for the thread to exit.
+  }
+
+private:
+  FilesystemStorage& storage;
+  bool canceled = false;
+  kj::Thread thread;
+
+  void doThread() {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      uint64_t total = 0;
+
+      // New objects are never created in the flat layout, so once a complete pass over the
+      // directory finds nothing to move, we're done. Objects moved during a pass may cause
+      // readdir() to skip or repeat entries, hence the need for a final clean pass.
+      for (;;) {
+        uint64_t moved = 0;
+
+        // Open a fresh description of the directory rather than dup()ing mainDirFd, so that we
+        // don't share its offset.
+        DIR* dir = fdopendir(sandstorm::raiiOpenAt(
+            storage.mainDirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC).release());
+        KJ_ASSERT(dir != nullptr);
+        KJ_DEFER(closedir(dir));
+
+        for (;;) {
+          if (__atomic_load_n(&canceled, __ATOMIC_RELAXED)) return;
+
+          errno = 0;
+          struct dirent* entry = readdir(dir);
+          if (entry == nullptr) {
+            int error = errno;
+            if (error != 0) {
+              KJ_FAIL_SYSCALL("readdir(main)", error);
+            }
+            break;
+          }
+
+          // Flat object files are exactly FLAT_NAME_SIZE characters starting with 'o'. Shard
+          // directories are shorter.
+          kj::StringPtr name = entry->d_name;
+          if (name.size() == FLAT_NAME_SIZE && name[0] == 'o') {
+            storage.migrateFromLegacyLayout(name);
+            ++moved;
+          }
+        }
+
+        total += moved;
+        if (moved == 0) break;
+      }
+
+      // Record that the migration is complete so that future startups skip it.
+      sandstorm::raiiOpenAt(storage.mainDirFd, SHARDED_MARKER, O_WRONLY | O_CREAT | O_CLOEXEC);
+      storage.sync();
+      __atomic_store_n(&storage.legacyLayout, false, __ATOMIC_RELAXED);
+
+      if (total > 0) {
+        KJ_LOG(INFO, "finished migrating storage to sharded layout", total);
+      }
+    })) {
+      // A failure here leaves the storage working in the legacy mode, which is slow but correct.
+      KJ_LOG(ERROR, "exception while migrating storage layout", *exception);
+    }
+  }
+};
+
+class FilesystemStorage::ColdMigrator {
+  // Every so often, evicts the blocks of Volumes which haven't been used for a while from the
+  // block shard to the cold store, leaving the local disk to active grains. A grain which starts
+  // up again faults its blocks back in as it reads them.
+
+public:
+  static constexpr uint CHECK_INTERVAL_SECONDS = 3600;
+  static constexpr kj::Duration IDLE_TIME = 24 * 3600 * kj::SECONDS;
+
+  explicit ColdMigrator(LocalBlockShard& shard)
+      : shard(shard),
+        eventFd(newEventFd(0, EFD_CLOEXEC)),
+        thread([this]() { doThread(); }) {}
+
+  ~ColdMigrator() noexcept(false) {
+    writeEvent(eventFd, 1);
+
+    // Now the destructor of the thread will wait for the thread to exit.
+  }
+
+private:
+  LocalBlockShard& shard;
+  kj::AutoCloseFd eventFd;
+  kj::Thread thread;
+
+  bool isCanceled(uint timeoutSeconds) {
+    // Wait up to the given time for the destructor to signal us.
+
+    struct pollfd pollFd;
+    memset(&pollFd, 0, sizeof(pollFd));
+    pollFd.fd = eventFd;
+    pollFd.events = POLLIN;
+    int n;
+    KJ_SYSCALL(n = poll(&pollFd, 1, timeoutSeconds * 1000));
+    return n > 0;
+  }
+
+  void doThread() {
+    while (!isCanceled(CHECK_INTERVAL_SECONDS)) {
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        uint64_t total = 0;
+        for (auto& group: shard.getIdleGroups(IDLE_TIME)) {
+          if (isCanceled(0)) break;
+          total += shard.evictGroup(group);
+        }
+
+        if (total > 0) {
+          // Free the local copies.
+          shard.sync();
+          KJ_LOG(INFO, "evicted idle volume blocks to cold storage", total);
+        }
+      })) {
+        // Probably the cold store is unreachable. Everything stays local meanwhile.
+        KJ_LOG(ERROR, "exception while evicting blocks to cold storage", *exception);
+      }
+    }
+  }
+};
+
+constexpr kj::Duration FilesystemStorage::ColdMigrator::IDLE_TIME;
+
+class FilesystemStorage::BlockingWorker {
+  // Runs calls which can block for a long time -- copying a whole volume image, say -- on a few
+  // threads of its own, so that the event loop keeps serving everything else meanwhile.
+
+public:
+  static constexpr uint THREAD_COUNT = 4;
+
+  explicit BlockingWorker(kj::UnixEventPort& eventPort)
+      : readyEventFd(newEventFd(0, EFD_CLOEXEC | EFD_SEMAPHORE)),
+        doneEventFd(newEventFd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+        doneEventFdObserver(eventPort, doneEventFd,
+            kj::UnixEventPort::FdObserver::OBSERVE_READ),
+        doneTask(doneLoop().eagerlyEvaluate([](kj::Exception&& exception) {
+          KJ_LOG(FATAL, "blocking worker loop threw exception", exception);
+          abort();
+        })),
+        threads(startThreads()) {}
+
+  ~BlockingWorker() noexcept(false) {
+    // Wake every thread to exit. Calls still queued are dropped, which breaks their promises.
+    queues.lockExclusive()->shuttingDown = true;
+    writeEvent(readyEventFd, threads.size());
+
+    // Now the destructors of the threads will wait for them to exit.
+  }
+
+  template <typename T>
+  kj::Promise<T> run(kj::Function<T()> func) {
+    // Calls func() on one of the threads, and returns its result back on the event loop. func()
+    // must not refer to anything that might go away if the promise is canceled: it runs anyway.
+
+    auto paf = kj::newPromiseAndFulfiller<T>();
+    auto job = kj::heap<JobImpl<T>>(kj::mv(func), kj::mv(paf.fulfiller));
+    queues.lockExclusive()->pending.push(kj::mv(job));
+    writeEvent(readyEventFd, 1);
+    return kj::mv(paf.promise);
+  }
+
+  kj::Promise<void> run(kj::Function<void()> func) {
+    return run<bool>([KJ_MVCAP(func)]() mutable {
+      func();
+      return true;
+    }).ignoreResult();
+  }
+
+private:
+  class Job {
+  public:
+    virtual ~Job() noexcept(false) {}
+    virtual void execute() = 0;
+    // Called on a worker thread.
+
+    virtual void finish() = 0;
+    // Called back on the event loop, which also destroys the Job, so func()'s captures are only
+    // ever destroyed there.
+  };
+
+  template <typename T>
+  class JobImpl final: public Job {
+  public:
+    JobImpl(kj::Function<T()> func, kj::Own<kj::PromiseFulfiller<T>> fulfiller)
+        : func(kj::mv(func)), fulfiller(kj::mv(fulfiller)) {}
+
+    void execute() override {
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() { result = func(); })) {
+        error = kj::mv(*exception);
+      }
+    }
+
+    void finish() override {
+      KJ_IF_MAYBE(exception, error) {
+        fulfiller->reject(kj::mv(*exception));
+      } else {
+        fulfiller->fulfill(kj::mv(KJ_ASSERT_NONNULL(result)));
+      }
+    }
+
+  private:
+    kj::Function<T()> func;
+    kj::Own<kj::PromiseFulfiller<T>> fulfiller;
+    kj::Maybe<T> result;
+    kj::Maybe<kj::Exception> error;
+  };
+
+  struct Queues {
+    std::queue<kj::Own<Job>> pending;
+    kj::Vector<kj::Own<Job>> done;
+    bool shuttingDown = false;
+  };
+
+  kj::MutexGuarded<Queues> queues;
+  kj::AutoCloseFd readyEventFd;
+  // Counts pending jobs, as a semaphore: each thread takes one job per event.
+
+  kj::AutoCloseFd doneEventFd;
+  kj::UnixEventPort::FdObserver doneEventFdObserver;
+  kj::Promise<void> doneTask;
+  kj::Array<kj::Own<kj::Thread>> threads;
+
+  kj::Array<kj::Own<kj::Thread>> startThreads() {
+    auto builder = kj::heapArrayBuilder<kj::Own<kj::Thread>>(THREAD_COUNT);
+    for (uint i = 0; i < THREAD_COUNT; i++) {
+      builder.add(kj::heap<kj::Thread>([this]() { doThread(); }));
+    }
+    return builder.finish();
+  }
+
+  void doThread() {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      for (;;) {
+        readEvent(readyEventFd);
+
+        kj::Own<Job> job;
+        {
+          auto lock = queues.lockExclusive();
+          if (lock->shuttingDown) break;
+          KJ_ASSERT(!lock->pending.empty());
+          job = kj::mv(lock->pending.front());
+          lock->pending.pop();
+        }
+
+        job->execute();
+        queues.lockExclusive()->done.add(kj::mv(job));
+        writeEvent(doneEventFd, 1);
+      }
+    })) {
+      KJ_LOG(FATAL, "exception in blocking worker thread", *exception);
+      abort();
+    }
+  }
+
+  kj::Promise<void> doneLoop() {
+    return doneEventFdObserver.whenBecomesReadable().then([this]() {
+      uint64_t count;
+      ssize_t n;
+      KJ_NONBLOCKING_SYSCALL(n = read(doneEventFd, &count, sizeof(count)));
+
+      // Even if that found nothing, whatever is done is ready to finish.
+      kj::Vector<kj::Own<Job>> done;
+      {
+        auto lock = queues.lockExclusive();
+        done = kj::mv(lock->done);
+      }
+      for (auto& job: done) {
+        job->finish();
+      }
+
+      return doneLoop();
+    });
+  }
 };
 
+constexpr uint FilesystemStorage::BlockingWorker::THREAD_COUNT;
+
 class FilesystemStorage::Journal {
   struct Entry;
 public:
@@ -368,6 +902,70 @@ public:
     return storage.createTempFile();
   }
 
+  kj::Maybe<Replicator&> getReplicator();
+  // The storage node's Replicator, if it is shipping its changes to a standby.
+
+  uint64_t getEnd() { return journalEnd; }
+
+  void simulateCrash() {
+    // See FilesystemStorage::simulateCrash().
+    __atomic_store_n(&crashed, true, __ATOMIC_RELAXED);
+  }
+
+  void gateOnReplica(kj::Maybe<uint64_t> acknowledged) {
+    // While non-null, a commit() doesn't resolve until the standby has acknowledged everything up
+    // to its end offset, in addition to it being synced here. The Replicator calls this again
+    // whenever the standby catches up further, and with null once it stops waiting on the
+    // standby.
+
+    replicaAcked = acknowledged;
+    fulfillSyncQueue();
+  }
+
+  kj::Promise<void> replay(kj::ArrayPtr<const byte> bytes,
+                           kj::Function<kj::Maybe<kj::AutoCloseFd>(uint64_t)> takeFile) {
+    // Commits a transaction shipped by another node's Replicator, i.e. entries in our own on-disk
+    // format, but whose `stagingId`s number files `takeFile()` returns (or zero, if the object
+    // was deleted by the time its turn came). Replaying entries already applied is harmless:
+    // whether each object is created or updated is decided by whether it exists now.
+
+    KJ_REQUIRE(bytes.size() % sizeof(Entry) == 0, "replicated transaction has partial entry");
+    auto entries = kj::heapArray<Entry>(bytes.size() / sizeof(Entry));
+    memcpy(entries.begin(), bytes.begin(), bytes.size());
+
+    Transaction txn(*this);
+    for (auto i: kj::indices(entries)) {
+      auto& entry = entries[i];
+      KJ_REQUIRE(entry.txSize == entries.size() - i, "replicated transaction is malformed");
+
+      switch (entry.type) {
+        case Entry::Type::CREATE_OBJECT:
+        case Entry::Type::UPDATE_OBJECT: {
+          if (entry.stagingId == 0) break;
+          auto maybeFd = takeFile(entry.stagingId);
+          auto& fd = KJ_REQUIRE_NONNULL(maybeFd,
+              "replicated transaction refers to unknown file", entry.stagingId);
+          Xattr oldXattr;
+          if (openObject(entry.objectId, oldXattr) == nullptr) {
+            txn.createObject(entry.objectId, entry.xattr, fd);
+          } else {
+            txn.updateObject(entry.objectId, entry.xattr, fd);
+          }
+          break;
+        }
+        case Entry::Type::UPDATE_XATTR:
+          txn.updateObjectXattr(entry.objectId, entry.xattr);
+          break;
+        case Entry::Type::MOVE_TO_DEATH_ROW:
+          txn.moveToDeathRow(entry.objectId);
+          break;
+        default:
+          KJ_FAIL_REQUIRE("replicated transaction has unknown entry type", (uint)entry.type);
+      }
+    }
+    return txn.commit();
+  }
+
   class Transaction: private kj::ExceptionCallback {
   public:
     explicit Transaction(Journal& journal): journal(journal) {
@@ -516,6 +1114,13 @@ public:
 
       KJ_REQUIRE(journal.txInProgress, "transaction already committed");
 
+      if (entries.empty()) {
+        // Nothing to write, which can happen when replay()ing a transaction whose objects are
+        // all gone.
+        journal.txInProgress = false;
+        return kj::READY_NOW;
+      }
+
       // Set `txSize` for all entries in the transaction.
       size_t i = entries.size();
       for (auto& entry: entries) {
@@ -533,6 +1138,8 @@ public:
 
       journal.txInProgress = false;
 
+      journal.replicate(entries.asPtr());
+
       // Arrange to be notified when sync completes.
       auto paf = kj::newPromiseAndFulfiller<void>();
       journal.syncQueue.push({journal.journalEnd, kj::mv(paf.fulfiller)});
@@ -566,6 +1173,8 @@ public:
   };
 
 private:
+  friend class Replicator;
+
   struct Entry {
     // In order to implement atomic transactions, we organize disk changes into a stream of
     // idempotent modifications. Each change is appended to the journal before being actually
@@ -689,6 +1298,12 @@ private:
   std::queue<SyncQueueEntry> syncQueue;
   kj::Promise<void> syncQueueTask;
 
+  kj::Maybe<uint64_t> replicaAcked;
+  // See gateOnReplica().
+
+  bool crashed = false;
+  // See simulateCrash(). Read by the processing thread.
+
   struct CacheDropQueueEntry {
     uint64_t offset;
     ObjectId objectId;
@@ -713,10 +1328,7 @@ private:
       } else {
         KJ_ASSERT(n == sizeof(byteCount), "eventfd read had unexpected size", n);
         journalSynced += byteCount;
-        while (!syncQueue.empty() && syncQueue.front().offset <= journalSynced) {
-          syncQueue.front().fulfiller->fulfill();
-          syncQueue.pop();
-        }
+        fulfillSyncQueue();
 
         while (!cacheDropQueue.empty() && cacheDropQueue.front().offset <= journalExecuted) {
           auto iter = cache.find(cacheDropQueue.front().objectId);
@@ -732,6 +1344,20 @@ private:
     });
   }
 
+  void fulfillSyncQueue() {
+    uint64_t durable = journalSynced;
+    KJ_IF_MAYBE(acked, replicaAcked) {
+      durable = kj::min(durable, *acked);
+    }
+    while (!syncQueue.empty() && syncQueue.front().offset <= durable) {
+      syncQueue.front().fulfiller->fulfill();
+      syncQueue.pop();
+    }
+  }
+
+  void replicate(kj::ArrayPtr<const Entry> entries);
+  // Hands a just-written transaction to the Replicator, if any.
+
   void doRecovery() {
     // Find the first actual data (skip leading hole).
   retry:
@@ -756,29 +1382,88 @@ private:
       preadAllOrZero(journalFd, entries.begin(), entries.asBytes().size(), position);
 
       // Process valid entries and discard any incomplete transaction.
-      for (auto& entry: validateEntries(entries, true)) {
-        executeEntry(entry);
-      }
+      replayEntries(validateEntries(entries, true));
     }
 
     storage.deleteAllStaging();
   }
 
-  void doProcessingThread() {
-    // This thread reads the journal, makes sure things are synced to disk, and actually executes
-    // the transactions.
-
-    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
-      // Get the current position from journalSynced rather than journalEnd since journalEnd could
-      // possibly have changed already, but journalSynced can't change until we signal back to the
-      // main thread.
-      uint64_t position = journalSynced;
+  static constexpr size_t PARALLEL_REPLAY_THRESHOLD = 1024;
+  // Journals with fewer entries than this are replayed serially; threads aren't worth it.
 
-      for (;;) {
-        // Wait for some data to read.
-        uint64_t count = readEvent(journalReadyEventFd);
+  void replayEntries(kj::ArrayPtr<const Entry> entries) {
+    // Executes entries recovered from the journal. Entries for different objects are independent,
+    // except that creating an object checks whether its owner exists. So, we group objects which
+    // are created under one another, and replay each group in journal order on one of several
+    // threads.
 
-        KJ_ASSERT(count > 0);
+    uint threadCount = recoveryThreadCount();
+    if (entries.size() < PARALLEL_REPLAY_THRESHOLD) {
+      for (auto& entry: entries) {
+        executeEntry(entry);
+      }
+      return;
+    }
+
+    // Union-find over object IDs.
+    std::unordered_map<ObjectId, ObjectId, ObjectId::Hash> parents;
+    auto find = [&](ObjectId id) {
+      for (;;) {
+        auto iter = parents.find(id);
+        if (iter == parents.end()) return id;
+        auto grandparent = parents.find(iter->second);
+        if (grandparent != parents.end()) {
+          iter->second = grandparent->second;  // path halving
+        }
+        id = iter->second;
+      }
+    };
+
+    for (auto& entry: entries) {
+      if (entry.type == Entry::Type::CREATE_OBJECT && entry.xattr.owner != nullptr) {
+        ObjectId group = find(entry.objectId);
+        ObjectId ownerGroup = find(entry.xattr.owner);
+        if (group != ownerGroup) {
+          parents[group] = ownerGroup;
+        }
+      }
+    }
+
+    auto buckets = kj::heapArray<kj::Vector<const Entry*>>(threadCount);
+    for (auto& entry: entries) {
+      buckets[ObjectId::Hash()(find(entry.objectId)) % threadCount].add(&entry);
+    }
+
+    KJ_LOG(INFO, "replaying journal", entries.size(), threadCount);
+
+    size_t done = 0;
+    size_t step = kj::max(entries.size() / 10, size_t(1));
+    parallelFor(threadCount, [&](uint i) {
+      for (auto entry: buckets[i]) {
+        executeEntry(*entry);
+        size_t n = __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+        if (n % step == 0) {
+          KJ_LOG(INFO, "journal replay progress", n, entries.size());
+        }
+      }
+    });
+  }
+
+  void doProcessingThread() {
+    // This thread reads the journal, makes sure things are synced to disk, and actually executes
+    // the transactions.
+
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      // Get the current position from journalSynced rather than journalEnd since journalEnd could
+      // possibly have changed already, but journalSynced can't change until we signal back to the
+      // main thread.
+      uint64_t position = journalSynced;
+
+      for (;;) {
+        // Wait for some data to read.
+        uint64_t count = readEvent(journalReadyEventFd);
+
+        KJ_ASSERT(count > 0);
 
         if (count == EVENTFD_MAX) {
           // Clean shutdown requested.
@@ -802,6 +1487,12 @@ private:
         uint64_t byteCount = entries.asBytes().size();
         writeEvent(journalProcessedEventFd, byteCount);
 
+        if (__atomic_load_n(&crashed, __ATOMIC_RELAXED)) {
+          // Leave them for the next startup to replay.
+          position += byteCount;
+          continue;
+        }
+
         // Now process them.
         for (auto& entry: validateEntries(entries, false)) {
           executeEntry(entry);
@@ -826,6 +1517,8 @@ private:
         }
       }
 
+      if (__atomic_load_n(&crashed, __ATOMIC_RELAXED)) return;
+
       // On clean shutdown, the journal is empty and we can discard it all.
       KJ_ASSERT(getFileSize(journalFd) == position, "journal not empty after clean shutdown");
       KJ_SYSCALL(ftruncate(journalFd, 0));
@@ -917,6 +1610,414 @@ private:
 
 // =======================================================================================
 
+static constexpr const char* STANDBY_PROMOTED_MESSAGE =
+    "storage standby was promoted; no longer replicating";
+// Description of the error a promoted standby returns to its old primary, from
+// ReplicaImpl::requireNotPromoted().
+
+class FilesystemStorage::Replicator: private kj::TaskSet::ErrorHandler {
+  // Ships everything this node changes to its hot standby, if it has one. See StorageReplica.
+  //
+  // Changes go into one queue and are shipped in order, one call at a time. The queue records
+  // only what changed; file contents are read when their turn comes. So, something written
+  // several times in a row may be shipped with its newer content, even more than once. That's
+  // fine since the standby only has to be right once the queue drains, and everything changed
+  // later is shipped again later.
+  //
+  // If shipping fails -- typically because the standby died -- we wait a bit and start over with
+  // a resync. In synchronous mode, commits keep waiting meanwhile, until a standby has caught up
+  // again, and objectSynced() fails: nothing is reported durable that the standby doesn't have.
+  // If the standby fails because it was promoted, the master has failed this node over, so we
+  // shut down rather than go on accepting writes nobody will see.
+
+public:
+  Replicator(FilesystemStorage& storage, bool synchronous)
+      : storage(storage), synchronous(synchronous), tasks(*this) {
+    if (synchronous) {
+      // Nothing is durable until the first standby has resynced.
+      acknowledged = storage.journal->getEnd();
+      storage.journal->gateOnReplica(acknowledged);
+    }
+  }
+
+  void setStandby(kj::Maybe<StorageReplica::Client> newStandby) {
+    // Starts shipping to `newStandby`, with a resync, abandoning whatever was being shipped to
+    // the previous one.
+
+    KJ_REQUIRE(newStandby == nullptr || storage.blockShard == nullptr,
+        "can't replicate a storage node with a block shard; shard blocks aren't shipped");
+
+    ++generation;
+    queue = decltype(queue)();
+    pumping = false;
+    caughtUp = false;
+    if (!synchronous) storage.journal->gateOnReplica(nullptr);
+
+    standby = kj::mv(newStandby);
+    if (standby != nullptr) {
+      enqueue([this](StorageReplica::Client standby) { return resync(kj::mv(standby)); });
+    }
+  }
+
+  void transactionCommitted(kj::Array<Journal::Entry> entries, uint64_t end) {
+    // `entries` were just written to the journal, ending at offset `end`.
+
+    uint64_t gen = generation;
+    enqueue([this,KJ_MVCAP(entries),end,gen](StorageReplica::Client standby) mutable {
+      return shipTransaction(kj::mv(standby), kj::mv(entries))
+          .then([this,end,gen]() {
+        if (gen == generation && caughtUp && synchronous) {
+          acknowledged = kj::max(acknowledged, end);
+          storage.journal->gateOnReplica(acknowledged);
+        }
+      });
+    });
+  }
+
+  void objectWritten(ObjectId id, uint64_t offset, uint64_t size) {
+    // A Volume or Blob was written in place, rather than through the journal.
+
+    enqueue([this,id,offset,size](StorageReplica::Client standby) -> kj::Promise<void> {
+      Xattr xattr;
+      KJ_IF_MAYBE(fd, storage.journal->openObject(id, xattr)) {
+        return shipData(kj::mv(standby), id, 0, kj::mv(*fd),
+                        kj::heapArray<Extent>({ { offset, size } }));
+      } else {
+        // Deleted since; a later transaction says so.
+        return kj::READY_NOW;
+      }
+    });
+  }
+
+  void objectZeroed(ObjectId id, uint64_t offset, uint64_t size) {
+    enqueue([id,offset,size](StorageReplica::Client standby) {
+      auto req = standby.zeroObjectRequest();
+      id.copyTo(req.initObject());
+      req.setOffset(offset);
+      req.setSize(size);
+      return req.send().ignoreResult();
+    });
+  }
+
+  kj::Promise<void> objectSynced(ObjectId id) {
+    // In synchronous mode, resolves once the standby has synced the object too -- and so has
+    // everything queued before it, including the rest of a resync in progress. Fails if there's
+    // no standby, or it fails meanwhile.
+
+    if (!synchronous) return kj::READY_NOW;
+    if (standby == nullptr) {
+      return KJ_EXCEPTION(DISCONNECTED, "storage standby is down; can't sync synchronously");
+    }
+
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    auto fulfiller = kj::mv(paf.fulfiller);
+    enqueue([id,KJ_MVCAP(fulfiller)](StorageReplica::Client standby) mutable {
+      auto req = standby.syncObjectRequest();
+      id.copyTo(req.initObject());
+      return req.send().then([KJ_MVCAP(fulfiller)](auto&&) mutable {
+        fulfiller->fulfill();
+      });
+    });
+    return paf.promise.catch_([](kj::Exception&&) -> kj::Promise<void> {
+      // The op was dropped because shipping failed.
+      return KJ_EXCEPTION(DISCONNECTED, "storage standby failed before syncing object");
+    });
+  }
+
+  void rootChanged(kj::StringPtr name) {
+    // The root file `name` was written or removed.
+
+    auto ownName = kj::heapString(name);
+    enqueue([this,KJ_MVCAP(ownName)](StorageReplica::Client standby) {
+      return shipRoot(standby, ownName);
+    });
+  }
+
+private:
+  FilesystemStorage& storage;
+  bool synchronous;
+
+  kj::Maybe<StorageReplica::Client> standby;
+
+  typedef kj::Function<kj::Promise<void>(StorageReplica::Client standby)> Op;
+  std::queue<Op> queue;
+  bool pumping = false;
+  // True while a task is running queued ops. It exits once the queue is empty.
+
+  uint64_t generation = 0;
+  // Incremented whenever we switch standbys, or start over with the same one. Anything still in
+  // progress for an older generation must not touch our state when it finishes.
+
+  bool caughtUp = false;
+  // True once the current standby's resync is done.
+
+  uint64_t acknowledged = 0;
+  // In synchronous mode, the journal offset through which the standby has committed.
+
+  uint64_t nextFile = 1;
+
+  kj::TaskSet tasks;
+
+  static constexpr size_t MAX_CHUNK_SIZE = 4 << 20;
+  static constexpr kj::Duration RETRY_DELAY = 10 * kj::SECONDS;
+
+  struct Extent {
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  void enqueue(Op op) {
+    if (standby == nullptr) return;
+
+    queue.push(kj::mv(op));
+    if (!pumping) {
+      pumping = true;
+      uint64_t gen = generation;
+      tasks.add(kj::evalLater([this,gen]() { return pump(gen); })
+          .catch_([this,gen](kj::Exception&& exception) {
+        if (gen == generation) failed(kj::mv(exception));
+      }));
+    }
+  }
+
+  kj::Promise<void> pump(uint64_t gen) {
+    if (gen != generation) return kj::READY_NOW;
+    if (queue.empty()) {
+      pumping = false;
+      return kj::READY_NOW;
+    }
+
+    auto op = kj::mv(queue.front());
+    queue.pop();
+    return op(KJ_ASSERT_NONNULL(standby)).then([this,gen]() { return pump(gen); });
+  }
+
+  void failed(kj::Exception&& exception) {
+    if (strstr(exception.getDescription().cStr(), STANDBY_PROMOTED_MESSAGE) != nullptr) {
+      KJ_LOG(FATAL, "our storage standby was promoted to replace us; shutting down", exception);
+
+      // Another node now serves our roots, so every write we accept from here on would be lost.
+      abort();
+    }
+
+    KJ_LOG(ERROR, "shipping to storage standby failed; will resync", exception);
+
+    auto retryWith = kj::mv(KJ_ASSERT_NONNULL(standby));
+    setStandby(nullptr);
+    uint64_t gen = generation;
+    tasks.add(storage.factory->getTimer().afterDelay(RETRY_DELAY)
+        .then([this,gen,KJ_MVCAP(retryWith)]() mutable {
+      if (gen == generation) setStandby(kj::mv(retryWith));
+    }));
+  }
+
+  void taskFailed(kj::Exception&& exception) override {
+    KJ_LOG(ERROR, exception);
+  }
+
+  kj::Promise<void> resync(StorageReplica::Client standby) {
+    KJ_LOG(INFO, "resyncing storage standby");
+
+    auto promise = standby.beginResyncRequest().send().ignoreResult();
+
+    kj::Vector<kj::String> names;
+    kj::Vector<ObjectId> pending;
+    kj::Vector<kj::Promise<void>> shipped;
+    shipped.add(kj::mv(promise));
+    for (auto& name: sandstorm::listDirectoryFd(storage.rootsFd)) {
+      if (name.startsWith(".")) continue;
+      shipped.add(shipRoot(standby, name, pending));
+      names.add(kj::mv(name));
+    }
+
+    uint64_t gen = generation;
+    return kj::joinPromises(shipped.releaseAsArray())
+        .then([this,standby,KJ_MVCAP(pending)]() mutable {
+      return shipObjects(kj::mv(standby), kj::mv(pending));
+    }).then([standby,KJ_MVCAP(names)]() mutable {
+      auto req = standby.finishResyncRequest();
+      auto list = req.initRoots(names.size());
+      for (auto i: kj::indices(names)) {
+        list.set(i, names[i]);
+      }
+      return req.send().ignoreResult();
+    }).then([this,gen]() {
+      if (gen != generation) return;
+      KJ_LOG(INFO, "storage standby resynced");
+      caughtUp = true;
+      if (synchronous) {
+        // Transactions from now on aren't durable until the standby has them. Earlier ones are
+        // still in the queue, ahead of them, so in practice commits wait for it to drain.
+        acknowledged = storage.journal->getEnd();
+        storage.journal->gateOnReplica(acknowledged);
+      }
+    });
+  }
+
+  kj::Promise<void> shipRoot(StorageReplica::Client& standby, kj::StringPtr name,
+                             kj::Maybe<kj::Vector<ObjectId>&> localRoots = nullptr) {
+    // Ships the root file `name` as it is now, or its removal if it's gone. If the root's object
+    // is stored here, adds its ID to `localRoots`.
+
+    KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(storage.rootsFd, name, O_RDONLY | O_CLOEXEC)) {
+      capnp::StreamFdMessageReader message(kj::mv(*fd));
+      auto root = message.getRoot<StoredRoot>();
+      KJ_IF_MAYBE(ids, localRoots) {
+        if (root.isLocal()) ids->add(ObjectKey(root.getKey()));
+      }
+      auto req = standby.setRootRequest();
+      req.setName(name);
+      req.setRoot(root);
+      return req.send().ignoreResult();
+    } else {
+      auto req = standby.removeRootRequest();
+      req.setName(name);
+      return req.send().ignoreResult();
+    }
+  }
+
+  kj::Promise<void> shipObjects(StorageReplica::Client standby, kj::Vector<ObjectId> pending) {
+    // Ships the objects in `pending`, and all of their descendants, one at a time, each as a
+    // transaction creating it. Parents are shipped before children, since the journal only
+    // creates an object once its owner exists.
+
+    while (!pending.empty()) {
+      ObjectId id = pending.back();
+      pending.removeLast();
+
+      Xattr xattr;
+      KJ_IF_MAYBE(fd, storage.journal->openObject(id, xattr)) {
+        if (isStoredObjectType(xattr.type)) {
+          capnp::StreamFdMessageReader reader(fd->get());
+          for (auto child: reader.getRoot<StoredChildIds>().getChildren()) {
+            pending.add(child);
+          }
+        }
+
+        Journal::Entry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.type = Journal::Entry::Type::CREATE_OBJECT;
+        entry.stagingId = nextFile++;
+        entry.objectId = id;
+        entry.xattr = xattr;
+        entry.txSize = 1;
+
+        return shipFile(standby, entry.stagingId, kj::mv(*fd))
+            .then([this,standby,entry,KJ_MVCAP(pending)]() mutable {
+          auto req = standby.commitRequest();
+          req.setEntries(kj::arrayPtr(&entry, 1).asBytes());
+          return req.send().then([this,KJ_MVCAP(standby),KJ_MVCAP(pending)](auto&&) mutable {
+            return shipObjects(kj::mv(standby), kj::mv(pending));
+          });
+        });
+      }
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> shipTransaction(StorageReplica::Client standby,
+                                    kj::Array<Journal::Entry> entries, size_t i = 0) {
+    // Ships the current content of each object which entries[i...] replace, then commits
+    // `entries`.
+
+    for (; i < entries.size(); i++) {
+      auto& entry = entries[i];
+      if (entry.stagingId == 0) continue;
+
+      Xattr xattr;
+      KJ_IF_MAYBE(fd, storage.journal->openObject(entry.objectId, xattr)) {
+        entry.stagingId = nextFile++;
+        return shipFile(standby, entry.stagingId, kj::mv(*fd))
+            .then([this,standby,KJ_MVCAP(entries),i]() mutable {
+          return shipTransaction(kj::mv(standby), kj::mv(entries), i + 1);
+        });
+      } else {
+        // Deleted since; a later transaction says so.
+        entry.stagingId = 0;
+      }
+    }
+
+    auto req = standby.commitRequest();
+    req.setEntries(entries.asBytes());
+    return req.send().ignoreResult();
+  }
+
+  kj::Promise<void> shipFile(StorageReplica::Client standby, uint64_t number,
+                             kj::AutoCloseFd fd) {
+    // Copies `fd` to the standby as temporary file `number`, skipping holes.
+
+    auto req = standby.newFileRequest();
+    req.setFile(number);
+    req.setSize(getFileSize(fd));
+    auto promise = req.send().ignoreResult();
+
+    kj::Vector<Extent> extents;
+    forEachDataExtent(fd, [&](uint64_t offset, uint64_t size) {
+      extents.add(Extent { offset, size });
+    });
+
+    return promise.then([this,KJ_MVCAP(standby),number,KJ_MVCAP(fd),KJ_MVCAP(extents)]() mutable {
+      return shipData(kj::mv(standby), nullptr, number, kj::mv(fd), extents.releaseAsArray());
+    });
+  }
+
+  kj::Promise<void> shipData(StorageReplica::Client standby, kj::Maybe<ObjectId> object,
+                             uint64_t file, kj::AutoCloseFd fd, kj::Array<Extent> extents,
+                             size_t i = 0) {
+    // Ships extents[i...] of `fd`, in chunks of up to MAX_CHUNK_SIZE, one chunk at a time, either
+    // to be written to `object` in place or to temporary file `file`.
+
+    while (i < extents.size() && extents[i].size == 0) ++i;
+    if (i == extents.size()) return kj::READY_NOW;
+
+    auto& extent = extents[i];
+    uint64_t offset = extent.offset;
+    size_t size = kj::min(extent.size, uint64_t(MAX_CHUNK_SIZE));
+    extent.offset += size;
+    extent.size -= size;
+
+    auto sizeHint = capnp::MessageSize { 16 + size / sizeof(capnp::word), 0 };
+    kj::Promise<void> promise = nullptr;
+    KJ_IF_MAYBE(id, object) {
+      auto req = standby.writeObjectRequest(sizeHint);
+      id->copyTo(req.initObject());
+      req.setOffset(offset);
+      preadAllOrZero(fd, req.initData(size).begin(), size, offset);
+      promise = req.send().ignoreResult();
+    } else {
+      auto req = standby.writeFileRequest(sizeHint);
+      req.setFile(file);
+      req.setOffset(offset);
+      preadAllOrZero(fd, req.initData(size).begin(), size, offset);
+      promise = req.send().ignoreResult();
+    }
+
+    return promise.then([this,KJ_MVCAP(standby),object,file,KJ_MVCAP(fd),KJ_MVCAP(extents),i]()
+                        mutable {
+      return shipData(kj::mv(standby), object, file, kj::mv(fd), kj::mv(extents), i);
+    });
+  }
+};
+
+constexpr size_t FilesystemStorage::Replicator::MAX_CHUNK_SIZE;
+constexpr kj::Duration FilesystemStorage::Replicator::RETRY_DELAY;
+
+kj::Maybe<FilesystemStorage::Replicator&> FilesystemStorage::Journal::getReplicator() {
+  KJ_IF_MAYBE(replicator, storage.replicator) {
+    return **replicator;
+  } else {
+    return nullptr;
+  }
+}
+
+void FilesystemStorage::Journal::replicate(kj::ArrayPtr<const Entry> entries) {
+  KJ_IF_MAYBE(replicator, storage.replicator) {
+    (*replicator)->transactionCommitted(kj::heapArray(entries), journalEnd);
+  }
+}
+
+// =======================================================================================
+
 class FilesystemStorage::ObjectFactory: public kj::Refcounted {
   // Class responsible for keeping track of live objects.
   //
@@ -927,7 +2028,9 @@ class FilesystemStorage::ObjectFactory: public kj::Refcounted {
 
 public:
   explicit ObjectFactory(Journal& journal, kj::Timer& timer,
-                         Restorer<SturdyRef>::Client&& restorer);
+                         Restorer<SturdyRef>::Client&& restorer,
+                         kj::Maybe<LocalBlockShard&> blockShard,
+                         BlockingWorker& blockingWorker);
 
   template <typename T, typename U>
   struct ClientObjectPair {
@@ -960,19 +2063,76 @@ public:
   // Call methods on the `Restorer` capbaility.
 
   inline kj::Timer& getTimer() { return timer; }
+  inline kj::Maybe<LocalBlockShard&> getBlockShard() { return blockShard; }
+  inline BlockingWorker& getBlockingWorker() { return blockingWorker; }
+
+  void joinCluster(uint32_t nodeIndex, kj::Own<BackendSetImpl<StorageSibling>> siblings);
+  inline uint32_t getNodeIndex() { return nodeIndex; }
+
+  StorageSibling::Client getSibling(uint32_t nodeIndex);
+  // Get the storage node with the given index. Fails if we aren't part of a cluster.
 
-  void modifyTransitiveSize(ObjectId id, int64_t deltaBlocks, Journal::Transaction& txn);
+  capnp::Capability::Client newWeakRef(ObjectBase& object);
+  // Implements OwnedStorage.getPersistentWeakRef().
+
+  capnp::Capability::Client restoreWeakRef(SturdyRef::Stored::Reader ref);
+  // Restores a ref saved from newWeakRef() on this or any other storage node.
+
+  void modifyTransitiveSize(ObjectId id, int64_t deltaBlocks);
   // Update the transitive size of the given object and its parents, adding `deltaBlocks` to each.
   // Call this when a new child was added.
+  //
+  // The change is applied in memory immediately but only journaled by the next
+  // flushTransitiveSizes(), which is scheduled automatically. A busy object resized many times
+  // in a row thus costs one xattr update per ancestor per flush, rather than per resize. If we
+  // crash in between, the sizes are off by the unflushed amount, which only affects quota
+  // accounting.
+
+  void flushTransitiveSizes();
+  // Journal all pending transitive size changes in one transaction.
 
-  void disowned(ObjectId id);
+  void shutdown();
+  // Flush, and stop the flush timer. Called when FilesystemStorage is destroyed, since the
+  // journal goes away with it even if the factory lives on.
+
+  kj::Maybe<uint64_t> disowned(ObjectId id);
   // Notes that the given object ID has been disowned by its owner. If the object is live, it needs
   // to have its owner reference cleared so that any later changes to the object's size don't
   // cause the owner to be updated.
+  //
+  // If the object's transitive size is known in memory -- which is more current than the journal
+  // when it has unflushed changes -- returns it.
 
 private:
   Journal& journal;
   kj::Timer& timer;
+  kj::Maybe<LocalBlockShard&> blockShard;
+  BlockingWorker& blockingWorker;
+
+  uint32_t nodeIndex = 0;
+  kj::Maybe<kj::Own<BackendSetImpl<StorageSibling>>> siblings;
+  // Set by joinCluster().
+
+  static constexpr kj::Duration TRANSITIVE_SIZE_FLUSH_DELAY = 1 * kj::SECONDS;
+
+  std::unordered_map<ObjectId, Xattr, ObjectId::Hash> detachedXattrs;
+  // Attributes of objects which are not live but whose transitive size we've modified, so that
+  // walking up the owner chain doesn't need to read them from disk every time. These are
+  // authoritative, as they include unflushed changes. Moved into the object if it is opened, and
+  // back here if the object is dropped while it still has unflushed changes.
+
+  static constexpr size_t MAX_DETACHED_XATTRS = 16384;
+  // Once there are more detached xattrs than this, the clean ones are discarded on flush.
+
+  std::unordered_set<ObjectId, ObjectId::Hash> dirtyXattrs;
+  // Objects whose transitive size has changed since the last flush.
+
+  bool flushScheduled = false;
+  kj::Maybe<kj::Promise<void>> flushTimer;
+
+  kj::Maybe<Xattr&> getXattrForAccounting(ObjectId id);
+  // Returns the authoritative in-memory attributes for `id`, loading them if needed, or null if
+  // the object no longer exists.
 
   capnp::CapabilityServerSet<capnp::Capability> serverSet;
   // Lets us map our own capabilities -- when they come back from the caller -- back to the
@@ -1278,8 +2438,11 @@ protected:
           adoption.commit(txn);
         }
         for (auto& disown: disowned) {
-          deltaBlocks -= txn.moveToDeathRow(disown);
-          factory->disowned(disown);
+          uint64_t disownedBlocks = txn.moveToDeathRow(disown);
+          KJ_IF_MAYBE(blocks, factory->disowned(disown)) {
+            disownedBlocks = *blocks;
+          }
+          deltaBlocks -= disownedBlocks;
         }
 
         if (deltaBlocks < 0 && -deltaBlocks > xattr.transitiveBlockCount) {
@@ -1292,7 +2455,7 @@ protected:
         xattr.transitiveBlockCount += deltaBlocks;
         txn.updateObject(id, xattr, newData.fd);
 
-        factory->modifyTransitiveSize(xattr.owner, deltaBlocks, txn);
+        factory->modifyTransitiveSize(xattr.owner, deltaBlocks);
 
         // Update currentData to reflect the transaction before closing it out.
         currentData = kj::mv(newData);
@@ -1333,8 +2496,7 @@ protected:
       // A set() is in progress. Return a copy of the cached value.
       auto payload = c->get()->getRoot<StoredObject>().getPayload();
       auto size = payload.targetSize();
-      size.wordCount += capnp::sizeInWords<
-          capnp::FromBuilder<kj::Decay<decltype(context.getResults())>>>();
+      size.wordCount += capnp::sizeInWords<typename ResultsOf<Context>::Type>();
       size.capCount += 1;  // for `setter`
       context.initResults(size).setValue(payload);
       return;
@@ -1352,8 +2514,7 @@ protected:
 
     auto payload = capTable.imbue(root.getPayload());
     auto size = payload.targetSize();
-    size.wordCount += capnp::sizeInWords<
-        capnp::FromBuilder<kj::Decay<decltype(context.getResults())>>>();
+    size.wordCount += capnp::sizeInWords<typename ResultsOf<Context>::Type>();
     size.capCount += 1;  // for `setter`
     context.initResults(size).setValue(payload);
   }
@@ -1366,11 +2527,10 @@ protected:
 
     if (state == COMMITTED) {
       if (blocks != xattr.accountedBlockCount) {
+        // Our own xattr is journaled along with the ancestors' by the next flush.
         int64_t delta = blocks - xattr.accountedBlockCount;
-        Journal::Transaction txn(journal);
         xattr.accountedBlockCount = blocks;
-        factory->modifyTransitiveSize(id, delta, txn);
-        txn.commit();
+        factory->modifyTransitiveSize(id, delta);
       }
     } else {
       // We don't bother counting child size until we're committed to disk.
@@ -1415,6 +2575,12 @@ protected:
     return xattr.transitiveBlockCount * Volume::BLOCK_SIZE;
   }
 
+  inline kj::Maybe<LocalBlockShard&> getBlockShard() { return factory->getBlockShard(); }
+  inline BlockingWorker& getBlockingWorker() { return factory->getBlockingWorker(); }
+  inline kj::Maybe<Replicator&> getReplicator() { return journal.getReplicator(); }
+  inline bool isCommitted() { return state == COMMITTED; }
+  inline capnp::Capability::Client getWeakRef() { return factory->newWeakRef(*this); }
+
 private:
   Journal& journal;
   kj::Own<ObjectFactory> factory;
@@ -1491,7 +2657,8 @@ private:
         o->key.copyTo(descriptor.initChild());
         return kj::Maybe<SavedChild>(SavedChild { *o, kj::mv(client) });
       } else {
-        // Not OwnedStorage. Do a regular save().
+        // Not OwnedStorage. Do a regular save(). (An OwnedStorage created by another storage node
+        // can't be owned here, and fails, but its weak ref saves as a SturdyRef.Stored.)
         auto req = client.castAs<StandardPersistent>().saveRequest(capnp::MessageSize {16, 0});
         req.getSealFor().setStorage();
 
@@ -1519,6 +2686,19 @@ private:
         return kj::mv(result);
       }
       case StoredObject::CapDescriptor::EXTERNAL: {
+        auto ref = descriptor.getExternal();
+        if (ref.isStored()) {
+          // A weak ref into storage, which we restore ourselves (with help from the node holding
+          // it, if that's not us).
+          kj::Own<capnp::ClientHook> result;
+          KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+            result = capnp::ClientHook::from(factory->restoreWeakRef(ref.getStored()));
+          })) {
+            result = capnp::newBrokenCap(kj::mv(*exception));
+          }
+          return kj::mv(result);
+        }
+
         auto req = factory->restoreRequest();
         req.setSturdyRef(descriptor.getExternal());
         capnp::Capability::Client cap(req.send().getCap());
@@ -1531,6 +2711,45 @@ private:
 
 // =======================================================================================
 
+class FilesystemStorage::WeakRefImpl: public StandardPersistent::Server {
+  // Returned by OwnedStorage.getPersistentWeakRef(). Forwards calls to the object, but can also be
+  // saved -- into storage only, for now -- as a SturdyRef.Stored. Doesn't keep the object's owner
+  // from deleting it, after which restoring the ref fails.
+
+public:
+  WeakRefImpl(ObjectBase& inner, uint32_t nodeIndex)
+      : inner(inner), innerCap(inner.self()), nodeIndex(nodeIndex) {}
+
+  capnp::Capability::Server::DispatchCallResult dispatchCall(
+      uint64_t interfaceId, uint16_t methodId,
+      capnp::CallContext<capnp::AnyPointer, capnp::AnyPointer> context) override {
+    if (interfaceId == capnp::typeId<StandardPersistent>()) {
+      return StandardPersistent::Server::dispatchCall(interfaceId, methodId, context);
+    } else {
+      return inner.dispatchCall(interfaceId, methodId, context);
+    }
+  }
+
+protected:
+  kj::Promise<void> save(SaveContext context) override {
+    KJ_REQUIRE(context.getParams().getSealFor().isStorage(),
+               "weak refs to storage objects can only be saved into storage");
+    context.releaseParams();
+
+    auto ref = context.getResults(capnp::MessageSize {16, 0}).initSturdyRef().initStored();
+    inner.getKey().copyTo(ref);
+    ref.setNode(nodeIndex);
+    return kj::READY_NOW;
+  }
+
+private:
+  ObjectBase& inner;
+  capnp::Capability::Client innerCap;  // prevent gc
+  uint32_t nodeIndex;
+};
+
+// =======================================================================================
+
 class FilesystemStorage::AssignableImpl: public OwnedAssignable<>::Server, public ObjectBase {
 public:
   static constexpr Type TYPE = Type::ASSIGNABLE;
@@ -1539,11 +2758,48 @@ public:
   using ObjectBase::setStoredObject;
   // Make public for Assignable so that StorageFactory can call this to initialize it.
 
+  kj::Own<RefcountedMallocMessageBuilder> snapshot() {
+    // Copies the current value -- that of the last set(), even if it hasn't hit disk yet -- into
+    // a message whose root is an Assignable.get() result and whose cap table holds the live
+    // capabilities.
+
+    auto message = kj::refcounted<RefcountedMallocMessageBuilder>();
+    getStoredObject(SnapshotContext(*message));
+    return message;
+  }
+
+  void holdSets() {
+    // Makes set()s wait until releaseSets().
+
+    KJ_REQUIRE(setsHeld == nullptr, "storage object is already being migrated");
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    setsHeld = paf.promise.fork();
+    releaseSetsFulfiller = kj::mv(paf.fulfiller);
+  }
+
+  void releaseSets(kj::Maybe<kj::Exception> error = nullptr) {
+    // Lets held set()s proceed, or if `error` is given, makes them -- and all later ones -- fail
+    // with it.
+
+    KJ_IF_MAYBE(e, error) {
+      releaseSetsFulfiller->reject(kj::mv(*e));
+    } else {
+      setsHeld = nullptr;
+      releaseSetsFulfiller->fulfill();
+    }
+  }
+
   kj::Promise<void> getStorageUsage(GetStorageUsageContext context) override {
     context.getResults().setTotalBytes(getStorageUsageImpl());
     return kj::READY_NOW;
   }
 
+  kj::Promise<void> getPersistentWeakRef(GetPersistentWeakRefContext context) override {
+    context.getResults(capnp::MessageSize { 4, 1 }).getRef()
+        .setAs<capnp::Capability>(getWeakRef());
+    return kj::READY_NOW;
+  }
+
   kj::Promise<void> get(GetContext context) override {
     context.releaseParams();
     getStoredObject(context);
@@ -1560,37 +2816,187 @@ public:
     return kj::READY_NOW;
   }
 
+  kj::Promise<void> getWithVersion(GetWithVersionContext context) override {
+    context.releaseParams();
+    getStoredObject(context);
+    auto results = context.getResults();
+    results.setSetter(kj::heap<SetterImpl>(*this, thisCap(), version));
+    results.setVersion(committedVersion);
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> whenChanged(WhenChangedContext context) override {
+    uint64_t since = context.getParams().getVersion();
+    context.releaseParams();
+    context.allowCancellation();
+    return whenCommittedPast(since).then([this,context]() mutable {
+      context.getResults(capnp::MessageSize { 4, 0 }).setVersion(committedVersion);
+    });
+  }
+
+  kj::Promise<void> observe(ObserveContext context) override {
+    auto params = context.getParams();
+    auto handle = kj::heap<ObserverHandle>(*this, thisCap(), params.getObserver(),
+                                           params.getVersion());
+    context.releaseParams();
+    context.getResults(capnp::MessageSize { 4, 1 }).setHandle(kj::mv(handle));
+    return kj::READY_NOW;
+  }
+
 private:
   uint version = 1;
+  // Incremented by every set(), before it is written. Setters use this to detect concurrent
+  // modification; it's never shown to callers.
 
-  class SetterImpl: public sandstorm::Assignable<>::Setter::Server {
-  public:
-    SetterImpl(AssignableImpl& object, capnp::Capability::Client client, uint expectedVersion = 0)
-        : object(object), client(client), expectedVersion(expectedVersion) {}
+  uint committedVersion = 1;
+  // The highest version whose set() has been committed to disk. This is the version callers see,
+  // from getWithVersion(), whenChanged() and observe().
 
-    kj::Promise<void> set(SetContext context) override {
-      if (expectedVersion > 0) {
-        if (object.version != expectedVersion) {
-          return KJ_EXCEPTION(DISCONNECTED, "Assignable modified concurrently");
-        }
-        ++expectedVersion;
-      }
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> changeWaiters;
+  // Waiting for committedVersion to change. Ones whose waiter went away are pruned whenever a
+  // new one is added, so that an object which rarely changes doesn't pile them up.
 
-      context.allowCancellation();
-      // If a save() call never returns we don't want this call context to be stuck here. So, only
-      // keep trying for as long as the caller hasn't canceled.
+  kj::Maybe<kj::ForkedPromise<void>> setsHeld;
+  kj::Own<kj::PromiseFulfiller<void>> releaseSetsFulfiller;
+  // See holdSets().
 
-      auto promise = object.setStoredObject(context.getParams().getValue());
-      ++object.version;
-      context.releaseParams();
-      return kj::mv(promise);
+  kj::Promise<void> whenCommittedPast(uint64_t since) {
+    if (committedVersion > since) return kj::READY_NOW;
+
+    kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> waiters(changeWaiters.size() + 1);
+    for (auto& waiter: changeWaiters) {
+      if (waiter->isWaiting()) waiters.add(kj::mv(waiter));
     }
 
-  private:
-    AssignableImpl& object;
-    capnp::Capability::Client client;  // prevent GC
-    uint expectedVersion;
-  };
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    waiters.add(kj::mv(paf.fulfiller));
+    changeWaiters = kj::mv(waiters);
+    return kj::mv(paf.promise);
+  }
+
+  void committed(uint newVersion) {
+    // A set() has hit disk. Note that sets can complete out-of-order, in which case the earlier
+    // one did nothing and the later one's value is current.
+
+    if (newVersion <= committedVersion) return;
+    committedVersion = newVersion;
+
+    auto waiters = kj::mv(changeWaiters);
+    for (auto& waiter: waiters) {
+      waiter->fulfill();
+    }
+  }
+
+  class ChangedRequestContext {
+    // Makes an Observer.changed() request look enough like a call context that
+    // getStoredObject() can fill it in.
+
+  public:
+    typedef Assignable<>::Observer::ChangedParams Results;
+    typedef capnp::Request<Results, Assignable<>::Observer::ChangedResults> Request;
+
+    ChangedRequestContext(Assignable<>::Observer::Client& observer, kj::Maybe<Request>& request)
+        : observer(observer), request(request) {}
+
+    Results::Builder initResults(capnp::MessageSize sizeHint) {
+      request = observer.changedRequest(sizeHint);
+      return KJ_ASSERT_NONNULL(request);
+    }
+
+  private:
+    Assignable<>::Observer::Client& observer;
+    kj::Maybe<Request>& request;
+  };
+
+  class SnapshotContext {
+    // Makes a message look enough like a call context that getStoredObject() can fill it in.
+
+  public:
+    typedef Assignable<>::GetResults Results;
+
+    explicit SnapshotContext(RefcountedMallocMessageBuilder& message): message(message) {}
+
+    Results::Builder initResults(capnp::MessageSize sizeHint) {
+      return message.getRoot<Results>();
+    }
+
+  private:
+    RefcountedMallocMessageBuilder& message;
+  };
+
+  class ObserverHandle: public sandstorm::Handle::Server {
+    // Pushes each committed version to the observer until dropped. Only one changed() call is in
+    // flight at a time; intervening versions are skipped.
+
+  public:
+    ObserverHandle(AssignableImpl& object, capnp::Capability::Client client,
+                   Assignable<>::Observer::Client observer, uint64_t sentVersion)
+        : object(object), client(kj::mv(client)), observer(kj::mv(observer)),
+          sentVersion(sentVersion),
+          loop(run().eagerlyEvaluate([](kj::Exception&& e) {
+            if (e.getType() != kj::Exception::Type::DISCONNECTED) {
+              KJ_LOG(ERROR, "Assignable observer failed", e);
+            }
+          })) {}
+
+  private:
+    AssignableImpl& object;
+    capnp::Capability::Client client;  // prevent GC
+    Assignable<>::Observer::Client observer;
+    uint64_t sentVersion;
+    kj::Promise<void> loop;
+
+    kj::Promise<void> run() {
+      return object.whenCommittedPast(sentVersion).then([this]() {
+        sentVersion = object.committedVersion;
+
+        kj::Maybe<ChangedRequestContext::Request> request;
+        object.getStoredObject(ChangedRequestContext(observer, request));
+        auto& req = KJ_ASSERT_NONNULL(request);
+        req.setVersion(sentVersion);
+        return req.send();
+      }).then([this](capnp::Response<Assignable<>::Observer::ChangedResults>&&) {
+        return run();
+      });
+    }
+  };
+
+  class SetterImpl: public sandstorm::Assignable<>::Setter::Server {
+  public:
+    SetterImpl(AssignableImpl& object, capnp::Capability::Client client, uint expectedVersion = 0)
+        : object(object), client(client), expectedVersion(expectedVersion) {}
+
+    kj::Promise<void> set(SetContext context) override {
+      KJ_IF_MAYBE(held, object.setsHeld) {
+        return held->addBranch().then([this,context]() mutable {
+          return set(context);
+        });
+      }
+
+      if (expectedVersion > 0) {
+        if (object.version != expectedVersion) {
+          return KJ_EXCEPTION(DISCONNECTED, "Assignable modified concurrently");
+        }
+        ++expectedVersion;
+      }
+
+      context.allowCancellation();
+      // If a save() call never returns we don't want this call context to be stuck here. So, only
+      // keep trying for as long as the caller hasn't canceled.
+
+      auto promise = object.setStoredObject(context.getParams().getValue());
+      uint newVersion = ++object.version;
+      context.releaseParams();
+      return promise.then([this,newVersion]() {
+        object.committed(newVersion);
+      });
+    }
+
+  private:
+    AssignableImpl& object;
+    capnp::Capability::Client client;  // prevent GC
+    uint expectedVersion;
+  };
 };
 
 constexpr FilesystemStorage::Type FilesystemStorage::AssignableImpl::TYPE;
@@ -1620,6 +3026,12 @@ public:
     return kj::READY_NOW;
   }
 
+  kj::Promise<void> getPersistentWeakRef(GetPersistentWeakRefContext context) override {
+    context.getResults(capnp::MessageSize { 4, 1 })
+        .setRef(getWeakRef().castAs<sandstorm::Blob>());
+    return kj::READY_NOW;
+  }
+
   kj::Promise<void> getSize(GetSizeContext context) override {
     context.releaseParams();
     auto& xattr = getXattrRef();
@@ -1766,6 +3178,10 @@ private:
 
       int fd = object.openRaw();
       KJ_SYSCALL(fdatasync(fd));
+      KJ_IF_MAYBE(replicator, object.getReplicator()) {
+        // We may have been committed -- and shipped -- before the upload finished.
+        replicator->objectWritten(object.getId(), 0, currentOffset);
+      }
       object.updateSize((currentOffset + Volume::BLOCK_SIZE - 1) / Volume::BLOCK_SIZE);
       return object.setReadOnly();
     }
@@ -1868,8 +3284,97 @@ public:
   static constexpr Type TYPE = Type::VOLUME;
   using ObjectBase::ObjectBase;
 
+  ~VolumeImpl() noexcept(false) {
+    if (!isCommitted()) {
+      KJ_IF_MAYBE(shard, getVolumeShard()) {
+        // We were never adopted, so nothing else is going to delete our blocks.
+        shard->deleteGroup(getBlockGroup());
+      }
+    }
+  }
+
   void init() {
-    openRaw();
+    if (getBlockShard() != nullptr) {
+      getXattrRef().inBlockShard = true;
+      ObjectId id = getId();
+      pwriteAll(openRaw(), &id, sizeof(id), 0);
+    } else {
+      openRaw();
+    }
+  }
+
+  kj::Promise<void> initFromTemplate(kj::AutoCloseFd templateFd) {
+    // Start out as a copy of the given volume image, in our own file, when no block store is
+    // configured. Shares the template's extents where the filesystem can; otherwise the copy
+    // happens off the event loop.
+
+    int fd = openRaw();
+    if (tryCloneFile(fd, templateFd)) {
+      updateSize(getFileBlockCount(fd));
+      return kj::READY_NOW;
+    }
+
+    // The copy gets its own descriptor, since it carries on even if we're destroyed meanwhile.
+    int newFd;
+    KJ_SYSCALL(newFd = fcntl(fd, F_DUPFD_CLOEXEC, 0));
+    kj::AutoCloseFd copyFd(newFd);
+    return getBlockingWorker().run<uint64_t>(
+        [KJ_MVCAP(copyFd),KJ_MVCAP(templateFd)]() {
+      copySparseFile(copyFd, templateFd);
+      return getFileBlockCount(copyFd);
+    }).then([this](uint64_t blockCount) {
+      updateSize(blockCount);
+    });
+  }
+
+  void initFromTemplateBlocks(kj::ArrayPtr<const TemplateBlock> blocks) {
+    // Start out in the block store, sharing the given blocks of a template. See
+    // StorageFactoryImpl::getTemplateBlocks(). The shared blocks aren't counted in our size.
+
+    init();
+    getXattrRef().fromTemplate = true;
+    pwriteAll(openRaw(), blocks.begin(), blocks.asBytes().size(), sizeof(ObjectId));
+    templateBlocks = kj::heapArray(blocks);
+  }
+
+  void trackWrites() {
+    // Starts recording which blocks are written or zeroed, for takeWrittenBlocks(). Every block
+    // holding data to begin with counts as written, so that copying the written blocks until
+    // none remain copies the whole volume.
+
+    if (writtenBlocks != nullptr) return;
+
+    BlockBitmap blocks;
+    KJ_IF_MAYBE(shard, getVolumeShard()) {
+      for (auto& id: shard->listGroup(getBlockGroup())) {
+        blocks.add(id.value[2], 1);
+      }
+      for (auto& block: getTemplateBlocks()) {
+        blocks.add(block.blockNum, 1);
+      }
+    } else {
+      forEachDataExtent(openRaw(), [&](uint64_t offset, uint64_t size) {
+        uint64_t first = offset / Volume::BLOCK_SIZE;
+        uint64_t end = (offset + size + Volume::BLOCK_SIZE - 1) / Volume::BLOCK_SIZE;
+        blocks.add(first, end - first);
+      });
+    }
+    writtenBlocks = kj::mv(blocks);
+  }
+
+  void stopTrackingWrites() { writtenBlocks = nullptr; }
+
+  kj::Array<uint32_t> takeWrittenBlocks() {
+    // The blocks written since trackWrites() or the last call, in order.
+    return KJ_REQUIRE_NONNULL(writtenBlocks, "not tracking writes").take();
+  }
+
+  size_t getWrittenBlockCount() {
+    KJ_IF_MAYBE(blocks, writtenBlocks) {
+      return blocks->getSize();
+    } else {
+      return 0;
+    }
   }
 
   kj::Promise<void> getStorageUsage(GetStorageUsageContext context) override {
@@ -1877,6 +3382,11 @@ public:
     return kj::READY_NOW;
   }
 
+  kj::Promise<void> getPersistentWeakRef(GetPersistentWeakRefContext context) override {
+    context.getResults(capnp::MessageSize { 4, 1 }).setRef(getWeakRef().castAs<Volume>());
+    return kj::READY_NOW;
+  }
+
   kj::Promise<void> read(ReadContext context) override {
     auto params = context.getParams();
     uint64_t blockNum = params.getBlockNum();
@@ -1892,7 +3402,26 @@ public:
     auto results = context.getResults(capnp::MessageSize {16 + size / sizeof(capnp::word), 0});
     auto data = results.initData(size);
 
-    preadAllOrZero(openRaw(), data.begin(), data.size(), offset);
+    KJ_IF_MAYBE(shard, getVolumeShard()) {
+      auto ids = kj::heapArray<UInt256>(count);
+      for (uint i = 0; i < count; i++) {
+        ids[i] = getBlockId(blockNum + i);
+      }
+      if (shard->hasColdBlocks(ids)) {
+        // Some blocks were evicted. Fetch them back on a thread rather than stall the event loop
+        // -- and with it every other object -- on the cold store.
+        auto& shardRef = *shard;
+        auto promise = getBlockingWorker().run([&shardRef,KJ_MVCAP(ids)]() {
+          shardRef.faultIn(ids);
+        });
+        return promise.then([this,context,&shardRef,blockNum,data]() mutable {
+          readFromShard(shardRef, blockNum, data);
+        });
+      }
+      readFromShard(*shard, blockNum, data);
+    } else {
+      preadAllOrZero(openRaw(), data.begin(), data.size(), offset);
+    }
 
     return kj::READY_NOW;
   }
@@ -1917,7 +3446,33 @@ public:
 
     uint64_t offset = blockNum * Volume::BLOCK_SIZE;
 
-    pwriteAll(openRaw(), data.begin(), data.size(), offset);
+    KJ_IF_MAYBE(shard, getVolumeShard()) {
+      kj::Vector<UInt256> ids(count);
+      kj::Vector<UInt256> keys(count);
+      kj::Vector<byte> blocks(data.size());
+      for (uint i = 0; i < count; i++) {
+        auto block = data.slice(i * Volume::BLOCK_SIZE, (i + 1) * Volume::BLOCK_SIZE);
+        if (isAllZero(block) && findTemplateBlock(blockNum + i) == nullptr) {
+          // Like a hole in a sparse file, an all-zero block takes no space -- unless our template
+          // has the block, which would then show through.
+          shard->deleteMutable(getBlockId(blockNum + i));
+        } else {
+          ids.add(getBlockId(blockNum + i));
+          keys.add(getBlockKey(blockNum + i));
+          blocks.addAll(block);
+        }
+      }
+      // Encrypt and store the rest as one batch, so that encryption is spread across cores.
+      shard->putMutableBlocks(ids.asPtr(), keys.asPtr(), blocks.asPtr());
+    } else {
+      pwriteAll(openRaw(), data.begin(), data.size(), offset);
+      KJ_IF_MAYBE(replicator, getReplicator()) {
+        replicator->objectWritten(getId(), offset, data.size());
+      }
+    }
+    KJ_IF_MAYBE(blocks, writtenBlocks) {
+      blocks->add(blockNum, count);
+    }
     maybeUpdateSize(count);
 
     return kj::READY_NOW;
@@ -1943,9 +3498,36 @@ public:
     uint64_t offset = blockNum * Volume::BLOCK_SIZE;
     uint size = count * Volume::BLOCK_SIZE;
 
-    int fd = openRaw();
-    KJ_SYSCALL(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size),
-               offset, size);
+    KJ_IF_MAYBE(shard, getVolumeShard()) {
+      kj::Vector<UInt256> deleteIds(count);
+      kj::Vector<UInt256> ids;
+      kj::Vector<UInt256> keys;
+      for (uint i = 0; i < count; i++) {
+        if (findTemplateBlock(blockNum + i) == nullptr) {
+          deleteIds.add(getBlockId(blockNum + i));
+        } else {
+          ids.add(getBlockId(blockNum + i));
+          keys.add(getBlockKey(blockNum + i));
+        }
+      }
+      shard->deleteMutableBlocks(deleteIds);
+      if (ids.size() > 0) {
+        // Where our template has a block, only an explicit zero block hides it.
+        auto zeros = kj::heapArray<byte>(ids.size() * Volume::BLOCK_SIZE);
+        memset(zeros.begin(), 0, zeros.size());
+        shard->putMutableBlocks(ids.asPtr(), keys.asPtr(), zeros);
+      }
+    } else {
+      int fd = openRaw();
+      KJ_SYSCALL(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size),
+                 offset, size);
+      KJ_IF_MAYBE(replicator, getReplicator()) {
+        replicator->objectZeroed(getId(), offset, size);
+      }
+    }
+    KJ_IF_MAYBE(blocks, writtenBlocks) {
+      blocks->add(blockNum, count);
+    }
 
     maybeUpdateSize(count);
 
@@ -1953,8 +3535,17 @@ public:
   }
 
   kj::Promise<void> sync(SyncContext context) override {
-    int fd = openRaw();
-    KJ_SYSCALL(fdatasync(fd));
+    KJ_IF_MAYBE(shard, getVolumeShard()) {
+      // This syncs the whole block store, which can take a while; don't stall the event loop.
+      auto& shardRef = *shard;
+      return getBlockingWorker().run([&shardRef]() { shardRef.sync(); });
+    } else {
+      int fd = openRaw();
+      KJ_SYSCALL(fdatasync(fd));
+      KJ_IF_MAYBE(replicator, getReplicator()) {
+        return replicator->objectSynced(getId());
+      }
+    }
     return kj::READY_NOW;
   }
 
@@ -2051,6 +3642,8 @@ private:
   uint32_t counter = 0;
   uint32_t currentExclusiveNumber = 0;
   uint32_t snapshotCount = 0;
+  kj::Maybe<BlockBitmap> writtenBlocks;  // while being migrated; see trackWrites()
+  kj::Maybe<kj::Array<TemplateBlock>> templateBlocks;  // see getTemplateBlocks()
   kj::ForkedPromise<void> onZeroSnapshots = nullptr;
   kj::Own<kj::PromiseFulfiller<void>> onZeroSnapshotsFulfiller;
 
@@ -2061,10 +3654,94 @@ private:
 
     counter += count;
     if (counter > 128) {
-      updateSize(getFileBlockCount(openRaw()));
+      KJ_IF_MAYBE(shard, getVolumeShard()) {
+        updateSize(shard->getGroupBlockCount(getBlockGroup()));
+      } else {
+        updateSize(getFileBlockCount(openRaw()));
+      }
       counter = 0;
     }
   }
+
+  kj::ArrayPtr<const TemplateBlock> getTemplateBlocks() {
+    // The template blocks we share, if we were made from a template in the block store. Loaded
+    // from our file the first time they're needed.
+
+    if (!getXattrRef().fromTemplate) return nullptr;
+    KJ_IF_MAYBE(blocks, templateBlocks) {
+      return *blocks;
+    }
+    return templateBlocks.emplace(readTemplateBlocks(openRaw(), sizeof(ObjectId)));
+  }
+
+  kj::Maybe<const UInt256&> findTemplateBlock(uint32_t blockNum) {
+    auto blocks = getTemplateBlocks();
+    auto iter = std::lower_bound(blocks.begin(), blocks.end(), blockNum,
+        [](const TemplateBlock& block, uint64_t n) { return block.blockNum < n; });
+    if (iter == blocks.end() || iter->blockNum != blockNum) return nullptr;
+    return iter->ref;
+  }
+
+  void readFromShard(LocalBlockShard& shard, uint32_t blockNum, kj::ArrayPtr<byte> data) {
+    // Fills `data` with blocks from the block store, starting at `blockNum`.
+
+    // Fetch the whole range as one batch, so that decryption is spread across cores.
+    uint count = data.size() / Volume::BLOCK_SIZE;
+    auto ids = kj::heapArray<UInt256>(count);
+    auto keys = kj::heapArray<UInt256>(count);
+    for (uint i = 0; i < count; i++) {
+      ids[i] = getBlockId(blockNum + i);
+      keys[i] = getBlockKey(blockNum + i);
+    }
+    auto found = kj::heapArray<bool>(count);
+    if (shard.getMutableBlocks(ids, keys, data, found) < count && getXattrRef().fromTemplate) {
+      // Blocks we haven't written ourselves come from our template, if it has them.
+      for (uint i = 0; i < count; i++) {
+        if (found[i]) continue;
+        KJ_IF_MAYBE(ref, findTemplateBlock(blockNum + i)) {
+          auto block = data.slice(i * Volume::BLOCK_SIZE, (i + 1) * Volume::BLOCK_SIZE);
+          KJ_ASSERT(shard.getImmutable(*ref, block), "template block missing from block store");
+        }
+      }
+    }
+  }
+
+  kj::Maybe<LocalBlockShard&> getVolumeShard() {
+    // Get the block store holding our blocks, or null if they're in our file.
+
+    if (getXattrRef().inBlockShard) {
+      return KJ_REQUIRE_NONNULL(getBlockShard(),
+          "volume is stored in a block store, but none is configured");
+    } else {
+      return nullptr;
+    }
+  }
+
+  UInt128 getBlockGroup() {
+    const ObjectId& id = getId();
+    return { { id.id[0], id.id[1] } };
+  }
+
+  UInt256 getBlockId(uint32_t blockNum) {
+    const ObjectId& id = getId();
+    return { { id.id[0], id.id[1], blockNum, 0 } };
+  }
+
+  UInt256 getBlockKey(uint32_t blockNum) {
+    // Each block is encrypted with its own key derived from the volume's key, so the block store
+    // alone can't read the volume, much like our file can't be found without the key.
+
+    static_assert(Volume::BLOCK_SIZE == LocalBlockShard::BLOCK_SIZE, "block sizes differ");
+
+    UInt256 result;
+    uint64_t input = blockNum;
+    const ObjectKey& key = getKey();
+    KJ_ASSERT(crypto_generichash_blake2b(
+        reinterpret_cast<byte*>(result.value), sizeof(result.value),
+        reinterpret_cast<const byte*>(&input), sizeof(input),
+        reinterpret_cast<const byte*>(key.key), sizeof(key.key)) == 0);
+    return result;
+  }
 };
 
 constexpr FilesystemStorage::Type FilesystemStorage::VolumeImpl::TYPE;
@@ -2073,8 +3750,8 @@ constexpr FilesystemStorage::Type FilesystemStorage::VolumeImpl::TYPE;
 
 class FilesystemStorage::StorageFactoryImpl: public StorageFactory::Server {
 public:
-  StorageFactoryImpl(ObjectFactory& factory, capnp::Capability::Client storage)
-      : factory(factory), storage(kj::mv(storage)) {}
+  StorageFactoryImpl(ObjectFactory& factory, int templatesFd, capnp::Capability::Client storage)
+      : factory(factory), templatesFd(templatesFd), storage(kj::mv(storage)) {}
 
   kj::Promise<void> newBlob(NewBlobContext context) override {
     auto result = factory.newObject<BlobImpl>();
@@ -2098,6 +3775,34 @@ public:
     return kj::READY_NOW;
   }
 
+  kj::Promise<void> newVolumeFromTemplate(NewVolumeFromTemplateContext context) override {
+    auto templateId = context.getParams().getTemplateId();
+    KJ_REQUIRE(templateId.size() > 0 && templateId[0] != '.' &&
+               strchr(templateId.cStr(), '/') == nullptr, "invalid template ID", templateId);
+    auto maybeTemplateFd =
+        sandstorm::raiiOpenAtIfExists(templatesFd, templateId, O_RDONLY | O_CLOEXEC);
+    auto& templateFd = KJ_REQUIRE_NONNULL(maybeTemplateFd, "no such volume template", templateId);
+    auto templateName = kj::heapString(templateId);
+    context.releaseParams();
+
+    auto result = factory.newObject<VolumeImpl>();
+    auto& volume = result.object;
+    kj::Promise<void> promise = nullptr;
+    if (factory.getBlockShard() == nullptr) {
+      promise = volume.initFromTemplate(kj::mv(templateFd));
+    } else {
+      promise = getTemplateBlocks(kj::mv(templateName), kj::mv(templateFd))
+          .then([&volume](kj::Array<TemplateBlock> blocks) {
+        volume.initFromTemplateBlocks(blocks);
+      });
+    }
+
+    // Holding the client keeps the volume alive until it's initialized.
+    return promise.then([context, KJ_MVCAP(client = result.client)]() mutable {
+      context.getResults(capnp::MessageSize { 4, 1 }).setVolume(kj::mv(client));
+    });
+  }
+
   kj::Promise<void> newAssignable(NewAssignableContext context) override {
     auto result = factory.newObject<AssignableImpl>();
     auto promise = result.object.setStoredObject(context.getParams().getInitialValue());
@@ -2107,103 +3812,941 @@ public:
 
 private:
   ObjectFactory& factory;
+  int templatesFd;
   capnp::Capability::Client storage;  // ensures storage is not destroyed while factory exists
+
+  kj::Promise<kj::Array<TemplateBlock>> getTemplateBlocks(
+      kj::String templateId, kj::AutoCloseFd templateFd) {
+    // Returns the template's non-zero blocks, as immutable blocks in the block shard. The first
+    // call for each template adds the blocks -- off the event loop -- and records them in
+    // templates/.<templateId>.blocks, whose references keep them alive for good. Volumes made
+    // from the template then share the blocks rather than copying them.
+
+    auto tableName = kj::str('.', templateId, ".blocks");
+    KJ_IF_MAYBE(tableFd,
+        sandstorm::raiiOpenAtIfExists(templatesFd, tableName, O_RDONLY | O_CLOEXEC)) {
+      return readTemplateBlocks(*tableFd, 0);
+    }
+
+    auto& shard = KJ_ASSERT_NONNULL(factory.getBlockShard());
+    int dirFd = templatesFd;
+    return factory.getBlockingWorker().run<kj::Array<TemplateBlock>>(
+        [&shard,dirFd,KJ_MVCAP(tableName),KJ_MVCAP(templateFd)]() {
+      kj::Vector<TemplateBlock> blocks;
+      scanSparseFile(templateFd, [&](uint64_t offset, kj::ArrayPtr<const byte> data) {
+        // Runs are block-aligned, except perhaps a partial block at the end of the file.
+        byte block[Volume::BLOCK_SIZE];
+        for (size_t pos = 0; pos < data.size(); pos += Volume::BLOCK_SIZE) {
+          auto chunk = data.slice(pos, kj::min(pos + Volume::BLOCK_SIZE, data.size()));
+          memset(block, 0, sizeof(block));
+          memcpy(block, chunk.begin(), chunk.size());
+          if (isAllZero(block)) continue;
+          blocks.add(TemplateBlock {
+              (offset + pos) / Volume::BLOCK_SIZE, shard.addImmutable(block) });
+        }
+      });
+      shard.sync();
+
+      // Write the table in full before linking it in. If another call beat us to it, its table
+      // is just as good; the references we added are merely never dropped.
+      auto tmp = sandstorm::raiiOpenAt(dirFd, ".", O_RDWR | O_TMPFILE | O_CLOEXEC);
+      pwriteAll(tmp, blocks.begin(), blocks.asPtr().asBytes().size(), 0);
+      KJ_SYSCALL(fdatasync(tmp));
+      if (linkat(AT_FDCWD, kj::str("/proc/self/fd/", tmp.get()).cStr(), dirFd,
+                 tableName.cStr(), AT_SYMLINK_FOLLOW) < 0 && errno != EEXIST) {
+        KJ_FAIL_SYSCALL("linkat(templates, tableName)", errno, tableName);
+      }
+      return blocks.releaseAsArray();
+    });
+  }
 };
 
 // =======================================================================================
-// finish implementing ObjectFactory
-
-FilesystemStorage::ObjectFactory::ObjectFactory(Journal& journal, kj::Timer& timer,
-                                                Restorer<SturdyRef>::Client&& restorer)
-    : journal(journal), timer(timer), restorer(kj::mv(restorer)) {}
 
-template <typename T>
-auto FilesystemStorage::ObjectFactory::newObject() -> ClientObjectPair<typename T::Serves, T> {
-  return registerObject<T>(kj::heap<T>(journal, kj::addRef(*this), T::TYPE));
-}
+class FilesystemStorage::SiblingImpl: public StorageSibling::Server {
+public:
+  SiblingImpl(FilesystemStorage& storage, capnp::Capability::Client storageCap)
+      : storage(storage), storageCap(kj::mv(storageCap)) {}
 
-auto FilesystemStorage::ObjectFactory::openObject(ObjectKey key)
-    -> ClientObjectPair<capnp::Capability, ObjectBase> {
-  ObjectId id = key;
-  auto iter = objectCache.find(id);
-  if (iter != objectCache.end()) {
-    ObjectBase& object = *iter->second;
-    return { object.self(), object };
+protected:
+  kj::Promise<void> getRoot(GetRootContext context) override {
+    auto name = context.getParams().getName();
+    auto maybeRoot = storage.tryOpenRoot(name);
+    auto& root = KJ_REQUIRE_NONNULL(maybeRoot, "no such storage root", name);
+    context.getResults(capnp::MessageSize { 4, 1 }).setObject(root.castAs<OwnedStorage<>>());
+    return kj::READY_NOW;
   }
 
-  // Not in cache. Create it.
-  Xattr xattr;
-  auto fd = KJ_ASSERT_NONNULL(journal.openObject(id, xattr), "object not found");
-
-  switch (xattr.type) {
-#define HANDLE_TYPE(tag, type) \
-    case Type::tag: \
-      return registerObject(kj::heap<type>(journal, kj::addRef(*this), key, id, xattr, kj::mv(fd)))
-    HANDLE_TYPE(BLOB, BlobImpl);
-    HANDLE_TYPE(VOLUME, VolumeImpl);
-//    HANDLE_TYPE(IMMUTABLE, ImmutableImpl);
-    HANDLE_TYPE(ASSIGNABLE, AssignableImpl);
-//    HANDLE_TYPE(COLLECTION, CollectionImpl);
-//    HANDLE_TYPE(OPAQUE, OpaqueImpl);
-#undef HANDLE_TYPE
-//    case Type::REFERENCE:
-    default:
-      KJ_UNIMPLEMENTED("unimplemented storage object type seen on disk", (uint)xattr.type);
+  kj::Promise<void> setRoot(SetRootContext context) override {
+    auto params = context.getParams();
+    auto name = kj::heapString(params.getName());
+    auto object = storage.factory->openObject(ObjectKey(params.getObject()))
+        .client.castAs<OwnedStorage<>>();
+    context.releaseParams();
+    return storage.setImpl(kj::mv(name), kj::mv(object));
   }
-}
 
-auto FilesystemStorage::ObjectFactory::getLiveObject(capnp::Capability::Client& client)
-    -> kj::Promise<kj::Maybe<FilesystemStorage::ObjectBase&>> {
-  return serverSet.getLocalServer(client).then([](auto&& maybeServer) {
-    return maybeServer.map([](auto& server) -> ObjectBase& {
-      return dynamic_cast<ObjectBase&>(server);
-    });
-  });
-}
+  kj::Promise<void> removeRoot(RemoveRootContext context) override {
+    auto name = kj::heapString(context.getParams().getName());
+    context.releaseParams();
+    return storage.removeImpl(kj::mv(name));
+  }
 
-void FilesystemStorage::ObjectFactory::destroyed(ObjectBase& object) {
-  objectCache.erase(object.getId());
-}
+  kj::Promise<void> restore(RestoreContext context) override {
+    auto ref = context.getParams().getRef();
+    KJ_REQUIRE(ref.getNode() == storage.factory->getNodeIndex(), "object is on another node");
+    auto cap = storage.factory->restoreWeakRef(ref);
+    context.releaseParams();
+    context.getResults(capnp::MessageSize { 4, 1 }).setCap(kj::mv(cap));
+    return kj::READY_NOW;
+  }
 
-void FilesystemStorage::ObjectFactory::modifyTransitiveSize(
-    ObjectId id, int64_t deltaBlocks, Journal::Transaction& txn) {
-  if (id == nullptr) {
-    // Root. Skip.
-    return;
+  kj::Promise<void> getFactory(GetFactoryContext context) override {
+    context.getResults(capnp::MessageSize { 4, 1 }).setFactory(
+        kj::heap<StorageFactoryImpl>(*storage.factory, storage.templatesFd, storageCap));
+    return kj::READY_NOW;
   }
 
-  Xattr scratchXattr;
-  Xattr* xattr;
+  kj::Promise<void> findRoot(FindRootContext context) override {
+    auto name = context.getParams().getName();
+    KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(storage.rootsFd, name, O_RDONLY | O_CLOEXEC)) {
+      capnp::StreamFdMessageReader message(kj::mv(*fd));
+      auto root = message.getRoot<StoredRoot>();
+      uint32_t self = storage.factory->getNodeIndex();
+      auto results = context.getResults(capnp::MessageSize { 16, 0 });
+      results.setHolder(self);
+      auto ref = results.initObject();
+      ObjectKey(root.getKey()).copyTo(ref);
+      ref.setNode(root.isSibling() ? root.getSibling() : self);
+      return kj::READY_NOW;
+    }
 
-  auto iter = objectCache.find(id);
-  if (iter == objectCache.end()) {
-    // Object not loaded. Edit directly.
-    if (journal.openObject(id, scratchXattr) == nullptr) {
-      // Apparently the object has been deleted. There's no use trying to modify it or its parents.
-      return;
+    auto previousNode = storage.previousHome(name);
+    KJ_IF_MAYBE(previous, previousNode) {
+      // The root may predate us, too.
+      auto req = storage.factory->getSibling(*previous).findRootRequest();
+      req.setName(name);
+      return context.tailCall(kj::mv(req));
     }
-    xattr = &scratchXattr;
-  } else {
-    xattr = &iter->second->getXattrRef();
+
+    return kj::READY_NOW;
   }
 
-  if (deltaBlocks < 0 && -deltaBlocks > xattr->transitiveBlockCount) {
-    KJ_LOG(ERROR, "storage object had inconsistent transitive block count",
-        deltaBlocks, xattr->transitiveBlockCount);
-    deltaBlocks = -xattr->transitiveBlockCount;
+  kj::Promise<void> dropRoot(DropRootContext context) override {
+    auto name = context.getParams().getName();
+    if (storage.getRootSibling(name) != nullptr) {
+      storage.unlinkRoot(name);
+    }
+    return kj::READY_NOW;
   }
 
-  xattr->transitiveBlockCount += deltaBlocks;
-  txn.updateObjectXattr(id, *xattr);
+private:
+  FilesystemStorage& storage;
+  capnp::Capability::Client storageCap;  // ensures storage is not destroyed while sibling exists
+};
 
-  modifyTransitiveSize(xattr->owner, deltaBlocks, txn);
-}
+// =======================================================================================
 
-void FilesystemStorage::ObjectFactory::disowned(ObjectId id) {
-  auto iter = objectCache.find(id);
+class FilesystemStorage::ReplicaImpl: public StorageReplica::Server {
+  // The standby's end of replication: applies what a Replicator ships.
+
+public:
+  ReplicaImpl(FilesystemStorage& storage, capnp::Capability::Client storageCap)
+      : storage(storage), storageCap(kj::mv(storageCap)) {}
+
+  static constexpr const char* PROMOTED_MARKER = ".promoted";
+  // Created in roots/ by promote(). Root names can't start with '.', so it's never mistaken for
+  // a root.
+
+protected:
+  kj::Promise<void> newFile(NewFileContext context) override {
+    requireNotPromoted();
+    auto params = context.getParams();
+    auto fd = storage.createTempFile();
+    KJ_SYSCALL(ftruncate(fd, params.getSize()));
+    files[params.getFile()] = kj::mv(fd);
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> writeFile(WriteFileContext context) override {
+    requireNotPromoted();
+    auto params = context.getParams();
+    auto iter = files.find(params.getFile());
+    KJ_REQUIRE(iter != files.end(), "no such replicated file", params.getFile());
+    auto data = params.getData();
+    pwriteAll(iter->second, data.begin(), data.size(), params.getOffset());
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> commit(CommitContext context) override {
+    requireNotPromoted();
+    auto promise = storage.journal->replay(context.getParams().getEntries(),
+        [this](uint64_t number) -> kj::Maybe<kj::AutoCloseFd> {
+      auto iter = files.find(number);
+      if (iter == files.end()) return nullptr;
+      auto result = kj::mv(iter->second);
+      files.erase(iter);
+      return kj::mv(result);
+    });
+    context.releaseParams();
+    return kj::mv(promise);
+  }
+
+  kj::Promise<void> writeObject(WriteObjectContext context) override {
+    requireNotPromoted();
+    auto params = context.getParams();
+    KJ_IF_MAYBE(fd, openInPlace(params.getObject())) {
+      // Write runs of non-zero blocks, and punch out runs of zero blocks.
+      auto data = params.getData();
+      uint64_t offset = params.getOffset();
+      size_t runStart = 0;
+      bool runIsZero = false;
+      auto flush = [&](size_t end) {
+        if (end == runStart) return;
+        if (runIsZero) {
+          KJ_SYSCALL(fallocate(*fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                               offset + runStart, end - runStart));
+        } else {
+          pwriteAll(*fd, data.begin() + runStart, end - runStart, offset + runStart);
+        }
+        runStart = end;
+      };
+      for (size_t pos = 0; pos < data.size(); pos += Volume::BLOCK_SIZE) {
+        size_t end = kj::min(pos + Volume::BLOCK_SIZE, data.size());
+        bool zero = end - pos == Volume::BLOCK_SIZE && isAllZero(data.slice(pos, end));
+        if (zero != runIsZero) {
+          flush(pos);
+          runIsZero = zero;
+        }
+      }
+      flush(data.size());
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> zeroObject(ZeroObjectContext context) override {
+    requireNotPromoted();
+    auto params = context.getParams();
+    KJ_IF_MAYBE(fd, openInPlace(params.getObject())) {
+      KJ_SYSCALL(fallocate(*fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                           params.getOffset(), params.getSize()));
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> syncObject(SyncObjectContext context) override {
+    requireNotPromoted();
+    KJ_IF_MAYBE(fd, openInPlace(context.getParams().getObject())) {
+      KJ_SYSCALL(fdatasync(*fd));
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> setRoot(SetRootContext context) override {
+    requireNotPromoted();
+    auto params = context.getParams();
+    auto name = params.getName();
+    auto root = params.getRoot();
+    KJ_REQUIRE(name.size() > 0 && name[0] != '.', "invalid storage root name", name);
+    storage.writeRoot(name, root.getKey(),
+        root.isSibling() ? kj::Maybe<uint32_t>(root.getSibling()) : nullptr);
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> removeRoot(RemoveRootContext context) override {
+    requireNotPromoted();
+    auto name = context.getParams().getName();
+    KJ_REQUIRE(name.size() > 0 && name[0] != '.', "invalid storage root name", name);
+    storage.unlinkRoot(name);
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> beginResync(BeginResyncContext context) override {
+    requireNotPromoted();
+    files.clear();
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> finishResync(FinishResyncContext context) override {
+    requireNotPromoted();
+    std::set<kj::StringPtr> keep;
+    auto roots = context.getParams().getRoots();
+    for (auto root: roots) {
+      keep.insert(root);
+    }
+    for (auto& name: sandstorm::listDirectoryFd(storage.rootsFd)) {
+      if (!name.startsWith(".") && keep.count(name) == 0) {
+        storage.unlinkRoot(name);
+      }
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> promote(PromoteContext context) override {
+    if (!storage.wasPromoted()) {
+      KJ_LOG(WARNING, "storage standby promoted");
+      files.clear();
+      sandstorm::raiiOpenAt(storage.rootsFd, PROMOTED_MARKER,
+                            O_WRONLY | O_CREAT | O_CLOEXEC);
+      storage.sync();
+    }
+    return kj::READY_NOW;
+  }
+
+private:
+  FilesystemStorage& storage;
+  capnp::Capability::Client storageCap;  // ensures storage is not destroyed while replica exists
+
+  std::unordered_map<uint64_t, kj::AutoCloseFd> files;
+  // Temporary files created by newFile(), until a commit() takes them.
+
+  void requireNotPromoted() {
+    // (The Replicator recognizes this message; see STANDBY_PROMOTED_MESSAGE.)
+    KJ_REQUIRE(!storage.wasPromoted(), "storage standby was promoted; no longer replicating");
+  }
+
+  kj::Maybe<kj::AutoCloseFd> openInPlace(StoredObjectId::Reader id) {
+    // Opens a Volume or Blob to write in place, or returns null if it doesn't exist (yet).
+    // Volumes in a block shard are skipped; their blocks aren't replicated.
+
+    Xattr xattr;
+    KJ_IF_MAYBE(fd, storage.journal->openObject(id, xattr)) {
+      if ((xattr.type == Type::VOLUME && !xattr.inBlockShard) || xattr.type == Type::BLOB) {
+        return kj::mv(*fd);
+      }
+    }
+    return nullptr;
+  }
+};
+
+// =======================================================================================
+
+class FilesystemStorage::ReplicaSetImpl: public BackendSet<StorageReplica>::Server {
+  // Through which the master tells the Replicator where the standby is. Normally it holds one
+  // standby at most; the one added last wins.
+
+public:
+  ReplicaSetImpl(Replicator& replicator, capnp::Capability::Client storageCap)
+      : replicator(replicator), storageCap(kj::mv(storageCap)) {}
+
+protected:
+  kj::Promise<void> reset(ResetContext context) override {
+    auto backends = context.getParams().getBackends();
+    if (backends.size() == 0) {
+      current = nullptr;
+      replicator.setStandby(nullptr);
+    } else {
+      auto last = backends[backends.size() - 1];
+      current = last.getId();
+      replicator.setStandby(last.getBackend());
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> add(AddContext context) override {
+    auto params = context.getParams();
+    current = params.getId();
+    replicator.setStandby(params.getBackend());
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> remove(RemoveContext context) override {
+    if (current == context.getParams().getId()) {
+      current = nullptr;
+      replicator.setStandby(nullptr);
+    }
+    return kj::READY_NOW;
+  }
+
+private:
+  Replicator& replicator;
+  capnp::Capability::Client storageCap;  // ensures storage is not destroyed while set exists
+  kj::Maybe<uint64_t> current;
+};
+
+// =======================================================================================
+
+class FilesystemStorage::RootMigrator {
+  // Implements StorageRootSet.migrate(): copies a root and everything it owns to another storage
+  // node while it stays in use, then leaves this node forwarding to the copy.
+  //
+  // Volumes hold nearly all the data, so they are copied first, in the background, one at a time,
+  // tracking which blocks are written meanwhile. Each pass copies the blocks written during the
+  // previous one, until few are left. Then comes the final pass: every Assignable in the tree is
+  // held -- its set()s wait -- and copied, each volume's user is disconnected so that its last
+  // writes can be copied, and the root is swapped over. If the migrator is destroyed before that
+  // (e.g. because the call failed or was canceled), everything is left as it was; the copies made
+  // so far are orphans on the other node, which deletes them once we drop them.
+
+public:
+  RootMigrator(FilesystemStorage& storage, capnp::Capability::Client storageCap,
+               kj::String name, uint32_t toNode)
+      : storage(storage), storageCap(kj::mv(storageCap)), name(kj::mv(name)), toNode(toNode),
+        destination(storage.factory->getSibling(toNode)),
+        destinationFactory(destination.getFactoryRequest().send().getFactory()) {}
+
+  ~RootMigrator() noexcept(false) {
+    for (auto& entry: volumes) {
+      entry.second.source.stopTrackingWrites();
+    }
+    for (auto& held: heldAssignables) {
+      if (moved) {
+        held.object.releaseSets(KJ_EXCEPTION(DISCONNECTED,
+            "storage object moved to another node; get the root again"));
+      } else {
+        held.object.releaseSets();
+      }
+    }
+  }
+
+  kj::Promise<void> run() {
+    KJ_REQUIRE(toNode != storage.factory->getNodeIndex(), "storage root is already on that node");
+    auto maybeKey = getLocalRootKey();
+    rootKey = KJ_REQUIRE_NONNULL(maybeKey, "no such storage root held by this node", name);
+
+    auto root = storage.factory->openObject(rootKey);
+    return findData(root.object, kj::mv(root.client)).then([this]() {
+      return copyVolumes(KJ_MAP(entry, volumes) { return &entry.second; });
+    }).then([this]() {
+      return copyBlobs(KJ_MAP(entry, blobs) { return &entry.second; });
+    }).then([this]() {
+      auto root = storage.factory->openObject(rootKey);
+      return copyFinal(root.object, kj::mv(root.client));
+    }).then([this](capnp::Capability::Client copy) {
+      return swap(kj::mv(copy));
+    });
+  }
+
+private:
+  static constexpr uint MAX_RUN_BLOCKS = 1024;
+  // Blocks copied per read()/write() pair: 4MB.
+
+  static constexpr size_t FINAL_PASS_BLOCKS = 4096;
+  static constexpr uint MAX_PASSES = 8;
+  // We stop making passes over a volume once a pass has at most FINAL_PASS_BLOCKS to copy (16MB),
+  // leaving the rest to the final pass, or after MAX_PASSES in case it's being written as fast as
+  // we can copy, in which case the final pass just takes longer.
+
+  struct CopiedVolume {
+    VolumeImpl& source;
+    capnp::Capability::Client sourceCap;  // prevent gc
+    OwnedVolume::Client copy;
+  };
+
+  struct CopiedBlob {
+    BlobImpl& source;
+    capnp::Capability::Client sourceCap;  // prevent gc
+    kj::Maybe<OwnedBlob::Client> copy;
+  };
+
+  struct HeldAssignable {
+    AssignableImpl& object;
+    capnp::Capability::Client cap;  // prevent gc
+  };
+
+  FilesystemStorage& storage;
+  capnp::Capability::Client storageCap;  // prevent gc
+  kj::String name;
+  uint32_t toNode;
+  StorageSibling::Client destination;
+  StorageFactory::Client destinationFactory;
+
+  ObjectKey rootKey;
+  std::unordered_map<ObjectId, CopiedVolume, ObjectId::Hash> volumes;
+  std::unordered_map<ObjectId, CopiedBlob, ObjectId::Hash> blobs;
+  kj::Vector<CopiedVolume*> finalVolumes;  // the volumes still in the tree at the final pass
+  kj::Vector<HeldAssignable> heldAssignables;
+  bool moved = false;
+
+  kj::Maybe<ObjectKey> getLocalRootKey() {
+    // The key of the root object, if the root exists and this node holds it.
+
+    KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(
+        storage.rootsFd, name, O_RDONLY | O_CLOEXEC)) {
+      capnp::StreamFdMessageReader message(kj::mv(*fd));
+      auto root = message.getRoot<StoredRoot>();
+      if (root.isLocal()) return ObjectKey(root.getKey());
+    }
+    return nullptr;
+  }
+
+  CopiedVolume& addVolume(VolumeImpl& volume, capnp::Capability::Client cap) {
+    KJ_REQUIRE(volume.getWrittenBlockCount() == 0, "volume is already being migrated");
+    volume.trackWrites();
+    auto copy = destinationFactory.newVolumeRequest().send().getVolume();
+    return volumes.insert(std::make_pair(volume.getId(),
+        CopiedVolume { volume, kj::mv(cap), kj::mv(copy) })).first->second;
+  }
+
+  kj::Promise<void> findData(capnp::Capability::Client cap) {
+    auto promise = storage.factory->getLiveObject(cap);
+    return promise.then([this,KJ_MVCAP(cap)](kj::Maybe<ObjectBase&> object) mutable
+                        -> kj::Promise<void> {
+      KJ_IF_MAYBE(o, object) {
+        return findData(*o, kj::mv(cap));
+      } else {
+        // Not one of our objects, so not owned, just referenced. The copy will reference it too.
+        return kj::READY_NOW;
+      }
+    });
+  }
+
+  kj::Promise<void> findData(ObjectBase& object, capnp::Capability::Client cap) {
+    // Finds the volumes and blobs in the tree under `object`, and starts tracking writes to the
+    // volumes.
+
+    switch (object.getXattrRef().type) {
+      case Type::VOLUME:
+        addVolume(dynamic_cast<VolumeImpl&>(object), kj::mv(cap));
+        return kj::READY_NOW;
+
+      case Type::BLOB:
+        blobs.insert(std::make_pair(object.getId(),
+            CopiedBlob { dynamic_cast<BlobImpl&>(object), kj::mv(cap), nullptr }));
+        return kj::READY_NOW;
+
+      case Type::ASSIGNABLE: {
+        auto message = dynamic_cast<AssignableImpl&>(object).snapshot();
+        auto promises = KJ_MAP(child, message->getCapTable()) -> kj::Promise<void> {
+          KJ_IF_MAYBE(c, child) {
+            return findData(capnp::Capability::Client((*c)->addRef()));
+          } else {
+            return kj::READY_NOW;
+          }
+        };
+        return kj::joinPromises(kj::mv(promises)).attach(kj::mv(message));
+      }
+
+      default:
+        KJ_FAIL_REQUIRE("can't migrate this type of storage object",
+                        (uint)object.getXattrRef().type);
+    }
+  }
+
+  kj::Promise<void> copyVolumes(kj::Array<CopiedVolume*> pending, size_t i = 0) {
+    if (i == pending.size()) return kj::READY_NOW;
+    return catchUp(*pending[i]).then([this,KJ_MVCAP(pending),i]() mutable {
+      return copyVolumes(kj::mv(pending), i + 1);
+    });
+  }
+
+  kj::Promise<void> catchUp(CopiedVolume& volume, uint pass = 0) {
+    // Copies the blocks written since the last pass -- the first time, all of them.
+
+    auto blocks = volume.source.takeWrittenBlocks();
+    bool last = blocks.size() <= FINAL_PASS_BLOCKS || pass + 1 >= MAX_PASSES;
+    auto promise = copyBlocks(volume.sourceCap.castAs<Volume>(), volume.copy, kj::mv(blocks));
+    if (last) return kj::mv(promise);
+    return promise.then([this,&volume,pass]() {
+      return catchUp(volume, pass + 1);
+    });
+  }
+
+  static kj::Promise<void> copyBlocks(Volume::Client from, Volume::Client to,
+                                      kj::Array<uint32_t> blocks, size_t start = 0) {
+    // Copies the given blocks, which are in order, one run of consecutive blocks at a time.
+
+    if (start == blocks.size()) return kj::READY_NOW;
+
+    size_t end = start + 1;
+    while (end < blocks.size() && end - start < MAX_RUN_BLOCKS &&
+           blocks[end] == blocks[end - 1] + 1) {
+      ++end;
+    }
+
+    uint32_t first = blocks[start];
+    auto req = from.readRequest();
+    req.setBlockNum(first);
+    req.setCount(end - start);
+    return req.send().then([to,first](auto&& response) mutable {
+      auto data = response.getData();
+      auto write = to.writeRequest(
+          capnp::MessageSize { 16 + data.size() / sizeof(capnp::word), 0 });
+      write.setBlockNum(first);
+      write.setData(data);
+      return write.send();
+    }).then([KJ_MVCAP(from),KJ_MVCAP(to),KJ_MVCAP(blocks),end](auto&&) mutable {
+      return copyBlocks(kj::mv(from), kj::mv(to), kj::mv(blocks), end);
+    });
+  }
+
+  kj::Promise<void> copyBlobs(kj::Array<CopiedBlob*> pending, size_t i = 0) {
+    // Copies the blobs which are done uploading. The rest are copied in the final pass.
+
+    for (; i < pending.size(); i++) {
+      auto& blob = *pending[i];
+      if (blob.source.getXattrRef().readOnly) {
+        return copyBlob(blob.sourceCap).then(
+            [this,KJ_MVCAP(pending),i,&blob](OwnedBlob::Client copy) mutable {
+          blob.copy = kj::mv(copy);
+          return copyBlobs(kj::mv(pending), i + 1);
+        });
+      }
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<OwnedBlob::Client> copyBlob(capnp::Capability::Client source) {
+    auto upload = destinationFactory.uploadBlobRequest().send();
+    auto blob = upload.getBlob();
+    auto req = source.castAs<sandstorm::Blob>().writeToRequest();
+    req.setStream(upload.getStream());
+    return req.send().then([KJ_MVCAP(blob)](auto&&) mutable {
+      return kj::mv(blob);
+    });
+  }
+
+  kj::Promise<kj::Maybe<capnp::Capability::Client>> copyFinal(capnp::Capability::Client cap) {
+    auto promise = storage.factory->getLiveObject(cap);
+    return promise.then([this,KJ_MVCAP(cap)](kj::Maybe<ObjectBase&> object) mutable
+                        -> kj::Promise<kj::Maybe<capnp::Capability::Client>> {
+      KJ_IF_MAYBE(o, object) {
+        return copyFinal(*o, kj::mv(cap)).then([](capnp::Capability::Client copy) {
+          return kj::Maybe<capnp::Capability::Client>(kj::mv(copy));
+        });
+      } else {
+        return kj::Maybe<capnp::Capability::Client>(nullptr);
+      }
+    });
+  }
+
+  kj::Promise<capnp::Capability::Client> copyFinal(
+      ObjectBase& object, capnp::Capability::Client cap) {
+    // Copies `object` and the tree under it for good, holding still whatever could change.
+
+    switch (object.getXattrRef().type) {
+      case Type::VOLUME: {
+        auto iter = volumes.find(object.getId());
+        CopiedVolume& volume = iter == volumes.end()
+            ? addVolume(dynamic_cast<VolumeImpl&>(object), kj::mv(cap))  // new since we started
+            : iter->second;
+        finalVolumes.add(&volume);
+
+        // Take exclusive access away from the volume's user, so that it can't write any more, then
+        // copy what it wrote last.
+        return volume.sourceCap.castAs<Volume>().getExclusiveRequest().send()
+            .then([&volume](auto&& response) {
+          return copyBlocks(response.getExclusive(), volume.copy,
+                            volume.source.takeWrittenBlocks());
+        }).then([&volume]() -> capnp::Capability::Client {
+          return volume.copy;
+        });
+      }
+
+      case Type::BLOB: {
+        auto iter = blobs.find(object.getId());
+        if (iter != blobs.end()) {
+          KJ_IF_MAYBE(copy, iter->second.copy) {
+            return capnp::Capability::Client(*copy);
+          }
+        }
+        return copyBlob(kj::mv(cap)).then([](OwnedBlob::Client copy) -> capnp::Capability::Client {
+          return kj::mv(copy);
+        });
+      }
+
+      case Type::ASSIGNABLE: {
+        auto& assignable = dynamic_cast<AssignableImpl&>(object);
+        assignable.holdSets();
+        heldAssignables.add(HeldAssignable { assignable, kj::mv(cap) });
+
+        auto message = assignable.snapshot();
+        auto promises = KJ_MAP(child, message->getCapTable())
+            -> kj::Promise<kj::Maybe<capnp::Capability::Client>> {
+          KJ_IF_MAYBE(c, child) {
+            return copyFinal(capnp::Capability::Client((*c)->addRef()));
+          } else {
+            return kj::Maybe<capnp::Capability::Client>(nullptr);
+          }
+        };
+        return kj::joinPromises(kj::mv(promises)).then([this,KJ_MVCAP(message)](
+            kj::Array<kj::Maybe<capnp::Capability::Client>> copies) {
+          // Substitute the copies for the children. Anything else is left as is.
+          auto capTable = message->getCapTable();
+          for (auto i: kj::indices(copies)) {
+            KJ_IF_MAYBE(copy, copies[i]) {
+              capTable[i] = capnp::ClientHook::from(kj::mv(*copy));
+            }
+          }
+
+          auto req = destinationFactory.newAssignableRequest();
+          req.getInitialValue().set(
+              message->getRoot<Assignable<>::GetResults>().asReader().getValue());
+          return req.send().then([](auto&& response) -> capnp::Capability::Client {
+            return response.getAssignable();
+          });
+        });
+      }
+
+      default:
+        KJ_FAIL_REQUIRE("can't migrate this type of storage object",
+                        (uint)object.getXattrRef().type);
+    }
+  }
+
+  kj::Promise<void> swap(capnp::Capability::Client rootCopy) {
+    // Has the destination take the copy as a root, then atomically replaces our root with a
+    // pointer to it and deletes the original -- unless something changed that we couldn't hold
+    // still, in which case the destination drops the copy again.
+
+    auto promise = rootCopy.castAs<OwnedStorage<>>()
+        .getPersistentWeakRefRequest(capnp::MessageSize { 4, 0 }).send()
+        .then([](auto&& response) {
+      auto req = response.getRef().template getAs<StandardPersistent>()
+          .saveRequest(capnp::MessageSize { 16, 0 });
+      req.getSealFor().setStorage();
+      return req.send();
+    }).then([this](auto&& response) {
+      auto ref = response.getSturdyRef().getStored();
+      ObjectKey key(ref);
+      auto req = destination.setRootRequest();
+      req.setName(name);
+      req.setObject(ref);
+      return req.send().then([key](auto&&) { return key; });
+    });
+
+    return promise.attach(kj::mv(rootCopy)).then([this](ObjectKey copyKey) -> kj::Promise<void> {
+      if (!isUnchanged()) {
+        auto req = destination.removeRootRequest();
+        req.setName(name);
+        return req.send().then([this](auto&&) {
+          KJ_FAIL_REQUIRE(
+              "storage root changed or volume reopened during migration; try again", name);
+        });
+      }
+
+      storage.writeRoot(name, copyKey, toNode);
+      moved = true;
+
+      Journal::Transaction txn(*storage.journal);
+      txn.moveToDeathRow(rootKey);
+      storage.factory->disowned(rootKey);
+      return txn.commit();
+    });
+  }
+
+  bool isUnchanged() {
+    // Whether the tree is still as we copied it. Only volumes can have changed: by being written
+    // after someone -- probably the grain, restarting -- took exclusive access back from us.
+    // Besides that, the root could have been set() to something else.
+
+    for (auto volume: finalVolumes) {
+      if (volume->source.getWrittenBlockCount() > 0) return false;
+    }
+
+    auto maybeKey = getLocalRootKey();
+    KJ_IF_MAYBE(key, maybeKey) {
+      return ObjectId(*key) == ObjectId(rootKey);
+    } else {
+      return false;
+    }
+  }
+};
+
+constexpr uint FilesystemStorage::RootMigrator::MAX_RUN_BLOCKS;
+constexpr size_t FilesystemStorage::RootMigrator::FINAL_PASS_BLOCKS;
+constexpr uint FilesystemStorage::RootMigrator::MAX_PASSES;
+
+// =======================================================================================
+// finish implementing ObjectFactory
+
+FilesystemStorage::ObjectFactory::ObjectFactory(Journal& journal, kj::Timer& timer,
+                                                Restorer<SturdyRef>::Client&& restorer,
+                                                kj::Maybe<LocalBlockShard&> blockShard,
+                                                BlockingWorker& blockingWorker)
+    : journal(journal), timer(timer), blockShard(blockShard), blockingWorker(blockingWorker),
+      restorer(kj::mv(restorer)) {}
+
+template <typename T>
+auto FilesystemStorage::ObjectFactory::newObject() -> ClientObjectPair<typename T::Serves, T> {
+  return registerObject<T>(kj::heap<T>(journal, kj::addRef(*this), T::TYPE));
+}
+
+auto FilesystemStorage::ObjectFactory::openObject(ObjectKey key)
+    -> ClientObjectPair<capnp::Capability, ObjectBase> {
+  ObjectId id = key;
+  auto iter = objectCache.find(id);
+  if (iter != objectCache.end()) {
+    ObjectBase& object = *iter->second;
+    return { object.self(), object };
+  }
+
+  // Not in cache. Create it.
+  Xattr xattr;
+  auto fd = KJ_ASSERT_NONNULL(journal.openObject(id, xattr), "object not found");
+
+  auto detached = detachedXattrs.find(id);
+  if (detached != detachedXattrs.end()) {
+    // We have unflushed size changes for this object, so our copy is newer than the journal's.
+    xattr = detached->second;
+    detachedXattrs.erase(detached);
+  }
+
+  switch (xattr.type) {
+#define HANDLE_TYPE(tag, type) \
+    case Type::tag: \
+      return registerObject(kj::heap<type>(journal, kj::addRef(*this), key, id, xattr, kj::mv(fd)))
+    HANDLE_TYPE(BLOB, BlobImpl);
+    HANDLE_TYPE(VOLUME, VolumeImpl);
+//    HANDLE_TYPE(IMMUTABLE, ImmutableImpl);
+    HANDLE_TYPE(ASSIGNABLE, AssignableImpl);
+//    HANDLE_TYPE(COLLECTION, CollectionImpl);
+//    HANDLE_TYPE(OPAQUE, OpaqueImpl);
+#undef HANDLE_TYPE
+//    case Type::REFERENCE:
+    default:
+      KJ_UNIMPLEMENTED("unimplemented storage object type seen on disk", (uint)xattr.type);
+  }
+}
+
+auto FilesystemStorage::ObjectFactory::getLiveObject(capnp::Capability::Client& client)
+    -> kj::Promise<kj::Maybe<FilesystemStorage::ObjectBase&>> {
+  return serverSet.getLocalServer(client).then([](auto&& maybeServer) {
+    return maybeServer.map([](auto& server) -> ObjectBase& {
+      return dynamic_cast<ObjectBase&>(server);
+    });
+  });
+}
+
+void FilesystemStorage::ObjectFactory::joinCluster(
+    uint32_t nodeIndex, kj::Own<BackendSetImpl<StorageSibling>> siblings) {
+  this->nodeIndex = nodeIndex;
+  this->siblings = kj::mv(siblings);
+}
+
+StorageSibling::Client FilesystemStorage::ObjectFactory::getSibling(uint32_t nodeIndex) {
+  auto& set = KJ_REQUIRE_NONNULL(siblings,
+      "object belongs to another storage node, but this node isn't part of a cluster", nodeIndex);
+  return set->chooseById(nodeIndex);
+}
+
+capnp::Capability::Client FilesystemStorage::ObjectFactory::newWeakRef(ObjectBase& object) {
+  return kj::heap<WeakRefImpl>(object, nodeIndex);
+}
+
+capnp::Capability::Client FilesystemStorage::ObjectFactory::restoreWeakRef(
+    SturdyRef::Stored::Reader ref) {
+  if (ref.getNode() == nodeIndex) {
+    return newWeakRef(openObject(ObjectKey(ref)).object);
+  } else {
+    auto req = getSibling(ref.getNode()).restoreRequest();
+    req.setRef(ref);
+    return req.send().getCap();
+  }
+}
+
+void FilesystemStorage::ObjectFactory::destroyed(ObjectBase& object) {
+  ObjectId id = object.getId();
+  objectCache.erase(id);
+
+  if (dirtyXattrs.count(id) > 0) {
+    // The object's size changed since the last flush. Keep its attributes around so that the
+    // flush still finds them.
+    detachedXattrs[id] = object.getXattrRef();
+  }
+}
+
+constexpr kj::Duration FilesystemStorage::ObjectFactory::TRANSITIVE_SIZE_FLUSH_DELAY;
+constexpr size_t FilesystemStorage::ObjectFactory::MAX_DETACHED_XATTRS;
+
+auto FilesystemStorage::ObjectFactory::getXattrForAccounting(ObjectId id) -> kj::Maybe<Xattr&> {
+  auto iter = objectCache.find(id);
+  if (iter != objectCache.end()) {
+    return iter->second->getXattrRef();
+  }
+
+  auto detached = detachedXattrs.find(id);
+  if (detached != detachedXattrs.end()) {
+    return detached->second;
+  }
+
+  // Object not loaded. Read its attributes once and keep them.
+  Xattr xattr;
+  if (journal.openObject(id, xattr) == nullptr) {
+    return nullptr;
+  }
+  return detachedXattrs.insert(std::make_pair(id, xattr)).first->second;
+}
+
+void FilesystemStorage::ObjectFactory::modifyTransitiveSize(ObjectId id, int64_t deltaBlocks) {
+  // Root (null ID) ends the chain.
+  while (id != nullptr) {
+    KJ_IF_MAYBE(xattr, getXattrForAccounting(id)) {
+      if (deltaBlocks < 0 && -deltaBlocks > xattr->transitiveBlockCount) {
+        KJ_LOG(ERROR, "storage object had inconsistent transitive block count",
+            deltaBlocks, xattr->transitiveBlockCount);
+        deltaBlocks = -xattr->transitiveBlockCount;
+      }
+
+      xattr->transitiveBlockCount += deltaBlocks;
+      dirtyXattrs.insert(id);
+
+      id = xattr->owner;
+    } else {
+      // Apparently the object has been deleted. There's no use trying to modify it or its parents.
+      break;
+    }
+  }
+
+  if (!flushScheduled && !dirtyXattrs.empty()) {
+    flushScheduled = true;
+    flushTimer = timer.afterDelay(TRANSITIVE_SIZE_FLUSH_DELAY)
+        .then([this]() { flushTransitiveSizes(); })
+        .eagerlyEvaluate([](kj::Exception&& exception) {
+      KJ_LOG(ERROR, "failed to flush transitive sizes", exception);
+    });
+  }
+}
+
+void FilesystemStorage::ObjectFactory::flushTransitiveSizes() {
+  flushScheduled = false;
+
+  if (!dirtyXattrs.empty()) {
+    Journal::Transaction txn(journal);
+    for (auto& id: dirtyXattrs) {
+      auto iter = objectCache.find(id);
+      if (iter != objectCache.end()) {
+        txn.updateObjectXattr(id, iter->second->getXattrRef());
+      } else {
+        auto detached = detachedXattrs.find(id);
+        if (detached != detachedXattrs.end()) {
+          txn.updateObjectXattr(id, detached->second);
+        }
+      }
+    }
+    dirtyXattrs.clear();
+    txn.commit();
+  }
+
+  if (detachedXattrs.size() > MAX_DETACHED_XATTRS) {
+    // Everything is clean now, so we can just start over.
+    detachedXattrs.clear();
+  }
+}
+
+void FilesystemStorage::ObjectFactory::shutdown() {
+  flushTransitiveSizes();
+  flushTimer = nullptr;
+}
+
+kj::Maybe<uint64_t> FilesystemStorage::ObjectFactory::disowned(ObjectId id) {
+  dirtyXattrs.erase(id);
+
+  auto iter = objectCache.find(id);
   if (iter != objectCache.end()) {
-    iter->second->getXattrRef().owner = nullptr;
+    auto& xattr = iter->second->getXattrRef();
+    xattr.owner = nullptr;
+    return uint64_t(xattr.transitiveBlockCount);
+  }
+
+  auto detached = detachedXattrs.find(id);
+  if (detached != detachedXattrs.end()) {
+    uint64_t result = detached->second.transitiveBlockCount;
+    detachedXattrs.erase(detached);
+    return result;
   }
+
+  return nullptr;
 }
 
 template <typename T>
@@ -2225,6 +4768,53 @@ static kj::AutoCloseFd openOrCreateDirectory(int parentFd, kj::StringPtr name) {
   return f;
 }
 
+static kj::AutoCloseFd openTemplates(int directoryFd) {
+  // Opens templates/, first adding the built-in templates if they're missing.
+
+  auto fd = openOrCreateDirectory(directoryFd, "templates");
+
+  if (faccessat(fd, "blank-ext4", F_OK, 0) != 0) {
+    // Write it in full before linking it in, so that we never see half a template.
+    auto tmp = sandstorm::raiiOpenAt(fd, ".", O_RDWR | O_TMPFILE | O_CLOEXEC);
+    writeSparseData(BLANK_EXT4, tmp);
+    KJ_SYSCALL(fdatasync(tmp));
+    KJ_SYSCALL(linkat(AT_FDCWD, kj::str("/proc/self/fd/", tmp.get()).cStr(), fd,
+                      "blank-ext4", AT_SYMLINK_FOLLOW));
+  }
+
+  return fd;
+}
+
+static kj::Maybe<kj::Own<ColdStore>> openColdStore(int directoryFd) {
+  KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(
+      directoryFd, "cold", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) {
+    return kj::heap<DirectoryColdStore>(kj::mv(*fd));
+  } else {
+    return nullptr;
+  }
+}
+
+static kj::Maybe<kj::Own<LocalBlockShard>> openBlockShard(
+    int directoryFd, kj::Maybe<kj::Own<ColdStore>>& coldStore) {
+  KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(directoryFd, "blocks", O_RDWR | O_CLOEXEC)) {
+    kj::Maybe<ColdStore&> borrowed;
+    KJ_IF_MAYBE(c, coldStore) {
+      borrowed = **c;
+    }
+    return kj::heap<LocalBlockShard>(kj::mv(*fd), borrowed);
+  } else {
+    return nullptr;
+  }
+}
+
+static kj::Maybe<LocalBlockShard&> borrowBlockShard(kj::Maybe<kj::Own<LocalBlockShard>>& shard) {
+  KJ_IF_MAYBE(s, shard) {
+    return **s;
+  } else {
+    return nullptr;
+  }
+}
+
 FilesystemStorage::FilesystemStorage(
     int directoryFd, kj::UnixEventPort& eventPort, kj::Timer& timer,
     Restorer<SturdyRef>::Client&& restorer)
@@ -2232,19 +4822,49 @@ FilesystemStorage::FilesystemStorage(
       stagingDirFd(openOrCreateDirectory(directoryFd, "staging")),
       deathRowFd(openOrCreateDirectory(directoryFd, "death-row")),
       rootsFd(openOrCreateDirectory(directoryFd, "roots")),
+      templatesFd(openTemplates(directoryFd)),
+      legacyLayout(faccessat(mainDirFd, LayoutMigrator::SHARDED_MARKER, F_OK, 0) != 0),
+      coldStore(openColdStore(directoryFd)),
+      blockShard(openBlockShard(directoryFd, coldStore)),
+      blockingWorker(kj::heap<BlockingWorker>(eventPort)),
       deathRow(kj::heap<DeathRow>(*this)),
       journal(kj::heap<Journal>(*this, eventPort,
           sandstorm::raiiOpenAt(directoryFd, "journal", O_RDWR | O_CREAT | O_CLOEXEC))),
-      factory(kj::refcounted<ObjectFactory>(*journal, timer, kj::mv(restorer))) {}
+      factory(kj::refcounted<ObjectFactory>(*journal, timer, kj::mv(restorer),
+          borrowBlockShard(blockShard), *blockingWorker)) {
+  if (legacyLayout) {
+    layoutMigrator = kj::heap<LayoutMigrator>(*this);
+  }
+
+  KJ_IF_MAYBE(shard, blockShard) {
+    if (coldStore != nullptr) {
+      coldMigrator = kj::heap<ColdMigrator>(**shard);
+    }
+  }
+
+  KJ_IF_MAYBE(shard, blockShard) {
+    // Delete the blocks of volumes which don't exist: ones which were never committed because we
+    // crashed first, or which death row was in the middle of deleting. Only groups present now
+    // are candidates; a volume created from here on can't have one of their IDs.
+    deathRow->sweepBlockGroups((*shard)->getGroups());
+  }
+}
 
-FilesystemStorage::~FilesystemStorage() noexcept(false) {}
+FilesystemStorage::~FilesystemStorage() noexcept(false) {
+  factory->shutdown();
+}
 
 kj::Promise<void> FilesystemStorage::set(SetContext context) {
   auto params = context.getParams();
   auto object = params.getObject();
   auto name = kj::heapString(params.getName());
   context.releaseParams();
-  return setImpl(kj::mv(name), kj::mv(object));
+
+  // Adopt any existing root first, so that whoever holds it lets go of it when it's replaced.
+  auto promise = adoptMovedRoot(name);
+  return promise.then([this,KJ_MVCAP(name),KJ_MVCAP(object)]() mutable {
+    return setImpl(kj::mv(name), kj::mv(object));
+  });
 }
 
 kj::Promise<void> FilesystemStorage::setImpl(kj::String name, OwnedStorage<>::Client object) {
@@ -2259,93 +4879,322 @@ kj::Promise<void> FilesystemStorage::setImpl(kj::String name, OwnedStorage<>::Cl
   }
 
   auto promise = factory->getLiveObject(object);
-  return promise
-      .then([this,KJ_MVCAP(object),KJ_MVCAP(name)](kj::Maybe<ObjectBase&>&& unwrapped) mutable {
-    ObjectBase& base = KJ_ASSERT_NONNULL(unwrapped,
-        "tried to set non-OwnedStorage object as storage root");
-    ObjectBase::AdoptionIntent adoption(base, kj::mv(object));
-
-    capnp::MallocMessageBuilder rootMessage(64);
-    base.getKey().copyTo(rootMessage.getRoot<StoredRoot>().initKey());
-    capnp::writeMessageToFd(
-        sandstorm::raiiOpenAt(rootsFd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC),
-        rootMessage);
+  return promise.then([this,KJ_MVCAP(object),KJ_MVCAP(name)](
+      kj::Maybe<ObjectBase&>&& unwrapped) mutable -> kj::Promise<void> {
+    KJ_IF_MAYBE(base, unwrapped) {
+      ObjectBase::AdoptionIntent adoption(*base, kj::mv(object));
+
+      // If a sibling held the old root for us, it still owns the old object, and must let go.
+      auto oldSibling = getRootSibling(name);
+      writeRoot(name, base->getKey(), nullptr);
+
+      Journal::Transaction txn(*journal);
+      adoption.prepCommit(nullptr);
+      adoption.commit(txn);
+      return txn.commit().then([this,KJ_MVCAP(name),oldSibling]() -> kj::Promise<void> {
+        KJ_IF_MAYBE(s, oldSibling) {
+          return removeSiblingRoot(name, *s);
+        }
+        return kj::READY_NOW;
+      });
+    } else {
+      return setForeignRoot(kj::mv(name), kj::mv(object));
+    }
+  });
+}
 
-    Journal::Transaction txn(*journal);
-    adoption.prepCommit(nullptr);
-    adoption.commit(txn);
-    return txn.commit();
+kj::Promise<void> FilesystemStorage::setForeignRoot(
+    kj::String name, OwnedStorage<>::Client object) {
+  // `object` isn't one of our live objects, so presumably another storage node created it, and
+  // only that node can own it. Have that node hold it as a root, and remember here where it is.
+
+  return object.getPersistentWeakRefRequest(capnp::MessageSize { 4, 0 }).send()
+      .then([](auto&& response) {
+    auto req = response.getRef().template getAs<StandardPersistent>()
+        .saveRequest(capnp::MessageSize { 16, 0 });
+    req.getSealFor().setStorage();
+    return req.send();
+  }).then([this,KJ_MVCAP(name),KJ_MVCAP(object)](auto&& response) mutable
+          -> kj::Promise<void> {
+    auto sturdyRef = response.getSturdyRef();
+    KJ_REQUIRE(sturdyRef.isStored(), "tried to set non-OwnedStorage object as storage root");
+    auto ref = sturdyRef.getStored();
+    ObjectKey key(ref);
+    uint32_t node = ref.getNode();
+
+    if (node == factory->getNodeIndex()) {
+      // It's ours after all, but reached us by way of some other vat.
+      return setImpl(kj::mv(name), factory->openObject(key).client.castAs<OwnedStorage<>>());
+    }
+
+    auto req = factory->getSibling(node).setRootRequest();
+    req.setName(name);
+    req.setObject(ref);
+    return req.send().then([this,KJ_MVCAP(name),KJ_MVCAP(object),key,node](auto&&)
+                           -> kj::Promise<void> {
+      auto oldSibling = getRootSibling(name);
+      writeRoot(name, key, node);
+
+      // If another sibling held the old root, it must let go of it. (The same sibling has just
+      // replaced it already.)
+      KJ_IF_MAYBE(s, oldSibling) {
+        if (*s != node) return removeSiblingRoot(name, *s);
+      }
+      return kj::READY_NOW;
+    });
   });
 }
 
-kj::Promise<void> FilesystemStorage::get(GetContext context) {
-  capnp::StreamFdMessageReader message(sandstorm::raiiOpenAt(
-      rootsFd, context.getParams().getName(), O_RDONLY | O_CLOEXEC));
-  ObjectKey key(message.getRoot<StoredRoot>().getKey());
-  context.getResults().setObject(factory->openObject(key).client.castAs<OwnedStorage<>>());
-  return kj::READY_NOW;
+kj::Maybe<capnp::Capability::Client> FilesystemStorage::tryOpenRoot(kj::StringPtr name) {
+  KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(rootsFd, name, O_RDONLY | O_CLOEXEC)) {
+    capnp::StreamFdMessageReader message(kj::mv(*fd));
+    auto root = message.getRoot<StoredRoot>();
+    switch (root.which()) {
+      case StoredRoot::LOCAL:
+        return factory->openObject(root.getKey()).client;
+      case StoredRoot::SIBLING: {
+        auto req = factory->getSibling(root.getSibling()).getRootRequest();
+        req.setName(name);
+        return capnp::Capability::Client(req.send().getObject());
+      }
+    }
+    KJ_FAIL_ASSERT("unknown storage root type", (uint)root.which(), name);
+  } else {
+    return nullptr;
+  }
 }
 
-kj::Promise<void> FilesystemStorage::tryGet(TryGetContext context) {
-  KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(
-      rootsFd, context.getParams().getName(), O_RDONLY | O_CLOEXEC)) {
+void FilesystemStorage::writeRoot(kj::StringPtr name, const ObjectKey& key,
+                                  kj::Maybe<uint32_t> sibling) {
+  capnp::MallocMessageBuilder rootMessage(64);
+  auto root = rootMessage.getRoot<StoredRoot>();
+  key.copyTo(root.initKey());
+  KJ_IF_MAYBE(s, sibling) {
+    root.setSibling(*s);
+  }
+
+  // Write to a temporary file and rename it into place, so that the root is never seen half
+  // written, even by a migration replacing it. Root names can't start with '.'.
+  auto tempName = kj::str('.', name);
+  capnp::writeMessageToFd(
+      sandstorm::raiiOpenAt(rootsFd, tempName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC),
+      rootMessage);
+  KJ_SYSCALL(renameat(rootsFd, tempName.cStr(), rootsFd, name.cStr()), name);
+
+  KJ_IF_MAYBE(r, replicator) {
+    (*r)->rootChanged(name);
+  }
+}
+
+kj::Maybe<uint32_t> FilesystemStorage::getRootSibling(kj::StringPtr name) {
+  KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(rootsFd, name, O_RDONLY | O_CLOEXEC)) {
     capnp::StreamFdMessageReader message(kj::mv(*fd));
-    ObjectKey key(message.getRoot<StoredRoot>().getKey());
-    context.getResults().setObject(factory->openObject(key).client.castAs<OwnedStorage<>>());
+    auto root = message.getRoot<StoredRoot>();
+    if (root.isSibling()) return root.getSibling();
   }
-  return kj::READY_NOW;
+  return nullptr;
+}
+
+kj::Promise<void> FilesystemStorage::removeSiblingRoot(kj::StringPtr name, uint32_t sibling) {
+  auto req = factory->getSibling(sibling).removeRootRequest();
+  req.setName(name);
+  return req.send().then([](auto&&) {});
+}
+
+kj::Promise<void> FilesystemStorage::get(GetContext context) {
+  return adoptMovedRoot(context.getParams().getName()).then([this,context]() mutable {
+    auto name = context.getParams().getName();
+    auto maybeRoot = tryOpenRoot(name);
+    auto& root = KJ_REQUIRE_NONNULL(maybeRoot, "no such storage root", name);
+    context.getResults().setObject(root.castAs<OwnedStorage<>>());
+  });
+}
+
+kj::Promise<void> FilesystemStorage::tryGet(TryGetContext context) {
+  return adoptMovedRoot(context.getParams().getName()).then([this,context]() mutable {
+    auto maybeRoot = tryOpenRoot(context.getParams().getName());
+    KJ_IF_MAYBE(root, maybeRoot) {
+      context.getResults().setObject(root->castAs<OwnedStorage<>>());
+    }
+  });
 }
 
 kj::Promise<void> FilesystemStorage::getOrCreateAssignable(GetOrCreateAssignableContext context) {
-  auto params = context.getParams();
-  KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(
-      rootsFd, params.getName(), O_RDONLY | O_CLOEXEC)) {
-    capnp::StreamFdMessageReader message(kj::mv(*fd));
-    ObjectKey key(message.getRoot<StoredRoot>().getKey());
-    context.getResults().setObject(factory->openObject(key).client.castAs<OwnedAssignable<>>());
-    return kj::READY_NOW;
-  } else {
-    auto name = kj::heapString(params.getName());
-    auto result = factory->newObject<AssignableImpl>();
-    auto object = result.client.castAs<OwnedStorage<>>();
-    context.getResults(capnp::MessageSize {4, 1}).setObject(kj::mv(result.client));
-    return result.object.setStoredObject(params.getDefaultValue())
-        .then([this,KJ_MVCAP(name),KJ_MVCAP(object)]() mutable {
-      return setImpl(kj::mv(name), kj::mv(object));
+  // Before creating the root, make sure it doesn't already exist on the node which was its home
+  // before this one joined the cluster.
+  return adoptMovedRoot(context.getParams().getName())
+      .then([this,context]() mutable -> kj::Promise<void> {
+    auto params = context.getParams();
+    auto maybeRoot = tryOpenRoot(params.getName());
+    KJ_IF_MAYBE(root, maybeRoot) {
+      context.getResults().setObject(root->castAs<OwnedAssignable<>>());
+      return kj::READY_NOW;
+    } else {
+      auto name = kj::heapString(params.getName());
+      auto result = factory->newObject<AssignableImpl>();
+      auto object = result.client.castAs<OwnedStorage<>>();
+      context.getResults(capnp::MessageSize {4, 1}).setObject(kj::mv(result.client));
+      return result.object.setStoredObject(params.getDefaultValue())
+          .then([this,KJ_MVCAP(name),KJ_MVCAP(object)]() mutable {
+        return setImpl(kj::mv(name), kj::mv(object));
+      });
+    }
+  });
+}
+
+kj::Promise<void> FilesystemStorage::remove(RemoveContext context) {
+  auto name = kj::heapString(context.getParams().getName());
+  context.releaseParams();
+  auto promise = adoptMovedRoot(name);
+  return promise.then([this,KJ_MVCAP(name)]() mutable {
+    return removeImpl(kj::mv(name));
+  });
+}
+
+kj::Maybe<uint32_t> FilesystemStorage::previousHome(kj::StringPtr name) {
+  uint32_t self = factory->getNodeIndex();
+  if (self == 0 || homeAmong(name, self + 1) != self) return nullptr;
+  return uint32_t(homeAmong(name, self));
+}
+
+kj::Promise<void> FilesystemStorage::adoptMovedRoot(kj::StringPtr name) {
+  if (faccessat(rootsFd, name.cStr(), F_OK, AT_SYMLINK_NOFOLLOW) == 0) return kj::READY_NOW;
+
+  auto previousNode = previousHome(name);
+  KJ_IF_MAYBE(previous, previousNode) {
+    auto req = factory->getSibling(*previous).findRootRequest();
+    req.setName(name);
+    auto ownName = kj::heapString(name);
+    return req.send().then([this,KJ_MVCAP(ownName)](auto&& response) -> kj::Promise<void> {
+      if (!response.hasObject()) return kj::READY_NOW;
+
+      // (A concurrent request may have adopted it -- or set it -- meanwhile.)
+      if (faccessat(rootsFd, ownName.cStr(), F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+        return kj::READY_NOW;
+      }
+
+      auto ref = response.getObject();
+      uint32_t node = ref.getNode();
+      uint32_t holder = response.getHolder();
+      KJ_REQUIRE(node != factory->getNodeIndex(),
+                 "previous home forwards storage root back to us", ownName, holder);
+
+      KJ_LOG(INFO, "storage root moved here from its previous home", ownName, holder, node);
+      writeRoot(ownName, ObjectKey(ref), node);
+
+      auto dropReq = factory->getSibling(holder).dropRootRequest();
+      dropReq.setName(ownName);
+      return dropReq.send().ignoreResult();
     });
   }
+
+  return kj::READY_NOW;
 }
 
-kj::Promise<void> FilesystemStorage::remove(RemoveContext context) {
-  kj::StringPtr name = context.getParams().getName();
+kj::Promise<void> FilesystemStorage::removeImpl(kj::String name) {
   KJ_IF_MAYBE(file, sandstorm::raiiOpenAtIfExists(
       rootsFd, name, O_RDONLY | O_CLOEXEC)) {
     capnp::StreamFdMessageReader message(kj::mv(*file));
-    ObjectKey key(message.getRoot<StoredRoot>().getKey());
+    auto root = message.getRoot<StoredRoot>();
+    if (root.isSibling()) {
+      auto promise = removeSiblingRoot(name, root.getSibling());
+      return promise.then([this,KJ_MVCAP(name)]() {
+        unlinkRoot(name);
+      });
+    }
+
+    ObjectKey key(root.getKey());
     Journal::Transaction txn(*journal);
     txn.moveToDeathRow(key);
-    return txn.commit().then([this,name]() {
-      while (unlinkat(rootsFd, name.cStr(), 0) < 0) {
-        int error = errno;
-        if (error == ENOENT) {
-          // fine
-          break;
-        } else if (error != EINTR) {
-          KJ_FAIL_SYSCALL("unlinkat(roots, name)", errno, name);
-        }
-      }
+    factory->disowned(key);
+    return txn.commit().then([this,KJ_MVCAP(name)]() {
+      unlinkRoot(name);
     });
   }
   return kj::READY_NOW;
 }
 
+void FilesystemStorage::unlinkRoot(kj::StringPtr name) {
+  while (unlinkat(rootsFd, name.cStr(), 0) < 0) {
+    int error = errno;
+    if (error == ENOENT) {
+      // fine
+      break;
+    } else if (error != EINTR) {
+      KJ_FAIL_SYSCALL("unlinkat(roots, name)", errno, name);
+    }
+  }
+
+  KJ_IF_MAYBE(r, replicator) {
+    (*r)->rootChanged(name);
+  }
+}
+
 kj::Promise<void> FilesystemStorage::getFactory(GetFactoryContext context) {
-  context.getResults().setFactory(kj::heap<StorageFactoryImpl>(*factory, thisCap()));
+  context.getResults().setFactory(kj::heap<StorageFactoryImpl>(*factory, templatesFd, thisCap()));
   return kj::READY_NOW;
 }
 
+kj::Promise<void> FilesystemStorage::locate(LocateContext context) {
+  return adoptMovedRoot(context.getParams().getName()).then([this,context]() mutable {
+    auto name = context.getParams().getName();
+    uint32_t node = factory->getNodeIndex();
+    auto sibling = getRootSibling(name);
+    KJ_IF_MAYBE(s, sibling) {
+      node = *s;
+    }
+    context.getResults().setNode(node);
+  });
+}
+
+kj::Promise<void> FilesystemStorage::migrate(MigrateContext context) {
+  return adoptMovedRoot(context.getParams().getName())
+      .then([this,context]() mutable -> kj::Promise<void> {
+    auto params = context.getParams();
+    auto migrator = kj::heap<RootMigrator>(
+        *this, thisCap(), kj::heapString(params.getName()), params.getToNode());
+    auto promise = migrator->run();
+    return promise.attach(kj::mv(migrator));
+  });
+}
+
+BackendSet<StorageReplica>::Client FilesystemStorage::replicateTo(bool synchronous) {
+  KJ_REQUIRE(replicator == nullptr, "already replicating");
+  auto ownReplicator = kj::heap<Replicator>(*this, synchronous);
+  auto& ref = *ownReplicator;
+  replicator = kj::mv(ownReplicator);
+  return kj::heap<ReplicaSetImpl>(ref, thisCap());
+}
+
+StorageReplica::Client FilesystemStorage::asStandby() {
+  return kj::heap<ReplicaImpl>(*this, thisCap());
+}
+
+void FilesystemStorage::simulateCrash() {
+  journal->simulateCrash();
+}
+
+bool FilesystemStorage::wasPromoted() {
+  return faccessat(rootsFd, ReplicaImpl::PROMOTED_MARKER, F_OK, 0) == 0;
+}
+
+StorageSibling::Client FilesystemStorage::joinCluster(
+    uint32_t nodeIndex, kj::Own<BackendSetImpl<StorageSibling>> siblings) {
+  factory->joinCluster(nodeIndex, kj::mv(siblings));
+  return kj::heap<SiblingImpl>(*this, thisCap());
+}
+
 kj::Maybe<kj::AutoCloseFd> FilesystemStorage::openObject(ObjectId id) {
-  return sandstorm::raiiOpenAtIfExists(mainDirFd, id.filename('o').begin(), O_RDWR | O_CLOEXEC);
+  if (isLegacyLayout()) {
+    // Check the flat name first: if the object is being migrated concurrently, it moves from
+    // there to the sharded name, never the other way.
+    KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(
+        mainDirFd, id.filename('o').begin(), O_RDWR | O_CLOEXEC)) {
+      return kj::mv(*fd);
+    }
+  }
+  return sandstorm::raiiOpenAtIfExists(
+      mainDirFd, id.shardedFilename('o').begin(), O_RDWR | O_CLOEXEC);
 }
 
 kj::Maybe<kj::AutoCloseFd> FilesystemStorage::openStaging(uint64_t number) {
@@ -2354,8 +5203,15 @@ kj::Maybe<kj::AutoCloseFd> FilesystemStorage::openStaging(uint64_t number) {
 }
 
 kj::AutoCloseFd FilesystemStorage::createObject(ObjectId id) {
-  return sandstorm::raiiOpenAt(mainDirFd, id.filename('o').begin(),
-                               O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC);
+  auto name = id.shardedFilename('o');
+  for (;;) {
+    int fd = openat(mainDirFd, name.begin(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd >= 0) return kj::AutoCloseFd(fd);
+
+    int error = errno;
+    if (error == EINTR || (error == ENOENT && makeShardDirectories(fixedStr(name)))) continue;
+    KJ_FAIL_SYSCALL("openat(main, O_CREAT)", error, fixedStr(name));
+  }
 }
 
 kj::AutoCloseFd FilesystemStorage::createTempFile() {
@@ -2373,68 +5229,87 @@ void FilesystemStorage::deleteStaging(uint64_t number) {
 }
 
 void FilesystemStorage::deleteAllStaging() {
-  for (auto& file: sandstorm::listDirectoryFd(stagingDirFd)) {
-    KJ_SYSCALL(unlinkat(stagingDirFd, file.cStr(), 0));
-  }
+  // After a crash with a large journal backlog there can be a lot of these, so unlink them in
+  // parallel.
+  auto files = sandstorm::listDirectoryFd(stagingDirFd);
+  uint threadCount = files.size() < 256 ? 1 : recoveryThreadCount();
+  parallelFor(threadCount, [&](uint i) {
+    for (size_t j = i; j < files.size(); j += threadCount) {
+      KJ_SYSCALL(unlinkat(stagingDirFd, files[j].cStr(), 0));
+    }
+  });
 }
 
 void FilesystemStorage::createFromStagingIfExists(
     uint64_t stagingId, ObjectId finalId, const Xattr& attributes) {
   auto stagingName = hex64(stagingId);
-  auto finalName = finalId.filename('o');
-
-  // Verify that file doesn't already exist in main.
-  //
-  // TODO(cleanup): Once we can assume kernel 3.15, we can do this atomically with renameat2().
-  if (faccessat(mainDirFd, finalName.begin(), F_OK, 0) == 0) {
-    // Hmm, the target file already exists. This is OK *if* the source file doesn't exist, which
-    // indicates that we're replaying a transaction that already happened.
-    KJ_ASSERT(faccessat(stagingDirFd, stagingName.begin(), F_OK, 0) != 0,
-        "can't create storage object: an object with that ID already exists",
-        stagingName.begin(), finalName.begin());
-    return;
-  }
+  migrateFromLegacyLayout(finalId);
+  auto finalName = finalId.shardedFilename('o');
 
   if (attributes.owner != nullptr) {
     // Verify that owner exists. If the owner was moved directly to death row, then we need to
     // move directly to death row as well, because the death row thread may have already deleted
     // the owner and failed to find this child.
-    auto ownerName = attributes.owner.filename('o');
-  retryAccess:
-    if (faccessat(mainDirFd, ownerName.begin(), F_OK, 0) != 0) {
-      int error = errno;
-      if (error == EINTR) {
-        goto retryAccess;
-      } else if (error == ENOENT) {
-        // Owner no longer exists, so we should just delete. Note that any children of this object
-        // which we attempt to create later will find that this object doesn't exist and therefore
-        // will delete themselves as well, so there's no need to move to death row.
-      retryUnlink:
-        if (unlinkat(stagingDirFd, stagingName.begin(), 0) != 0) {
-          int error = errno;
-          if (error == EINTR) {
-            goto retryUnlink;
-          } else if (error == ENOENT) {
-            // acceptable; file already deleted by someone else
-          } else {
-            KJ_FAIL_SYSCALL("unlinkat(stagingDirFd, stagingName)", error, stagingName);
-          }
+    if (!objectExists(attributes.owner)) {
+      // Owner no longer exists, so we should just delete. Note that any children of this object
+      // which we attempt to create later will find that this object doesn't exist and therefore
+      // will delete themselves as well, so there's no need to move to death row.
+    retryUnlink:
+      if (unlinkat(stagingDirFd, stagingName.begin(), 0) != 0) {
+        int error = errno;
+        if (error == EINTR) {
+          goto retryUnlink;
+        } else if (error == ENOENT) {
+          // acceptable; file already deleted by someone else
+        } else {
+          KJ_FAIL_SYSCALL("unlinkat(stagingDirFd, stagingName)", error, stagingName);
         }
-        return;
-      } else {
-        KJ_FAIL_SYSCALL("faccessat", error, ownerName.begin());
       }
+      return;
     }
   }
 
 retry:
+  // Move into place, unless the file already exists in main. This is OK *if* the source file
+  // doesn't exist, which indicates that we're replaying a transaction that already happened.
+  KJ_IF_MAYBE(error, renameat2IfSupported(stagingDirFd, stagingName.begin(),
+                                          mainDirFd, finalName.begin(), RENAME_NOREPLACE)) {
+    switch (*error) {
+      case 0:
+        break;
+      case ENOENT:
+        // Either the shard directory doesn't exist yet, or the staging file is already gone
+        // (acceptable).
+        if (makeShardDirectories(fixedStr(finalName))) goto retry;
+        break;
+      case EEXIST:
+        // renameat2() checks the source first, so we know the staging file exists.
+        KJ_FAIL_ASSERT("can't create storage object: an object with that ID already exists",
+            stagingName.begin(), finalName.begin());
+      default:
+        KJ_FAIL_SYSCALL("renameat2(staging -> final)", *error,
+                        fixedStr(stagingName), fixedStr(finalName));
+    }
+    return;
+  }
+
+  // No renameat2(), so check that the file doesn't already exist in main separately.
+  if (faccessat(mainDirFd, finalName.begin(), F_OK, 0) == 0) {
+    KJ_ASSERT(faccessat(stagingDirFd, stagingName.begin(), F_OK, 0) != 0,
+        "can't create storage object: an object with that ID already exists",
+        stagingName.begin(), finalName.begin());
+    return;
+  }
+
   if (renameat(stagingDirFd, stagingName.begin(), mainDirFd, finalName.begin()) < 0) {
     int error = errno;
     switch (error) {
       case EINTR:
         goto retry;
       case ENOENT:
-        // Acceptable;
+        // Either the shard directory doesn't exist yet, or the staging file is already gone
+        // (acceptable).
+        if (makeShardDirectories(fixedStr(finalName))) goto retry;
         break;
       default:
         KJ_FAIL_SYSCALL("renameat(staging -> final)", error,
@@ -2446,14 +5321,16 @@ retry:
 void FilesystemStorage::replaceFromStagingIfExists(
     uint64_t stagingId, ObjectId finalId, const Xattr& attributes) {
   auto stagingName = hex64(stagingId);
-  auto finalName = finalId.filename('o');
+  migrateFromLegacyLayout(finalId);
+  auto finalName = finalId.shardedFilename('o');
 
   // First check that the old file still exists, since we're updating. If it doesn't, it was
   // probably deleted, and the new copy should also be immediately deleted.
   //
   // Note that since all modifications are done by the journal thread we can assume no race between
-  // faccessat() and renameat(), but if races were possible we could use renameat2() (new feature
-  // in Linux 3.15).
+  // faccessat() and renameat(). renameat2(RENAME_EXCHANGE) followed by unlinking the old copy would
+  // be atomic, but not idempotent: replaying the entry after a crash between the two steps would
+  // swap the old content back in.
 retryAccess:
   if (faccessat(mainDirFd, finalName.begin(), F_OK, 0) != 0) {
     int error = errno;
@@ -2497,7 +5374,8 @@ retry:
 
 void FilesystemStorage::setAttributesIfExists(ObjectId objectId, const Xattr& attributes) {
   // Sadly, there is no setxattrat(). But we can use /proc/self/fd to emulate it.
-  auto name = objectId.filename('o');
+  migrateFromLegacyLayout(objectId);
+  auto name = objectId.shardedFilename('o');
   auto hackname = kj::str("/proc/self/fd/", mainDirFd, "/", fixedStr(name));
 retry:
   if (setxattr(hackname.cStr(), Xattr::NAME, &attributes, sizeof(attributes), 0) < 0) {
@@ -2515,10 +5393,13 @@ retry:
 }
 
 void FilesystemStorage::moveToDeathRowIfExists(ObjectId id, bool notify) {
+  // Death row is emptied continuously, so it stays flat.
+  migrateFromLegacyLayout(id);
   auto name = id.filename('o');
+  auto shardedName = id.shardedFilename('o');
 
 retry:
-  if (renameat(mainDirFd, name.begin(), deathRowFd, name.begin()) == 0) {
+  if (renameat(mainDirFd, shardedName.begin(), deathRowFd, name.begin()) == 0) {
     if (notify) deathRow->notifyNewInmates();
   } else {
     int error = errno;
@@ -2556,6 +5437,116 @@ retry:
   }
 }
 
+bool FilesystemStorage::isLegacyLayout() {
+  return __atomic_load_n(&legacyLayout, __ATOMIC_RELAXED);
+}
+
+bool FilesystemStorage::objectExists(ObjectId id) {
+  // Like openObject(), checks the flat name first.
+
+  auto check = [this](const char* name) {
+  retry:
+    if (faccessat(mainDirFd, name, F_OK, 0) == 0) {
+      return true;
+    } else {
+      int error = errno;
+      if (error == EINTR) {
+        goto retry;
+      } else if (error == ENOENT) {
+        return false;
+      } else {
+        KJ_FAIL_SYSCALL("faccessat", error, name);
+      }
+    }
+  };
+
+  return (isLegacyLayout() && check(id.filename('o').begin())) ||
+         check(id.shardedFilename('o').begin());
+}
+
+bool FilesystemStorage::makeShardDirectories(kj::StringPtr shardedName) {
+  // Creates the directories containing `shardedName`, if they don't exist yet, returning true if
+  // any were created. We create them lazily, when a rename or link into one fails with ENOENT, so
+  // that small storage instances don't pay for thousands of empty directories.
+
+  KJ_ASSERT(shardedName.size() > 4 && shardedName[2] == '/' && shardedName[4] == '/');
+
+  bool created = false;
+  char dir[5];
+  memcpy(dir, shardedName.begin(), 4);
+  for (size_t length: { 2, 4 }) {
+    dir[length] = '\0';
+    if (mkdirat(mainDirFd, dir, 0777) == 0) {
+      created = true;
+    } else {
+      int error = errno;
+      if (error != EEXIST) {
+        KJ_FAIL_SYSCALL("mkdirat(shard)", error, dir);
+      }
+    }
+    dir[length] = '/';
+  }
+  return created;
+}
+
+void FilesystemStorage::migrateFromLegacyLayout(kj::StringPtr flatName) {
+  // Moves the object from its flat name to its sharded name, if it's still at the former. Called
+  // concurrently by LayoutMigrator and by anything modifying the object, so every step must
+  // tolerate the other having already done it.
+
+  auto shardedName = shardName(flatName.cStr());
+
+retry:
+  // With renameat2() this is a single atomic step.
+  KJ_IF_MAYBE(error, renameat2IfSupported(mainDirFd, flatName.cStr(),
+                                          mainDirFd, shardedName.begin(), RENAME_NOREPLACE)) {
+    switch (*error) {
+      case 0:
+        return;
+      case ENOENT:
+        if (makeShardDirectories(fixedStr(shardedName))) goto retry;
+        return;
+      case EEXIST:
+        // The link() path below was interrupted (e.g. by a crash) after linking, so the two names
+        // are the same file. Finish the job.
+        break;
+      default:
+        KJ_FAIL_SYSCALL("renameat2(flat -> sharded)", *error, flatName);
+    }
+  } else if (linkat(mainDirFd, flatName.cStr(), mainDirFd, shardedName.begin(), 0) < 0) {
+    int error = errno;
+    switch (error) {
+      case EINTR:
+        goto retry;
+      case ENOENT:
+        // Either the shard directory doesn't exist yet, or the object isn't in the flat layout
+        // (anymore).
+        if (makeShardDirectories(fixedStr(shardedName))) goto retry;
+        return;
+      case EEXIST:
+        // Someone else linked it but didn't unlink the flat name yet. Since objects are never
+        // created at their flat names, the two names must be the same file.
+        break;
+      default:
+        KJ_FAIL_SYSCALL("linkat(flat -> sharded)", error, flatName);
+    }
+  }
+
+  if (unlinkat(mainDirFd, flatName.cStr(), 0) < 0) {
+    int error = errno;
+    if (error != ENOENT) {
+      KJ_FAIL_SYSCALL("unlinkat(flat)", error, flatName);
+    }
+  }
+}
+
+void FilesystemStorage::migrateFromLegacyLayout(ObjectId id) {
+  if (isLegacyLayout()) {
+    auto name = id.filename('o');
+    migrateFromLegacyLayout(fixedStr(name));
+  }
+}
+
 bool FilesystemStorage::isStoredObjectType(Type type) {
   switch (type) {
     case Type::BLOB:
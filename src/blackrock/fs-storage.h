@@ -18,6 +18,7 @@
 #define BLACKROCK_VOLUME_H_
 
 #include "common.h"
+#include "backend-set.h"
 #include <blackrock/storage.capnp.h>
 #include <blackrock/fs-storage.capnp.h>
 #include <kj/io.h>
@@ -30,12 +31,41 @@ namespace kj {
 
 namespace blackrock {
 
+class LocalBlockShard;
+class ColdStore;
+
 class FilesystemStorage: public StorageRootSet::Server {
 public:
   FilesystemStorage(int directoryFd, kj::UnixEventPort& eventPort, kj::Timer& timer,
                     Restorer<SturdyRef>::Client&& restorer);
   ~FilesystemStorage() noexcept(false);
 
+  StorageSibling::Client joinCluster(uint32_t nodeIndex,
+                                     kj::Own<BackendSetImpl<StorageSibling>> siblings);
+  // Makes this storage node number `nodeIndex` of a cluster whose nodes -- including this one --
+  // are `siblings`, by index. Returns the capability through which the other nodes reach this
+  // one. Until this is called, this is node 0 of a cluster of one. Call only after this object
+  // has been wrapped in a capability.
+
+  BackendSet<StorageReplica>::Client replicateTo(bool synchronous);
+  // Starts shipping every change to whichever hot standby is added to the returned set -- at
+  // most one at a time -- after first resyncing it. If `synchronous`, changes aren't reported
+  // durable until the standby has them too; while no standby is caught up, commits wait. Not
+  // supported with a block shard. Call only after this object has been wrapped in a capability.
+
+  StorageReplica::Client asStandby();
+  // Returns the capability through which another node replicates to this one, which must not be
+  // in use otherwise until it is promoted.
+
+  bool wasPromoted();
+  // True if this node was a standby, and has since been promoted to replace the node it was
+  // replicating. It then refuses replication, permanently.
+
+  void simulateCrash();
+  // From now on, transactions are journaled but never applied, as if the node crashed right
+  // after each one was synced. The next FilesystemStorage opened on the same directory has to
+  // replay them. Exposed for testing.
+
 protected:
   kj::Promise<void> set(SetContext context) override;
   kj::Promise<void> get(GetContext context) override;
@@ -43,6 +73,8 @@ protected:
   kj::Promise<void> getOrCreateAssignable(GetOrCreateAssignableContext context) override;
   kj::Promise<void> remove(RemoveContext context) override;
   kj::Promise<void> getFactory(GetFactoryContext context) override;
+  kj::Promise<void> locate(LocateContext context) override;
+  kj::Promise<void> migrate(MigrateContext context) override;
 
 public:
   struct ObjectKey {
@@ -51,6 +83,8 @@ public:
     ObjectKey() = default;
     ObjectKey(StoredObjectKey::Reader reader)
         : key { reader.getKey0(), reader.getKey1(), reader.getKey2(), reader.getKey3() } {}
+    explicit ObjectKey(SturdyRef::Stored::Reader reader)
+        : key { reader.getKey0(), reader.getKey1(), reader.getKey2(), reader.getKey3() } {}
     ~ObjectKey() {
       sodium_memzero(key, sizeof(key));
     }
@@ -63,6 +97,12 @@ public:
       builder.setKey2(key[2]);
       builder.setKey3(key[3]);
     }
+    inline void copyTo(SturdyRef::Stored::Builder builder) const {
+      builder.setKey0(key[0]);
+      builder.setKey1(key[1]);
+      builder.setKey2(key[2]);
+      builder.setKey3(key[3]);
+    }
   };
 
   struct ObjectId {
@@ -98,6 +138,10 @@ public:
     };
 
     kj::FixedArray<char, 24> filename(char prefix) const;
+
+    kj::FixedArray<char, 29> shardedFilename(char prefix) const;
+    // Like filename(), but prefixed with the two levels of shard directories under which the
+    // file lives in main/, e.g. "Ab/c/oAbc...".
   };
 
 private:
@@ -109,22 +153,69 @@ private:
   class CollectionImpl;
   class OpaqueImpl;
   class StorageFactoryImpl;
+  class WeakRefImpl;
+  class SiblingImpl;
   enum class Type: uint8_t;
   struct Xattr;
   class Journal;
   class DeathRow;
   class ObjectFactory;
+  class LayoutMigrator;
+  class ColdMigrator;
+  class BlockingWorker;
+  class RootMigrator;
+  class Replicator;
+  class ReplicaImpl;
+  class ReplicaSetImpl;
 
   kj::AutoCloseFd mainDirFd;
   kj::AutoCloseFd stagingDirFd;
   kj::AutoCloseFd deathRowFd;
   kj::AutoCloseFd rootsFd;
+  kj::AutoCloseFd templatesFd;
+  // templates/ holds volume images, as sparse files, for StorageFactory.newVolumeFromTemplate().
+
+  bool legacyLayout;
+  // True if main/ may still contain objects in the old flat layout, i.e. directly under main/
+  // rather than in shard directories. Cleared (atomically) by LayoutMigrator once none remain.
+
+  kj::Maybe<kj::Own<ColdStore>> coldStore;
+  // Opened if the storage directory contains `cold` -- a directory, typically a mounted object
+  // store bucket -- as well as `blocks`. Volumes which go unused for a while are evicted there
+  // by ColdMigrator.
+
+  kj::Maybe<kj::Own<LocalBlockShard>> blockShard;
+  // Opened if the storage directory contains `blocks` -- a file or a symlink to a disk, set up
+  // with LocalBlockShard::format(). New Volumes then keep their blocks there rather than in
+  // sparse files. Declared before `deathRow`, which uses it.
+
+  kj::Own<BlockingWorker> blockingWorker;
 
   kj::Own<DeathRow> deathRow;
   kj::Own<Journal> journal;
   kj::Own<ObjectFactory> factory;
+  kj::Maybe<kj::Own<LayoutMigrator>> layoutMigrator;
+  kj::Maybe<kj::Own<ColdMigrator>> coldMigrator;
+  kj::Maybe<kj::Own<Replicator>> replicator;
 
   kj::Promise<void> setImpl(kj::String name, OwnedStorage<>::Client object);
+  kj::Promise<void> setForeignRoot(kj::String name, OwnedStorage<>::Client object);
+  kj::Maybe<capnp::Capability::Client> tryOpenRoot(kj::StringPtr name);
+  void writeRoot(kj::StringPtr name, const ObjectKey& key, kj::Maybe<uint32_t> sibling);
+  kj::Maybe<uint32_t> getRootSibling(kj::StringPtr name);
+  kj::Promise<void> removeSiblingRoot(kj::StringPtr name, uint32_t sibling);
+  kj::Promise<void> removeImpl(kj::String name);
+  void unlinkRoot(kj::StringPtr name);
+
+  kj::Maybe<uint32_t> previousHome(kj::StringPtr name);
+  // If this node took over as `name`'s home when it joined the cluster, the node which was the
+  // home until then. Nodes join in index order, so that's the home among the lower-numbered nodes.
+
+  kj::Promise<void> adoptMovedRoot(kj::StringPtr name);
+  // If there's no root `name` here, but there is on the node which was its home before this one
+  // (see previousHome()), record here where it is, and have that node drop its own record. Every
+  // StorageRootSet method calls this first, so that a root doesn't disappear -- or, worse, get
+  // created afresh -- when the cluster grows and its name hashes to the new node.
 
   kj::Maybe<kj::AutoCloseFd> openObject(ObjectId id);
   kj::Maybe<kj::AutoCloseFd> openStaging(uint64_t number);
@@ -139,6 +230,12 @@ private:
   void moveToDeathRowIfExists(ObjectId id, bool notify = true);
   void sync();
 
+  bool isLegacyLayout();
+  bool objectExists(ObjectId id);
+  bool makeShardDirectories(kj::StringPtr shardedName);
+  void migrateFromLegacyLayout(kj::StringPtr flatName);
+  void migrateFromLegacyLayout(ObjectId id);
+
   static bool isStoredObjectType(Type type);
 };
 
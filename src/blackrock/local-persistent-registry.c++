@@ -70,6 +70,10 @@ public:
     return kj::READY_NOW;
   }
 
+  kj::Promise<void> ping(PingContext context) override {
+    return kj::READY_NOW;
+  }
+
 private:
   LocalPersistentRegistry& registry;
   kj::Maybe<Registration&> registration;
@@ -61,8 +61,8 @@ public:
     // deregistration).
 
     Persistent::Client getWrapped();
-    // Get a capability which forwards all calls to the original except for save() which is handled
-    // by the LocalPersistentRegistry.
+    // Get a capability which forwards all calls to the original except for save() and ping(),
+    // which are handled by the LocalPersistentRegistry.
 
   private:
     LocalPersistentRegistry& registry;
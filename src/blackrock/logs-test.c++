@@ -0,0 +1,353 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "logs.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <sandstorm/util.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+
+namespace blackrock {
+namespace {
+
+constexpr uint64_t SINK_RING_SIZE = 32768;
+// Size of the sink's per-connection receive ring. Stream offsets which are multiples of this
+// land at the physical end of the ring.
+
+constexpr time_t T0 = 1500000000;  // 2017-07-14_02-40-00 UTC
+constexpr time_t DAY = 86400;
+
+kj::AutoCloseFd newFile() {
+  return sandstorm::raiiOpen("/var/tmp", O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+}
+
+kj::String readAll(int fd) {
+  kj::Vector<char> result;
+  char buffer[4096];
+  for (off_t offset = 0;;) {
+    ssize_t n;
+    KJ_SYSCALL(n = pread(fd, buffer, sizeof(buffer), offset));
+    if (n == 0) break;
+    result.addAll(kj::arrayPtr(buffer, n));
+    offset += n;
+  }
+  result.add('\0');
+  return kj::String(result.releaseAsArray());
+}
+
+kj::Vector<kj::String> splitLines(kj::StringPtr text) {
+  kj::Vector<kj::String> result;
+  while (text.size() > 0) {
+    const char* eol = strchr(text.cStr(), '\n');
+    KJ_ASSERT(eol != nullptr, "output doesn't end with a newline");
+    result.add(kj::heapString(text.begin(), eol - text.begin()));
+    text = text.slice(eol + 1 - text.begin());
+  }
+  return result;
+}
+
+kj::String formatTime(time_t time) {
+  char buffer[32];
+  struct tm utc;
+  KJ_ASSERT(gmtime_r(&time, &utc) != nullptr);
+  size_t n = strftime(buffer, sizeof(buffer), "%Y-%m-%d_%H-%M-%S", &utc);
+  return kj::heapString(buffer, n);
+}
+
+kj::String logLine(time_t time, kj::StringPtr name, kj::StringPtr text) {
+  // A line as LogSink writes it.
+  return kj::str(formatTime(time), " [", name, kj::repeat(' ', 16 - name.size()), "] ", text);
+}
+
+void addRecord(kj::Vector<byte>& stream, time_t time, kj::StringPtr text, uint8_t flags = 0) {
+  LogRecordHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = RECORD_MAGIC;
+  header.flags = flags;
+  header.size = text.size();
+  header.timestamp = int64_t(time) * 1000000000 + 123456789;
+  stream.addAll(kj::arrayPtr(reinterpret_cast<const byte*>(&header), sizeof(header)));
+  stream.addAll(text.asBytes());
+}
+
+kj::String filler(size_t size, char c) {
+  return kj::str(kj::repeat(c, size));
+}
+
+kj::Vector<kj::String> runSink(kj::ArrayPtr<const byte> stream) {
+  // Sends `stream` to a LogSink over one connection, and returns the lines the sink writes
+  // between the connection's CONNECTED and DISCONNECTED status lines.
+
+  auto io = kj::setupAsyncIo();
+  auto output = newFile();
+  LogSink sink(output);
+
+  auto listener = io.provider->getNetwork()
+      .parseAddress("127.0.0.1")
+      .wait(io.waitScope)
+      ->listen();
+  uint port = listener->getPort();
+  auto acceptTask = sink.acceptLoop(kj::mv(listener)).eagerlyEvaluate(nullptr);
+
+  auto connection = io.provider->getNetwork()
+      .parseAddress("127.0.0.1", port)
+      .wait(io.waitScope)
+      ->connect()
+      .wait(io.waitScope);
+
+  // Write in uneven pieces, so that reads don't line up with records.
+  for (size_t pos = 0; pos < stream.size();) {
+    size_t n = kj::min(stream.size() - pos, 3001);
+    connection->write(stream.begin() + pos, n).wait(io.waitScope);
+    pos += n;
+  }
+  connection->shutdownWrite();
+
+  for (uint i = 0; i < 500 && strstr(readAll(output).cStr(), "DISCONNECTED") == nullptr; i++) {
+    io.provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(io.waitScope);
+  }
+
+  auto lines = splitLines(readAll(output));
+  KJ_ASSERT(lines.size() >= 2, lines.size());
+  KJ_EXPECT(strstr(lines.front().cStr(), " * test (127.0.0.1:") != nullptr, lines.front());
+  KJ_EXPECT(strstr(lines.back().cStr(), "] DISCONNECTED") != nullptr, lines.back());
+
+  kj::Vector<kj::String> result;
+  for (size_t i = 1; i + 1 < lines.size(); i++) {
+    result.add(kj::mv(lines[i]));
+  }
+  return result;
+}
+
+KJ_TEST("framed log records round-trip through the sink") {
+  kj::Vector<byte> stream;
+  stream.addAll(kj::StringPtr("test framed\n").asBytes());
+  addRecord(stream, T0, "first line");
+  addRecord(stream, T0, "");
+  addRecord(stream, T0 + 1, "next second");
+  addRecord(stream, T0 + 1, filler(MAX_LINE, 'x'));
+  addRecord(stream, T0 + 1, "end of long line", RECORD_CONTINUATION);
+  // Clients write their own errors into the backlog as raw text, between records.
+  stream.addAll(kj::StringPtr("raw error text\n").asBytes());
+  addRecord(stream, T0 + 2, "after raw text");
+
+  auto lines = runSink(stream);
+
+  KJ_ASSERT(lines.size() == 7, lines.size());
+  KJ_EXPECT(lines[0] == logLine(T0, "test", "first line"), lines[0]);
+  KJ_EXPECT(lines[1] == logLine(T0, "test", ""), lines[1]);
+  KJ_EXPECT(lines[2] == logLine(T0 + 1, "test", "next second"), lines[2]);
+  KJ_EXPECT(lines[3] == logLine(T0 + 1, "test", filler(MAX_LINE, 'x')));
+  KJ_EXPECT(lines[4] == logLine(T0 + 1, "test", "...end of long line"), lines[4]);
+  // Raw text is stamped with the time the sink received it.
+  KJ_EXPECT(lines[5].endsWith(" [test            ] raw error text"), lines[5]);
+  KJ_EXPECT(lines[6] == logLine(T0 + 2, "test", "after raw text"), lines[6]);
+}
+
+KJ_TEST("framed log records split across the sink's ring wrap") {
+  kj::Vector<byte> stream;
+  stream.addAll(kj::StringPtr("test framed\n").asBytes());
+  kj::Vector<kj::String> expected;
+
+  auto add = [&](kj::String text) {
+    expected.add(logLine(T0, "test", text));
+    addRecord(stream, T0, text);
+  };
+
+  uint counter = 0;
+  auto fillTo = [&](uint64_t limit) {
+    // Add records up to a little short of `limit` in the stream.
+    while (stream.size() + sizeof(LogRecordHeader) * 2 + 300 < limit) {
+      uint n = counter++;
+      add(kj::str("line ", n, ' ', filler(n % 200, 'a' + n % 26)));
+    }
+  };
+
+  // A record whose text wraps around the end of the ring.
+  fillTo(SINK_RING_SIZE);
+  size_t space = SINK_RING_SIZE - stream.size() - sizeof(LogRecordHeader);
+  add(kj::str(filler(space, 'b'), "|wrapped text"));
+  KJ_ASSERT(stream.size() > SINK_RING_SIZE);
+  KJ_ASSERT(stream.size() - strlen("|wrapped text") == SINK_RING_SIZE);
+
+  // A record whose header wraps around the end of the ring.
+  fillTo(SINK_RING_SIZE * 2);
+  add(filler(SINK_RING_SIZE * 2 - stream.size() - sizeof(LogRecordHeader) - 5, 'c'));
+  add(kj::str("wrapped header"));
+  KJ_ASSERT(stream.size() - strlen("wrapped header") > SINK_RING_SIZE * 2);
+
+  // A raw line which wraps around the end of the ring.
+  fillTo(SINK_RING_SIZE * 3);
+  size_t rawSize = SINK_RING_SIZE * 3 - stream.size() + 10;
+  auto raw = filler(rawSize, 'R');
+  stream.addAll(raw.asBytes());
+  stream.add('\n');
+
+  add(kj::str("last line"));
+
+  auto lines = runSink(stream);
+
+  KJ_ASSERT(lines.size() == expected.size() + 1, lines.size(), expected.size());
+  size_t j = 0;
+  for (auto& line: lines) {
+    if (line.endsWith(raw)) {
+      KJ_EXPECT(line.size() == logLine(T0, "test", raw).size());
+    } else {
+      KJ_ASSERT(j < expected.size());
+      KJ_EXPECT(line == expected[j], j, line.size(), expected[j].size());
+      ++j;
+    }
+  }
+  KJ_EXPECT(j == expected.size(), j);
+}
+
+// =======================================================================================
+
+class TempDir {
+public:
+  TempDir() {
+    KJ_ASSERT(mkdtemp(path) != nullptr);
+    fd = sandstorm::raiiOpen(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+  ~TempDir() noexcept(false) {
+    sandstorm::recursivelyDelete(path);
+  }
+
+  char path[sizeof("/var/tmp/blackrock-logs-test.XXXXXX")] =
+      "/var/tmp/blackrock-logs-test.XXXXXX";
+  kj::AutoCloseFd fd;
+};
+
+void storeLines(int logDirFd, kj::ArrayPtr<const kj::String> lines) {
+  auto input = newFile();
+  {
+    kj::FdOutputStream out(input.get());
+    for (auto& line: lines) {
+      out.write(line.begin(), line.size());
+      out.write("\n", 1);
+    }
+  }
+  KJ_SYSCALL(lseek(input, 0, SEEK_SET));
+  storeLogs(input, logDirFd);
+}
+
+kj::Vector<kj::String> query(int logDirFd, time_t begin, time_t end,
+                             kj::ArrayPtr<const kj::StringPtr> sources) {
+  auto output = newFile();
+  queryLogs(logDirFd, begin, end, sources, output);
+  return splitLines(readAll(output));
+}
+
+kj::Vector<kj::String> storedLines() {
+  // Two days of logs from three sources, plus a status line.
+
+  kj::Vector<kj::String> lines;
+  lines.add(kj::str(formatTime(T0), " * alpha (10.0.0.1:1234) CONNECTED"));
+  for (uint i = 0; i < 30; i++) {
+    time_t time = T0 + i * 3600;  // Crosses midnight UTC after 22 hours.
+    lines.add(logLine(time, "alpha", kj::str("alpha ", i)));
+    lines.add(logLine(time, "beta", kj::str("beta ", i)));
+    if (i % 10 == 0) {
+      lines.add(logLine(time, "gamma-long-name1", kj::str("gamma ", i)));
+    }
+  }
+  return lines;
+}
+
+bool contains(kj::ArrayPtr<const kj::String> lines, kj::StringPtr line) {
+  for (auto& l: lines) {
+    if (l == line) return true;
+  }
+  return false;
+}
+
+KJ_TEST("stored logs can be queried by time range") {
+  TempDir dir;
+  auto lines = storedLines();
+  storeLines(dir.fd, lines);
+
+  // Stored in one file per day.
+  KJ_EXPECT(access(kj::str(dir.path, "/blackrock.2017-07-14.logz-index").cStr(), F_OK) == 0);
+  KJ_EXPECT(access(kj::str(dir.path, "/blackrock.2017-07-15.logz-index").cStr(), F_OK) == 0);
+
+  // Everything.
+  {
+    auto result = query(dir.fd, T0, T0 + 2 * DAY, nullptr);
+    KJ_ASSERT(result.size() == lines.size(), result.size());
+    for (auto i: kj::indices(lines)) {
+      KJ_EXPECT(result[i] == lines[i], i, result[i]);
+    }
+  }
+
+  // Both ends inclusive, and spanning the day boundary.
+  {
+    auto result = query(dir.fd, T0 + 20 * 3600, T0 + 23 * 3600, nullptr);
+    KJ_ASSERT(result.size() == 9, result.size());
+    KJ_EXPECT(result[0] == logLine(T0 + 20 * 3600, "alpha", "alpha 20"), result[0]);
+    KJ_EXPECT(result[1] == logLine(T0 + 20 * 3600, "beta", "beta 20"), result[1]);
+    KJ_EXPECT(result[2] == logLine(T0 + 20 * 3600, "gamma-long-name1", "gamma 20"), result[2]);
+    KJ_EXPECT(result[8] == logLine(T0 + 23 * 3600, "beta", "beta 23"), result[8]);
+  }
+
+  // Between lines.
+  KJ_EXPECT(query(dir.fd, T0 + 1, T0 + 3599, nullptr).size() == 0);
+
+  // Outside the stored days entirely.
+  KJ_EXPECT(query(dir.fd, T0 - 3 * DAY, T0 - 2 * DAY, nullptr).size() == 0);
+}
+
+KJ_TEST("stored logs can be queried by source") {
+  TempDir dir;
+  auto lines = storedLines();
+  storeLines(dir.fd, lines);
+
+  {
+    kj::StringPtr sources[] = { "gamma-long-name1" };
+    auto result = query(dir.fd, T0, T0 + 2 * DAY, sources);
+    KJ_ASSERT(result.size() == 3, result.size());
+    for (uint i = 0; i < 3; i++) {
+      time_t time = T0 + i * 36000;
+      KJ_EXPECT(result[i] == logLine(time, "gamma-long-name1", kj::str("gamma ", i * 10)),
+                result[i]);
+    }
+  }
+
+  {
+    kj::StringPtr sources[] = { "alpha", "gamma-long-name1" };
+    auto result = query(dir.fd, T0 + 5 * 3600, T0 + 10 * 3600, sources);
+    KJ_ASSERT(result.size() == 7, result.size());
+    KJ_EXPECT(!contains(result, logLine(T0 + 5 * 3600, "beta", "beta 5")));
+    KJ_EXPECT(contains(result, logLine(T0 + 5 * 3600, "alpha", "alpha 5")));
+    KJ_EXPECT(contains(result, logLine(T0 + 10 * 3600, "gamma-long-name1", "gamma 10")));
+  }
+
+  // A prefix of a name doesn't match, and neither do status lines.
+  {
+    kj::StringPtr sources[] = { "alph" };
+    KJ_EXPECT(query(dir.fd, T0, T0 + 2 * DAY, sources).size() == 0);
+  }
+  {
+    kj::StringPtr sources[] = { "nobody" };
+    KJ_EXPECT(query(dir.fd, T0, T0 + 2 * DAY, sources).size() == 0);
+  }
+}
+
+}  // namespace
+}  // namespace blackrock
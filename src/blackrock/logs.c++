@@ -21,58 +21,59 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <errno.h>
+#include <poll.h>
+#include <zlib.h>
+#include <sys/eventfd.h>
+#include <kj/thread.h>
+#include <kj/async-unix.h>
 
 namespace blackrock {
 
+// =======================================================================================
+
 class LogSink::ClientHandler {
 public:
   ClientHandler(LogSink& sink, kj::Own<kj::AsyncIoStream> stream, kj::String addr)
       : sink(sink), stream(kj::mv(stream)), addr(kj::mv(addr)) {}
 
   kj::Promise<void> run() {
-    return stream->tryRead(buffer + leftover, 1, sizeof(buffer) - leftover)
+    // Read into the free space following `end`, stopping at the physical end of the ring or at
+    // unconsumed data, whichever comes first.
+    size_t offset = end % sizeof(buffer);
+    size_t space = kj::min(sizeof(buffer) - offset, sizeof(buffer) - (end - start));
+    KJ_ASSERT(space > 0, "log ring buffer full; should have forced a line split");
+
+    return stream->tryRead(buffer + offset, 1, space)
         .then([this](size_t amount) -> kj::Promise<void> {
       if (amount == 0) {
         if (prefix == nullptr) {
           // Never got any data on this stream. Probably just a probe. Don't print anything.
         } else {
-          if (leftover > 0) {
-            buffer[leftover] = '\n';
-            writeLine(kj::arrayPtr(buffer, leftover + 1));
+          if (end > start && !(framed && byteAt(start) == RECORD_MAGIC)) {
+            writeLine(time(nullptr), start, end);
           }
-          writeLine(kj::StringPtr("DISCONNECTED\n"));
+          sink.write(prefix, kj::StringPtr("DISCONNECTED"));
         }
         return kj::READY_NOW;
       }
 
-      amount += leftover;
-
-      // Split into lines.
-      uint lineStart = 0;
-      for (uint i = 0; i < amount; i++) {
-        if (buffer[i] == '\n') {
-          writeLine(kj::arrayPtr(buffer + lineStart, i + 1 - lineStart));
-          lineStart = i + 1;
-        } else if (i - lineStart >= 8192) {
-          // Force a line split at 8k to avoid excessive buffering.
-          char c = buffer[i];
-          buffer[i] = '\n';
-          writeLine(kj::arrayPtr(buffer + lineStart, i + 1 - lineStart));
-          buffer[i] = c;
-
-          // Insert a "..." prefix on the continuation.
-          buffer[i-1] = '.';
-          buffer[i-2] = '.';
-          buffer[i-3] = '.';
-          lineStart = i - 3;
+      end += amount;
+
+      time_t now = time(nullptr);
+      for (;;) {
+        if (framed && start < end && byteAt(start) == RECORD_MAGIC) {
+          if (!takeRecord()) break;
+        } else {
+          if (!takeLine(now)) break;
         }
       }
 
-      // Move trailing text to the start of the buffer.
-      leftover = amount - lineStart;
-      memmove(buffer, buffer + lineStart, leftover);
+      // Queued lines point into `buffer`, so write them out before reading more.
+      sink.flush();
 
       return run();
     });
@@ -83,16 +84,120 @@ private:
   kj::Own<kj::AsyncIoStream> stream;
   kj::String addr;
   kj::String prefix;
-  uint leftover = 0;
-  char buffer[16384];
+  bool framed = false;
+  bool continuation = false;
+
+  uint64_t start = 0;
+  uint64_t end = 0;
+  byte buffer[32768];
+  // Ring buffer. `start` and `end` count bytes since the connection began; the unconsumed data
+  // is at offsets [start, end) modulo the buffer size. A line that wraps around the end of the
+  // buffer is simply written out as two pieces, so we never have to move data around. The
+  // buffer must be large enough to hold a full line or record plus some.
+
+  byte byteAt(uint64_t pos) {
+    return buffer[pos % sizeof(buffer)];
+  }
+
+  kj::ArrayPtr<const byte> segment(uint64_t begin, uint64_t limit) {
+    // Returns the contiguous part of the ring starting at `begin` and ending at `limit` or at
+    // the physical end of the buffer, whichever comes first.
+
+    size_t offset = begin % sizeof(buffer);
+    return kj::arrayPtr(buffer + offset, kj::min(limit - begin, sizeof(buffer) - offset));
+  }
+
+  uint64_t findNewline(uint64_t begin, uint64_t limit) {
+    // Find the first newline in [begin, limit), or return `limit` if there is none. memchr() is
+    // vectorized by libc and much faster than checking byte by byte.
+
+    while (begin < limit) {
+      auto seg = segment(begin, limit);
+      const void* found = memchr(seg.begin(), '\n', seg.size());
+      if (found != nullptr) {
+        return begin + (reinterpret_cast<const byte*>(found) - seg.begin());
+      }
+      begin += seg.size();
+    }
+    return limit;
+  }
+
+  bool takeLine(time_t now) {
+    // Consume one line of raw text. Returns false if there isn't a complete line available yet.
 
-  void writeLine(kj::ArrayPtr<const char> chars) {
-    if (chars.size() == 0) return;
+    uint64_t limit = kj::min(end, start + MAX_LINE);
+    uint64_t eol = findNewline(start, limit);
+
+    if (eol < limit) {
+      writeLine(now, start, eol);
+      continuation = false;
+      start = eol + 1;
+      return true;
+    } else if (limit - start == MAX_LINE) {
+      // Force a line split at 8k to avoid excessive buffering. The continuation will be written
+      // with a "..." prefix.
+      writeLine(now, start, limit);
+      continuation = true;
+      start = limit;
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  bool takeRecord() {
+    // Consume one framed record. Returns false if the record isn't complete yet.
+
+    if (end - start < sizeof(LogRecordHeader)) return false;
+
+    // The header may wrap around the end of the ring, so copy it out.
+    LogRecordHeader header;
+    auto headerPart1 = segment(start, start + sizeof(header));
+    auto headerPart2 = segment(start + headerPart1.size(), start + sizeof(header));
+    memcpy(&header, headerPart1.begin(), headerPart1.size());
+    memcpy(reinterpret_cast<byte*>(&header) + headerPart1.size(),
+           headerPart2.begin(), headerPart2.size());
+
+    if (header.size > MAX_LINE) {
+      // Can't be a valid record. Give up on framing rather than buffer without bound; what
+      // follows will at least be readable if it's text.
+      sink.write(prefix,
+          kj::StringPtr("PROTOCOL ERROR: bad log record; reading rest of stream as text"));
+      framed = false;
+      return true;
+    }
+
+    uint64_t textStart = start + sizeof(header);
+    uint64_t textEnd = textStart + header.size;
+    if (textEnd > end) return false;
+
+    auto text1 = segment(textStart, textEnd);
+    auto text2 = segment(textStart + text1.size(), textEnd);
+    sink.append(header.timestamp / 1000000000, prefix,
+                header.flags & RECORD_CONTINUATION, text1, text2);
+    start = textEnd;
+    return true;
+  }
+
+  void writeLine(time_t time, uint64_t begin, uint64_t limit) {
+    auto text1 = segment(begin, limit);
+    auto text2 = segment(begin + text1.size(), limit);
 
     if (prefix == nullptr) {
       // This is the first line received. Treat it as the name, if it's valid.
 
-      kj::ArrayPtr<const char> name = chars.slice(0, chars.size() - 1);
+      auto nameLine = kj::heapString(text1.size() + text2.size());
+      memcpy(nameLine.begin(), text1.begin(), text1.size());
+      memcpy(nameLine.begin() + text1.size(), text2.begin(), text2.size());
+      kj::ArrayPtr<const char> name = nameLine;
+
+      size_t suffixSize = strlen(FRAMED_SUFFIX);
+      if (name.size() > suffixSize &&
+          memcmp(name.end() - suffixSize, FRAMED_SUFFIX, suffixSize) == 0) {
+        // Client will send framed records from here on.
+        name = name.slice(0, name.size() - suffixSize);
+        framed = true;
+      }
 
       // We expect the name to be a 16-or-fewer character hostname.
       bool valid = true;
@@ -127,9 +232,9 @@ private:
       }
 
       if (valid) {
-        sink.write(kj::str(" * ", name, " (", addr, ") CONNECTED\n"));
+        sink.write(kj::str(" * ", name, " (", addr, ") CONNECTED"));
       } else {
-        sink.write(kj::str(" * ??? (", addr, ") CONNECTED\n"));
+        sink.write(kj::str(" * ??? (", addr, ") CONNECTED"));
       }
 
       prefix = kj::str(" [", name, kj::repeat(' ', 16 - kj::min(name.size(), 16)), "] ");
@@ -140,11 +245,11 @@ private:
       }
     }
 
-    sink.write(prefix, chars);
+    sink.append(time, prefix, continuation, text1, text2);
   }
 };
 
-LogSink::LogSink(): tasks(*this) {}
+LogSink::LogSink(int output): output(output), tasks(*this) {}
 
 kj::Promise<void> LogSink::acceptLoop(kj::Own<kj::ConnectionReceiver> receiver) {
   auto promise = receiver->accept();
@@ -158,16 +263,45 @@ kj::Promise<void> LogSink::acceptLoop(kj::Own<kj::ConnectionReceiver> receiver)
 }
 
 void LogSink::write(kj::ArrayPtr<const char> part1, kj::ArrayPtr<const char> part2) {
-  char timestampBuf[128];
-  time_t now = time(nullptr);
-  struct tm local;
-  KJ_ASSERT(gmtime_r(&now, &local) != nullptr);
-  size_t n = strftime(timestampBuf, sizeof(timestampBuf), "%Y-%m-%d_%H-%M-%S", &local);
+  append(time(nullptr), part1, false, part2.asBytes());
+  flush();
+}
+
+void LogSink::append(time_t time, kj::ArrayPtr<const char> prefix, bool continuation,
+                     kj::ArrayPtr<const byte> text1, kj::ArrayPtr<const byte> text2) {
+  if (time != timestampTime) {
+    // Queued lines point at the old timestamp text, so they have to go out first.
+    flush();
+
+    struct tm utc;
+    KJ_ASSERT(gmtime_r(&time, &utc) != nullptr);
+    size_t n = strftime(timestampBuffer, sizeof(timestampBuffer), "%Y-%m-%d_%H-%M-%S", &utc);
+    timestamp = kj::arrayPtr(timestampBuffer, n);
+    timestampTime = time;
+  }
+
+  if (pending.size() + 6 > 1000) {
+    // Stay under IOV_MAX.
+    flush();
+  }
 
-  kj::StringPtr timestamp(timestampBuf, n);
+  pending.add(timestamp.asBytes());
+  pending.add(prefix.asBytes());
+  if (continuation) {
+    pending.add(kj::StringPtr("...").asBytes());
+  }
+  pending.add(text1);
+  if (text2.size() > 0) {
+    pending.add(text2);
+  }
+  pending.add(kj::StringPtr("\n").asBytes());
+}
 
-  kj::ArrayPtr<const byte> pieces[3] = { timestamp.asBytes(), part1.asBytes(), part2.asBytes() };
-  kj::FdOutputStream(STDOUT_FILENO).write(pieces);
+void LogSink::flush() {
+  if (pending.size() > 0) {
+    kj::FdOutputStream(output).write(pending.asPtr());
+    pending.clear();
+  }
 }
 
 void LogSink::taskFailed(kj::Exception&& exception) {
@@ -226,20 +360,461 @@ void rotateLogs(int input, int logDirFd) {
 }
 
 // =======================================================================================
+// Compressed log store
+//
+// Each day's logs are stored in two files. `blackrock.YYYY-MM-DD.logz` is a sequence of blocks,
+// each an independent zlib stream containing up to LOG_BLOCK_SIZE bytes of log lines, exactly as
+// they'd appear in the plain-text logs. `blackrock.YYYY-MM-DD.logz-index` is an array of
+// LogBlockIndexEntry, one per block, appended after the block itself is written.
+
+static constexpr size_t LOG_BLOCK_SIZE = 1u << 20;
+static constexpr time_t LOG_BLOCK_MAX_AGE = 60;
+// A block is written when it reaches LOG_BLOCK_SIZE uncompressed, or has been open for
+// LOG_BLOCK_MAX_AGE seconds, so that quiet periods don't leave logs unqueryable for long.
+
+static constexpr size_t TIMESTAMP_SIZE = sizeof("YYYY-MM-DD_HH-MM-SS") - 1;
+
+struct LogSourceFilter {
+  // 256-bit Bloom filter of source names. A block's filter may match sources which aren't
+  // actually present, but queries filter individual lines anyway.
+
+  uint64_t bits[4];
+
+  void add(kj::ArrayPtr<const char> name) {
+    uint64_t h = hash(name);
+    for (uint i = 0; i < 3; i++) {
+      uint bit = (h >> (i * 8)) & 0xff;
+      bits[bit / 64] |= 1ull << (bit % 64);
+    }
+  }
+
+  bool mayContain(const LogSourceFilter& other) const {
+    // True if every bit set in `other` is also set here.
+    for (uint i = 0; i < kj::size(bits); i++) {
+      if ((bits[i] & other.bits[i]) != other.bits[i]) return false;
+    }
+    return true;
+  }
+
+  static uint64_t hash(kj::ArrayPtr<const char> name) {
+    // FNV-1a.
+    uint64_t h = 14695981039346656037ull;
+    for (char c: name) {
+      h = (h ^ static_cast<byte>(c)) * 1099511628211ull;
+    }
+    return h;
+  }
+};
+
+struct LogBlockIndexEntry {
+  uint64_t offset;            // Position of the compressed block in the .logz file.
+  uint32_t compressedSize;
+  uint32_t uncompressedSize;
+  int64_t startTime;          // Earliest and latest line timestamps in the block.
+  int64_t endTime;
+  LogSourceFilter sources;
+};
+static_assert(sizeof(LogBlockIndexEntry) == 64, "LogBlockIndexEntry has unexpected size");
+
+static kj::Maybe<time_t> parseLogTimestamp(kj::ArrayPtr<const char> line) {
+  // Parse the timestamp with which LogSink prefixes every line.
+
+  if (line.size() < TIMESTAMP_SIZE) return nullptr;
+
+  char buffer[TIMESTAMP_SIZE + 1];
+  memcpy(buffer, line.begin(), TIMESTAMP_SIZE);
+  buffer[TIMESTAMP_SIZE] = '\0';
+
+  struct tm utc;
+  memset(&utc, 0, sizeof(utc));
+  const char* end = strptime(buffer, "%Y-%m-%d_%H-%M-%S", &utc);
+  if (end == nullptr || *end != '\0') return nullptr;
+  return timegm(&utc);
+}
+
+static kj::ArrayPtr<const char> parseLogSource(kj::ArrayPtr<const char> line) {
+  // Extract the name from the " [name] " which follows the timestamp on lines written by
+  // LogSink. Returns an empty array for lines which don't have one, like status lines.
+
+  if (line.size() < TIMESTAMP_SIZE + 2 ||
+      line[TIMESTAMP_SIZE] != ' ' || line[TIMESTAMP_SIZE + 1] != '[') {
+    return nullptr;
+  }
+
+  auto rest = line.slice(TIMESTAMP_SIZE + 2, line.size());
+  auto close = reinterpret_cast<const char*>(memchr(rest.begin(), ']', rest.size()));
+  if (close == nullptr) return nullptr;
+
+  auto name = rest.slice(0, close - rest.begin());
+  while (name.size() > 0 && name[name.size() - 1] == ' ') {
+    name = name.slice(0, name.size() - 1);
+  }
+  return name;
+}
+
+static kj::String logStoreFilename(time_t day, kj::StringPtr suffix) {
+  char buffer[128];
+  time_t time = day * 86400;
+  struct tm utc;
+  KJ_ASSERT(gmtime_r(&time, &utc) != nullptr);
+  size_t n = strftime(buffer, sizeof(buffer), "blackrock.%Y-%m-%d", &utc);
+  return kj::str(kj::arrayPtr(buffer, n), suffix);
+}
+
+class LogStoreWriter {
+public:
+  explicit LogStoreWriter(int logDirFd): logDirFd(logDirFd) {}
+  KJ_DISALLOW_COPY(LogStoreWriter);
+
+  ~LogStoreWriter() noexcept(false) {
+    flush();
+  }
+
+  void addLine(kj::ArrayPtr<const char> line) {
+    // Add a line, including its trailing newline.
+
+    time_t lineTime = blockEnd;
+    KJ_IF_MAYBE(t, parseLogTimestamp(line)) {
+      lineTime = *t;
+    } else if (block.size() == 0) {
+      lineTime = time(nullptr);
+    }
+
+    if (block.size() > 0 && (block.size() + line.size() > LOG_BLOCK_SIZE ||
+                             lineTime / 86400 != blockStart / 86400)) {
+      flush();
+    }
+
+    if (block.size() == 0) {
+      blockStart = lineTime;
+      blockEnd = lineTime;
+      blockOpened = time(nullptr);
+      memset(&sources, 0, sizeof(sources));
+    }
+
+    blockStart = kj::min(blockStart, lineTime);
+    blockEnd = kj::max(blockEnd, lineTime);
+
+    auto source = parseLogSource(line);
+    if (source.size() > 0) {
+      sources.add(source);
+    }
+
+    block.addAll(line);
+  }
+
+  void flushIfOld(time_t now) {
+    if (block.size() > 0 && now - blockOpened >= LOG_BLOCK_MAX_AGE) {
+      flush();
+    }
+  }
+
+  void flush() {
+    if (block.size() == 0) return;
+
+    time_t blockDay = blockStart / 86400;
+    if (blockDay != day) {
+      dataFd = sandstorm::raiiOpenAt(logDirFd, logStoreFilename(blockDay, ".logz"),
+                                     O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC);
+      indexFd = sandstorm::raiiOpenAt(logDirFd, logStoreFilename(blockDay, ".logz-index"),
+                                      O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC);
+      day = blockDay;
+    }
+
+    auto compressed = kj::heapArray<byte>(compressBound(block.size()));
+    uLongf compressedSize = compressed.size();
+    int result = compress2(compressed.begin(), &compressedSize,
+                           reinterpret_cast<const byte*>(block.begin()), block.size(),
+                           Z_DEFAULT_COMPRESSION);
+    KJ_ASSERT(result == Z_OK, "zlib compress2() failed", result);
+
+    // Write the block before its index entry, so that the index never points at data that isn't
+    // there. Since the file is opened O_APPEND, its size is where our block lands.
+    struct stat stats;
+    KJ_SYSCALL(fstat(dataFd, &stats));
+    kj::FdOutputStream(dataFd.get()).write(compressed.begin(), compressedSize);
+
+    LogBlockIndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.offset = stats.st_size;
+    entry.compressedSize = compressedSize;
+    entry.uncompressedSize = block.size();
+    entry.startTime = blockStart;
+    entry.endTime = blockEnd;
+    entry.sources = sources;
+    kj::FdOutputStream(indexFd.get()).write(&entry, sizeof(entry));
+
+    block.clear();
+  }
+
+private:
+  int logDirFd;
+  time_t day = -1;
+  kj::AutoCloseFd dataFd;
+  kj::AutoCloseFd indexFd;
+
+  kj::Vector<char> block;
+  time_t blockStart = 0;
+  time_t blockEnd = 0;
+  time_t blockOpened = 0;
+  LogSourceFilter sources;
+};
+
+void storeLogs(int input, int logDirFd) {
+  LogStoreWriter writer(logDirFd);
+  kj::Vector<char> partial;
+  char buffer[65536];
+
+  for (;;) {
+    // Wake up periodically even if no logs arrive, so that old blocks get written out.
+    struct pollfd pollfd;
+    memset(&pollfd, 0, sizeof(pollfd));
+    pollfd.fd = input;
+    pollfd.events = POLLIN;
+    int pollResult;
+    KJ_SYSCALL(pollResult = poll(&pollfd, 1, LOG_BLOCK_MAX_AGE * 1000 / 4));
+
+    if (pollResult > 0) {
+      ssize_t n;
+      KJ_SYSCALL(n = read(input, buffer, sizeof(buffer)));
+      if (n == 0) break;
+
+      auto data = kj::arrayPtr(buffer, n);
+      while (data.size() > 0) {
+        auto eol = reinterpret_cast<const char*>(memchr(data.begin(), '\n', data.size()));
+        if (eol == nullptr) {
+          partial.addAll(data);
+          break;
+        }
+
+        auto line = data.slice(0, eol + 1 - data.begin());
+        if (partial.size() > 0) {
+          partial.addAll(line);
+          writer.addLine(partial.asPtr());
+          partial.clear();
+        } else {
+          writer.addLine(line);
+        }
+        data = data.slice(line.size(), data.size());
+      }
+    }
+
+    writer.flushIfOld(time(nullptr));
+  }
+
+  if (partial.size() > 0) {
+    partial.add('\n');
+    writer.addLine(partial.asPtr());
+  }
+}
+
+static void preadAll(int fd, void* data, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t n;
+    KJ_SYSCALL(n = pread(fd, data, size, offset));
+    KJ_REQUIRE(n > 0, "log store file truncated");
+    data = reinterpret_cast<byte*>(data) + n;
+    size -= n;
+    offset += n;
+  }
+}
+
+void queryLogs(int logDirFd, time_t begin, time_t end,
+               kj::ArrayPtr<const kj::StringPtr> sources, int output) {
+  auto wanted = kj::heapArray<LogSourceFilter>(sources.size());
+  for (uint i = 0; i < sources.size(); i++) {
+    memset(&wanted[i], 0, sizeof(wanted[i]));
+    wanted[i].add(sources[i]);
+  }
+
+  kj::FdOutputStream out(output);
+  kj::Vector<kj::ArrayPtr<const byte>> matches;
+
+  for (time_t day = begin / 86400; day <= end / 86400; day++) {
+    KJ_IF_MAYBE(indexFd, sandstorm::raiiOpenAtIfExists(
+        logDirFd, logStoreFilename(day, ".logz-index"), O_RDONLY | O_CLOEXEC)) {
+      auto dataFd = sandstorm::raiiOpenAt(
+          logDirFd, logStoreFilename(day, ".logz"), O_RDONLY | O_CLOEXEC);
+
+      // storeLogs() may be appending to the index right now, so ignore any partial entry at the
+      // end.
+      struct stat stats;
+      KJ_SYSCALL(fstat(*indexFd, &stats));
+      auto entries = kj::heapArray<LogBlockIndexEntry>(
+          stats.st_size / sizeof(LogBlockIndexEntry));
+      preadAll(*indexFd, entries.begin(), entries.asBytes().size(), 0);
+
+      for (auto& entry: entries) {
+        if (entry.endTime < begin || entry.startTime > end) continue;
+
+        if (wanted.size() > 0) {
+          bool match = false;
+          for (auto& filter: wanted) {
+            if (entry.sources.mayContain(filter)) {
+              match = true;
+              break;
+            }
+          }
+          if (!match) continue;
+        }
+
+        auto compressed = kj::heapArray<byte>(entry.compressedSize);
+        preadAll(dataFd, compressed.begin(), compressed.size(), entry.offset);
+
+        auto text = kj::heapArray<char>(entry.uncompressedSize);
+        uLongf size = text.size();
+        int result = uncompress(reinterpret_cast<byte*>(text.begin()), &size,
+                                compressed.begin(), compressed.size());
+        KJ_REQUIRE(result == Z_OK && size == text.size(), "corrupt log block",
+                   logStoreFilename(day, ".logz"), entry.offset, result);
+
+        // Blocks are coarse, so filter individual lines. Consecutive lines usually share a
+        // timestamp, so only re-parse it when it changes.
+        kj::ArrayPtr<const char> remaining = text;
+        kj::ArrayPtr<const char> lastTimestamp;
+        time_t lineTime = entry.startTime;
+        while (remaining.size() > 0) {
+          auto eol = reinterpret_cast<const char*>(
+              memchr(remaining.begin(), '\n', remaining.size()));
+          size_t lineSize = eol == nullptr ? remaining.size() : eol + 1 - remaining.begin();
+          auto line = remaining.slice(0, lineSize);
+          remaining = remaining.slice(lineSize, remaining.size());
+
+          if (line.size() >= TIMESTAMP_SIZE &&
+              (lastTimestamp.size() == 0 ||
+               memcmp(line.begin(), lastTimestamp.begin(), TIMESTAMP_SIZE) != 0)) {
+            KJ_IF_MAYBE(t, parseLogTimestamp(line)) {
+              lineTime = *t;
+              lastTimestamp = line.slice(0, TIMESTAMP_SIZE);
+            }
+          }
+
+          if (lineTime < begin || lineTime > end) continue;
+
+          if (sources.size() > 0) {
+            auto source = parseLogSource(line);
+            bool match = false;
+            for (auto& name: sources) {
+              if (name.size() == source.size() &&
+                  memcmp(name.begin(), source.begin(), source.size()) == 0) {
+                match = true;
+                break;
+              }
+            }
+            if (!match) continue;
+          }
+
+          if (matches.size() >= 1000) {
+            // Stay under IOV_MAX.
+            out.write(matches.asPtr());
+            matches.clear();
+          }
+          matches.add(line.asBytes());
+        }
+
+        if (matches.size() > 0) {
+          out.write(matches.asPtr());
+          matches.clear();
+        }
+      }
+    }
+  }
+}
+
+// =======================================================================================
+
+static constexpr uint64_t EVENTFD_MAX = (uint64_t)-2;
+
+static constexpr size_t BACKLOG_RING_SIZE = 1u << 20;
+// Size of the in-memory buffer in front of the backlog file. Data is copied into the ring by the
+// event loop and written to disk by a background thread, so that a slow disk never blocks log
+// forwarding. If the ring fills up, new logs are dropped (and counted).
+
+static constexpr uint64_t BACKLOG_MAX_SIZE = 512ull << 20;
+// Once this much is waiting in the backlog file, further logs are dropped rather than filling
+// up the disk.
+
+static constexpr size_t BACKLOG_REPLAY_CHUNK = 65536;
+static constexpr kj::Duration BACKLOG_REPLAY_INTERVAL = 20 * kj::MILLISECONDS;
+// After reconnecting, the backlog is uploaded one chunk at a time with a delay between chunks,
+// interleaved with live logs. This caps replay at ~3MB/s per machine, so that a whole cluster
+// reconnecting after a sink outage doesn't bury the sink, and so that live logs never wait
+// behind the entire backlog. Framed records carry their original timestamps, so ordering in the
+// stored logs isn't affected.
+
+static size_t wholeRecordsPrefix(kj::ArrayPtr<const byte> data) {
+  // Returns the size of the longest prefix of `data` consisting of complete records and raw
+  // lines, so that a chunk of the backlog can be sent without splitting a record.
+
+  size_t pos = 0;
+  while (pos < data.size()) {
+    if (data[pos] == RECORD_MAGIC) {
+      if (data.size() - pos < sizeof(LogRecordHeader)) break;
+      LogRecordHeader header;
+      memcpy(&header, data.begin() + pos, sizeof(header));
+      if (data.size() - pos < sizeof(header) + header.size) break;
+      pos += sizeof(header) + header.size;
+    } else {
+      auto eol = reinterpret_cast<const byte*>(
+          memchr(data.begin() + pos, '\n', data.size() - pos));
+      if (eol == nullptr) break;
+      pos = eol + 1 - data.begin();
+    }
+  }
+  return pos;
+}
+
+static void writevAll(int fd, kj::ArrayPtr<struct iovec> pieces) {
+  // writev() everything, even if the kernel writes only part of it at a time.
+
+  while (pieces.size() > 0) {
+    ssize_t n;
+    KJ_SYSCALL(n = writev(fd, pieces.begin(), pieces.size()));
+    KJ_ASSERT(n != 0, "zero-sized write?");
+
+    // Skip what was written, which may end partway through a piece.
+    while (pieces.size() > 0 && size_t(n) >= pieces[0].iov_len) {
+      n -= pieces[0].iov_len;
+      pieces = pieces.slice(1, pieces.size());
+    }
+    if (n > 0) {
+      pieces[0].iov_base = reinterpret_cast<byte*>(pieces[0].iov_base) + n;
+      pieces[0].iov_len -= n;
+    }
+  }
+}
 
 class LogClient {
 public:
-  LogClient(kj::Network& network, kj::Timer& timer, kj::StringPtr name,
-            kj::StringPtr backlogDir, kj::StringPtr logAddressFile,
+  LogClient(kj::Network& network, kj::Timer& timer, kj::UnixEventPort& unixEventPort,
+            kj::StringPtr name, kj::StringPtr backlogDir, kj::StringPtr logAddressFile,
             kj::Own<kj::AsyncInputStream> input)
       : network(network),
         timer(timer),
-        nameLine(kj::str(name, '\n')),
+        nameLine(kj::str(name, FRAMED_SUFFIX, '\n')),
         logAddressFile(logAddressFile),
         input(kj::mv(input)),
         backlogName(kj::str(backlogDir, "/blackrock-backlog.", time(nullptr), '.', getpid())),
         backlog(sandstorm::raiiOpen(backlogName, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)),
-        reconnectTask(reconnect()) {}
+        ring(kj::heapArray<byte>(BACKLOG_RING_SIZE)),
+        ringReadyEventFd(newEventFd(0, EFD_CLOEXEC)),
+        ringFlushedEventFd(newEventFd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+        ringFlushedObserver(unixEventPort, ringFlushedEventFd,
+            kj::UnixEventPort::FdObserver::OBSERVE_READ),
+        ringFlushedTask(ringFlushedLoop().eagerlyEvaluate([](kj::Exception&& exception) {
+          KJ_LOG(ERROR, "log backlog flush loop failed", exception);
+        })),
+        statsTask(statsLoop().eagerlyEvaluate([](kj::Exception&& exception) {
+          KJ_LOG(ERROR, "log backlog stats loop failed", exception);
+        })),
+        reconnectTask(reconnect()),
+        flushThread([this]() { doFlushThread(); }) {}
+
+  ~LogClient() noexcept(false) {
+    // Tell the flush thread to exit, as FilesystemStorage's journal does. The thread's destructor
+    // then waits for it.
+    writeEvent(ringReadyEventFd, EVENTFD_MAX);
+  }
 
   void redirectToBacklog(int fd) {
     KJ_SYSCALL(dup2(backlog, fd));
@@ -249,49 +824,23 @@ public:
     return input->tryRead(buffer, 1, sizeof(buffer)).then([this](size_t size) {
       if (size == 0) {
         // EOF -- the main process exited. Finish up writing.
+        if (partialLine.size() > 0) {
+          addRecord(currentTime(), partialLine.asPtr(), partialIsContinuation);
+          partialLine.clear();
+        }
+        queueBatch();
+
         return writeQueue.then([this]() {
           // In case we're not currently connected, we'll keep trying to reconnect and upload logs
           // for 30 seconds. If we don't manage to do so, we'll leave our log file on local disk.
-          return reconnectTask.then([this]() {
+          return whenBacklogDrained().then([this]() {
             // Successfully uploaded the logs, so let's delete the file.
             KJ_SYSCALL(unlink(backlogName.cStr()));
           }).exclusiveJoin(timer.afterDelay(30 * kj::SECONDS));
         });
       } else {
-        auto data = kj::heapArray<byte>(buffer, size);
-        kj::ArrayPtr<const byte> dataPtr = data;
-        writeQueue = writeQueue.then([this,size,dataPtr]() -> kj::Promise<void> {
-          KJ_IF_MAYBE(c, connection) {
-            if (receivedEof) {
-              // It appears that we've received an EOF from the other end, therefore anything we
-              // write() now may be silently lost.
-              connection = nullptr;
-              writeBacklog(dataPtr);
-              reconnectTask = reconnect();
-              return kj::READY_NOW;
-            } else {
-              return kj::evalNow([&]() {
-                return c->get()->write(dataPtr.begin(), dataPtr.size());
-              }).catch_([this,dataPtr](kj::Exception&& exception) {
-                // Cancel existing reconnect task (which may still be looping in awaitEof(), which
-                // uses `connection`, which we're about to destroy).
-                reconnectTask = nullptr;
-
-                // Discard the connection.
-                connection = nullptr;
-                if (expectDisconnected(exception)) {
-                  KJ_LOG(ERROR, "log sink disconnected (write error); trying to reconnect");
-                }
-                writeBacklog(dataPtr);
-                reconnectTask = reconnect();
-              });
-            }
-          } else {
-            writeBacklog(dataPtr);
-            return kj::READY_NOW;
-          }
-        }).attach(kj::mv(data));
-
+        addLines(kj::arrayPtr(buffer, size));
+        queueBatch();
         return run();
       }
     });
@@ -308,14 +857,337 @@ private:
 
   kj::Maybe<kj::Own<kj::AsyncIoStream>> connection;
   kj::Promise<void> writeQueue = kj::READY_NOW;
-  kj::Promise<void> reconnectTask;
   bool receivedEof = false;
-  off_t backlogOffset = 0;
   byte buffer[4096];
-  byte backlogBuffer[4096];
+
+  kj::Vector<byte> partialLine;
+  bool partialIsContinuation = false;
+  // Text read since the last newline, waiting for the rest of its line.
+
+  kj::Vector<byte> batch;
+  bool batchQueued = false;
+  // Framed records which haven't been sent yet. While a write is in progress, new records
+  // accumulate here, so under load each write carries many lines rather than one read()'s worth.
+
+  kj::Array<byte> ring;
+  uint64_t ringEnd = 0;
+  uint64_t ringFlushed = 0;
+  // Ring buffer holding data destined for the backlog file. Positions count bytes since startup;
+  // [ringFlushed, ringEnd) hasn't been written to disk yet. Only the main thread modifies these;
+  // the flush thread learns of new data through `ringReadyEventFd` and reports completion through
+  // `ringFlushedEventFd`, the same way the storage journal talks to its processing thread.
+
+  kj::AutoCloseFd ringReadyEventFd;
+  kj::AutoCloseFd ringFlushedEventFd;
+  kj::UnixEventPort::FdObserver ringFlushedObserver;
+  kj::Promise<void> ringFlushedTask;
+
+  off_t backlogOffset = 0;
+  // How far into the backlog file we've replayed. What's before this was sent successfully, so
+  // a new connection picks up from here rather than sending it again. Reset only when the file
+  // is truncated.
+
+  byte backlogBuffer[BACKLOG_REPLAY_CHUNK];
+  kj::Promise<void> replayTask = nullptr;
+  bool replaying = false;
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> drainedFulfiller;
+
+  uint64_t droppedBytes = 0;
+  uint64_t droppedBatches = 0;
+  // Logs discarded because the ring or the backlog file was full.
+
+  uint64_t flushErrors = 0;
+  // Number of failed writes to the backlog file. Incremented by the flush thread with a relaxed
+  // atomic write, since it's only used for reporting.
+
+  uint64_t reportedDrops = 0;
+  kj::Promise<void> statsTask;
+
+  kj::Promise<void> reconnectTask;
+
+  kj::Thread flushThread;
+  // Declared last so that it starts after everything else is initialized.
+
+  static int64_t currentTime() {
+    struct timespec ts;
+    KJ_SYSCALL(clock_gettime(CLOCK_REALTIME, &ts));
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+  }
+
+  void addLines(kj::ArrayPtr<const byte> data) {
+    // All lines in a read() get the same timestamp; they arrived together anyway.
+    int64_t time = currentTime();
+
+    while (data.size() > 0) {
+      auto eol = reinterpret_cast<const byte*>(memchr(data.begin(), '\n', data.size()));
+      if (eol == nullptr) {
+        partialLine.addAll(data);
+        if (partialLine.size() >= MAX_LINE) {
+          // Don't hold an unterminated line indefinitely.
+          addRecord(time, partialLine.asPtr(), partialIsContinuation);
+          partialLine.clear();
+          partialIsContinuation = true;
+        }
+        break;
+      }
+
+      auto line = data.slice(0, eol - data.begin());
+      if (partialLine.size() > 0) {
+        partialLine.addAll(line);
+        addRecord(time, partialLine.asPtr(), partialIsContinuation);
+        partialLine.clear();
+      } else {
+        addRecord(time, line, partialIsContinuation);
+      }
+      partialIsContinuation = false;
+
+      data = data.slice(line.size() + 1, data.size());
+    }
+  }
+
+  void addRecord(int64_t time, kj::ArrayPtr<const byte> text, bool continuation) {
+    LogRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = RECORD_MAGIC;
+    header.timestamp = time;
+
+    for (;;) {
+      auto piece = text.slice(0, kj::min(text.size(), MAX_LINE));
+      header.flags = continuation ? RECORD_CONTINUATION : 0;
+      header.size = piece.size();
+      batch.addAll(kj::arrayPtr(reinterpret_cast<const byte*>(&header), sizeof(header)));
+      batch.addAll(piece);
+
+      text = text.slice(piece.size(), text.size());
+      if (text.size() == 0) break;
+      continuation = true;
+    }
+  }
+
+  void queueBatch() {
+    if (batchQueued || batch.size() == 0) return;
+
+    // Take the batch only once the previous write has completed, so that everything which
+    // arrives in the meantime goes out together.
+    batchQueued = true;
+    writeQueue = writeQueue.then([this]() {
+      batchQueued = false;
+      auto data = batch.releaseAsArray();
+      kj::ArrayPtr<const byte> dataPtr = data;
+      return send(dataPtr).attach(kj::mv(data));
+    });
+  }
+
+  kj::Promise<void> send(kj::ArrayPtr<const byte> data) {
+    KJ_IF_MAYBE(c, connection) {
+      if (receivedEof) {
+        // It appears that we've received an EOF from the other end, therefore anything we
+        // write() now may be silently lost.
+        dropConnection();
+        writeBacklog(data);
+        reconnectTask = reconnect();
+        return kj::READY_NOW;
+      } else {
+        return kj::evalNow([&]() {
+          return c->get()->write(data.begin(), data.size());
+        }).catch_([this,data](kj::Exception&& exception) {
+          writeFailed(kj::mv(exception));
+          writeBacklog(data);
+        });
+      }
+    } else {
+      writeBacklog(data);
+      return kj::READY_NOW;
+    }
+  }
+
+  void dropConnection() {
+    // Cancel existing reconnect task (which may still be looping in awaitEof(), which uses
+    // `connection`, which we're about to destroy) and the replay task.
+    reconnectTask = nullptr;
+    replayTask = nullptr;
+    replaying = false;
+    connection = nullptr;
+  }
+
+  void writeFailed(kj::Exception&& exception) {
+    dropConnection();
+    if (expectDisconnected(exception)) {
+      KJ_LOG(ERROR, "log sink disconnected (write error); trying to reconnect");
+    }
+    reconnectTask = reconnect();
+  }
 
   void writeBacklog(kj::ArrayPtr<const byte> data) {
-    kj::FdOutputStream(backlog.get()).write(data.begin(), data.size());
+    // Queue the data to be appended to the backlog file by the flush thread. Batches are only
+    // ever dropped whole, so the backlog never contains partial records.
+
+    if (ringEnd - ringFlushed + data.size() > ring.size() ||
+        backlogPending() + data.size() > BACKLOG_MAX_SIZE) {
+      ++droppedBatches;
+      droppedBytes += data.size();
+      return;
+    }
+
+    size_t offset = ringEnd % ring.size();
+    size_t firstPart = kj::min(data.size(), ring.size() - offset);
+    memcpy(ring.begin() + offset, data.begin(), firstPart);
+    memcpy(ring.begin(), data.begin() + firstPart, data.size() - firstPart);
+    ringEnd += data.size();
+
+    writeEvent(ringReadyEventFd, data.size());
+  }
+
+  uint64_t backlogPending() {
+    // Bytes in the backlog not yet replayed. The file's real size counts, rather than what we put
+    // in the ring, because stdout and stderr -- including our own error messages -- are written
+    // straight to it.
+
+    struct stat stats;
+    KJ_SYSCALL(fstat(backlog, &stats));
+    uint64_t unreplayed = kj::max(stats.st_size, backlogOffset) - backlogOffset;
+    return unreplayed + (ringEnd - ringFlushed);
+  }
+
+  void doFlushThread() {
+    // Writes data from the ring to the backlog file.
+
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      uint64_t position = 0;
+
+      for (;;) {
+        uint64_t count = readEvent(ringReadyEventFd);
+
+        KJ_ASSERT(count > 0);
+
+        if (count == EVENTFD_MAX) {
+          // Clean shutdown requested.
+          break;
+        }
+
+        // The data may wrap around the end of the ring. Write both parts with one writev(), since
+        // stdout and stderr share this file description: a line written to them in between two
+        // write()s would land in the middle of a record. (For the same reason, don't use
+        // pwritev().)
+        size_t offset = position % ring.size();
+        size_t firstPart = kj::min(count, ring.size() - offset);
+        struct iovec pieces[2] = {
+          { ring.begin() + offset, firstPart },
+          { ring.begin(), count - firstPart },
+        };
+        KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+          writevAll(backlog, kj::arrayPtr(pieces, 2));
+        })) {
+          // Probably out of disk space. These logs are lost, but keep going.
+          __atomic_add_fetch(&flushErrors, 1, __ATOMIC_RELAXED);
+        }
+        position += count;
+
+        // Post back to main thread that the space can be reused.
+        writeEvent(ringFlushedEventFd, count);
+      }
+    })) {
+      KJ_LOG(FATAL, "exception in log backlog thread", *exception);
+      abort();
+    }
+  }
+
+  kj::Promise<void> ringFlushedLoop() {
+    return ringFlushedObserver.whenBecomesReadable().then([this]() {
+      uint64_t byteCount;
+      ssize_t n;
+      KJ_NONBLOCKING_SYSCALL(n = read(ringFlushedEventFd, &byteCount, sizeof(byteCount)));
+
+      if (n < 0) {
+        // Oops, not actually ready.
+      } else {
+        KJ_ASSERT(n == sizeof(byteCount), "eventfd read had unexpected size", n);
+        ringFlushed += byteCount;
+      }
+
+      return ringFlushedLoop();
+    });
+  }
+
+  kj::Promise<void> statsLoop() {
+    return timer.afterDelay(60 * kj::SECONDS).then([this]() {
+      // Report backlog size and drops. These go into our own backlog, and thus to the log sink
+      // once it's reachable.
+      uint64_t pending = backlogPending();
+      uint64_t errors = __atomic_load_n(&flushErrors, __ATOMIC_RELAXED);
+      if (pending > 0 || droppedBatches + errors != reportedDrops) {
+        KJ_LOG(WARNING, "log backlog", pending, droppedBatches, droppedBytes, errors);
+        reportedDrops = droppedBatches + errors;
+      }
+      return statsLoop();
+    });
+  }
+
+  kj::Promise<void> whenBacklogDrained() {
+    if (connection != nullptr && !replaying) {
+      return kj::READY_NOW;
+    } else {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      drainedFulfiller = kj::mv(paf.fulfiller);
+      return kj::mv(paf.promise);
+    }
+  }
+
+  kj::Promise<void> replayBacklog() {
+    ssize_t n;
+    KJ_SYSCALL(n = pread(backlog, backlogBuffer, sizeof(backlogBuffer), backlogOffset));
+
+    size_t size = wholeRecordsPrefix(kj::arrayPtr(backlogBuffer, n));
+    if (size == 0 && n == sizeof(backlogBuffer)) {
+      // A whole chunk without a line break? Must be some weird output on stderr. Send it anyway.
+      size = n;
+    }
+
+    if (size == 0) {
+      if (n == 0 && ringFlushed == ringEnd) {
+        // We're all caught up! Truncate the backlog; it's all saved. The flush thread is idle
+        // since the ring is empty.
+        KJ_SYSCALL(lseek(backlog, 0, SEEK_SET));
+        KJ_SYSCALL(ftruncate(backlog, 0));
+        backlogOffset = 0;
+
+        KJ_IF_MAYBE(f, drainedFulfiller) {
+          f->get()->fulfill();
+          drainedFulfiller = nullptr;
+        }
+
+        replaying = false;
+        return kj::READY_NOW;
+      } else {
+        // Waiting on the flush thread.
+        return timer.afterDelay(BACKLOG_REPLAY_INTERVAL).then([this]() {
+          return replayBacklog();
+        });
+      }
+    }
+
+    // Send the chunk in turn with live logs.
+    auto written = writeQueue.then([this,size]() -> kj::Promise<void> {
+      KJ_IF_MAYBE(c, connection) {
+        if (!receivedEof) {
+          return kj::evalNow([&]() {
+            return c->get()->write(backlogBuffer, size);
+          }).then([this,size]() {
+            backlogOffset += size;
+          }, [this](kj::Exception&& exception) {
+            writeFailed(kj::mv(exception));
+          });
+        }
+      }
+      return kj::READY_NOW;
+    }).fork();
+    writeQueue = written.addBranch();
+
+    return written.addBranch().then([this]() {
+      return timer.afterDelay(BACKLOG_REPLAY_INTERVAL);
+    }).then([this]() {
+      return replayBacklog();
+    });
   }
 
   kj::Promise<void> reconnect() {
@@ -337,14 +1209,23 @@ private:
       auto promise = addressObj->connect();
       return promise.attach(kj::mv(addressObj));
     }).then([this](kj::Own<kj::AsyncIoStream>&& newConnection) -> kj::Promise<void> {
-      // Connected, start writing the backlog to the new connection.
+      // Connected, send our name.
 
       auto promise = kj::evalNow([&]() {
         return newConnection->write(nameLine.begin(), nameLine.size());
       });
 
       return promise.then([this,KJ_MVCAP(newConnection)]() mutable {
-        return writeBacklog(kj::mv(newConnection));
+        // Start using the connection for live logs right away. The backlog follows in the
+        // background.
+        receivedEof = false;
+        auto promise = awaitEof(*newConnection);
+        connection = kj::mv(newConnection);
+        replaying = true;
+        replayTask = replayBacklog().eagerlyEvaluate([](kj::Exception&& e) {
+          KJ_LOG(ERROR, "failure replaying log backlog", e);
+        });
+        return promise;
       }, [this](kj::Exception&& exception) {
         // Dang, connection failed right away. Keep trying.
         expectDisconnected(exception);
@@ -359,41 +1240,6 @@ private:
     });
   }
 
-  kj::Promise<void> writeBacklog(kj::Own<kj::AsyncIoStream> newConnection) {
-    ssize_t n;
-    KJ_SYSCALL(n = pread(backlog, backlogBuffer, sizeof(backlogBuffer), backlogOffset));
-
-    if (n == 0) {
-      // We're all caught up!
-
-      // Truncate the backlog; it's all saved.
-      KJ_SYSCALL(lseek(backlog, 0, SEEK_SET));
-      KJ_SYSCALL(ftruncate(backlog, 0));
-      backlogOffset = 0;
-
-      // Now we can continue on.
-      receivedEof = false;
-      auto promise = awaitEof(*newConnection);
-      connection = kj::mv(newConnection);
-      return promise;
-    } else {
-      backlogOffset += n;
-
-      // Send backlog up to server.
-      auto promise = kj::evalNow([&]() {
-        return newConnection->write(backlogBuffer, n);
-      });
-
-      return promise.then([this,KJ_MVCAP(newConnection)]() mutable {
-        return writeBacklog(kj::mv(newConnection));
-      }, [this](kj::Exception&& exception) {
-        // Dang, failed while trying to upload the backlog.
-        expectDisconnected(exception);
-        return reconnectLoop();
-      });
-    }
-  }
-
   bool expectDisconnected(const kj::Exception& exception) {
     if (exception.getType() == kj::Exception::Type::DISCONNECTED) {
       return true;
@@ -429,6 +1275,7 @@ void runLogClient(kj::StringPtr name, kj::StringPtr logAddressFile, kj::StringPt
 
   LogClient client(ioContext.provider->getNetwork(),
                    ioContext.lowLevelProvider->getTimer(),
+                   ioContext.unixEventPort,
                    name, backlogDir, logAddressFile,
                    ioContext.lowLevelProvider->wrapInputFd(STDIN_FILENO));
   client.redirectToBacklog(STDOUT_FILENO);
@@ -19,7 +19,10 @@
 
 #include "common.h"
 #include <kj/async-io.h>
+#include <kj/vector.h>
 #include <set>
+#include <time.h>
+#include <unistd.h>
 
 namespace sandstorm {
   class Subprocess;
@@ -29,21 +32,80 @@ namespace blackrock {
 
 class SimpleAddress;
 
+// =======================================================================================
+// Wire format
+//
+// A log client connects to the sink and sends its name on the first line. Old-style clients
+// then send raw text. Clients which append " framed" to their name instead send a sequence of
+// records, each a LogRecordHeader followed by the text of one line (without the newline). Framed
+// records carry the time at which the line was produced, and let the client batch many lines into
+// each write without the sink having to scan for line breaks.
+//
+// The client also writes its own error messages as raw text into its backlog file, which is later
+// replayed over the framed connection. Therefore, the sink treats any data on a framed connection
+// which does not start with RECORD_MAGIC as a raw line of text.
+
+constexpr byte RECORD_MAGIC = 0x1e;  // ASCII "record separator"; never appears in text.
+constexpr uint8_t RECORD_CONTINUATION = 1;
+// Flag indicating that the record continues the line from the previous record, which was too long
+// to fit in one record.
+
+constexpr uint MAX_LINE = 8192;
+// Lines longer than this are split (both by the sink, for raw text, and by the client, for
+// records).
+
+constexpr const char FRAMED_SUFFIX[] = " framed";
+
+struct LogRecordHeader {
+  byte magic;           // Always RECORD_MAGIC.
+  uint8_t flags;        // RECORD_* flags.
+  uint16_t reserved;    // Zero.
+  uint32_t size;        // Number of bytes of text following the header; at most MAX_LINE.
+  int64_t timestamp;    // Time the line was read by the client, in ns since the Unix epoch.
+};
+static_assert(sizeof(LogRecordHeader) == 16, "LogRecordHeader has unexpected size");
+
+// =======================================================================================
+
 class LogSink: private kj::TaskSet::ErrorHandler {
 public:
-  LogSink();
+  explicit LogSink(int output = STDOUT_FILENO);
+  // Log lines are written to `output`.
 
   kj::Promise<void> acceptLoop(kj::Own<kj::ConnectionReceiver> receiver);
 
 private:
   class ClientHandler;
 
+  int output;
+
   std::set<kj::String> namesSeen;
 
   kj::TaskSet tasks;
 
+  kj::Vector<kj::ArrayPtr<const byte>> pending;
+  // Pieces of lines which have been queued by append() but not yet written. These point into
+  // client receive buffers, so they must be flushed before those buffers are reused.
+
+  time_t timestampTime = -1;
+  char timestampBuffer[32];
+  kj::ArrayPtr<const char> timestamp;
+  // `timestampTime` formatted for output. Nearly every line in a batch falls in the same second,
+  // so we only call strftime() when the second changes.
+
   void write(kj::ArrayPtr<const char> part1, kj::ArrayPtr<const char> part2 = nullptr);
-  // Write a line to the log file, prefixed by a timestamp.
+  // Write a line to the log file immediately, prefixed by the current time. Used for status
+  // messages. A newline is appended.
+
+  void append(time_t time, kj::ArrayPtr<const char> prefix, bool continuation,
+              kj::ArrayPtr<const byte> text1, kj::ArrayPtr<const byte> text2 = nullptr);
+  // Queue a line to be written on the next flush(), prefixed by `time`. The line's text is the
+  // concatenation of `text1` and `text2` (the latter is used when the line wraps around a ring
+  // buffer). A newline is appended. Nothing is copied: all arguments must remain valid until
+  // flush() is called.
+
+  void flush();
+  // Write all queued lines with one writev().
 
   void taskFailed(kj::Exception&& exception) override;
 };
@@ -52,11 +114,24 @@ void rotateLogs(int input, int logDirFd);
 // Read logs on `input` and write them to files in `logDirFd`, rotated to avoid any file becoming
 // overly large.
 
+void storeLogs(int input, int logDirFd);
+// Like rotateLogs(), but writes zlib-compressed blocks to daily `blackrock.YYYY-MM-DD.logz` files,
+// alongside an index (`.logz-index`) recording each block's time range and which sources appear
+// in it. This lets queryLogs() seek straight to the relevant blocks rather than reading
+// everything.
+
+void queryLogs(int logDirFd, time_t begin, time_t end,
+               kj::ArrayPtr<const kj::StringPtr> sources, int output);
+// Write to `output` every line saved by storeLogs() in `logDirFd` with a timestamp in the range
+// [begin, end] which came from one of `sources`. If `sources` is empty, lines from all sources
+// are written, including the sink's own status lines.
+
 void runLogClient(kj::StringPtr name, kj::StringPtr logAddressFile, kj::StringPtr backlogDir);
 // Reads logs from standard input and upload them to the log sink server, reconnecting to the
 // server as needed, buffering logs to a local file when the log server is unreachable. Note that
 // some logs may be lost around the moment of a disconnect; this is not intended to be 100%
-// reliable, only as reliable as is reasonable.
+// reliable, only as reliable as is reasonable. Logs are also dropped if the local backlog grows
+// too large; the client periodically logs its backlog size and drop counts.
 //
 // `logAddressFile` is the name of a file on the hard drive which contains the address (in
 // SimpleAddress format). The file is re-read every time a reconnect is attempted. This allows an
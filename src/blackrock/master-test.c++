@@ -0,0 +1,332 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "master.h"
+#include <kj/test.h>
+#include <kj/async-io.h>
+
+namespace blackrock {
+namespace {
+
+struct FakeMachine {
+  uint grainCount = 0;
+  bool routed = false;
+  bool stopped = false;
+  bool canDrain = false;      // if false, drain() is unimplemented, like an old worker
+  uint drainSuccessors = 0;   // number of successors passed to drain()
+  kj::Own<BackendSetFeederBase::Registration> registration;
+};
+
+class FakeWorker: public Worker::Server {
+public:
+  explicit FakeWorker(FakeMachine& machine): machine(machine) {}
+
+protected:
+  kj::Promise<void> getLoad(GetLoadContext context) override {
+    context.getResults().initLoad().setGrainCount(machine.grainCount);
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> drain(DrainContext context) override {
+    if (!machine.canDrain) {
+      return KJ_EXCEPTION(UNIMPLEMENTED, "drain() not implemented");
+    }
+    machine.drainSuccessors = context.getParams().getSuccessors().size();
+    context.getResults().setGrainCount(machine.grainCount);
+    machine.grainCount = 0;
+    return kj::READY_NOW;
+  }
+
+private:
+  FakeMachine& machine;
+};
+
+class FakeRouting: public BackendSetFeederBase::Registration {
+  // Stands in for a BackendSetFeeder registration; tracks whether the worker is in the set.
+
+public:
+  explicit FakeRouting(FakeMachine& machine): machine(machine) { machine.routed = true; }
+  ~FakeRouting() noexcept(false) { machine.routed = false; }
+
+private:
+  FakeMachine& machine;
+};
+
+class FakeWorkerPool: public WorkerAutoscaler::WorkerPool {
+  // Workers "boot" instantly and report whatever load the test sets.
+
+public:
+  kj::Maybe<WorkerAutoscaler&> autoscaler;
+  std::map<uint, kj::Own<FakeMachine>> machines;
+  uint startCount = 0;
+  uint stopCount = 0;
+
+  ~FakeWorkerPool() noexcept(false) {
+    // Disconnect everyone before the machines go away, as the autoscaler refers to them.
+    for (auto& machine: machines) {
+      machine.second->registration = nullptr;
+    }
+  }
+
+  void startWorker(uint index) override {
+    ++startCount;
+    auto& machine = *(machines[index] = kj::heap<FakeMachine>());
+    machine.registration = KJ_ASSERT_NONNULL(autoscaler).addWorker(
+        index, kj::heap<FakeWorker>(machine), kj::heap<FakeRouting>(machine));
+  }
+
+  kj::Promise<void> stopWorker(uint index) override {
+    ++stopCount;
+    auto& machine = *machines[index];
+    machine.registration = nullptr;
+    machine.stopped = true;
+    return kj::READY_NOW;
+  }
+};
+
+struct AutoscalerFixture {
+  AutoscalerFixture(uint initialCount)
+      : io(kj::setupAsyncIo()),
+        autoscaler(io.provider->getTimer(), pool, WorkerAutoscaler::Options {
+          1, 3, 10, 0.75, 0.35,
+          1 * kj::MILLISECONDS,  // pollInterval
+          0 * kj::SECONDS,       // cooldown
+          10 * kj::SECONDS       // drainTimeout
+        }, initialCount) {
+    pool.autoscaler = autoscaler;
+    for (uint i = 0; i < initialCount; i++) {
+      pool.startWorker(i);
+    }
+    pool.startCount = 0;
+  }
+
+  kj::AsyncIoContext io;
+  WorkerAutoscaler autoscaler;
+  FakeWorkerPool pool;  // destroyed first; see ~FakeWorkerPool()
+
+  void poll() {
+    autoscaler.pollOnce().wait(io.waitScope);
+  }
+
+  void sleep(kj::Duration duration) {
+    io.provider->getTimer().afterDelay(duration).wait(io.waitScope);
+  }
+
+  bool waitUntil(kj::Function<bool()> condition) {
+    for (uint i = 0; i < 1000; i++) {
+      if (condition()) return true;
+      sleep(1 * kj::MILLISECONDS);
+    }
+    return false;
+  }
+};
+
+KJ_TEST("autoscaler adds workers under load, up to the maximum") {
+  AutoscalerFixture env(1);
+
+  env.pool.machines[0]->grainCount = 9;
+  env.poll();
+  KJ_EXPECT(env.pool.startCount == 1);
+  KJ_EXPECT(env.autoscaler.getTargetCount() == 2);
+  KJ_EXPECT(env.pool.machines[1]->routed);
+
+  env.pool.machines[1]->grainCount = 9;
+  env.poll();
+  KJ_EXPECT(env.autoscaler.getTargetCount() == 3);
+
+  env.pool.machines[2]->grainCount = 9;
+  env.poll();
+  KJ_EXPECT(env.pool.startCount == 2);
+  KJ_EXPECT(env.autoscaler.getTargetCount() == 3);
+}
+
+KJ_TEST("autoscaler leaves a comfortable cluster alone") {
+  AutoscalerFixture env(2);
+
+  // An average of 0.4 is between the thresholds.
+  env.pool.machines[0]->grainCount = 4;
+  env.pool.machines[1]->grainCount = 4;
+  env.poll();
+  KJ_EXPECT(env.pool.startCount == 0);
+  KJ_EXPECT(env.pool.stopCount == 0);
+  KJ_EXPECT(env.autoscaler.getTargetCount() == 2);
+}
+
+KJ_TEST("autoscaler evacuates a worker onto the others") {
+  AutoscalerFixture env(3);
+  for (auto& machine: env.pool.machines) {
+    machine.second->grainCount = 1;
+    machine.second->canDrain = true;
+  }
+
+  env.poll();
+  KJ_EXPECT(env.autoscaler.getTargetCount() == 2);
+
+  auto& draining = *env.pool.machines[2];
+  KJ_EXPECT(env.waitUntil([&]() { return draining.stopped; }));
+  KJ_EXPECT(draining.drainSuccessors == 2);
+  KJ_EXPECT(!env.pool.machines[0]->stopped);
+  KJ_EXPECT(!env.pool.machines[1]->stopped);
+}
+
+KJ_TEST("autoscaler waits for idle grains if a worker can't drain") {
+  AutoscalerFixture env(2);
+
+  env.pool.machines[0]->grainCount = 1;
+  env.pool.machines[1]->grainCount = 1;
+  env.poll();
+  KJ_EXPECT(env.autoscaler.getTargetCount() == 1);
+
+  // Worker 1 no longer receives new grains, but keeps running while it has some.
+  auto& draining = *env.pool.machines[1];
+  KJ_EXPECT(!draining.routed);
+  KJ_EXPECT(env.pool.machines[0]->routed);
+  env.sleep(20 * kj::MILLISECONDS);
+  KJ_EXPECT(!draining.stopped, "stopped worker which still had grains");
+
+  draining.grainCount = 0;
+  KJ_EXPECT(env.waitUntil([&]() { return draining.stopped; }));
+  KJ_EXPECT(env.pool.stopCount == 1);
+
+  // Never goes below the minimum.
+  env.pool.machines[0]->grainCount = 0;
+  env.poll();
+  KJ_EXPECT(env.pool.stopCount == 1);
+  KJ_EXPECT(env.autoscaler.getTargetCount() == 1);
+}
+
+kj::Duration timeToSuspicion(PhiAccrualDetector& detector, kj::TimePoint last) {
+  // Steps forward from the last heartbeat until phi crosses the default suspicion threshold,
+  // checking that it only ever rises.
+
+  double previous = 0;
+  for (auto elapsed = 0 * kj::MILLISECONDS; elapsed < 60 * kj::SECONDS;
+       elapsed = elapsed + 10 * kj::MILLISECONDS) {
+    double phi = detector.phi(last + elapsed);
+    KJ_EXPECT(phi >= previous, elapsed / kj::MILLISECONDS, phi, previous);
+    if (phi >= 8.0) return elapsed;
+    previous = phi;
+  }
+  KJ_FAIL_EXPECT("never suspected");
+  return 60 * kj::SECONDS;
+}
+
+KJ_TEST("phi accrual detector doesn't suspect steady heartbeats") {
+  auto io = kj::setupAsyncIo();
+  auto now = io.provider->getTimer().now();
+  PhiAccrualDetector detector(1 * kj::SECONDS, now);
+
+  for (uint i = 0; i < 50; i++) {
+    // Just before each heartbeat arrives, it's no more overdue than usual.
+    KJ_EXPECT(detector.phi(now + 990 * kj::MILLISECONDS) < 1.0, i);
+    now = now + 1 * kj::SECONDS;
+    detector.heartbeat(now);
+    KJ_EXPECT(detector.sinceLastHeartbeat(now) == 0 * kj::SECONDS);
+  }
+}
+
+KJ_TEST("phi accrual detector suspects a missed heartbeat") {
+  auto io = kj::setupAsyncIo();
+  auto now = io.provider->getTimer().now();
+  PhiAccrualDetector detector(1 * kj::SECONDS, now);
+  for (uint i = 0; i < 50; i++) {
+    now = now + 1 * kj::SECONDS;
+    detector.heartbeat(now);
+  }
+
+  // One heartbeat is missed.
+  auto later = now + 2 * kj::SECONDS;
+  KJ_EXPECT(detector.sinceLastHeartbeat(later) == 2 * kj::SECONDS);
+  KJ_EXPECT(detector.phi(later) >= 8.0, detector.phi(later));
+
+  // It turns up late after all; suspicion clears right away.
+  detector.heartbeat(later);
+  KJ_EXPECT(detector.phi(later) < 1.0, detector.phi(later));
+  KJ_EXPECT(detector.phi(later + 990 * kj::MILLISECONDS) < 8.0);
+}
+
+KJ_TEST("phi accrual detector crosses the threshold later for jittery machines") {
+  auto io = kj::setupAsyncIo();
+  auto start = io.provider->getTimer().now();
+
+  auto steadyNow = start;
+  PhiAccrualDetector steady(1 * kj::SECONDS, start);
+  auto jitteryNow = start;
+  PhiAccrualDetector jittery(1 * kj::SECONDS, start);
+  for (uint i = 0; i < 50; i++) {
+    steadyNow = steadyNow + 1 * kj::SECONDS;
+    steady.heartbeat(steadyNow);
+    jitteryNow = jitteryNow + (i % 2 == 0 ? 1500 : 500) * kj::MILLISECONDS;
+    jittery.heartbeat(jitteryNow);
+  }
+
+  // The steady machine is suspected within about half an interval of being late...
+  auto steadyTime = timeToSuspicion(steady, steadyNow);
+  KJ_EXPECT(steadyTime > 1 * kj::SECONDS, steadyTime / kj::MILLISECONDS);
+  KJ_EXPECT(steadyTime < 2 * kj::SECONDS, steadyTime / kj::MILLISECONDS);
+
+  // ...while one whose heartbeats routinely straggle gets more slack.
+  auto jitteryTime = timeToSuspicion(jittery, jitteryNow);
+  KJ_EXPECT(jitteryTime > 2 * steadyTime, jitteryTime / kj::MILLISECONDS);
+}
+
+KJ_TEST("rolling restart drains each worker onto the others") {
+  auto io = kj::setupAsyncIo();
+  FakeMachine machines[3];
+  WorkerRestarter restarter(io.provider->getTimer(), 10 * kj::SECONDS);
+  for (uint i = 0; i < 3; i++) {
+    machines[i].grainCount = 1;
+    machines[i].canDrain = true;
+    machines[i].registration = restarter.addWorker(
+        i, kj::heap<FakeWorker>(machines[i]), kj::heap<FakeRouting>(machines[i]));
+  }
+
+  auto turn0 = restarter.drain(0).wait(io.waitScope);
+  KJ_EXPECT(machines[0].drainSuccessors == 2);
+  KJ_EXPECT(machines[0].grainCount == 0);
+  KJ_EXPECT(!machines[0].routed);
+  KJ_EXPECT(machines[1].routed);
+  KJ_EXPECT(machines[2].routed);
+
+  // Only one worker restarts at a time.
+  kj::Maybe<kj::Own<WorkerRestarter::Turn>> turn1;
+  auto next = restarter.drain(1).then([&](kj::Own<WorkerRestarter::Turn>&& turn) {
+    turn1 = kj::mv(turn);
+  }).eagerlyEvaluate(nullptr);
+  io.provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(io.waitScope);
+  KJ_EXPECT(turn1 == nullptr);
+  KJ_EXPECT(machines[1].routed);
+
+  // Worker 0's process is restarted, dropping its registration, before it gives up its turn.
+  machines[0].registration = nullptr;
+  turn0 = nullptr;
+  next.wait(io.waitScope);
+  KJ_EXPECT(turn1 != nullptr);
+  KJ_EXPECT(machines[1].drainSuccessors == 1);
+  KJ_EXPECT(!machines[1].routed);
+  KJ_EXPECT(machines[2].routed);
+
+  // A worker which isn't connected has nothing to hand off.
+  turn1 = nullptr;
+  restarter.drain(0).wait(io.waitScope);
+
+  for (auto& machine: machines) {
+    machine.registration = nullptr;
+  }
+}
+
+}  // namespace
+}  // namespace blackrock
@@ -23,6 +23,8 @@
 #include <signal.h>
 #include <sandstorm/util.h>
 #include <capnp/serialize-async.h>
+#include <queue>
+#include <math.h>
 #include "backend-set.h"
 
 namespace blackrock {
@@ -76,6 +78,171 @@ RegistrationArray registrationArray(Params&&... params) {
   return addEach(builder, kj::fwd<Params>(params)...);
 }
 
+class StartupOrchestrator {
+  // Coordinates bringing up the cluster. Machines boot concurrently, up to `parallelism` at a
+  // time, but a machine isn't assigned its role until the machines it depends on are up:
+  //
+  //     storage, mongo  ->  workers, frontends  ->  gateways
+  //
+  // Each phase completes when all of its machines have been set up once. We log how long each
+  // machine and phase took, so that slow startups can be diagnosed. Once a phase has completed
+  // it stays complete; machines which fail later are simply restarted by their harness.
+
+public:
+  StartupOrchestrator(kj::Timer& timer, uint parallelism)
+      : timer(timer), parallelism(parallelism), startTime(timer.now()) {
+    for (auto& phase: phases) {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      phase.ready = paf.promise.fork();
+      phase.fulfiller = kj::mv(paf.fulfiller);
+    }
+  }
+
+  void expect(ComputeDriver::MachineId id) {
+    // Declare that `id` will be started. Must be called for every machine before seal(). Machines
+    // added later (e.g. by the autoscaler) may call it too; it's a no-op for machines which have
+    // already been ready once.
+    if (readyMachines.count(id) == 0) {
+      ++phases[phaseOf(id)].pending;
+    }
+  }
+
+  void seal() {
+    // All machines have been declared. Phases with no machines can complete now.
+    sealed = true;
+    maybeComplete(0);
+  }
+
+  kj::Promise<void> boot(ComputeDriver& driver, ComputeDriver::MachineId id) {
+    return acquireBootSlot().then([this,&driver,id]() {
+      KJ_LOG(INFO, "BOOTING", id);
+      auto bootStart = timer.now();
+      return driver.boot(id).then([this,id,bootStart]() {
+        KJ_LOG(INFO, "booted", id, secondsSince(bootStart));
+      }).attach(kj::defer([this]() { releaseBootSlot(); }));
+    });
+  }
+
+  kj::Promise<void> whenDependenciesReady(ComputeDriver::MachineId id) {
+    uint phase = phaseOf(id);
+    if (phase == 0) {
+      return kj::READY_NOW;
+    } else {
+      return phases[phase - 1].ready.addBranch();
+    }
+  }
+
+  void machineReady(ComputeDriver::MachineId id) {
+    // Called each time a machine is set up. Only the first time counts.
+    if (readyMachines.insert(id).second) {
+      KJ_LOG(INFO, "machine ready", id, secondsSince(startTime));
+      uint phase = phaseOf(id);
+      KJ_ASSERT(phases[phase].pending > 0);
+      --phases[phase].pending;
+      maybeComplete(phase);
+    }
+  }
+
+private:
+  enum Phase {
+    STORAGE_PHASE,
+    COMPUTE_PHASE,
+    GATEWAY_PHASE,
+    PHASE_COUNT
+  };
+
+  struct PhaseState {
+    uint pending = 0;
+    bool complete = false;
+    kj::ForkedPromise<void> ready = nullptr;
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+  };
+
+  kj::Timer& timer;
+  uint parallelism;
+  kj::TimePoint startTime;
+  bool sealed = false;
+  PhaseState phases[PHASE_COUNT];
+  std::set<ComputeDriver::MachineId> readyMachines;
+
+  uint bootsInProgress = 0;
+  std::queue<kj::Own<kj::PromiseFulfiller<void>>> bootWaiters;
+
+  static uint phaseOf(ComputeDriver::MachineId id) {
+    switch (id.type) {
+      case ComputeDriver::MachineType::STORAGE:
+      case ComputeDriver::MachineType::MONGO:
+        return STORAGE_PHASE;
+      case ComputeDriver::MachineType::WORKER:
+      case ComputeDriver::MachineType::COORDINATOR:
+      case ComputeDriver::MachineType::FRONTEND:
+        return COMPUTE_PHASE;
+      case ComputeDriver::MachineType::GATEWAY:
+        return GATEWAY_PHASE;
+    }
+    KJ_UNREACHABLE;
+  }
+
+  static kj::StringPtr phaseName(uint phase) {
+    switch (phase) {
+      case STORAGE_PHASE: return "storage";
+      case COMPUTE_PHASE: return "compute";
+      case GATEWAY_PHASE: return "gateway";
+    }
+    KJ_UNREACHABLE;
+  }
+
+  double secondsSince(kj::TimePoint time) {
+    return (timer.now() - time) / kj::MILLISECONDS / 1000.0;
+  }
+
+  void maybeComplete(uint phase) {
+    for (; sealed && phase < PHASE_COUNT; phase++) {
+      auto& state = phases[phase];
+      if (state.complete || state.pending > 0 ||
+          (phase > 0 && !phases[phase - 1].complete)) {
+        return;
+      }
+
+      state.complete = true;
+      KJ_LOG(INFO, "startup phase complete", phaseName(phase), secondsSince(startTime));
+      state.fulfiller->fulfill();
+    }
+
+    KJ_LOG(INFO, "*** cluster is up ***", secondsSince(startTime));
+  }
+
+  kj::Promise<void> acquireBootSlot() {
+    if (parallelism == 0 || bootsInProgress < parallelism) {
+      ++bootsInProgress;
+      return kj::READY_NOW;
+    } else {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      bootWaiters.push(kj::mv(paf.fulfiller));
+      return kj::mv(paf.promise);
+    }
+  }
+
+  void releaseBootSlot() {
+    // Hand the slot directly to the next waiter, skipping any which were canceled.
+    while (!bootWaiters.empty()) {
+      auto fulfiller = kj::mv(bootWaiters.front());
+      bootWaiters.pop();
+      if (fulfiller->isWaiting()) {
+        fulfiller->fulfill();
+        return;
+      }
+    }
+    --bootsInProgress;
+  }
+};
+
+struct HeartbeatOptions {
+  kj::Duration interval;
+  double suspicionThreshold;
+  kj::Duration failureTimeout;
+};
+
 class MachineHarness {
   // Runs one machine, booting it and automatically restarting it as needed. A callback is provided
   // which is called each time a connection to the machine is established in order to add it to
@@ -83,12 +250,17 @@ class MachineHarness {
 
 public:
   MachineHarness(kj::Timer& timer, capnp::RpcSystem<VatPath>& rpcSystem, VatId::Reader self,
-                 ComputeDriver& driver, ComputeDriver::MachineId id,
-                 bool alreadyBooted, bool requireRestartProcess,
-                 kj::Function<RegistrationArray(Machine::Client)> setup)
-      : timer(timer), rpcSystem(rpcSystem), self(self), driver(driver), id(id),
-        setup(kj::mv(setup)), booted(alreadyBooted),
-        runTask(run(requireRestartProcess ? RESTART : RECONNECT)
+                 ComputeDriver& driver, StartupOrchestrator& orchestrator,
+                 const HeartbeatOptions& heartbeat,
+                 ComputeDriver::MachineId id, bool alreadyBooted, bool requireRestartProcess,
+                 kj::Function<RegistrationArray(Machine::Client)> setup,
+                 kj::Maybe<WorkerRestarter&> restarter = nullptr)
+      : timer(timer), rpcSystem(rpcSystem), self(self), driver(driver),
+        orchestrator(orchestrator), heartbeat(heartbeat), id(id), setup(kj::mv(setup)),
+        restarter(restarter), booted(alreadyBooted),
+        // A worker which is already running gets to hand its grains off before it's restarted.
+        restartAfterDrain(requireRestartProcess && alreadyBooted && restarter != nullptr),
+        runTask(run(requireRestartProcess && !restartAfterDrain ? RESTART : RECONNECT)
             .eagerlyEvaluate([](kj::Exception&& exception) {
           // Shouldn't happen! Don't let cluster end up in broken state.
           KJ_LOG(FATAL, "MachineHarness run task failed", exception);
@@ -100,9 +272,19 @@ private:
   capnp::RpcSystem<VatPath>& rpcSystem;
   VatId::Reader self;
   ComputeDriver& driver;
+  StartupOrchestrator& orchestrator;
+  const HeartbeatOptions& heartbeat;
   ComputeDriver::MachineId id;
   kj::Function<RegistrationArray(Machine::Client)> setup;
+  kj::Maybe<WorkerRestarter&> restarter;
   bool booted;
+
+  bool restartAfterDrain;
+  // We're to restart the process, but only once it has been drained through `restarter`.
+
+  kj::Maybe<kj::Own<WorkerRestarter::Turn>> turn;
+  // Held from when the worker is drained until its process has been restarted.
+
   kj::Promise<void> runTask;
 
   enum RetryStage {
@@ -115,6 +297,9 @@ private:
     if (booted) {
       // Already booted. Should we reboot?
       if (retryStage == REBOOT) {
+        // Rebooting restarts the process anyway, and a machine that isn't answering can't be
+        // drained.
+        restartAfterDrain = false;
         return driver.stop(id).then([this]() {
           booted = false;
           // Since we're not booted, the stage we pass to run() here is irrelevant.
@@ -122,7 +307,7 @@ private:
         });
       }
     } else {
-      return driver.boot(id).then([this]() {
+      return orchestrator.boot(driver, id).then([this]() {
         booted = true;
         // Since we just booted, RECONNECT vs. RESTART are equivalent.
         return run(RECONNECT);
@@ -131,29 +316,55 @@ private:
 
     return timer.timeoutAfter(300 * kj::SECONDS, driver.run(id, self, retryStage == RESTART))
         .then([this,retryStage](VatPath::Reader path) {
+      // If this was a restart after draining, the next worker may go now.
+      turn = nullptr;
+
       auto machine = rpcSystem.bootstrap(path).castAs<Machine>();
 
       // Try to send a ping, giving up after 60 seconds.
       auto initialPing = machine.pingRequest().send().then([](auto&&) {});
       return timer.timeoutAfter(60 * kj::SECONDS, kj::mv(initialPing))
-          .then([this,KJ_MVCAP(machine)]() mutable {
-        // Successfully pinged. The machine is up.
-
+          .then([this]() {
+        // Successfully pinged. The machine is up. Wait for the machines it depends on before
+        // giving it its role.
+        return orchestrator.whenDependenciesReady(id);
+      }).then([this,KJ_MVCAP(machine)]() mutable {
         // Call the setup function.
         auto registrations = setup(machine);
+        orchestrator.machineReady(id);
 
-        // Arrange a hanging ping and periodic quick pings to detect machine failure.
+        // Arrange a hanging ping and frequent heartbeats to detect machine failure. The hanging
+        // ping returns (with an exception) as soon as the connection drops; the heartbeats catch
+        // a machine which is still connected but not making progress.
+        auto detector = kj::heap<PhiAccrualDetector>(heartbeat.interval, timer.now());
         auto req = machine.pingRequest();
         req.setHang(true);
-        return req.send().then([](auto&&) {})
-            .exclusiveJoin(pingLoop(machine))
-            .attach(kj::mv(registrations))
+        auto monitor = req.send().then([](auto&&) {})
+            .exclusiveJoin(heartbeatLoop(machine, *detector))
+            .exclusiveJoin(suspicionLoop(*detector, registrations, false));
+        if (restartAfterDrain) {
+          KJ_IF_MAYBE(r, restarter) {
+            monitor = monitor.exclusiveJoin(r->drain(id.index)
+                .then([this](kj::Own<WorkerRestarter::Turn>&& drained) {
+              turn = kj::mv(drained);
+            }));
+          }
+        }
+        return monitor.attach(kj::mv(registrations), kj::mv(detector))
             .then([this]() {
+          if (turn != nullptr) {
+            // Drained; the registrations are gone, so nothing new lands on it while it restarts.
+            restartAfterDrain = false;
+            KJ_LOG(INFO, "restarting drained worker", id);
+            return RESTART;
+          }
           KJ_LOG(ERROR, "monitoring for machine returned without error? reconnecting", id);
+          return RECONNECT;
         }, [this](kj::Exception&& exception) {
           KJ_LOG(ERROR, "lost connection to machine; reconnecting", id, exception);
-        }).then([this]() {
-          return run(RECONNECT);
+          return RECONNECT;
+        }).then([this](RetryStage stage) {
+          return run(stage);
         });
       }, [this,retryStage](kj::Exception&& exception) {
         // If we only tried to reconnect, now try to restart the process, otherwise try to reboot
@@ -169,25 +380,723 @@ private:
       });
     }, [this](kj::Exception&& exception) {
       // run() failed.
+      turn = nullptr;
       KJ_LOG(ERROR, "couldn't connect to machine; rebooting it", id, exception);
       return run(REBOOT);
     });
   }
 
-  kj::Promise<void> pingLoop(Machine::Client machine) {
-    return timer.afterDelay(60 * kj::SECONDS)
-        .then([this,KJ_MVCAP(machine)]() mutable {
-      auto ping = machine.pingRequest().send().then([](auto&&) {});
-      return timer.timeoutAfter(60 * kj::SECONDS, kj::mv(ping))
-          .then([this,KJ_MVCAP(machine)]() mutable {
-        return pingLoop(kj::mv(machine));
+  kj::Promise<void> heartbeatLoop(Machine::Client machine, PhiAccrualDetector& detector) {
+    // Only one heartbeat is outstanding at a time; suspicionLoop() decides what a late one means.
+    return timer.afterDelay(heartbeat.interval)
+        .then([this,KJ_MVCAP(machine),&detector]() mutable {
+      auto ping = machine.pingRequest().send();
+      return ping.then([this,KJ_MVCAP(machine),&detector](auto&&) mutable {
+        detector.heartbeat(timer.now());
+        return heartbeatLoop(kj::mv(machine), detector);
       });
     });
   }
+
+  kj::Promise<void> suspicionLoop(PhiAccrualDetector& detector,
+                                  kj::ArrayPtr<kj::Own<BackendSetFeederBase::Registration>>
+                                      registrations,
+                                  bool suspected) {
+    // Periodically evaluates the detector. While the machine is suspected, its backends are
+    // pulled from the load-balancing sets; if it stays silent past the failure timeout, we give
+    // up on it, which drops the registrations and reconnects.
+    return timer.afterDelay(kj::min(heartbeat.interval / 4, 250 * kj::MILLISECONDS))
+        .then([this,&detector,registrations,suspected]() -> kj::Promise<void> {
+      auto now = timer.now();
+      if (detector.sinceLastHeartbeat(now) >= heartbeat.failureTimeout) {
+        return KJ_EXCEPTION(DISCONNECTED, "machine stopped answering heartbeats", id);
+      }
+
+      double phi = detector.phi(now);
+      bool nowSuspected = phi >= heartbeat.suspicionThreshold;
+      if (nowSuspected != suspected) {
+        if (nowSuspected) {
+          KJ_LOG(WARNING, "machine suspected of failure; routing around it", id, phi);
+        } else {
+          KJ_LOG(INFO, "suspected machine is responding again", id);
+        }
+        for (auto& registration: registrations) {
+          registration->setSuspected(nowSuspected);
+        }
+      }
+
+      return suspicionLoop(detector, registrations, nowSuspected);
+    });
+  }
+};
+
+class HarnessWorkerPool final: public WorkerAutoscaler::WorkerPool {
+  // Runs each worker under a MachineHarness, so that the set of workers can change over time.
+
+public:
+  HarnessWorkerPool(ComputeDriver& driver,
+                    kj::Function<kj::Own<MachineHarness>(uint index)> newHarness)
+      : driver(driver), newHarness(kj::mv(newHarness)) {}
+
+  void startWorker(uint index) override {
+    harnesses[index] = newHarness(index);
+  }
+
+  kj::Promise<void> stopWorker(uint index) override {
+    // Dropping the harness stops monitoring and drops the worker's registrations.
+    harnesses.erase(index);
+
+    ComputeDriver::MachineId id = { ComputeDriver::MachineType::WORKER, index };
+    KJ_LOG(INFO, "STOPPING", id);
+    return driver.stop(id);
+  }
+
+private:
+  ComputeDriver& driver;
+  kj::Function<kj::Own<MachineHarness>(uint index)> newHarness;
+  std::map<uint, kj::Own<MachineHarness>> harnesses;
 };
 
 }  // namespace
 
+// =======================================================================================
+
+PhiAccrualDetector::PhiAccrualDetector(kj::Duration expectedInterval, kj::TimePoint now)
+    : lastHeartbeat(now) {
+  // Seed the window with a guess so that phi is meaningful before we have any real history.
+  double ms = expectedInterval / kj::MILLISECONDS;
+  add(ms - ms / 4);
+  add(ms + ms / 4);
+}
+
+void PhiAccrualDetector::heartbeat(kj::TimePoint now) {
+  add((now - lastHeartbeat) / kj::MICROSECONDS / 1000.0);
+  lastHeartbeat = now;
+}
+
+double PhiAccrualDetector::phi(kj::TimePoint now) const {
+  double elapsed = (now - lastHeartbeat) / kj::MICROSECONDS / 1000.0;
+  double mean = sum / count;
+  double variance = sumSquares / count - mean * mean;
+  double stddev = kj::max(sqrt(kj::max(variance, 0.0)), double(MIN_STDDEV_MS));
+
+  // Logistic approximation of the normal CDF (max error ~0.02%), which unlike erfc() stays
+  // well-behaved far out in the tail.
+  double y = (elapsed - mean) / stddev;
+  double e = exp(-y * (1.5976 + 0.070566 * y * y));
+  if (elapsed > mean) {
+    return -log10(e / (1.0 + e));
+  } else {
+    return -log10(1.0 - 1.0 / (1.0 + e));
+  }
+}
+
+void PhiAccrualDetector::add(double interval) {
+  if (count == WINDOW_SIZE) {
+    double old = intervals[next];
+    sum -= old;
+    sumSquares -= old * old;
+  } else {
+    ++count;
+  }
+  intervals[next] = interval;
+  next = (next + 1) % WINDOW_SIZE;
+  sum += interval;
+  sumSquares += interval * interval;
+}
+
+// =======================================================================================
+
+auto WorkerAutoscaler::Options::fromConfig(WorkerAutoscaleConfig::Reader config) -> Options {
+  uint minWorkers = kj::max(config.getMinWorkers(), 1u);
+  return Options {
+    minWorkers,
+    kj::max(config.getMaxWorkers(), minWorkers),
+    kj::max(config.getGrainsPerWorker(), 1u),
+    config.getScaleUpThreshold(),
+    config.getScaleDownThreshold(),
+    kj::max(config.getPollIntervalSeconds(), 1u) * kj::SECONDS,
+    config.getCooldownSeconds() * kj::SECONDS,
+    config.getDrainTimeoutSeconds() * kj::SECONDS
+  };
+}
+
+class WorkerAutoscaler::WorkerRegistration final: public BackendSetFeederBase::Registration {
+public:
+  WorkerRegistration(WorkerAutoscaler& autoscaler, uint index)
+      : autoscaler(autoscaler), index(index) {}
+
+  ~WorkerRegistration() noexcept(false) {
+    // The worker disconnected. Its harness will reconnect and call addWorker() again.
+    KJ_IF_MAYBE(state, find()) {
+      state->worker = nullptr;
+      state->routing = nullptr;
+      state->registration = nullptr;
+    }
+  }
+
+  void setSuspected(bool suspected) override {
+    KJ_IF_MAYBE(state, find()) {
+      if (state->routing.get() != nullptr) {
+        state->routing->setSuspected(suspected);
+      }
+    }
+  }
+
+private:
+  WorkerAutoscaler& autoscaler;
+  uint index;
+
+  kj::Maybe<WorkerState&> find() {
+    auto iter = autoscaler.workers.find(index);
+    if (iter == autoscaler.workers.end() || iter->second.registration != this) {
+      // Worker was removed, or this registration is stale.
+      return nullptr;
+    } else {
+      return iter->second;
+    }
+  }
+};
+
+WorkerAutoscaler::WorkerAutoscaler(kj::Timer& timer, WorkerPool& pool, Options options,
+                                   uint initialCount)
+    : timer(timer), pool(pool), options(options),
+      targetCount(kj::min(kj::max(initialCount, options.minWorkers), options.maxWorkers)),
+      lastChange(timer.now()) {
+  for (uint i = 0; i < targetCount; i++) {
+    workers[i];
+  }
+}
+
+WorkerAutoscaler::~WorkerAutoscaler() noexcept(false) {}
+
+kj::Own<BackendSetFeederBase::Registration> WorkerAutoscaler::addWorker(
+    uint index, Worker::Client worker, kj::Own<BackendSetFeederBase::Registration> routing) {
+  auto result = kj::heap<WorkerRegistration>(*this, index);
+
+  auto& state = workers[index];
+  state.worker = kj::mv(worker);
+  state.registration = result.get();
+
+  if (isDraining(index)) {
+    // Reconnected while being drained. Keep it out of the worker set.
+  } else {
+    state.routing = kj::mv(routing);
+  }
+
+  return kj::mv(result);
+}
+
+kj::Promise<void> WorkerAutoscaler::run() {
+  return pollOnce().catch_([](kj::Exception&& exception) {
+    KJ_LOG(ERROR, "worker autoscaler poll failed", exception);
+  }).then([this]() {
+    return timer.afterDelay(options.pollInterval);
+  }).then([this]() {
+    return run();
+  });
+}
+
+kj::Promise<void> WorkerAutoscaler::pollOnce() {
+  auto loads = kj::heap<kj::Vector<double>>();
+  auto& loadsRef = *loads;
+
+  kj::Vector<kj::Promise<void>> queries;
+  for (auto& entry: workers) {
+    if (isDraining(entry.first)) continue;
+    KJ_IF_MAYBE(worker, entry.second.worker) {
+      queries.add(queryLoad(*worker).then([&loadsRef](kj::Maybe<double> load) {
+        KJ_IF_MAYBE(l, load) {
+          loadsRef.add(*l);
+        }
+      }));
+    }
+  }
+
+  return kj::joinPromises(queries.releaseAsArray()).then([this,KJ_MVCAP(loads)]() {
+    if (drainingIndex != nullptr || loads->size() == 0) return;
+
+    double total = 0;
+    for (double load: *loads) total += load;
+    double average = total / loads->size();
+
+    auto now = timer.now();
+    if (now - lastChange < options.cooldown) return;
+
+    if (average > options.scaleUpThreshold) {
+      if (targetCount < options.maxWorkers) {
+        KJ_LOG(INFO, "worker load is high; adding a worker", average, targetCount);
+        uint index = targetCount++;
+        workers[index];
+        lastChange = now;
+        pool.startWorker(index);
+      }
+    } else if (average < options.scaleDownThreshold && targetCount > options.minWorkers) {
+      // Only scale down if the remaining workers wouldn't immediately want to scale back up.
+      double projected = average * targetCount / (targetCount - 1);
+      if (projected < options.scaleUpThreshold) {
+        KJ_LOG(INFO, "worker load is low; removing a worker", average, targetCount);
+        --targetCount;
+        lastChange = now;
+        drain(targetCount);
+      }
+    }
+  });
+}
+
+bool WorkerAutoscaler::isDraining(uint index) {
+  KJ_IF_MAYBE(d, drainingIndex) {
+    return *d == index;
+  } else {
+    return false;
+  }
+}
+
+double WorkerAutoscaler::loadOf(WorkerLoad::Reader load) {
+  double result = double(load.getGrainCount()) / options.grainsPerWorker;
+  if (load.getMemoryTotal() > 0) {
+    double memory = 1.0 - double(load.getMemoryAvailable()) / load.getMemoryTotal();
+    result = kj::max(result, memory);
+  }
+  return kj::max(result, double(load.getCpuLoad()));
+}
+
+kj::Promise<kj::Maybe<double>> WorkerAutoscaler::queryLoad(Worker::Client& worker) {
+  auto load = worker.getLoadRequest().send().then([this](auto&& response) {
+    return loadOf(response.getLoad());
+  });
+  return timer.timeoutAfter(options.pollInterval, kj::mv(load))
+      .then([](double load) -> kj::Maybe<double> {
+    return load;
+  }, [](kj::Exception&& exception) -> kj::Maybe<double> {
+    // Don't let one sick worker stall scaling; it's the failure detector's problem.
+    KJ_LOG(WARNING, "couldn't get worker load", exception);
+    return nullptr;
+  });
+}
+
+void WorkerAutoscaler::drain(uint index) {
+  drainingIndex = index;
+
+  // Stop routing new grains to the worker, then evacuate it, restarting its grains on the
+  // workers which remain.
+  auto& state = workers[index];
+  state.routing = nullptr;
+
+  auto deadline = timer.now() + options.drainTimeout;
+  kj::Promise<void> evacuated = nullptr;
+  KJ_IF_MAYBE(worker, state.worker) {
+    auto req = worker->drainRequest();
+    kj::Vector<Worker::Client> successors;
+    for (auto& entry: workers) {
+      if (entry.second.routing.get() != nullptr) {
+        KJ_IF_MAYBE(w, entry.second.worker) {
+          successors.add(*w);
+        }
+      }
+    }
+    auto list = req.initSuccessors(successors.size());
+    for (uint i = 0; i < successors.size(); i++) {
+      list.set(i, successors[i]);
+    }
+
+    evacuated = timer.timeoutAfter(options.drainTimeout, req.send().then([](auto&&) {}))
+        .catch_([this,index,deadline](kj::Exception&& exception) {
+      // Perhaps an older worker which can't drain; wait for its grains to go idle instead.
+      KJ_LOG(WARNING, "Worker.drain() failed", index, exception);
+      return waitForDrained(index, deadline);
+    });
+  } else {
+    evacuated = kj::READY_NOW;
+  }
+
+  drainTask = evacuated.then([this,index]() {
+    workers.erase(index);
+    return pool.stopWorker(index);
+  }).then([index]() {
+    KJ_LOG(INFO, "worker drained and stopped", index);
+  }, [index](kj::Exception&& exception) {
+    KJ_LOG(ERROR, "failed to stop drained worker", index, exception);
+  }).then([this]() {
+    drainingIndex = nullptr;
+  }).eagerlyEvaluate(nullptr);
+}
+
+kj::Promise<void> WorkerAutoscaler::waitForDrained(uint index, kj::TimePoint deadline) {
+  auto iter = workers.find(index);
+  KJ_ASSERT(iter != workers.end());
+
+  if (timer.now() >= deadline) {
+    KJ_LOG(WARNING, "timed out draining worker; stopping it anyway", index);
+    return kj::READY_NOW;
+  }
+
+  KJ_IF_MAYBE(worker, iter->second.worker) {
+    return worker->getLoadRequest().send()
+        .then([](auto&& response) -> kj::Promise<bool> {
+      return response.getLoad().getGrainCount() == 0;
+    }, [index](kj::Exception&& exception) -> kj::Promise<bool> {
+      KJ_LOG(WARNING, "couldn't get load of draining worker", index, exception);
+      return false;
+    }).then([this,index,deadline](bool drained) -> kj::Promise<void> {
+      if (drained) return kj::READY_NOW;
+      return timer.afterDelay(options.pollInterval).then([this,index,deadline]() {
+        return waitForDrained(index, deadline);
+      });
+    });
+  } else {
+    // Not connected (possibly being restarted by its harness). Nothing to wait for.
+    return kj::READY_NOW;
+  }
+}
+
+// =======================================================================================
+
+class WorkerRestarter::WorkerRegistration final: public BackendSetFeederBase::Registration {
+public:
+  WorkerRegistration(WorkerRestarter& restarter, uint index)
+      : restarter(restarter), index(index) {}
+
+  ~WorkerRegistration() noexcept(false) {
+    // The worker disconnected, or is being restarted.
+    auto iter = restarter.workers.find(index);
+    if (iter != restarter.workers.end() && iter->second.registration == this) {
+      restarter.workers.erase(iter);
+    }
+  }
+
+  void setSuspected(bool suspected) override {
+    auto iter = restarter.workers.find(index);
+    if (iter != restarter.workers.end() && iter->second.registration == this &&
+        iter->second.routing.get() != nullptr) {
+      iter->second.routing->setSuspected(suspected);
+    }
+  }
+
+private:
+  WorkerRestarter& restarter;
+  uint index;
+};
+
+WorkerRestarter::WorkerRestarter(kj::Timer& timer, kj::Duration drainTimeout)
+    : timer(timer), drainTimeout(drainTimeout) {}
+
+WorkerRestarter::~WorkerRestarter() noexcept(false) {}
+
+kj::Own<BackendSetFeederBase::Registration> WorkerRestarter::addWorker(
+    uint index, Worker::Client worker, kj::Own<BackendSetFeederBase::Registration> routing) {
+  auto result = kj::heap<WorkerRegistration>(*this, index);
+
+  // Replaces any stale entry left by a registration which hasn't been dropped yet.
+  workers.erase(index);
+  workers.insert(std::make_pair(index,
+      WorkerState { kj::mv(worker), kj::mv(routing), result.get() }));
+
+  return kj::mv(result);
+}
+
+kj::Promise<kj::Own<WorkerRestarter::Turn>> WorkerRestarter::drain(uint index) {
+  return beginTurn().then([this,index]() -> kj::Promise<kj::Own<Turn>> {
+    auto turn = kj::heap<Turn>(*this);
+
+    auto iter = workers.find(index);
+    if (iter == workers.end()) {
+      // Disconnected while waiting. Nothing to hand off.
+      return kj::mv(turn);
+    }
+
+    auto& state = iter->second;
+    state.routing = nullptr;
+
+    auto req = state.worker.drainRequest();
+    kj::Vector<Worker::Client> successors;
+    for (auto& entry: workers) {
+      if (entry.second.routing.get() != nullptr) {
+        successors.add(entry.second.worker);
+      }
+    }
+    auto list = req.initSuccessors(successors.size());
+    for (uint i = 0; i < successors.size(); i++) {
+      list.set(i, successors[i]);
+    }
+
+    KJ_LOG(INFO, "draining worker before restarting it", index, successors.size());
+    return timer.timeoutAfter(drainTimeout, req.send().then([](auto&&) {}))
+        .then([index]() {
+      KJ_LOG(INFO, "worker drained; restarting it", index);
+    }, [index](kj::Exception&& exception) {
+      KJ_LOG(WARNING, "couldn't drain worker; restarting it anyway", index, exception);
+    }).then([KJ_MVCAP(turn)]() mutable {
+      return kj::mv(turn);
+    });
+  });
+}
+
+kj::Promise<void> WorkerRestarter::beginTurn() {
+  if (!busy) {
+    busy = true;
+    return kj::READY_NOW;
+  }
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  waiters.push(kj::mv(paf.fulfiller));
+  return kj::mv(paf.promise);
+}
+
+void WorkerRestarter::endTurn() {
+  while (!waiters.empty()) {
+    auto waiter = kj::mv(waiters.front());
+    waiters.pop();
+    if (waiter->isWaiting()) {
+      waiter->fulfill();
+      return;
+    }
+  }
+  busy = false;
+}
+
+// =======================================================================================
+
+class StorageFailover {
+  // Watches one storage node which has a hot standby, and fails the node over to the standby once
+  // it has been down for `timeout`: promotes the standby, then registers it in the node's place.
+  // The node's siblings and root sets are keyed by node index, so consumers switch to the standby
+  // as soon as it is registered. From then on, the node's own machine no longer serves as that
+  // node.
+  //
+  // "Down" only means we can't reach the node; it may well still be serving others. So before
+  // promoting the standby we stop the node's machine, so that the old node can't go on accepting
+  // writes the standby will never see. The machine's harness then brings it back up, but only as
+  // the host of its neighbor's standby.
+  //
+  // Whether we failed over is only known in memory, so after the master restarts, we learn it
+  // again from the standby: the node's own machine isn't made the node until the standby has
+  // told us it wasn't promoted. Until then, the node is down.
+
+public:
+  typedef kj::Own<BackendSetFeederBase::Registration> Registration;
+
+  StorageFailover(kj::Timer& timer, ComputeDriver& driver, kj::Duration timeout, uint index)
+      : timer(timer), driver(driver), timeout(timeout), index(index), tasks(logger) {
+    // The node counts as down until it first comes up.
+    primaryDown();
+  }
+
+  Registration primaryUp(kj::Function<RegistrationArray()> startPrimary) {
+    // The node's machine came up. `startPrimary()` makes it the node and registers it; we call it
+    // once we know the standby wasn't promoted, and drop what it returned if we fail over later.
+
+    return kj::heap<PrimaryRegistration>(*this, kj::mv(startPrimary));
+  }
+
+  Registration standbyUp(StorageReplica::Client replica, Registration replicaRegistration,
+                         kj::Promise<bool> promoted,
+                         kj::Function<RegistrationArray()> registerStandby) {
+    // The standby came up. `replicaRegistration` offers `replica` to the node, and is dropped
+    // when the standby is promoted. `promoted` resolves to whether it already was promoted, e.g.
+    // before the master restarted. `registerStandby()` registers it in the node's place.
+
+    auto result = kj::heap<StandbyRegistration>(*this, kj::mv(replica),
+        kj::mv(replicaRegistration), kj::mv(registerStandby));
+    StandbyRegistration* ptr = result;
+    tasks.add(promoted.then([this,ptr](bool wasPromoted) {
+      standbyReported(ptr, wasPromoted);
+    }));
+    return kj::mv(result);
+  }
+
+private:
+  class PrimaryRegistration;
+  class StandbyRegistration;
+
+  kj::Timer& timer;
+  ComputeDriver& driver;
+  kj::Duration timeout;
+  uint index;
+  ErrorLogger logger;
+  kj::TaskSet tasks;
+
+  static constexpr kj::Duration FENCE_RETRY_DELAY = 10 * kj::SECONDS;
+
+  kj::Maybe<PrimaryRegistration&> primary;
+  kj::Maybe<StandbyRegistration&> standby;
+  kj::Promise<void> downTimer = nullptr;
+  bool downTooLong = false;
+  bool failedOver = false;
+
+  bool standbyChecked = false;
+  // Whether the standby has told us it wasn't promoted. Only the master promotes it, so this
+  // stays true until we do.
+
+  bool fenced = false;
+  kj::Promise<void> fencing = nullptr;
+  // Once we fail over, `fencing` stops the node's machine, retrying until it works, and then sets
+  // `fenced`. The standby isn't promoted before that.
+
+  void primaryDown() {
+    if (failedOver) return;
+    downTimer = timer.afterDelay(timeout).then([this]() {
+      downTooLong = true;
+      if (standby == nullptr) {
+        KJ_LOG(ERROR, "storage node is down, but so is its standby; can't fail over yet", index);
+      } else {
+        failOver();
+      }
+    }).eagerlyEvaluate([](kj::Exception&& exception) {
+      KJ_LOG(ERROR, exception);
+    });
+  }
+
+  void standbyReported(StandbyRegistration* reporter, bool wasPromoted);
+  // `reporter` -- which may have gone away since -- told us whether it was promoted.
+
+  void failOver();
+
+  kj::Promise<void> fence();
+};
+
+constexpr kj::Duration StorageFailover::FENCE_RETRY_DELAY;
+
+class StorageFailover::PrimaryRegistration final: public BackendSetFeederBase::Registration {
+public:
+  PrimaryRegistration(StorageFailover& failover, kj::Function<RegistrationArray()> startPrimary)
+      : failover(failover), startPrimary(kj::mv(startPrimary)) {
+    failover.primary = *this;
+    if (failover.standbyChecked) start();
+  }
+
+  ~PrimaryRegistration() noexcept(false) {
+    KJ_IF_MAYBE(p, failover.primary) {
+      if (p == this) {
+        failover.primary = nullptr;
+        // (If we never started it, the node has been down all along.)
+        if (started) failover.primaryDown();
+      }
+    }
+  }
+
+  void setSuspected(bool suspected) override {
+    for (auto& registration: registrations) {
+      registration->setSuspected(suspected);
+    }
+  }
+
+  void start() {
+    if (started || failover.failedOver) return;
+    started = true;
+    failover.downTimer = nullptr;
+    failover.downTooLong = false;
+    registrations = startPrimary();
+  }
+
+  void drop() { registrations = nullptr; }
+
+private:
+  StorageFailover& failover;
+  kj::Function<RegistrationArray()> startPrimary;
+  RegistrationArray registrations;
+  bool started = false;
+};
+
+class StorageFailover::StandbyRegistration final: public BackendSetFeederBase::Registration {
+public:
+  StandbyRegistration(StorageFailover& failover, StorageReplica::Client replica,
+                      Registration replicaRegistration,
+                      kj::Function<RegistrationArray()> registerStandby)
+      : failover(failover), replica(kj::mv(replica)),
+        replicaRegistration(kj::mv(replicaRegistration)),
+        registerStandby(kj::mv(registerStandby)) {
+    failover.standby = *this;
+  }
+
+  ~StandbyRegistration() noexcept(false) {
+    KJ_IF_MAYBE(s, failover.standby) {
+      if (s == this) failover.standby = nullptr;
+    }
+  }
+
+  void setSuspected(bool suspected) override {
+    for (auto& registration: registrations) {
+      registration->setSuspected(suspected);
+    }
+  }
+
+  void promote() {
+    // Promotes the standby before registering it, so that the old node, should it come back,
+    // can no longer replicate to it. We also withdraw it from the node's replica set, so that
+    // the old node doesn't keep trying.
+    if (promoting) return;
+    promoting = true;
+    replicaRegistration = nullptr;
+    promotion = replica.promoteRequest().send().then([this](auto&&) {
+      registrations = registerStandby();
+    }).eagerlyEvaluate([this](kj::Exception&& exception) {
+      KJ_LOG(ERROR, "couldn't promote storage standby", failover.index, exception);
+    });
+  }
+
+private:
+  StorageFailover& failover;
+  StorageReplica::Client replica;
+  Registration replicaRegistration;
+  kj::Function<RegistrationArray()> registerStandby;
+  RegistrationArray registrations;
+  bool promoting = false;
+  kj::Promise<void> promotion = nullptr;
+};
+
+void StorageFailover::standbyReported(StandbyRegistration* reporter, bool wasPromoted) {
+  if (wasPromoted) {
+    // It replaced the node before the master restarted; the node must stay down for good.
+    failOver();
+    return;
+  }
+
+  if (!standbyChecked) {
+    standbyChecked = true;
+    KJ_IF_MAYBE(p, primary) {
+      p->start();
+    }
+  }
+
+  KJ_IF_MAYBE(s, standby) {
+    // (Unless the standby went down again meanwhile.)
+    if (s == reporter && downTooLong) failOver();
+  }
+}
+
+void StorageFailover::failOver() {
+  if (!failedOver) {
+    KJ_LOG(ERROR, "storage node is down; stopping it and failing over to its standby", index);
+    failedOver = true;
+    downTimer = nullptr;
+    fencing = fence().eagerlyEvaluate(nullptr);
+  }
+  KJ_IF_MAYBE(p, primary) {
+    p->drop();
+  }
+  if (fenced) {
+    KJ_IF_MAYBE(s, standby) {
+      s->promote();
+    }
+  }
+}
+
+kj::Promise<void> StorageFailover::fence() {
+  auto id = ComputeDriver::MachineId(ComputeDriver::MachineType::STORAGE, index);
+  return driver.stop(id).then([this]() -> kj::Promise<void> {
+    fenced = true;
+    KJ_IF_MAYBE(s, standby) {
+      s->promote();
+    }
+    return kj::READY_NOW;
+  }, [this](kj::Exception&& exception) -> kj::Promise<void> {
+    KJ_LOG(ERROR, "couldn't stop failed storage node's machine; retrying", index, exception);
+    return timer.afterDelay(FENCE_RETRY_DELAY).then([this]() { return fence(); });
+  });
+}
+
+// =======================================================================================
+
 void runMaster(kj::AsyncIoContext& ioContext, ComputeDriver& driver, MasterConfig::Reader config,
                bool shouldRestart, kj::ArrayPtr<kj::StringPtr> machinesToRestart) {
   KJ_REQUIRE(config.getWorkerCount() > 0, "need at least one worker");
@@ -201,14 +1110,26 @@ void runMaster(kj::AsyncIoContext& ioContext, ComputeDriver& driver, MasterConfi
                      driver.getMasterBindAddress());
   auto rpcSystem = capnp::makeRpcClient(network);
 
+  StartupOrchestrator orchestrator(ioContext.provider->getTimer(), config.getBootParallelism());
+  HeartbeatOptions heartbeat {
+    kj::max(config.getHeartbeatIntervalMs(), 10u) * kj::MILLISECONDS,
+    config.getSuspicionThreshold(),
+    config.getFailureTimeoutSeconds() * kj::SECONDS
+  };
+  WorkerRestarter restarter(ioContext.provider->getTimer(),
+      config.getWorkerAutoscale().getDrainTimeoutSeconds() * kj::SECONDS);
   kj::Vector<kj::Own<MachineHarness>> harnesses;
   ErrorLogger logger;
   kj::TaskSet tasks(logger);
 
-  uint storageCount = 1;
+  uint storageCount = kj::max(config.getStorageCount(), 1u);
   uint workerCount = config.getWorkerCount();
+  if (config.getWorkerAutoscale().getEnabled()) {
+    auto options = WorkerAutoscaler::Options::fromConfig(config.getWorkerAutoscale());
+    workerCount = kj::min(kj::max(workerCount, options.minWorkers), options.maxWorkers);
+  }
   uint frontendCount = config.getFrontendCount();
-  uint mongoCount = 1;
+  uint mongoCount = kj::max(config.getMongoCount(), 1u);
   uint coordinatorCount = 0;
   uint gatewayCount = 1;
 
@@ -254,8 +1175,8 @@ void runMaster(kj::AsyncIoContext& ioContext, ComputeDriver& driver, MasterConfi
     }
   }
 
-  auto start = [&](ComputeDriver::MachineId id,
-                   kj::Function<RegistrationArray(Machine::Client)> setup) {
+  auto newHarness = [&](ComputeDriver::MachineId id,
+                        kj::Function<RegistrationArray(Machine::Client)> setup) {
     bool shouldRestartNode = shouldRestart || restartSet.count(id) > 0;
     if (shouldRestartNode) {
       KJ_LOG(INFO, "RESTARTING", id);
@@ -263,36 +1184,156 @@ void runMaster(kj::AsyncIoContext& ioContext, ComputeDriver& driver, MasterConfi
       KJ_LOG(INFO, "STARTING", id);
     }
 
-    harnesses.add(kj::heap<MachineHarness>(
+    orchestrator.expect(id);
+    return kj::heap<MachineHarness>(
         ioContext.provider->getTimer(), rpcSystem, network.getSelf().getId(),
-        driver, id, alreadyRunning.count(id) > 0, shouldRestartNode,
-        kj::mv(setup)));
+        driver, orchestrator, heartbeat, id, alreadyRunning.count(id) > 0, shouldRestartNode,
+        kj::mv(setup), id.type == ComputeDriver::MachineType::WORKER
+            ? kj::Maybe<WorkerRestarter&>(restarter) : nullptr);
+  };
+  auto start = [&](ComputeDriver::MachineId id,
+                   kj::Function<RegistrationArray(Machine::Client)> setup) {
+    harnesses.add(newHarness(id, kj::mv(setup)));
   };
 
-  // Start storage.
-  start({ ComputeDriver::MachineType::STORAGE, 0 }, [&](Machine::Client&& machine) {
-    auto storage = machine.becomeStorageRequest().send();
+  // Storage replication: each storage machine keeps the hot standby of the previous one.
+  auto replication = config.getStorageReplication();
+  if (replication != MasterConfig::StorageReplication::NONE && storageCount < 2) {
+    KJ_LOG(WARNING, "storage replication needs at least two storage machines; disabling it");
+    replication = MasterConfig::StorageReplication::NONE;
+  }
+  kj::Vector<kj::Own<BackendSetFeeder<StorageReplica>>> storageReplicaFeeders;
+  kj::Vector<kj::Own<StorageFailover>> storageFailovers;
+  if (replication != MasterConfig::StorageReplication::NONE) {
+    for (uint i = 0; i < storageCount; i++) {
+      storageReplicaFeeders.add(kj::heap<BackendSetFeeder<StorageReplica>>(1));
+      storageFailovers.add(kj::heap<StorageFailover>(ioContext.provider->getTimer(), driver,
+          config.getStorageFailoverSeconds() * kj::SECONDS, i));
+    }
+  }
 
+  auto registerStorage = [&](MasterRestorer<SturdyRef::Stored>::Client restorer,
+                             StorageFactory::Client factory,
+                             BackendSet<StorageSibling>::Client siblingSet,
+                             BackendSet<Restorer<SturdyRef::Hosted>>::Client hostedRestorerSet,
+                             BackendSet<Restorer<SturdyRef::External>>::Client gatewayRestorerSet) {
+    // Registers a storage node's capabilities other than its (keyed) sibling and root set.
     return registrationArray(
-        storageSiblingFeeder.addBackend(storage.getSibling()),
-        storageRootFeeder.addBackend(storage.getRootSet()),
         ({
-          auto req = storage.getStorageRestorer().getForOwnerRequest();
+          auto req = restorer.getForOwnerRequest();
           req.initDomain().setFrontend();
           storageRestorerForFrontendFeeder.addBackend(req.send().getAttenuated());
         }),
-        storageFactoryFeeder.addBackend(storage.getStorageFactory()),
-        storageSiblingFeeder.addConsumer(storage.getSiblingSet()),
-        hostedRestorerForStorageFeeder.addConsumer(storage.getHostedRestorerSet()),
-        gatewayRestorerForStorageFeeder.addConsumer(storage.getGatewayRestorerSet()));
-  });
+        storageFactoryFeeder.addBackend(kj::mv(factory)),
+        storageSiblingFeeder.addConsumer(kj::mv(siblingSet)),
+        hostedRestorerForStorageFeeder.addConsumer(kj::mv(hostedRestorerSet)),
+        gatewayRestorerForStorageFeeder.addConsumer(kj::mv(gatewayRestorerSet)));
+  };
 
-  // Start workers.
-  for (uint i = 0; i < workerCount; i++) {
-    start({ ComputeDriver::MachineType::WORKER, i }, [&](Machine::Client&& machine) {
-      return registrationArray(
-          workerFeeder.addBackend(machine.becomeWorkerRequest().send().getWorker()));
+  auto startStorage = [&](Machine::Client& machine, uint i) {
+    // Makes `machine` storage node `i`, and registers it.
+    auto storage = ({
+      auto req = machine.becomeStorageRequest();
+      req.setNodeIndex(i);
+      req.setSynchronousReplication(replication == MasterConfig::StorageReplication::SYNC);
+      req.send();
+    });
+
+    auto others = registerStorage(
+        storage.getStorageRestorer(), storage.getStorageFactory(), storage.getSiblingSet(),
+        storage.getHostedRestorerSet(), storage.getGatewayRestorerSet());
+    bool replicated = storageReplicaFeeders.size() > 0;
+    auto builder = kj::heapArrayBuilder<kj::Own<BackendSetFeederBase::Registration>>(
+        others.size() + (replicated ? 3 : 2));
+    builder.add(storageSiblingFeeder.addBackend(i, storage.getSibling()));
+    builder.add(storageRootFeeder.addBackend(i, storage.getRootSet()));
+    if (replicated) {
+      builder.add(storageReplicaFeeders[i]->addConsumer(storage.getReplicaSet()));
+    }
+    for (auto& registration: others) {
+      builder.add(kj::mv(registration));
+    }
+    return builder.finish();
+  };
+
+  // Start storage. Root objects are partitioned among the storage machines, so siblings and root
+  // sets are keyed by machine index.
+  for (uint i = 0; i < storageCount; i++) {
+    start({ ComputeDriver::MachineType::STORAGE, i }, [&,i](Machine::Client&& machine) {
+      kj::Vector<kj::Own<BackendSetFeederBase::Registration>> registrations;
+      bool replicated = storageFailovers.size() > 0;
+
+      if (replicated) {
+        // Only once we know the node hasn't failed over to its standby.
+        registrations.add(storageFailovers[i]->primaryUp(
+            [&startStorage,i,machine]() mutable { return startStorage(machine, i); }));
+      } else {
+        for (auto& registration: startStorage(machine, i)) {
+          registrations.add(kj::mv(registration));
+        }
+      }
+
+      if (replicated) {
+        uint node = (i + storageCount - 1) % storageCount;
+        auto standby = ({
+          auto req = machine.becomeStorageStandbyRequest();
+          req.setNodeIndex(node);
+          req.send();
+        });
+
+        auto replica = standby.getReplica();
+        auto sibling = standby.getSibling();
+        auto rootSet = standby.getRootSet();
+        auto restorer = standby.getStorageRestorer();
+        auto factory = standby.getStorageFactory();
+        auto siblingSet = standby.getSiblingSet();
+        auto hostedRestorerSet = standby.getHostedRestorerSet();
+        auto gatewayRestorerSet = standby.getGatewayRestorerSet();
+        auto promoted = standby.then([](auto&& response) { return response.getPromoted(); });
+
+        auto replicaRegistration = storageReplicaFeeders[node]->addBackend(0, replica);
+        registrations.add(storageFailovers[node]->standbyUp(
+            replica, kj::mv(replicaRegistration), kj::mv(promoted),
+            [&,node,sibling,rootSet,restorer,factory,siblingSet,hostedRestorerSet,
+             gatewayRestorerSet]() mutable {
+          auto others = registerStorage(kj::mv(restorer), kj::mv(factory), kj::mv(siblingSet),
+              kj::mv(hostedRestorerSet), kj::mv(gatewayRestorerSet));
+          auto builder = kj::heapArrayBuilder<kj::Own<BackendSetFeederBase::Registration>>(
+              others.size() + 2);
+          builder.add(storageSiblingFeeder.addBackend(node, sibling));
+          builder.add(storageRootFeeder.addBackend(node, rootSet));
+          for (auto& registration: others) {
+            builder.add(kj::mv(registration));
+          }
+          return builder.finish();
+        }));
+      }
+
+      return registrations.releaseAsArray();
+    });
+  }
+
+  // Start workers. Unlike other machines, these come and go if autoscaling is enabled.
+  kj::Maybe<kj::Own<WorkerAutoscaler>> autoscaler;
+  HarnessWorkerPool workerPool(driver, [&](uint i) {
+    return newHarness({ ComputeDriver::MachineType::WORKER, i },
+                      [&,i](Machine::Client&& machine) {
+      auto worker = machine.becomeWorkerRequest().send().getWorker();
+      auto routing = restarter.addWorker(i, worker, workerFeeder.addBackend(worker));
+      KJ_IF_MAYBE(a, autoscaler) {
+        return registrationArray((*a)->addWorker(i, kj::mv(worker), kj::mv(routing)));
+      } else {
+        return registrationArray(kj::mv(routing));
+      }
     });
+  });
+  if (config.getWorkerAutoscale().getEnabled()) {
+    autoscaler = kj::heap<WorkerAutoscaler>(
+        ioContext.provider->getTimer(), workerPool,
+        WorkerAutoscaler::Options::fromConfig(config.getWorkerAutoscale()), workerCount);
+  }
+  for (uint i = 0; i < workerCount; i++) {
+    workerPool.startWorker(i);
   }
 
   // Start front-end.
@@ -316,11 +1357,20 @@ void runMaster(kj::AsyncIoContext& ioContext, ComputeDriver& driver, MasterConfi
     });
   }
 
-  // Start mongo.
-  start({ ComputeDriver::MachineType::MONGO, 0 }, [&](Machine::Client&& machine) {
-    return registrationArray(
-        mongoFeeder.addBackend(machine.becomeMongoRequest().send().getMongo()));
-  });
+  // Start mongo. Members find the seed (member 0) among the others, so they're keyed by index.
+  for (uint i = 0; i < mongoCount; i++) {
+    start({ ComputeDriver::MachineType::MONGO, i }, [&,i](Machine::Client&& machine) {
+      auto mongo = ({
+        auto req = machine.becomeMongoRequest();
+        req.setMemberIndex(i);
+        req.send();
+      });
+
+      return registrationArray(
+          mongoFeeder.addBackend(i, mongo.getMongo()),
+          mongoFeeder.addConsumer(mongo.getMemberSet()));
+    });
+  }
 
   // Start gateway.
   start({ ComputeDriver::MachineType::GATEWAY, 0 }, [&](Machine::Client&& machine) {
@@ -335,6 +1385,12 @@ void runMaster(kj::AsyncIoContext& ioContext, ComputeDriver& driver, MasterConfi
         frontendFeeder.addConsumer(gateway.getFrontends()));
   });
 
+  orchestrator.seal();
+
+  KJ_IF_MAYBE(a, autoscaler) {
+    tasks.add((*a)->run());
+  }
+
   // Loop forever handling messages.
   kj::NEVER_DONE.wait(ioContext.waitScope);
   KJ_UNREACHABLE;
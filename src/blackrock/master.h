@@ -21,8 +21,11 @@
 #include "cluster-rpc.h"
 #include <kj/async-io.h>
 #include <blackrock/master.capnp.h>
+#include <blackrock/worker.capnp.h>
 #include <map>
+#include <queue>
 #include "logs.h"
+#include "backend-set.h"
 
 namespace sandstorm {
   class SubprocessSet;
@@ -92,6 +95,189 @@ public:
   // Shut down the given machine.
 };
 
+class PhiAccrualDetector {
+  // Adaptive failure detector, per Hayashibara et al., "The phi accrual failure detector" (2004).
+  // Rather than a fixed timeout, we keep a window of recent heartbeat inter-arrival times and
+  // compute phi = -log10(P(a heartbeat arrives later than now)), assuming intervals are normally
+  // distributed. Since each heartbeat is only sent after the previous one is answered, the
+  // intervals include the round trip time, so the detector adapts to each machine's latency and
+  // jitter: a machine which normally answers in 2ms is suspected much sooner after going quiet
+  // than one which routinely takes 500ms.
+
+public:
+  PhiAccrualDetector(kj::Duration expectedInterval, kj::TimePoint now);
+
+  void heartbeat(kj::TimePoint now);
+  // Records a heartbeat received at `now`.
+
+  double phi(kj::TimePoint now) const;
+  // How suspicious it is not to have heard a heartbeat since the last one, as of `now`. A phi
+  // of 1 means ~10% odds that the machine is merely slow, 2 means ~1%, and so on.
+
+  kj::Duration sinceLastHeartbeat(kj::TimePoint now) const { return now - lastHeartbeat; }
+
+private:
+  static constexpr uint WINDOW_SIZE = 100;
+  static constexpr double MIN_STDDEV_MS = 100;
+  // Keeps a machine on a very quiet network from being suspected over a few ms of jitter.
+
+  kj::TimePoint lastHeartbeat;
+  double intervals[WINDOW_SIZE];  // milliseconds, ring buffer
+  uint count = 0;
+  uint next = 0;
+  double sum = 0;
+  double sumSquares = 0;
+
+  void add(double interval);
+};
+
+class WorkerAutoscaler {
+  // Grows and shrinks the set of worker machines according to their reported load.
+  //
+  // Every poll interval we ask each worker for its load (see Worker.getLoad()) and average it. If
+  // the average is too high, we start another worker. If it is low enough that the cluster would
+  // still be comfortable with one fewer, we drain the highest-numbered worker: it is removed from
+  // the workers' BackendSet so that no new grains land on it, then Worker.drain() shuts down its
+  // grains and restarts them on the remaining workers. Once that's done (or the drain timeout
+  // passes) the machine is stopped. We make at most one change per cooldown
+  // period and never start a change while a drain is in progress.
+
+public:
+  struct Options {
+    uint minWorkers;
+    uint maxWorkers;
+    uint grainsPerWorker;
+    double scaleUpThreshold;
+    double scaleDownThreshold;
+    kj::Duration pollInterval;
+    kj::Duration cooldown;
+    kj::Duration drainTimeout;
+
+    static Options fromConfig(WorkerAutoscaleConfig::Reader config);
+  };
+
+  class WorkerPool {
+    // Starts and stops worker machines on behalf of the autoscaler. The master implements this
+    // with MachineHarnesses on top of the ComputeDriver; tests can substitute a fake.
+
+  public:
+    virtual void startWorker(uint index) = 0;
+    // Begin bringing up worker `index`. Once it is running, its setup should call addWorker().
+
+    virtual kj::Promise<void> stopWorker(uint index) = 0;
+    // Stop monitoring worker `index` and shut down its machine.
+  };
+
+  WorkerAutoscaler(kj::Timer& timer, WorkerPool& pool, Options options, uint initialCount);
+  ~WorkerAutoscaler() noexcept(false);
+  KJ_DISALLOW_COPY(WorkerAutoscaler);
+
+  kj::Own<BackendSetFeederBase::Registration> addWorker(
+      uint index, Worker::Client worker,
+      kj::Own<BackendSetFeederBase::Registration> routing) KJ_WARN_UNUSED_RESULT;
+  // Called when worker `index` has come up. `routing` is the worker's registration in the
+  // workers' BackendSetFeeder, which we drop in order to drain the worker. The returned
+  // registration should be dropped when the worker disconnects; it forwards setSuspected() to
+  // `routing`.
+
+  kj::Promise<void> run();
+  // Polls and adjusts forever.
+
+  kj::Promise<void> pollOnce();
+  // Queries all workers and makes at most one change. Exposed for testing.
+
+  uint getTargetCount() { return targetCount; }
+  // Number of workers we currently want, not counting any being drained.
+
+private:
+  class WorkerRegistration;
+
+  struct WorkerState {
+    kj::Maybe<Worker::Client> worker;  // null until addWorker() and after disconnect
+    kj::Own<BackendSetFeederBase::Registration> routing;
+    WorkerRegistration* registration = nullptr;
+  };
+
+  kj::Timer& timer;
+  WorkerPool& pool;
+  Options options;
+  uint targetCount;
+  kj::TimePoint lastChange;
+  std::map<uint, WorkerState> workers;
+  // Workers 0 through targetCount - 1, plus the one being drained, if any.
+
+  kj::Maybe<uint> drainingIndex;
+  kj::Promise<void> drainTask = nullptr;
+
+  bool isDraining(uint index);
+  double loadOf(WorkerLoad::Reader load);
+  kj::Promise<kj::Maybe<double>> queryLoad(Worker::Client& worker);
+  void drain(uint index);
+  kj::Promise<void> waitForDrained(uint index, kj::TimePoint deadline);
+};
+
+class WorkerRestarter {
+  // Restarts worker processes one at a time, first handing each one's grains off to the workers
+  // which remain, so that a rolling restart doesn't cold-start every grain in the cluster.
+  //
+  // A worker which is to be restarted is first reconnected to as usual, and registered here with
+  // addWorker(). Its harness then calls drain(). Once it's the worker's turn, we take it out of
+  // the workers' BackendSet, so that no new grains land on it, and call Worker.drain() with every
+  // other worker still in the set as successors. The harness then restarts the process, and
+  // drops its Turn once that's done, letting the next worker go.
+
+public:
+  class Turn {
+    // Held while a worker is being drained and restarted. Dropping it lets the next one go.
+
+  public:
+    explicit Turn(WorkerRestarter& restarter): restarter(restarter) {}
+    ~Turn() noexcept(false) { restarter.endTurn(); }
+    KJ_DISALLOW_COPY(Turn);
+
+  private:
+    WorkerRestarter& restarter;
+  };
+
+  WorkerRestarter(kj::Timer& timer, kj::Duration drainTimeout);
+  ~WorkerRestarter() noexcept(false);
+  KJ_DISALLOW_COPY(WorkerRestarter);
+
+  kj::Own<BackendSetFeederBase::Registration> addWorker(
+      uint index, Worker::Client worker,
+      kj::Own<BackendSetFeederBase::Registration> routing) KJ_WARN_UNUSED_RESULT;
+  // Called when worker `index` has come up. `routing` is the worker's registration in the
+  // workers' BackendSetFeeder, which we drop in order to drain the worker. The returned
+  // registration should be dropped when the worker disconnects; it forwards setSuspected() to
+  // `routing`.
+
+  kj::Promise<kj::Own<Turn>> drain(uint index);
+  // Waits for worker `index`'s turn, then drains it. Resolves once it's drained, or once draining
+  // failed or timed out, which is only logged, since the worker is to be restarted either way.
+  // Dropping the Turn (or canceling the promise) lets the next worker take its turn.
+
+private:
+  class WorkerRegistration;
+
+  struct WorkerState {
+    Worker::Client worker;
+    kj::Own<BackendSetFeederBase::Registration> routing;  // null while draining
+    WorkerRegistration* registration;
+  };
+
+  kj::Timer& timer;
+  kj::Duration drainTimeout;
+  std::map<uint, WorkerState> workers;
+  // Workers which are currently connected.
+
+  bool busy = false;
+  std::queue<kj::Own<kj::PromiseFulfiller<void>>> waiters;
+  // Whether some worker has its turn, and who's waiting for one.
+
+  kj::Promise<void> beginTurn();
+  void endTurn();
+};
+
 void runMaster(kj::AsyncIoContext& ioContext, ComputeDriver& driver, MasterConfig::Reader config,
                bool shouldRestart, kj::ArrayPtr<kj::StringPtr> machinesToRestart);
 
@@ -27,7 +27,7 @@
 #include <unistd.h>
 #include <sodium/randombytes.h>
 #include <capnp/message.h>
-#include <blackrock/sparse-data.capnp.h>
+#include "sparse-stream.h"
 #include <blackrock/blank-ext4.capnp.h>
 #include <limits.h>
 
@@ -361,24 +361,8 @@ NbdDevice::NbdDevice(uint number)
   KJ_SYSCALL(flock(fd, LOCK_EX | LOCK_NB), "requested nbd device is already in-use", path);
 }
 
-static void pwriteAll(int fd, const void* data, size_t size, off_t offset) {
-  while (size > 0) {
-    ssize_t n;
-    KJ_SYSCALL(n = pwrite(fd, data, size, offset));
-    KJ_ASSERT(n != 0, "zero-sized write?");
-    data = reinterpret_cast<const byte*>(data) + n;
-    size -= n;
-    offset += n;
-  }
-}
-
 void NbdDevice::format() {
-  SparseData::Reader sparse = BLANK_EXT4;
-
-  for (auto chunk: sparse.getChunks()) {
-    auto data = chunk.getData();
-    pwriteAll(fd, data.begin(), data.size(), chunk.getOffset());
-  }
+  writeSparseData(BLANK_EXT4, fd);
 }
 
 namespace {
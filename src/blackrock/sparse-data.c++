@@ -14,20 +14,21 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#include <blackrock/sparse-data.capnp.h>
+#include "sparse-stream.h"
 #include <kj/main.h>
-#include <kj/encoding.h>
+#include <kj/debug.h>
+#include <kj/vector.h>
 #include <sandstorm/util.h>
 #include <capnp/message.h>
 #include <capnp/serialize.h>
 #include <unistd.h>
-#include <errno.h>
 
 namespace blackrock {
 
 class SparseDataMain {
   // Main class for a simple program that produces a SparseData from an input sparse file.
-  // The output is written as a single-segment message (no leading segment table).
+  // The output is written as a single-segment message (no leading segment table), or as a
+  // SparseData stream (see sparse-stream.h) with --stream.
 
 public:
   SparseDataMain(kj::ProcessContext& context): context(context) {}
@@ -36,83 +37,48 @@ public:
     return kj::MainBuilder(context, "unknown version",
                            "Given a sparse file, output (on stdout) a blackrock::SparseData "
                            "Cap'n Proto representation of the file content.")
+        .addOption({"stream"}, [this]() { stream = true; return true; },
+                   "Output a SparseData stream rather than one message, so that memory use "
+                   "doesn't grow with the size of the file.")
+        .addOption({"apply"}, [this]() { apply = true; return true; },
+                   "Instead, read a SparseData stream (or message) from stdin and write it to "
+                   "<file>, which may be a block device.")
         .expectArg("<file>", KJ_BIND_METHOD(*this, run))
         .build();
   }
 
   kj::MainBuilder::Validity run(kj::StringPtr arg) {
-    auto fd = sandstorm::raiiOpen(arg, O_RDONLY | O_CLOEXEC);
-
-    capnp::MallocMessageBuilder message(1 << 17);  // start with 1MB
-    auto root = message.getRoot<SparseData>();
-    auto orphanage = message.getOrphanage();
-
-    kj::Vector<Chunk> chunks;
-    Chunk chunk;
-    chunk.offset = 0;
-
-    kj::byte block[4096];
-
-    off_t offset = 0;
-    for (;;) {
-    retry:
-      offset = lseek(fd, offset, SEEK_DATA);
-      if (offset < 0) {
-        int error = errno;
-        if (error == EINTR) {
-          goto retry;
-        } else if (error == ENXIO) {
-          // reached EOF
-          break;
-        } else {
-          KJ_FAIL_SYSCALL("lseek", error);
-        }
-      }
-
-      KJ_ASSERT(offset % sizeof(block) == 0);
-
-      size_t n = kj::FdInputStream(fd.get()).tryRead(block, sizeof(block), sizeof(block));
-      KJ_ASSERT(n > 0);
-
-      KJ_LOG(INFO, kj::hex((uint64_t)offset / sizeof(block)), kj::encodeHex(block));
-
-      for (kj::byte b: block) {
-        if (b != 0) {
-          // This block has non-zero bytes. We need to add it to the results. Note that we write
-          // a whole block even if it contains runs of zeros because block-aligned writes probably
-          // will make our main use case (initializing ext4 block devices) more efficient.
-          if (chunk.data == nullptr) {
-          newChunk:
-            chunk.offset = offset;
-            chunk.data = orphanage.newOrphanCopy(capnp::Data::Reader(block, n));
-          } else {
-            size_t chunkSize = chunk.data.getReader().size();
-            if (chunk.offset + chunkSize == offset) {
-              // Extend the chunk.
-              chunk.data.truncate(chunkSize + n);
-              memcpy(chunk.data.get().begin() + chunkSize, block, n);
-            } else {
-              // Start new chunk.
-              chunks.add(kj::mv(chunk));
-              goto newChunk;
-            }
-          }
-          break;
-        }
-      }
-
-      offset += n;
+    if (apply) {
+      auto fd = sandstorm::raiiOpen(arg, O_WRONLY | O_CLOEXEC);
+      kj::FdInputStream input(STDIN_FILENO);
+      applySparseDataStream(input, fd);
+      return true;
     }
 
-    if (chunk.data != nullptr) {
-      chunks.add(kj::mv(chunk));
+    auto fd = sandstorm::raiiOpen(arg, O_RDONLY | O_CLOEXEC);
+
+    if (stream) {
+      kj::FdOutputStream output(STDOUT_FILENO);
+      writeSparseDataStream(fd, output);
+      return true;
     }
 
-    auto list = root.initChunks(chunks.size());
+    // Embedding the result in a binary (see blank-ext4.capnp) requires a single message, so
+    // collect the chunks first, then build a message of exactly the right size.
+    kj::Vector<Chunk> chunks;
+    size_t words = 16;
+    scanSparseFile(fd, [&](uint64_t offset, kj::ArrayPtr<const byte> data) {
+      chunks.add(Chunk { offset, kj::heapArray(data) });
+      words += (data.size() + sizeof(capnp::word) - 1) / sizeof(capnp::word) +
+               capnp::sizeInWords<SparseData::Chunk>();
+    });
+
+    capnp::MallocMessageBuilder message(words);
+    auto list = message.getRoot<SparseData>().initChunks(chunks.size());
     for (auto i: kj::indices(chunks)) {
       auto chunkBuilder = list[i];
       chunkBuilder.setOffset(chunks[i].offset);
-      chunkBuilder.adoptData(kj::mv(chunks[i].data));
+      chunkBuilder.setData(chunks[i].data);
     }
 
     capnp::writeMessageToFd(STDOUT_FILENO, message);
@@ -122,10 +88,12 @@ public:
 
 private:
   kj::ProcessContext& context;
+  bool stream = false;
+  bool apply = false;
 
   struct Chunk {
     uint64_t offset;
-    capnp::Orphan<capnp::Data> data;
+    kj::Array<byte> data;
   };
 };
 
@@ -0,0 +1,243 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sparse-stream.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <capnp/message.h>
+#include <sandstorm/util.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+namespace blackrock {
+namespace {
+
+constexpr uint64_t IMAGE_BLOCKS = 2048;
+constexpr uint64_t IMAGE_SIZE = IMAGE_BLOCKS * SPARSE_BLOCK_SIZE + 100;
+// 8MB and change, so that the image ends in a partial block.
+
+struct Run {
+  uint64_t offset;
+  uint64_t size;
+};
+
+const Run IMAGE_RUNS[] = {
+  { 0, SPARSE_BLOCK_SIZE },
+  // Block 1 is written, but with zeros. Then there's a hole.
+  { 100 * SPARSE_BLOCK_SIZE, SPARSE_BLOCK_SIZE },
+  // Block 101 is written with zeros, in the middle of the data.
+  { 102 * SPARSE_BLOCK_SIZE, SPARSE_BLOCK_SIZE },
+  // Longer than both MAX_SPARSE_CHUNK_SIZE and one Volume write.
+  { 200 * SPARSE_BLOCK_SIZE, 5 << 20 },
+  { IMAGE_BLOCKS * SPARSE_BLOCK_SIZE, 100 },
+};
+// The non-zero parts of the image made by makeImage().
+
+kj::AutoCloseFd newFile() {
+  return sandstorm::raiiOpen("/var/tmp", O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+}
+
+void writeAt(int fd, kj::ArrayPtr<const byte> data, uint64_t offset) {
+  ssize_t n;
+  KJ_SYSCALL(n = pwrite(fd, data.begin(), data.size(), offset));
+  KJ_ASSERT(size_t(n) == data.size(), "short write to temp file");
+}
+
+kj::Array<byte> readAll(int fd, uint64_t size) {
+  auto result = kj::heapArray<byte>(size);
+  uint64_t offset = 0;
+  while (offset < size) {
+    ssize_t n;
+    KJ_SYSCALL(n = pread(fd, result.begin() + offset, size - offset, offset));
+    KJ_ASSERT(n > 0, "file is shorter than expected");
+    offset += n;
+  }
+  return result;
+}
+
+bool sameBytes(kj::ArrayPtr<const byte> a, kj::ArrayPtr<const byte> b) {
+  return a.size() == b.size() && memcmp(a.begin(), b.begin(), a.size()) == 0;
+}
+
+kj::AutoCloseFd makeImage() {
+  // Makes a sparse file with the data in IMAGE_RUNS, and zeros elsewhere: some of them written,
+  // the rest holes.
+
+  auto fd = newFile();
+  KJ_SYSCALL(ftruncate(fd, IMAGE_SIZE));
+
+  for (auto& run: IMAGE_RUNS) {
+    auto data = kj::heapArray<byte>(run.size);
+    for (auto i: kj::indices(data)) {
+      // Never zero, and different in each block.
+      data[i] = byte('a' + (run.offset + i) / SPARSE_BLOCK_SIZE % 26);
+    }
+    writeAt(fd, data, run.offset);
+  }
+
+  byte zeros[SPARSE_BLOCK_SIZE];
+  memset(zeros, 0, sizeof(zeros));
+  writeAt(fd, kj::arrayPtr(zeros, sizeof(zeros)), 1 * SPARSE_BLOCK_SIZE);
+  writeAt(fd, kj::arrayPtr(zeros, sizeof(zeros)), 101 * SPARSE_BLOCK_SIZE);
+
+  return fd;
+}
+
+KJ_TEST("scanSparseFile skips holes and zero blocks") {
+  auto image = makeImage();
+
+  kj::Vector<Run> runs;
+  scanSparseFile(image, [&](uint64_t offset, kj::ArrayPtr<const byte> data) {
+    KJ_EXPECT(offset % SPARSE_BLOCK_SIZE == 0, offset);
+    KJ_EXPECT(data.size() > 0 && data.size() <= MAX_SPARSE_CHUNK_SIZE, data.size());
+
+    // Merge adjacent chunks, since how long runs are split depends on the filesystem's extents.
+    if (runs.size() > 0 && runs.back().offset + runs.back().size == offset) {
+      runs.back().size += data.size();
+    } else {
+      runs.add(Run { offset, data.size() });
+    }
+  });
+
+  KJ_ASSERT(runs.size() == kj::size(IMAGE_RUNS), runs.size());
+  for (auto i: kj::indices(runs)) {
+    KJ_EXPECT(runs[i].offset == IMAGE_RUNS[i].offset, i, runs[i].offset);
+    KJ_EXPECT(runs[i].size == IMAGE_RUNS[i].size, i, runs[i].size);
+  }
+}
+
+KJ_TEST("sparse data streams round-trip through files") {
+  auto image = makeImage();
+  auto expected = readAll(image, IMAGE_SIZE);
+
+  auto stream = newFile();
+  {
+    kj::FdOutputStream output(stream.get());
+    writeSparseDataStream(image, output);
+  }
+  KJ_SYSCALL(lseek(stream, 0, SEEK_SET));
+
+  auto copy = newFile();
+  KJ_SYSCALL(ftruncate(copy, IMAGE_SIZE));
+  {
+    kj::FdInputStream input(stream.get());
+    applySparseDataStream(input, copy);
+  }
+
+  KJ_EXPECT(sameBytes(readAll(copy, IMAGE_SIZE), expected));
+
+  // Zeros weren't written, so the long hole is still a hole.
+  forEachDataExtent(copy, [&](uint64_t offset, uint64_t size) {
+    KJ_EXPECT(offset + size <= 2 * SPARSE_BLOCK_SIZE || offset >= 100 * SPARSE_BLOCK_SIZE,
+              offset, size);
+  });
+}
+
+class TestVolume final: public Volume::Server {
+  // A Volume which is just an array in memory. Checks that writes are whole blocks, and records
+  // how big they get.
+
+public:
+  kj::Array<byte> content = kj::heapArray<byte>((IMAGE_BLOCKS + 1) * SPARSE_BLOCK_SIZE);
+  uint writeCount = 0;
+  size_t maxWriteSize = 0;
+  uint syncCount = 0;
+
+  TestVolume() {
+    memset(content.begin(), 0, content.size());
+  }
+
+protected:
+  kj::Promise<void> write(WriteContext context) override {
+    auto params = context.getParams();
+    auto data = params.getData();
+    uint64_t offset = uint64_t(params.getBlockNum()) * SPARSE_BLOCK_SIZE;
+    KJ_ASSERT(data.size() % SPARSE_BLOCK_SIZE == 0, data.size());
+    KJ_ASSERT(offset + data.size() <= content.size(), offset, data.size());
+    KJ_ASSERT(syncCount == 0, "wrote after sync");
+
+    memcpy(content.begin() + offset, data.begin(), data.size());
+    ++writeCount;
+    maxWriteSize = kj::max(maxWriteSize, data.size());
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> sync(SyncContext context) override {
+    ++syncCount;
+    return kj::READY_NOW;
+  }
+};
+
+KJ_TEST("sparse data streams apply to volumes") {
+  auto io = kj::setupAsyncIo();
+  auto image = makeImage();
+  auto expected = readAll(image, IMAGE_SIZE);
+
+  auto stream = newFile();
+  {
+    kj::FdOutputStream output(stream.get());
+    writeSparseDataStream(image, output);
+  }
+  KJ_SYSCALL(lseek(stream, 0, SEEK_SET));
+
+  auto server = kj::heap<TestVolume>();
+  auto& volume = *server;
+  Volume::Client client = kj::mv(server);
+
+  auto input = io.lowLevelProvider->wrapInputFd(stream);
+  applySparseDataStream(*input, client).wait(io.waitScope);
+
+  KJ_EXPECT(sameBytes(volume.content.slice(0, IMAGE_SIZE), expected));
+  KJ_EXPECT(volume.syncCount == 1);
+}
+
+KJ_TEST("adjacent sparse data chunks combine into bounded volume writes") {
+  auto io = kj::setupAsyncIo();
+  auto image = makeImage();
+  auto expected = readAll(image, IMAGE_SIZE);
+
+  // One message holding every chunk, as in a SparseData image that isn't streamed.
+  kj::Vector<kj::Array<byte>> datas;
+  kj::Vector<uint64_t> offsets;
+  scanSparseFile(image, [&](uint64_t offset, kj::ArrayPtr<const byte> data) {
+    offsets.add(offset);
+    datas.add(kj::heapArray(data));
+  });
+  capnp::MallocMessageBuilder message;
+  auto chunks = message.getRoot<SparseData>().initChunks(datas.size());
+  for (auto i: kj::indices(datas)) {
+    chunks[i].setOffset(offsets[i]);
+    chunks[i].setData(datas[i]);
+  }
+
+  auto server = kj::heap<TestVolume>();
+  auto& volume = *server;
+  Volume::Client client = kj::mv(server);
+
+  writeSparseData(message.getRoot<SparseData>().asReader(), client).wait(io.waitScope);
+
+  KJ_EXPECT(sameBytes(volume.content.slice(0, IMAGE_SIZE), expected));
+
+  // One write per run, except the long one, which takes a full-sized write and the rest.
+  KJ_EXPECT(volume.writeCount == kj::size(IMAGE_RUNS) + 1, volume.writeCount);
+  KJ_EXPECT(volume.maxWriteSize == 4 << 20, volume.maxWriteSize);
+  KJ_EXPECT(volume.syncCount == 0);
+}
+
+}  // namespace
+}  // namespace blackrock
@@ -0,0 +1,242 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sparse-stream.h"
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <capnp/serialize-async.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+namespace blackrock {
+
+static_assert(SPARSE_BLOCK_SIZE == Volume::BLOCK_SIZE, "SparseData blocks must be Volume blocks");
+
+namespace {
+
+constexpr size_t MAX_VOLUME_WRITE_SIZE = 4 << 20;
+// Each Volume.write() carries at most this much, well under the RPC message size limit.
+
+kj::Maybe<off_t> trySeek(int fd, off_t offset, int whence) {
+  // lseek() for SEEK_DATA / SEEK_HOLE, returning null if there's no more data.
+
+  for (;;) {
+    off_t result = lseek(fd, offset, whence);
+    if (result >= 0) return result;
+
+    int error = errno;
+    if (error == ENXIO) {
+      return nullptr;
+    } else if (error != EINTR) {
+      KJ_FAIL_SYSCALL("lseek", error, offset, whence);
+    }
+  }
+}
+
+void preadAll(int fd, void* data, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t n;
+    KJ_SYSCALL(n = pread(fd, data, size, offset));
+    KJ_ASSERT(n != 0, "file shrank while reading it");
+    data = reinterpret_cast<byte*>(data) + n;
+    size -= n;
+    offset += n;
+  }
+}
+
+void pwritevAll(int fd, kj::ArrayPtr<struct iovec> pieces, off_t offset) {
+  while (pieces.size() > 0) {
+    ssize_t n;
+    KJ_SYSCALL(n = pwritev(fd, pieces.begin(), pieces.size(), offset));
+    KJ_ASSERT(n != 0, "zero-sized write?");
+    offset += n;
+
+    // Skip what was written, which may end partway through a piece.
+    while (pieces.size() > 0 && size_t(n) >= pieces[0].iov_len) {
+      n -= pieces[0].iov_len;
+      pieces = pieces.slice(1, pieces.size());
+    }
+    if (n > 0) {
+      pieces[0].iov_base = reinterpret_cast<byte*>(pieces[0].iov_base) + n;
+      pieces[0].iov_len -= n;
+    }
+  }
+}
+
+bool isAllZero(kj::ArrayPtr<const byte> data) {
+  byte bits = 0;
+  for (byte b: data) bits |= b;
+  return bits == 0;
+}
+
+}  // namespace
+
+void forEachDataExtent(int fd, kj::Function<void(uint64_t offset, uint64_t size)> callback) {
+  off_t offset = 0;
+  for (;;) {
+    KJ_IF_MAYBE(dataStart, trySeek(fd, offset, SEEK_DATA)) {
+      offset = *dataStart;
+    } else {
+      break;
+    }
+    KJ_ASSERT(offset % SPARSE_BLOCK_SIZE == 0, "filesystem blocks are smaller than 4k?", offset);
+
+    // There's always a hole after data, if only at EOF.
+    off_t end = KJ_ASSERT_NONNULL(trySeek(fd, offset, SEEK_HOLE));
+    callback(offset, end - offset);
+    offset = end;
+  }
+}
+
+void scanSparseFile(int fd,
+    kj::Function<void(uint64_t offset, kj::ArrayPtr<const byte> data)> callback) {
+  auto buffer = kj::heapArray<byte>(MAX_SPARSE_CHUNK_SIZE);
+
+  forEachDataExtent(fd, [&](uint64_t offset, uint64_t size) {
+    uint64_t end = offset + size;
+    while (offset < end) {
+      size_t n = kj::min(end - offset, uint64_t(buffer.size()));
+      preadAll(fd, buffer.begin(), n, offset);
+
+      // Allocated blocks may still be all zero. Write a whole block even if it contains runs of
+      // zeros, though, since block-aligned writes are what our main use case (initializing ext4
+      // block devices) wants.
+      size_t runStart = 0;
+      for (size_t pos = 0; pos < n; pos += SPARSE_BLOCK_SIZE) {
+        size_t blockEnd = kj::min(pos + SPARSE_BLOCK_SIZE, n);
+        if (isAllZero(buffer.slice(pos, blockEnd))) {
+          if (pos > runStart) callback(offset + runStart, buffer.slice(runStart, pos));
+          runStart = blockEnd;
+        }
+      }
+      if (n > runStart) callback(offset + runStart, buffer.slice(runStart, n));
+
+      offset += n;
+    }
+  });
+}
+
+void writeSparseDataStream(int fd, kj::OutputStream& output) {
+  scanSparseFile(fd, [&](uint64_t offset, kj::ArrayPtr<const byte> data) {
+    capnp::MallocMessageBuilder message(data.size() / sizeof(capnp::word) + 16);
+    auto chunk = message.getRoot<SparseData>().initChunks(1)[0];
+    chunk.setOffset(offset);
+    chunk.setData(data);
+    capnp::writeMessage(output, message);
+  });
+}
+
+void writeSparseData(SparseData::Reader data, int fd) {
+  kj::Vector<struct iovec> pieces;
+  uint64_t start = 0;
+  uint64_t size = 0;
+
+  auto flush = [&]() {
+    pwritevAll(fd, pieces.asPtr(), start);
+    pieces.clear();
+    size = 0;
+  };
+
+  for (auto chunk: data.getChunks()) {
+    auto bytes = chunk.getData();
+    if (pieces.size() > 0 && (start + size != chunk.getOffset() || pieces.size() == IOV_MAX)) {
+      flush();
+    }
+    if (pieces.size() == 0) start = chunk.getOffset();
+    pieces.add(iovec { const_cast<byte*>(bytes.begin()), bytes.size() });
+    size += bytes.size();
+  }
+  flush();
+}
+
+void applySparseDataStream(kj::InputStream& input, int fd) {
+  kj::BufferedInputStreamWrapper buffered(input);
+  while (buffered.tryGetReadBuffer().size() > 0) {
+    capnp::InputStreamMessageReader message(buffered);
+    writeSparseData(message.getRoot<SparseData>(), fd);
+  }
+}
+
+kj::Promise<void> writeSparseData(SparseData::Reader data, Volume::Client volume) {
+  kj::Vector<kj::Promise<void>> writes;
+  kj::Vector<kj::ArrayPtr<const byte>> pieces;
+  uint64_t start = 0;
+  uint64_t size = 0;
+
+  auto flush = [&]() {
+    if (size == 0) return;
+
+    auto request = volume.writeRequest(
+        capnp::MessageSize { 16 + size / sizeof(capnp::word), 0 });
+    request.setBlockNum(start / SPARSE_BLOCK_SIZE);
+    // A trailing partial block is padded with zeros, which initData() provides.
+    auto out = request.initData((size + SPARSE_BLOCK_SIZE - 1) / SPARSE_BLOCK_SIZE *
+                                SPARSE_BLOCK_SIZE);
+    byte* pos = out.begin();
+    for (auto piece: pieces) {
+      memcpy(pos, piece.begin(), piece.size());
+      pos += piece.size();
+    }
+    writes.add(request.send().ignoreResult());
+
+    pieces.clear();
+    size = 0;
+  };
+
+  for (auto chunk: data.getChunks()) {
+    uint64_t offset = chunk.getOffset();
+    auto bytes = chunk.getData();
+    KJ_REQUIRE(offset % SPARSE_BLOCK_SIZE == 0, "SparseData chunk isn't block-aligned", offset);
+
+    while (bytes.size() > 0) {
+      if (size > 0 && (start + size != offset || size % SPARSE_BLOCK_SIZE != 0)) flush();
+      if (size == 0) start = offset;
+
+      size_t n = kj::min(bytes.size(), MAX_VOLUME_WRITE_SIZE - size);
+      pieces.add(bytes.slice(0, n));
+      size += n;
+      offset += n;
+      bytes = bytes.slice(n, bytes.size());
+
+      if (size == MAX_VOLUME_WRITE_SIZE) flush();
+    }
+  }
+  flush();
+
+  return kj::joinPromises(writes.releaseAsArray());
+}
+
+kj::Promise<void> applySparseDataStream(kj::AsyncInputStream& input, Volume::Client volume) {
+  return capnp::tryReadMessage(input)
+      .then([&input,KJ_MVCAP(volume)](kj::Maybe<kj::Own<capnp::MessageReader>>&& maybeMessage)
+            mutable -> kj::Promise<void> {
+    KJ_IF_MAYBE(message, maybeMessage) {
+      auto promise = writeSparseData((*message)->getRoot<SparseData>(), volume);
+      return promise.attach(kj::mv(*message))
+          .then([&input,KJ_MVCAP(volume)]() mutable {
+        return applySparseDataStream(input, kj::mv(volume));
+      });
+    } else {
+      return volume.syncRequest().send().ignoreResult();
+    }
+  });
+}
+
+}  // namespace blackrock
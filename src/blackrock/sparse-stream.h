@@ -0,0 +1,67 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLACKROCK_SPARSE_STREAM_H_
+#define BLACKROCK_SPARSE_STREAM_H_
+
+#include "common.h"
+#include <blackrock/sparse-data.capnp.h>
+#include <blackrock/storage.capnp.h>
+#include <kj/async-io.h>
+
+namespace blackrock {
+
+// A SparseData stream is a series of SparseData messages, serialized one after another with
+// capnp::writeMessage() and ending at EOF. Each message holds only part of the image, so neither
+// end ever needs the whole thing in memory. A single SparseData message is itself a valid stream.
+
+constexpr uint SPARSE_BLOCK_SIZE = 4096;
+// Chunks produced here always start on a block boundary, and end on one unless they end at EOF.
+
+constexpr size_t MAX_SPARSE_CHUNK_SIZE = 1 << 20;
+
+void forEachDataExtent(int fd, kj::Function<void(uint64_t offset, uint64_t size)> callback);
+// Calls `callback` for each extent of `fd` which isn't a hole, in order, found with SEEK_DATA /
+// SEEK_HOLE without reading anything. Extents may still contain runs of zeros.
+
+void scanSparseFile(int fd,
+    kj::Function<void(uint64_t offset, kj::ArrayPtr<const byte> data)> callback);
+// Calls `callback` for each run of blocks in `fd` containing non-zero bytes, in order. Holes are
+// skipped with SEEK_DATA / SEEK_HOLE without being read. Runs longer than MAX_SPARSE_CHUNK_SIZE
+// are split. `data` is only valid during the call.
+
+void writeSparseDataStream(int fd, kj::OutputStream& output);
+// Writes the sparse file `fd` to `output` as a SparseData stream, one chunk per message.
+
+void writeSparseData(SparseData::Reader data, int fd);
+// Writes each chunk to `fd` -- a file or block device -- at its offset. Adjacent chunks are
+// combined into one pwritev().
+
+void applySparseDataStream(kj::InputStream& input, int fd);
+// writeSparseData() for each message of a stream.
+
+kj::Promise<void> writeSparseData(SparseData::Reader data, Volume::Client volume);
+// Writes each chunk to `volume`, whose blocks must be SPARSE_BLOCK_SIZE. Adjacent chunks are
+// combined into writes of up to 4MB, all sent at once. `data` must remain valid until the
+// returned promise resolves. Doesn't sync.
+
+kj::Promise<void> applySparseDataStream(kj::AsyncInputStream& input, Volume::Client volume);
+// writeSparseData() for each message of a stream, reading the next message once the previous
+// one's writes are done, then syncs `volume`.
+
+}  // namespace blackrock
+
+#endif // BLACKROCK_SPARSE_STREAM_H_
@@ -33,6 +33,8 @@
 #include "bundle.h"
 
 #include <sys/mount.h>
+#include <stdlib.h>
+#include <stdio.h>
 #undef BLOCK_SIZE // grr, mount.h
 
 namespace blackrock {
@@ -445,7 +447,8 @@ public:
                sandstorm::Subprocess::Options&& subprocessOptions,
                kj::String grainIdParam,
                sandstorm::SandstormCore::Client core,
-               kj::Own<LocalPersistentRegistry::Registration> persistentRegistration)
+               kj::Own<LocalPersistentRegistry::Registration> persistentRegistration,
+               kj::Own<capnp::MessageBuilder> restoreParams)
       : worker(worker),
         workerCap(kj::mv(workerCap)),
         grainState(kj::mv(grainState)),
@@ -468,7 +471,8 @@ public:
         capnpSocket(kj::mv(capnpSocket)),
         rpcClient(*this->capnpSocket, kj::mv(core)),
         persistentRegistration(kj::mv(persistentRegistration)),
-        grainId(kj::mv(grainIdParam)) {
+        grainId(kj::mv(grainIdParam)),
+        restoreParams(kj::mv(restoreParams)) {
     KJ_LOG(INFO, "starting grain", grainId);
   }
 
@@ -489,12 +493,40 @@ public:
     sizeHint.wordCount += 4;
     auto req = grainStateSetter.setRequest(sizeHint);
     req.setValue(newState);
-    req.send().detach([](kj::Exception&& exception) {
-      KJ_LOG(ERROR, "dirty grain shutdown", exception);
-    });
+
+    KJ_IF_MAYBE(f, drainFulfiller) {
+      // We're being drained. Once the inactive state is saved, hand back everything needed to
+      // restore the grain elsewhere. Our setter remains valid for the new worker's initial set().
+      auto fulfiller = kj::mv(*f);
+      auto& fulfillerRef = *fulfiller;
+      auto params = restoreParams->getRoot<Worker::RestoreGrainParams>();
+      params.setGrainState(newState);
+      params.setExclusiveGrainStateSetter(grainStateSetter);
+      auto message = kj::mv(restoreParams);
+      worker.tasks.add(req.send().then([&fulfillerRef,KJ_MVCAP(message)](auto&&) mutable {
+        fulfillerRef.fulfill(kj::mv(message));
+      }, [&fulfillerRef](kj::Exception&& exception) {
+        fulfillerRef.reject(kj::mv(exception));
+      }).attach(kj::mv(fulfiller)));
+    } else {
+      req.send().detach([](kj::Exception&& exception) {
+        KJ_LOG(ERROR, "dirty grain shutdown", exception);
+      });
+    }
     worker.packageMountSet.returnPackage(kj::mv(packageMount));
   }
 
+  kj::Promise<kj::Own<capnp::MessageBuilder>> drain() {
+    // Ask the grain to shut down cleanly. The meta-supervisor forwards SIGTERM to the supervisor,
+    // then unmounts the grain's volume and trims its journal before exiting, after which we're
+    // destroyed. Resolves to RestoreGrainParams for restarting the grain on another worker.
+    KJ_LOG(INFO, "draining grain", grainId);
+    auto paf = kj::newPromiseAndFulfiller<kj::Own<capnp::MessageBuilder>>();
+    drainFulfiller = kj::mv(paf.fulfiller);
+    subprocess.signal(SIGTERM);
+    return kj::mv(paf.promise);
+  }
+
   kj::Promise<void> onExit() {
     return processWaitTask.catch_([this](auto) { return kj::mv(volumeRunTask); });
   }
@@ -528,6 +560,13 @@ private:
   // We hold on to this until the grain shuts down, so that the grain can be restored from storage.
 
   kj::String grainId;
+
+  kj::Own<capnp::MessageBuilder> restoreParams;
+  // Worker::RestoreGrainParams with the package, command, grain ID, and core filled in, so that
+  // a drained grain can be handed off to another worker.
+
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<kj::Own<capnp::MessageBuilder>>>> drainFulfiller;
+  // Set by drain(); fulfilled once the grain has stopped and its state has been saved.
 };
 
 WorkerImpl::WorkerImpl(kj::AsyncIoContext& ioContext, sandstorm::SubprocessSet& subprocessSet,
@@ -576,6 +615,10 @@ struct WorkerImpl::CommandInfo {
 };
 
 kj::Promise<void> WorkerImpl::newGrain(NewGrainContext context) {
+  if (draining) {
+    return KJ_EXCEPTION(DISCONNECTED, "worker is draining");
+  }
+
   auto params = context.getParams();
 
   // Create a promise for the Supervisor, and then make that promise persistent. Although in theory
@@ -588,7 +631,10 @@ kj::Promise<void> WorkerImpl::newGrain(NewGrainContext context) {
 
   // Construct objects and create the GrainState Assignable.
   auto storageFactory = params.getStorage();
-  auto grainVolume = storageFactory.newVolumeRequest().send().getVolume();
+  // The volume starts out as a copy of the blank filesystem, so the grain needn't format it.
+  auto volumeReq = storageFactory.newVolumeFromTemplateRequest();
+  volumeReq.setTemplateId("blank-ext4");
+  auto grainVolume = volumeReq.send().getVolume();
   auto grainStateHolder = kj::heap<capnp::MallocMessageBuilder>(8);
   auto req = storageFactory.newAssignableRequest<GrainState>();
   {
@@ -615,6 +661,10 @@ kj::Promise<void> WorkerImpl::newGrain(NewGrainContext context) {
 }
 
 kj::Promise<void> WorkerImpl::restoreGrain(RestoreGrainContext context) {
+  if (draining) {
+    return KJ_EXCEPTION(DISCONNECTED, "worker is draining");
+  }
+
   auto params = context.getParams();
 
   // Create a promise for the Supervisor, and then make that promise persistent. We need to save
@@ -671,11 +721,22 @@ sandstorm::Supervisor::Client WorkerImpl::bootGrain(
   // Copy command info from params, since params will no longer be valid when we return.
   CommandInfo command(commandReader);
 
+  // Likewise, remember how to restore this grain, in case we're drained. (`storage` is left
+  // null; restoreGrain() doesn't need it.)
+  auto restoreParams = kj::heap<capnp::MallocMessageBuilder>();
+  {
+    auto params = restoreParams->getRoot<Worker::RestoreGrainParams>();
+    params.setPackage(packageInfo);
+    params.setCommand(commandReader);
+    params.setGrainId(grainId);
+    params.setCore(core);
+  }
+
   // Make sure the package is mounted, then start the grain.
   return packageMountSet.getPackage(packageInfo)
       .then([this,isNew,KJ_MVCAP(grainState),KJ_MVCAP(grainStateSetter),
              KJ_MVCAP(command),KJ_MVCAP(grainVolume),KJ_MVCAP(grainId),
-             KJ_MVCAP(core),KJ_MVCAP(persistentRegistration)]
+             KJ_MVCAP(core),KJ_MVCAP(persistentRegistration),KJ_MVCAP(restoreParams)]
             (auto&& packageMount) mutable {
     // Create the NBD socketpair. The Supervisor will actually mount the NBD device (in its own
     // mount namespace) but we'll implement it in the Worker.
@@ -734,7 +795,7 @@ sandstorm::Supervisor::Client WorkerImpl::bootGrain(
     auto grain = kj::heap<RunningGrain>(
         *this, thisCap(), kj::mv(grainState), kj::mv(grainStateSetter), kj::mv(nbdUserEnd),
         kj::mv(grainVolume), kj::mv(capnpWorkerEnd), kj::mv(packageMount), kj::mv(options),
-        kj::mv(grainId), kj::mv(core), kj::mv(persistentRegistration));
+        kj::mv(grainId), kj::mv(core), kj::mv(persistentRegistration), kj::mv(restoreParams));
 
     auto supervisor = grain->getSupervisor();
 
@@ -1006,6 +1067,73 @@ kj::Promise<void> WorkerImpl::packBackup(PackBackupContext context) {
   });
 }
 
+kj::Promise<void> WorkerImpl::getLoad(GetLoadContext context) {
+  auto load = context.getResults(capnp::MessageSize {8, 0}).initLoad();
+  load.setGrainCount(runningGrains.size());
+
+  // /proc/meminfo lines look like "MemTotal:       16318260 kB".
+  auto meminfo = sandstorm::readAll(sandstorm::raiiOpen("/proc/meminfo", O_RDONLY | O_CLOEXEC));
+  for (auto& line: sandstorm::splitLines(kj::mv(meminfo))) {
+    uint64_t kb;
+    if (sscanf(line.cStr(), "MemTotal: %lu kB", &kb) == 1) {
+      load.setMemoryTotal(kb * 1024);
+    } else if (sscanf(line.cStr(), "MemAvailable: %lu kB", &kb) == 1) {
+      load.setMemoryAvailable(kb * 1024);
+    }
+  }
+
+  double loadavg;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (getloadavg(&loadavg, 1) == 1 && cpus > 0) {
+    load.setCpuLoad(loadavg / cpus);
+  }
+
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> WorkerImpl::drain(DrainContext context) {
+  draining = true;
+
+  auto successors = KJ_MAP(s, context.getParams().getSuccessors()) { return s; };
+  context.releaseParams();
+
+  KJ_LOG(INFO, "draining worker", runningGrains.size(), successors.size());
+
+  kj::Vector<kj::Promise<void>> handoffs;
+  uint i = 0;
+  for (auto& entry: runningGrains) {
+    auto stopped = entry.first->drain();
+    if (successors.size() == 0) {
+      handoffs.add(stopped.then([](auto&&) {}, [](kj::Exception&& exception) {
+        KJ_LOG(ERROR, "dirty grain shutdown", exception);
+      }));
+    } else {
+      auto successor = successors[i++ % successors.size()];
+      handoffs.add(stopped.then([KJ_MVCAP(successor)](kj::Own<capnp::MessageBuilder> message)
+                                mutable {
+        auto params = message->getRoot<Worker::RestoreGrainParams>().asReader();
+        auto req = successor.restoreGrainRequest(params.totalSize());
+        req.setPackage(params.getPackage());
+        req.setCommand(params.getCommand());
+        req.setGrainState(params.getGrainState());
+        req.setExclusiveGrainStateSetter(params.getExclusiveGrainStateSetter());
+        req.setGrainId(params.getGrainId());
+        req.setCore(params.getCore());
+        return req.send().then([](auto&&) {});
+      }).catch_([](kj::Exception&& exception) {
+        // The grain is stopped cleanly either way; it'll just cold-start on next use.
+        KJ_LOG(WARNING, "couldn't restart drained grain on another worker", exception);
+      }));
+    }
+  }
+
+  uint count = handoffs.size();
+  return kj::joinPromises(handoffs.releaseAsArray()).then([context,count]() mutable {
+    KJ_LOG(INFO, "worker drained", count);
+    context.getResults(capnp::MessageSize {4, 0}).setGrainCount(count);
+  });
+}
+
 // =======================================================================================
 
 class SupervisorMain::SystemConnectorImpl: public sandstorm::SupervisorMain::SystemConnector {
@@ -1160,9 +1288,8 @@ kj::MainBuilder::Validity MetaSupervisorMain::run() {
   NbdDevice device;
   NbdBinding binding(device, kj::AutoCloseFd(4), NbdAccessType::READ_WRITE);
 
-  if (isNew) {
-    device.format();
-  } else {
+  if (!isNew) {
+    // New grains' volumes are cloned from the blank-ext4 template, which is already right.
     device.fixSurpriseFeatures();
   }
 
@@ -134,6 +134,8 @@ protected:
   kj::Promise<void> unpackPackage(UnpackPackageContext context) override;
   kj::Promise<void> unpackBackup(UnpackBackupContext context) override;
   kj::Promise<void> packBackup(PackBackupContext context) override;
+  kj::Promise<void> getLoad(GetLoadContext context) override;
+  kj::Promise<void> drain(DrainContext context) override;
 
 private:
   class RunningGrain;
@@ -145,6 +147,7 @@ private:
   LocalPersistentRegistry& persistentRegistry;
   PackageMountSet packageMountSet;
   std::unordered_map<RunningGrain*, kj::Own<RunningGrain>> runningGrains;
+  bool draining = false;  // If true, refuse to start new grains.
   kj::TaskSet tasks;
 
   sandstorm::Supervisor::Client bootGrain(